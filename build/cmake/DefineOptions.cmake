@@ -91,6 +91,8 @@ if(WITH_CPP)
     option(WITH_STDTHREADS "Build with C++ std::thread support" OFF)
     CMAKE_DEPENDENT_OPTION(WITH_BOOSTTHREADS "Build with Boost threads support" OFF
         "NOT WITH_STDTHREADS;Boost_FOUND" OFF)
+    CMAKE_DEPENDENT_OPTION(WITH_FUTEX "Build with Linux futex based Mutex, ReadWriteMutex and Monitor" OFF
+        "CMAKE_SYSTEM_NAME STREQUAL Linux;NOT WITH_STDTHREADS;NOT WITH_BOOSTTHREADS" OFF)
 endif()
 CMAKE_DEPENDENT_OPTION(BUILD_CPP "Build C++ library" ON
                        "BUILD_LIBRARIES;WITH_CPP;Boost_FOUND" OFF)
@@ -210,6 +212,7 @@ message(STATUS "  Build with Boost thread support:            ${WITH_BOOSTTHREAD
 message(STATUS "  Build with boost/tr1/functional (forced)    ${WITH_BOOST_FUNCTIONAL}")
 message(STATUS "  Build with boost/smart_ptr (forced)         ${WITH_BOOST_SMART_PTR}")
 message(STATUS "  Build with C++ std::thread support:         ${WITH_STDTHREADS}")
+message(STATUS "  Build with Linux futex locks:               ${WITH_FUTEX}")
 message(STATUS "  Build with libevent support:                ${WITH_LIBEVENT}")
 message(STATUS "  Build with OpenSSL support:                 ${WITH_OPENSSL}")
 message(STATUS "  Build with Qt4 support:                     ${WITH_QT4}")
@@ -60,6 +60,7 @@ public:
     gen_pure_enums_ = false;
     use_include_prefix_ = false;
     gen_cob_style_ = false;
+    gen_coroutines_ = false;
     gen_no_client_completion_ = false;
     gen_no_default_operators_ = false;
     gen_templates_ = false;
@@ -67,6 +68,7 @@ public:
     gen_moveable_ = false;
     gen_no_ostream_operators_ = false;
     gen_no_skeleton_ = false;
+    gen_serialized_size_ = false;
 
     for (iter = parsed_options.begin(); iter != parsed_options.end(); ++iter) {
       if (iter->first.compare("pure_enums") == 0) {
@@ -75,6 +77,10 @@ public:
         use_include_prefix_ = true;
       } else if (iter->first.compare("cob_style") == 0) {
         gen_cob_style_ = true;
+      } else if (iter->first.compare("coroutines") == 0) {
+        // The coroutine classes are built on the cob style ones
+        gen_coroutines_ = true;
+        gen_cob_style_ = true;
       } else if (iter->first.compare("no_client_completion") == 0) {
         gen_no_client_completion_ = true;
       } else if (iter->first.compare("no_default_operators") == 0) {
@@ -88,6 +94,8 @@ public:
         gen_no_ostream_operators_ = true;
       } else if (iter->first.compare("no_skeleton") == 0) {
         gen_no_skeleton_ = true;
+      } else if (iter->first.compare("serialized_size") == 0) {
+        gen_serialized_size_ = true;
       } else {
         throw "unknown option cpp:" + iter->first;
       }
@@ -153,7 +161,15 @@ public:
   void generate_struct_writer(std::ostream& out, t_struct* tstruct, bool pointers = false);
   void generate_struct_result_writer(std::ostream& out, t_struct* tstruct, bool pointers = false);
   void generate_struct_swap(std::ostream& out, t_struct* tstruct);
+  void generate_struct_serialized_size(std::ostream& out, t_struct* tstruct);
+  void generate_serialized_size_field(std::ostream& out,
+                                      t_field* tfield,
+                                      std::string prefix = "",
+                                      std::string suffix = "");
+  void generate_serialized_size_container(std::ostream& out, t_type* ttype, std::string prefix);
+  bool get_fixed_binary_size(t_type* ttype, uint32_t& size);
   void generate_struct_print_method(std::ostream& out, t_struct* tstruct);
+  void generate_struct_print_buffer_method(std::ostream& out, t_struct* tstruct);
   void generate_exception_what_method(std::ostream& out, t_struct* tstruct);
 
   /**
@@ -174,6 +190,9 @@ public:
                                  bool specialized = false);
   void generate_function_helpers(t_service* tservice, t_function* tfunction);
   void generate_service_async_skeleton(t_service* tservice);
+  void generate_service_coroutines(t_service* tservice);
+  void generate_service_coro_client(t_service* tservice);
+  void generate_service_coro_adapter(t_service* tservice);
 
   /**
    * Serialization constructs
@@ -261,6 +280,7 @@ public:
   void generate_struct_ostream_operator_decl(std::ostream& f, t_struct* tstruct);
   void generate_struct_ostream_operator(std::ostream& f, t_struct* tstruct);
   void generate_struct_print_method_decl(std::ostream& f, t_struct* tstruct);
+  void generate_struct_print_buffer_method_decl(std::ostream& f, t_struct* tstruct);
   void generate_exception_what_method_decl(std::ostream& f,
                                            t_struct* tstruct,
                                            bool external = false);
@@ -337,6 +357,11 @@ private:
    */
   bool gen_cob_style_;
 
+  /**
+   * True if we should generate C++20 coroutine classes as well.
+   */
+  bool gen_coroutines_;
+
   /**
    * True if we should omit calls to completion__() in CobClient class.
    */
@@ -352,6 +377,11 @@ private:
    */
   bool gen_no_skeleton_;
 
+  /**
+   * True if we should generate serializedSize<Protocol_>() methods.
+   */
+  bool gen_serialized_size_;
+
   /**
    * Strings for namespace, computed once up front then used directly
    */
@@ -371,6 +401,13 @@ private:
   ofstream_with_content_based_conditional_update f_service_;
   ofstream_with_content_based_conditional_update f_service_tcc_;
 
+  /**
+   * Out-of-class serializedSize definitions when not generating templates.
+   * They are emitted at the end of the types header, once every struct is
+   * complete.
+   */
+  std::ostringstream f_types_size_;
+
   // The ProcessorGenerator is used to generate parts of the code,
   // so it needs access to many of our protected members and methods.
   //
@@ -499,6 +536,8 @@ void t_cpp_generator::init_generator() {
  * Closes the output files.
  */
 void t_cpp_generator::close_generator() {
+  f_types_ << f_types_size_.str();
+
   // Close namespace
   f_types_ << ns_close_ << endl << endl;
   f_types_impl_ << ns_close_ << endl;
@@ -629,6 +668,17 @@ void t_cpp_generator::generate_enum_ostream_operator_decl(std::ostream& out, t_e
   }
   out << " val);" << endl;
   out << endl;
+
+  if (!has_custom_ostream(tenum)) {
+    out << "THRIFT_DLLEXPORT void append_to(::apache::thrift::TToStringBuffer& out, const ";
+    if (gen_pure_enums_) {
+      out << tenum->get_name();
+    } else {
+      out << tenum->get_name() << "::type&";
+    }
+    out << " val);" << endl;
+    out << endl;
+  }
 }
 
 void t_cpp_generator::generate_enum_ostream_operator(std::ostream& out, t_enum* tenum) {
@@ -661,6 +711,29 @@ void t_cpp_generator::generate_enum_ostream_operator(std::ostream& out, t_enum*
     out << indent() << "return out;" << endl;
     scope_down(out);
     out << endl;
+
+    out << "void append_to(::apache::thrift::TToStringBuffer& out, const ";
+    if (gen_pure_enums_) {
+      out << tenum->get_name();
+    } else {
+      out << tenum->get_name() << "::type&";
+    }
+    out << " val) ";
+    scope_up(out);
+
+    out << indent() << "std::map<int, const char*>::const_iterator it = _" << tenum->get_name()
+        << "_VALUES_TO_NAMES.find(val);" << endl;
+    out << indent() << "if (it != _" << tenum->get_name() << "_VALUES_TO_NAMES.end()) {" << endl;
+    indent_up();
+    out << indent() << "out.append(it->second);" << endl;
+    indent_down();
+    out << indent() << "} else {" << endl;
+    indent_up();
+    out << indent() << "::apache::thrift::append_to(out, static_cast<int>(val));" << endl;
+    indent_down();
+    out << indent() << "}" << endl;
+    scope_down(out);
+    out << endl;
   }
 }
 
@@ -883,6 +956,15 @@ void t_cpp_generator::generate_cpp_struct(t_struct* tstruct, bool is_exception)
   std::ostream& out = (gen_templates_ ? f_types_tcc_ : f_types_impl_);
   generate_struct_reader(out, tstruct);
   generate_struct_writer(out, tstruct);
+  if (gen_serialized_size_) {
+    uint32_t fixed_size;
+    if (get_fixed_binary_size(tstruct, fixed_size)) {
+      f_types_impl_ << indent() << "const uint32_t " << tstruct->get_name()
+                    << "::fixedBinarySerializedSize;" << endl
+                    << endl;
+    }
+    generate_struct_serialized_size(gen_templates_ ? f_types_tcc_ : f_types_size_, tstruct);
+  }
   generate_struct_swap(f_types_impl_, tstruct);
   generate_copy_constructor(f_types_impl_, tstruct, is_exception);
   if (gen_moveable_) {
@@ -895,6 +977,7 @@ void t_cpp_generator::generate_cpp_struct(t_struct* tstruct, bool is_exception)
 
   if (!has_custom_ostream(tstruct)) {
     generate_struct_print_method(f_types_impl_, tstruct);
+    generate_struct_print_buffer_method(f_types_impl_, tstruct);
   }
 
   if (is_exception) {
@@ -1320,12 +1403,24 @@ void t_cpp_generator::generate_struct_declaration(ostream& out,
           << "::apache::thrift::protocol::TProtocol* oprot) const;" << endl;
     }
   }
+  if (is_user_struct && gen_serialized_size_) {
+    uint32_t fixed_size;
+    out << indent() << "template <class Protocol_>" << endl
+        << indent() << "uint32_t serializedSize() const;" << endl;
+    if (get_fixed_binary_size(tstruct, fixed_size)) {
+      out << indent() << "static const uint32_t fixedBinarySerializedSize = " << fixed_size << ";"
+          << endl;
+    }
+  }
   out << endl;
 
   if (is_user_struct && !has_custom_ostream(tstruct)) {
     out << indent() << "virtual ";
     generate_struct_print_method_decl(out, NULL);
     out << ";" << endl;
+    out << indent() << "virtual ";
+    generate_struct_print_buffer_method_decl(out, NULL);
+    out << ";" << endl;
   }
 
   // std::exception::what()
@@ -1667,6 +1762,205 @@ void t_cpp_generator::generate_struct_result_writer(ostream& out,
   indent(out) << "}" << endl << endl;
 }
 
+/**
+ * Generates serializedSize<Protocol_>(), which returns the number of bytes
+ * write() would produce through Protocol_, computed with Protocol_::Sizer
+ * instead of a transport.
+ *
+ * @param out Stream to write to
+ * @param tstruct The struct
+ */
+void t_cpp_generator::generate_struct_serialized_size(ostream& out, t_struct* tstruct) {
+  const vector<t_field*>& fields = tstruct->get_sorted_members();
+  vector<t_field*>::const_iterator f_iter;
+
+  out << indent() << "template <class Protocol_>" << endl
+      << indent() << "uint32_t " << tstruct->get_name() << "::serializedSize() const {" << endl;
+  indent_up();
+
+  out << indent() << "typename Protocol_::Sizer sizer;" << endl
+      << indent() << "uint32_t xfer = 0;" << endl;
+
+  for (f_iter = fields.begin(); f_iter != fields.end(); ++f_iter) {
+    bool check_if_set
+        = (*f_iter)->get_req() == t_field::T_OPTIONAL || (*f_iter)->get_type()->is_xception();
+    out << endl;
+    if (check_if_set) {
+      out << indent() << "if (this->__isset." << (*f_iter)->get_name() << ") {" << endl;
+      indent_up();
+    }
+
+    out << indent() << "xfer += sizer.fieldBeginSize(" << type_to_enum((*f_iter)->get_type())
+        << ", " << (*f_iter)->get_key() << ");" << endl;
+    generate_serialized_size_field(out, *f_iter, "this->");
+
+    if (check_if_set) {
+      indent_down();
+      indent(out) << "}" << endl;
+    }
+  }
+
+  out << endl
+      << indent() << "xfer += sizer.fieldStopSize();" << endl
+      << indent() << "return xfer;" << endl;
+
+  indent_down();
+  indent(out) << "}" << endl << endl;
+}
+
+/**
+ * Emits the size of a single value, mirroring generate_serialize_field.
+ */
+void t_cpp_generator::generate_serialized_size_field(ostream& out,
+                                                     t_field* tfield,
+                                                     string prefix,
+                                                     string suffix) {
+  t_type* type = get_true_type(tfield->get_type());
+  string name = prefix + tfield->get_name() + suffix;
+
+  if (type->is_struct() || type->is_xception()) {
+    if (is_reference(tfield)) {
+      // write() emits an empty struct for a null reference.
+      indent(out) << "xfer += " << name << " ? " << name
+                  << "->serializedSize<Protocol_>() : sizer.fieldStopSize();" << endl;
+    } else {
+      indent(out) << "xfer += " << name << ".serializedSize<Protocol_>();" << endl;
+    }
+  } else if (type->is_container()) {
+    generate_serialized_size_container(out, type, name);
+  } else if (type->is_enum()) {
+    indent(out) << "xfer += sizer.i32Size((int32_t)" << name << ");" << endl;
+  } else if (type->is_base_type()) {
+    t_base_type::t_base tbase = ((t_base_type*)type)->get_base();
+    indent(out) << "xfer += sizer.";
+    switch (tbase) {
+    case t_base_type::TYPE_STRING:
+      out << (type->is_binary() ? "binarySize(" : "stringSize(");
+      break;
+    case t_base_type::TYPE_BOOL:
+      out << "boolSize(";
+      break;
+    case t_base_type::TYPE_I8:
+      out << "byteSize(";
+      break;
+    case t_base_type::TYPE_I16:
+      out << "i16Size(";
+      break;
+    case t_base_type::TYPE_I32:
+      out << "i32Size(";
+      break;
+    case t_base_type::TYPE_I64:
+      out << "i64Size(";
+      break;
+    case t_base_type::TYPE_DOUBLE:
+      out << "doubleSize(";
+      break;
+    default:
+      throw "compiler error: no C++ sizer for base type " + t_base_type::t_base_name(tbase) + name;
+    }
+    out << name << ");" << endl;
+  } else {
+    throw "compiler error: cannot compute serialized size of " + name;
+  }
+}
+
+void t_cpp_generator::generate_serialized_size_container(ostream& out,
+                                                         t_type* ttype,
+                                                         string prefix) {
+  scope_up(out);
+
+  if (ttype->is_map()) {
+    indent(out) << "xfer += sizer.mapBeginSize(" << type_to_enum(((t_map*)ttype)->get_key_type())
+                << ", " << type_to_enum(((t_map*)ttype)->get_val_type()) << ", "
+                << "static_cast<uint32_t>(" << prefix << ".size()));" << endl;
+  } else if (ttype->is_set()) {
+    indent(out) << "xfer += sizer.setBeginSize(" << type_to_enum(((t_set*)ttype)->get_elem_type())
+                << ", "
+                << "static_cast<uint32_t>(" << prefix << ".size()));" << endl;
+  } else if (ttype->is_list()) {
+    indent(out) << "xfer += sizer.listBeginSize("
+                << type_to_enum(((t_list*)ttype)->get_elem_type()) << ", "
+                << "static_cast<uint32_t>(" << prefix << ".size()));" << endl;
+  }
+
+  string iter = tmp("_iter");
+  out << indent() << type_name(ttype) << "::const_iterator " << iter << ";" << endl
+      << indent() << "for (" << iter << " = " << prefix << ".begin(); " << iter << " != " << prefix
+      << ".end(); ++" << iter << ")" << endl;
+  scope_up(out);
+  if (ttype->is_map()) {
+    t_field kfield(((t_map*)ttype)->get_key_type(), iter + "->first");
+    generate_serialized_size_field(out, &kfield);
+    t_field vfield(((t_map*)ttype)->get_val_type(), iter + "->second");
+    generate_serialized_size_field(out, &vfield);
+  } else if (ttype->is_set()) {
+    t_field efield(((t_set*)ttype)->get_elem_type(), "(*" + iter + ")");
+    generate_serialized_size_field(out, &efield);
+  } else if (ttype->is_list()) {
+    t_field efield(((t_list*)ttype)->get_elem_type(), "(*" + iter + ")");
+    generate_serialized_size_field(out, &efield);
+  }
+  scope_down(out);
+
+  scope_down(out);
+}
+
+/**
+ * Computes the binary protocol encoding size of a type whose encoding does
+ * not depend on its value: fixed-width base types, enums, and structs made
+ * only of such fields that are always written.
+ *
+ * @return false if the size depends on the value
+ */
+bool t_cpp_generator::get_fixed_binary_size(t_type* ttype, uint32_t& size) {
+  ttype = get_true_type(ttype);
+
+  if (ttype->is_enum()) {
+    size = 4;
+    return true;
+  }
+
+  if (ttype->is_base_type()) {
+    switch (((t_base_type*)ttype)->get_base()) {
+    case t_base_type::TYPE_BOOL:
+    case t_base_type::TYPE_I8:
+      size = 1;
+      return true;
+    case t_base_type::TYPE_I16:
+      size = 2;
+      return true;
+    case t_base_type::TYPE_I32:
+      size = 4;
+      return true;
+    case t_base_type::TYPE_I64:
+    case t_base_type::TYPE_DOUBLE:
+      size = 8;
+      return true;
+    default:
+      return false;
+    }
+  }
+
+  if (!ttype->is_struct() && !ttype->is_xception()) {
+    return false;
+  }
+
+  const vector<t_field*>& fields = ((t_struct*)ttype)->get_members();
+  vector<t_field*>::const_iterator f_iter;
+  uint32_t total = 1; // field stop
+  for (f_iter = fields.begin(); f_iter != fields.end(); ++f_iter) {
+    uint32_t field_size;
+    if ((*f_iter)->get_req() == t_field::T_OPTIONAL || (*f_iter)->get_type()->is_xception()
+        || is_reference(*f_iter) || !get_fixed_binary_size((*f_iter)->get_type(), field_size)) {
+      return false;
+    }
+    total += 3 + field_size; // field header + value
+  }
+
+  size = total;
+  return true;
+}
+
 /**
  * Generates the swap function.
  *
@@ -1714,6 +2008,12 @@ void t_cpp_generator::generate_struct_ostream_operator_decl(std::ostream& out, t
   out << "THRIFT_DLLEXPORT std::ostream& operator<<(std::ostream& out, const "
       << tstruct->get_name() << "& obj);" << endl;
   out << endl;
+
+  if (!has_custom_ostream(tstruct)) {
+    out << "THRIFT_DLLEXPORT void append_to(::apache::thrift::TToStringBuffer& out, const "
+        << tstruct->get_name() << "& obj);" << endl;
+    out << endl;
+  }
 }
 
 void t_cpp_generator::generate_struct_ostream_operator(std::ostream& out, t_struct* tstruct) {
@@ -1725,6 +2025,13 @@ void t_cpp_generator::generate_struct_ostream_operator(std::ostream& out, t_stru
     out << indent() << "obj.printTo(out);" << endl << indent() << "return out;" << endl;
     scope_down(out);
     out << endl;
+
+    out << "void append_to(::apache::thrift::TToStringBuffer& out, const " << tstruct->get_name()
+        << "& obj)" << endl;
+    scope_up(out);
+    out << indent() << "obj.printTo(out);" << endl;
+    scope_down(out);
+    out << endl;
   }
 }
 
@@ -1736,6 +2043,15 @@ void t_cpp_generator::generate_struct_print_method_decl(std::ostream& out, t_str
   out << "printTo(std::ostream& out) const";
 }
 
+void t_cpp_generator::generate_struct_print_buffer_method_decl(std::ostream& out,
+                                                               t_struct* tstruct) {
+  out << "void ";
+  if (tstruct) {
+    out << tstruct->get_name() << "::";
+  }
+  out << "printTo(::apache::thrift::TToStringBuffer& out) const";
+}
+
 void t_cpp_generator::generate_exception_what_method_decl(std::ostream& out,
                                                           t_struct* tstruct,
                                                           bool external) {
@@ -1809,6 +2125,45 @@ void t_cpp_generator::generate_struct_print_method(std::ostream& out, t_struct*
   out << "}" << endl << endl;
 }
 
+/**
+ * Generates printTo(TToStringBuffer&), which formats the same text as
+ * printTo(std::ostream&) by appending to a string.
+ */
+void t_cpp_generator::generate_struct_print_buffer_method(std::ostream& out, t_struct* tstruct) {
+  out << indent();
+  generate_struct_print_buffer_method_decl(out, tstruct);
+  out << " {" << endl;
+
+  indent_up();
+
+  out << indent() << "using ::apache::thrift::append_to;" << endl;
+  out << indent() << "out.append(\"" << tstruct->get_name() << "(\");" << endl;
+
+  const vector<t_field*>& fields = tstruct->get_members();
+  for (vector<t_field*>::const_iterator f_iter = fields.begin(); f_iter != fields.end(); ++f_iter) {
+    const string& name = (*f_iter)->get_name();
+    out << indent() << "out.append(\"" << (f_iter == fields.begin() ? "" : ", ") << name << "=\");"
+        << endl;
+    if ((*f_iter)->get_req() == t_field::T_OPTIONAL) {
+      out << indent() << "if (__isset." << name << ") {" << endl;
+      indent_up();
+      out << indent() << "append_to(out, " << name << ");" << endl;
+      indent_down();
+      out << indent() << "} else {" << endl;
+      indent_up();
+      out << indent() << "out.append(\"<null>\");" << endl;
+      indent_down();
+      out << indent() << "}" << endl;
+    } else {
+      out << indent() << "append_to(out, " << name << ");" << endl;
+    }
+  }
+  out << indent() << "out.append(')');" << endl;
+
+  indent_down();
+  out << "}" << endl << endl;
+}
+
 /**
  * Generates what() method for exceptions
  */
@@ -1872,6 +2227,9 @@ void t_cpp_generator::generate_service(t_service* tservice) {
   if (gen_cob_style_) {
     f_header_ << "#include <thrift/async/TAsyncDispatchProcessor.h>" << endl;
   }
+  if (gen_coroutines_) {
+    f_header_ << "#include <thrift/async/TCoroutine.h>" << endl;
+  }
   f_header_ << "#include <thrift/async/TConcurrentClientSyncInfo.h>" << endl;
   f_header_ << "#include \"" << get_include_prefix(*get_program()) << program_name_ << "_types.h\""
             << endl;
@@ -1952,6 +2310,10 @@ void t_cpp_generator::generate_service(t_service* tservice) {
     }
   }
 
+  if (gen_coroutines_) {
+    generate_service_coroutines(tservice);
+  }
+
   f_header_ << "#ifdef _MSC_VER\n"
                "  #pragma warning( pop )\n"
                "#endif\n\n";
@@ -2299,6 +2661,218 @@ void t_cpp_generator::generate_service_async_skeleton(t_service* tservice) {
   f_skeleton << "};" << endl << endl;
 }
 
+/**
+ * Collects the functions of a service and of the services it extends,
+ * those of the base service first.
+ */
+static void get_all_functions(t_service* tservice, vector<t_function*>& functions) {
+  if (tservice->get_extends() != NULL) {
+    get_all_functions(tservice->get_extends(), functions);
+  }
+  const vector<t_function*>& own = tservice->get_functions();
+  functions.insert(functions.end(), own.begin(), own.end());
+}
+
+/**
+ * Generates the C++20 coroutine classes of a service: the handler interface,
+ * the client and the adapter serving a handler through the cob style
+ * processor.  They are inline in the header, and only compiled where the
+ * compiler has coroutines.
+ *
+ * @param tservice The service to generate coroutine classes for
+ */
+void t_cpp_generator::generate_service_coroutines(t_service* tservice) {
+  f_header_ << "#ifdef THRIFT_HAVE_COROUTINES" << endl << endl;
+  generate_service_interface(tservice, "Coro");
+  generate_service_coro_client(tservice);
+  generate_service_coro_adapter(tservice);
+  f_header_ << "#endif // THRIFT_HAVE_COROUTINES" << endl << endl;
+}
+
+/**
+ * Generates a client whose methods are coroutines, on top of the cob style
+ * client: each sends the request, awaits the channel and reads the
+ * response.
+ *
+ * @param tservice The service to generate a coroutine client for
+ */
+void t_cpp_generator::generate_service_coro_client(t_service* tservice) {
+  string template_header, short_suffix, template_suffix;
+  if (gen_templates_) {
+    template_header = "template <class Protocol_>\n";
+    short_suffix = "T";
+    template_suffix = "T<Protocol_>";
+  }
+  string client_name = service_name_ + "CoroClient" + short_suffix;
+  string cob_client = service_name_ + "CobClient" + template_suffix;
+
+  f_header_ << "// The coroutine client awaits one call at a time; use one client per call\n"
+               "// that should be outstanding at once, they may share the channel.\n"
+            << template_header << "class THRIFT_DLLEXPORT " << client_name << " : public "
+            << cob_client << " {" << endl
+            << " public:" << endl;
+  indent_up();
+  f_header_ << indent() << client_name
+            << "(::apache::thrift::stdcxx::shared_ptr< ::apache::thrift::async::TAsyncChannel> "
+               "channel, ::apache::thrift::protocol::TProtocolFactory* protocolFactory) :" << endl
+            << indent() << "  " << cob_client << "(channel, protocolFactory) {}" << endl;
+
+  vector<t_function*> functions;
+  get_all_functions(tservice, functions);
+  for (vector<t_function*>::const_iterator f_iter = functions.begin(); f_iter != functions.end();
+       ++f_iter) {
+    string funname = (*f_iter)->get_name();
+    t_type* returntype = (*f_iter)->get_returntype();
+
+    f_header_ << indent() << function_signature(*f_iter, "Coro", "", true) << " {" << endl;
+    indent_up();
+    f_header_ << indent() << "this->send_" << funname << "(";
+    const vector<t_field*>& fields = (*f_iter)->get_arglist()->get_members();
+    for (vector<t_field*>::const_iterator fld_iter = fields.begin(); fld_iter != fields.end();
+         ++fld_iter) {
+      f_header_ << (fld_iter == fields.begin() ? "" : ", ") << (*fld_iter)->get_name();
+    }
+    f_header_ << ");" << endl;
+
+    if ((*f_iter)->is_oneway()) {
+      f_header_ << indent()
+                << "co_await ::apache::thrift::async::sendMessage(*this->channel_, "
+                   "this->otrans_.get());" << endl;
+    } else {
+      f_header_ << indent()
+                << "co_await ::apache::thrift::async::sendAndRecvMessage(*this->channel_, "
+                   "this->otrans_.get(), this->itrans_.get());" << endl;
+      if (returntype->is_void()) {
+        f_header_ << indent() << "this->recv_" << funname << "();" << endl;
+      } else if (is_complex_type(returntype)) {
+        t_field returnfield(returntype, "_return");
+        f_header_ << indent() << declare_field(&returnfield, true) << endl
+                  << indent() << "this->recv_" << funname << "(_return);" << endl
+                  << indent() << "co_return _return;" << endl;
+      } else {
+        f_header_ << indent() << "co_return this->recv_" << funname << "();" << endl;
+      }
+    }
+    scope_down(f_header_);
+  }
+  indent_down();
+  f_header_ << "};" << endl << endl;
+
+  if (gen_templates_) {
+    f_header_ << "typedef " << client_name << "< ::apache::thrift::protocol::TProtocol> "
+              << service_name_ << "CoroClient;" << endl
+              << endl;
+  }
+}
+
+/**
+ * Generates an adapter that implements the cob style server interface with
+ * a coroutine handler, so that the async processor serves it.
+ *
+ * @param tservice The service to generate a coroutine adapter for
+ */
+void t_cpp_generator::generate_service_coro_adapter(t_service* tservice) {
+  string adapter_name = service_name_ + "CoroAdapter";
+  string iface_type = "::apache::thrift::stdcxx::shared_ptr<" + service_name_ + "CoroIf>";
+
+  f_header_ << "// Serves a coroutine handler through " << service_name_
+            << "AsyncProcessor.  A handler\n"
+               "// may only throw the exceptions its functions declare; for a function\n"
+               "// that declares none, an exception it throws is logged and the call\n"
+               "// gets no response.\n"
+            << "class THRIFT_DLLEXPORT " << adapter_name << " : virtual public " << service_name_
+            << "CobSvIf {" << endl
+            << " public:" << endl;
+  indent_up();
+  f_header_ << indent() << adapter_name << "(const " << iface_type << "& iface) : iface_(iface) {}"
+            << endl
+            << indent() << "virtual ~" << adapter_name << "() {}" << endl;
+
+  vector<t_function*> functions;
+  get_all_functions(tservice, functions);
+  vector<t_function*>::const_iterator f_iter;
+  for (f_iter = functions.begin(); f_iter != functions.end(); ++f_iter) {
+    string signature = function_signature(*f_iter, "CobSv", "", true);
+    bool has_xceptions = !(*f_iter)->get_xceptions()->get_members().empty();
+    if (has_xceptions) {
+      // it is left unnamed elsewhere
+      signature.replace(signature.find("/* exn_cob */"), 13, "exn_cob");
+    }
+    f_header_ << indent() << signature << " {" << endl;
+    indent_up();
+    f_header_ << indent() << "::apache::thrift::async::spawn(run_" << (*f_iter)->get_name()
+              << "(iface_, cob" << (has_xceptions ? ", exn_cob" : "");
+    const vector<t_field*>& fields = (*f_iter)->get_arglist()->get_members();
+    for (vector<t_field*>::const_iterator fld_iter = fields.begin(); fld_iter != fields.end();
+         ++fld_iter) {
+      f_header_ << ", " << (*fld_iter)->get_name();
+    }
+    f_header_ << "));" << endl;
+    scope_down(f_header_);
+  }
+
+  f_header_ << endl << " protected:" << endl;
+  for (f_iter = functions.begin(); f_iter != functions.end(); ++f_iter) {
+    string funname = (*f_iter)->get_name();
+    t_type* returntype = (*f_iter)->get_returntype();
+    const vector<t_field*>& fields = (*f_iter)->get_arglist()->get_members();
+    const vector<t_field*>& xceptions = (*f_iter)->get_xceptions()->get_members();
+
+    f_header_ << indent() << "static ::apache::thrift::async::TTask<void> run_" << funname << "("
+              << iface_type << " iface, ::apache::thrift::stdcxx::function<void"
+              << (returntype->is_void() ? "()" : "(" + type_name(returntype) + " const& _return)")
+              << "> cob";
+    if (!xceptions.empty()) {
+      f_header_ << ", ::apache::thrift::stdcxx::function<void(::apache::thrift::TDelayedException* "
+                   "_throw)> exn_cob";
+    }
+    for (vector<t_field*>::const_iterator fld_iter = fields.begin(); fld_iter != fields.end();
+         ++fld_iter) {
+      f_header_ << ", " << type_name((*fld_iter)->get_type()) << " " << (*fld_iter)->get_name();
+    }
+    f_header_ << ") {" << endl;
+    indent_up();
+
+    if (!returntype->is_void()) {
+      t_field returnfield(returntype, "_return");
+      f_header_ << indent() << declare_field(&returnfield, true) << endl;
+    }
+    if (!xceptions.empty()) {
+      f_header_ << indent() << "try {" << endl;
+      indent_up();
+    }
+    f_header_ << indent() << (returntype->is_void() ? "" : "_return = ") << "co_await iface->"
+              << funname << "(";
+    for (vector<t_field*>::const_iterator fld_iter = fields.begin(); fld_iter != fields.end();
+         ++fld_iter) {
+      f_header_ << (fld_iter == fields.begin() ? "" : ", ") << "std::move("
+                << (*fld_iter)->get_name() << ")";
+    }
+    f_header_ << ");" << endl;
+    if (!xceptions.empty()) {
+      indent_down();
+      for (vector<t_field*>::const_iterator x_iter = xceptions.begin(); x_iter != xceptions.end();
+           ++x_iter) {
+        f_header_ << indent() << "} catch (const " << type_name((*x_iter)->get_type()) << "& "
+                  << (*x_iter)->get_name() << ") {" << endl
+                  << indent() << "  exn_cob(::apache::thrift::TDelayedException::delayException("
+                  << (*x_iter)->get_name() << "));" << endl
+                  << indent() << "  co_return;" << endl;
+      }
+      f_header_ << indent() << "} catch (const std::exception& e) {" << endl
+                << indent() << "  exn_cob(::apache::thrift::TDelayedException::delayException("
+                               "::apache::thrift::TApplicationException(e.what())));" << endl
+                << indent() << "  co_return;" << endl
+                << indent() << "}" << endl;
+    }
+    f_header_ << indent() << "cob(" << (returntype->is_void() ? "" : "_return") << ");" << endl;
+    scope_down(f_header_);
+  }
+  f_header_ << endl << indent() << iface_type << " iface_;" << endl;
+  indent_down();
+  f_header_ << "};" << endl << endl;
+}
+
 /**
  * Generates a multiface, which is a single server that just takes a set
  * of objects implementing the interface and calls them all, returning the
@@ -4675,6 +5249,17 @@ string t_cpp_generator::function_signature(t_function* tfunction,
 
     return "void " + prefix + tfunction->get_name() + "(::apache::thrift::stdcxx::function<void"
            + cob_type + "> cob" + exn_cob + argument_list(arglist, name_params, true) + ")";
+  } else if (style == "Coro") {
+    // The arguments are taken by value: the call may run after the
+    // caller's temporaries are gone
+    string args;
+    const vector<t_field*>& fields = arglist->get_members();
+    for (vector<t_field*>::const_iterator f_iter = fields.begin(); f_iter != fields.end(); ++f_iter) {
+      args += (f_iter == fields.begin() ? "" : ", ") + type_name((*f_iter)->get_type()) + " "
+              + (name_params ? (*f_iter)->get_name() : "/* " + (*f_iter)->get_name() + " */");
+    }
+    return "::apache::thrift::async::TTask<" + (ttype->is_void() ? "void" : type_name(ttype))
+           + " > " + prefix + tfunction->get_name() + "(" + args + ")";
   } else {
     throw "UNKNOWN STYLE";
   }
@@ -4817,6 +5402,8 @@ THRIFT_REGISTER_GENERATOR(
     cpp,
     "C++",
     "    cob_style:       Generate \"Continuation OBject\"-style classes.\n"
+    "    coroutines:      Also generate C++20 coroutine clients and handler interfaces\n"
+    "                     (implies cob_style).\n"
     "    no_client_completion:\n"
     "                     Omit calls to completion__() in CobClient class.\n"
     "    no_default_operators:\n"
@@ -4827,4 +5414,5 @@ THRIFT_REGISTER_GENERATOR(
     "    moveable_types:  Generate move constructors and assignment operators.\n"
     "    no_ostream_operators:\n"
     "                     Omit generation of ostream definitions.\n"
-    "    no_skeleton:     Omits generation of skeleton.\n")
+    "    no_skeleton:     Omits generation of skeleton.\n"
+    "    serialized_size: Generate serializedSize<Protocol>() methods for pre-sizing buffers.\n")
@@ -47,75 +47,30 @@ void FacebookBase::getOptions(std::map<std::string, std::string> & _return) {
 }
 
 int64_t FacebookBase::incrementCounter(const std::string& key, int64_t amount) {
-  counters_.acquireRead();
-
-  // if we didn't find the key, we need to write lock the whole map to create it
-  ReadWriteCounterMap::iterator it = counters_.find(key);
-  if (it == counters_.end()) {
-    counters_.release();
-    counters_.acquireWrite();
-
-    // we need to check again to make sure someone didn't create this key
-    // already while we released the lock
-    it = counters_.find(key);
-    if(it == counters_.end()){
-      counters_[key].value = amount;
-      counters_.release();
-      return amount;
-    }
-  }
+  ShardedCounter* counter = counters_.get(key);
+  counter->add(amount);
+  return counter->get();
+}
 
-  it->second.acquireWrite();
-  int64_t count = it->second.value + amount;
-  it->second.value = count;
-  it->second.release();
-  counters_.release();
-  return count;
+void FacebookBase::addToCounter(const std::string& key, int64_t amount) {
+  counters_.get(key)->add(amount);
 }
 
 int64_t FacebookBase::setCounter(const std::string& key, int64_t value) {
-  counters_.acquireRead();
-
-  // if we didn't find the key, we need to write lock the whole map to create it
-  ReadWriteCounterMap::iterator it = counters_.find(key);
-  if (it == counters_.end()) {
-    counters_.release();
-    counters_.acquireWrite();
-    counters_[key].value = value;
-    counters_.release();
-    return value;
-  }
+  return counters_.set(key, value);
+}
 
-  it->second.acquireWrite();
-  it->second.value = value;
-  it->second.release();
-  counters_.release();
-  return value;
+ShardedCounter* FacebookBase::registerCounter(const std::string& key) {
+  return counters_.get(key);
 }
 
 void FacebookBase::getCounters(std::map<std::string, int64_t>& _return) {
-  // we need to lock the whole thing and actually build the map since we don't
-  // want our read/write structure to go over the wire
-  counters_.acquireRead();
-  for(ReadWriteCounterMap::iterator it = counters_.begin();
-      it != counters_.end(); ++it)
-  {
-    _return[it->first] = it->second.value;
-  }
-  counters_.release();
+  counters_.getAll(_return);
 }
 
 int64_t FacebookBase::getCounter(const std::string& key) {
-  int64_t rv = 0;
-  counters_.acquireRead();
-  ReadWriteCounterMap::iterator it = counters_.find(key);
-  if (it != counters_.end()) {
-    it->second.acquireRead();
-    rv = it->second.value;
-    it->second.release();
-  }
-  counters_.release();
-  return rv;
+  ShardedCounter* counter = counters_.find(key);
+  return counter != NULL ? counter->get() : 0;
 }
 
 inline int64_t FacebookBase::aliveSince() {
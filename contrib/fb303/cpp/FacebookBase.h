@@ -21,6 +21,7 @@
 #define _FACEBOOK_TB303_FACEBOOKBASE_H_ 1
 
 #include "FacebookService.h"
+#include "ShardedCounters.h"
 
 #include <boost/shared_ptr.hpp>
 #include <thrift/server/TServer.h>
@@ -36,6 +37,7 @@ using apache::thrift::concurrency::Mutex;
 using apache::thrift::concurrency::ReadWriteMutex;
 using apache::thrift::server::TServer;
 
+// No longer used by FacebookBase, kept for source compatibility
 struct ReadWriteInt : ReadWriteMutex {int64_t value;};
 struct ReadWriteCounterMap : ReadWriteMutex,
                              std::map<std::string, ReadWriteInt> {};
@@ -73,6 +75,25 @@ class FacebookBase : virtual public FacebookServiceIf {
   int64_t incrementCounter(const std::string& key, int64_t amount = 1);
   int64_t setCounter(const std::string& key, int64_t value);
 
+  /**
+   * Adds amount to the counter for key, as incrementCounter() does, but
+   * without summing the shards of the counter to return its new value.
+   */
+  void addToCounter(const std::string& key, int64_t amount = 1);
+
+  /**
+   * Returns a handle for a counter that is updated often.  The handle is
+   * this object's own and stays valid for its lifetime, and handle->add()
+   * skips the name lookup and never locks.  Keep it in a member:
+   *
+   *   MyService::MyService() : FacebookBase("MyService") {
+   *     requests_ = registerCounter("requests");
+   *   }
+   *   ...
+   *   requests_->add(1);
+   */
+  ShardedCounter* registerCounter(const std::string& key);
+
   void getCounters(std::map<std::string, int64_t>& _return);
   int64_t getCounter(const std::string& key);
 
@@ -93,7 +114,7 @@ class FacebookBase : virtual public FacebookServiceIf {
   std::map<std::string, std::string> options_;
   Mutex optionsLock_;
 
-  ReadWriteCounterMap counters_;
+  ShardedCounterMap counters_;
 
   boost::shared_ptr<TServer> server_;
 
@@ -18,18 +18,118 @@
  */
 
 #include <sys/time.h>
+#include <unistd.h>
 
 #include "FacebookBase.h"
 #include "ServiceTracker.h"
 #include <thrift/concurrency/ThreadManager.h>
+#include <thrift/processor/TMetricsEventHandler.h>
+
+#include <algorithm>
+#include <cmath>
 
 using namespace std;
 using namespace facebook::fb303;
 using namespace apache::thrift::concurrency;
+using apache::thrift::processor::THistogram;
+
+
+/**
+ * Durations of one service method since the last checkpoint, as a
+ * log-linear histogram (see THistogram) per shard.  record() is lock-free;
+ * drain() takes and resets the counts with atomic exchanges, so a duration
+ * recorded while a checkpoint is being reported lands in either that
+ * checkpoint or the next one.
+ */
+class ServiceTracker::MethodStats
+{
+public:
+  MethodStats(const string &name, uint32_t shards)
+    : name_(name), shardCount_(shards), shards_(new Shard[shards]), next_(NULL)
+  {
+  }
+
+  ~MethodStats()
+  {
+    delete[] shards_;
+  }
+
+  void record(uint64_t duration)
+  {
+    Shard &shard = shards_[ShardedCounter::currentShard(shardCount_)];
+    shard.buckets[THistogram::bucketFor(duration)].fetch_add(
+      1, boost::memory_order_relaxed);
+    shard.sum.fetch_add(duration, boost::memory_order_relaxed);
+  }
+
+  /**
+   * Adds the counts since the last drain to buckets (which must hold
+   * THistogram::NUM_BUCKETS entries) and resets them.
+   */
+  void drain(vector<uint64_t> &buckets, uint64_t &count, uint64_t &sum)
+  {
+    for (uint32_t s = 0; s < shardCount_; ++s) {
+      Shard &shard = shards_[s];
+      for (uint32_t b = 0; b < THistogram::NUM_BUCKETS; ++b) {
+        if (shard.buckets[b].load(boost::memory_order_relaxed) != 0) {
+          uint64_t n = shard.buckets[b].exchange(0, boost::memory_order_relaxed);
+          buckets[b] += n;
+          count += n;
+        }
+      }
+      sum += shard.sum.exchange(0, boost::memory_order_relaxed);
+    }
+  }
+
+  const string name_;
+
+private:
+  friend class ServiceTracker;
+
+  struct Shard {
+    Shard() : sum(0)
+    {
+      for (uint32_t b = 0; b < THistogram::NUM_BUCKETS; ++b) {
+        buckets[b].store(0, boost::memory_order_relaxed);
+      }
+    }
+    boost::atomic<uint64_t> sum;
+    boost::atomic<uint64_t> buckets[THistogram::NUM_BUCKETS];
+    // keep the next shard's sum off our last cache line
+    char pad[ShardedCounter::CACHE_LINE_SIZE];
+  };
+
+  const uint32_t shardCount_;
+  Shard *shards_;
+  MethodStats *next_;
+};
+
+
+/**
+ * The smallest bucket bound below which at least p percent of count
+ * durations fall.
+ */
+static uint64_t
+percentile(const vector<uint64_t> &buckets, uint64_t count, double p)
+{
+  if (count == 0) {
+    return 0;
+  }
+  uint64_t target = static_cast<uint64_t>(ceil(p / 100.0 * count));
+  uint64_t seen = 0;
+  for (uint32_t b = 0; b < buckets.size(); ++b) {
+    seen += buckets[b];
+    if (seen >= max(target, static_cast<uint64_t>(1))) {
+      return THistogram::bucketUpperBound(b);
+    }
+  }
+  return THistogram::MAX_VALUE;
+}
 
 
 uint64_t ServiceTracker::CHECKPOINT_MINIMUM_INTERVAL_SECONDS = 60;
 int ServiceTracker::LOG_LEVEL = 5;
+const uint32_t ServiceTracker::METHOD_BUCKETS;
 
 
 ServiceTracker::ServiceTracker(facebook::fb303::FacebookBase *handler,
@@ -43,13 +143,24 @@ ServiceTracker::ServiceTracker(facebook::fb303::FacebookBase *handler,
     featureStatusCheck_(featureStatusCheck),
     featureThreadCheck_(featureThreadCheck),
     stopwatchUnit_(stopwatchUnit),
-    checkpointServices_(0)
+    checkpointTime_(featureCheckpoint ? time(NULL) : 0),
+    lifetimeServices_(handler->registerCounter("lifetime_services")),
+    shards_(sysconf(_SC_NPROCESSORS_CONF) > 0 ? sysconf(_SC_NPROCESSORS_CONF) : 1)
 {
-  if (featureCheckpoint_) {
-    time_t now = time(NULL);
-    checkpointTime_ = now;
-  } else {
-    checkpointTime_ = 0;
+  for (uint32_t i = 0; i < METHOD_BUCKETS; ++i) {
+    methods_[i].store(NULL, boost::memory_order_relaxed);
+  }
+}
+
+ServiceTracker::~ServiceTracker()
+{
+  for (uint32_t i = 0; i < METHOD_BUCKETS; ++i) {
+    MethodStats *stats = methods_[i].load(boost::memory_order_relaxed);
+    while (stats != NULL) {
+      MethodStats *next = stats->next_;
+      delete stats;
+      stats = next;
+    }
   }
 }
 
@@ -165,111 +276,135 @@ ServiceTracker::finishService(const ServiceMethod &serviceMethod)
   // count, record, and maybe report service statistics
   if (!serviceMethod.featureLogOnly_) {
 
-    if (!featureCheckpoint_) {
-
-      // lifetime counters
-      // (note: No need to lock statisticsMutex_ if not doing checkpoint;
-      // FacebookService::incrementCounter() is already thread-safe.)
-      handler_->incrementCounter("lifetime_services");
-
-    } else {
-
-      statisticsMutex_.lock();
-      // note: No exceptions expected from this code block.  Wrap in a try
-      // just to be safe.
-      try {
-
-        // lifetime counters
-        // note: Good to synchronize this with the increment of
-        // checkpoint services, even though incrementCounter() is
-        // already thread-safe, for the sake of checkpoint reporting
-        // consistency (i.e.  since the last checkpoint,
-        // lifetime_services has incremented by checkpointServices_).
-        handler_->incrementCounter("lifetime_services");
-
-        // checkpoint counters
-        checkpointServices_++;
-        checkpointDuration_ += duration;
-
-        // per-service timing
-        // note kjv: According to my tests it is very slightly faster to
-        // call insert() once (and detect not-found) than calling find()
-        // and then maybe insert (if not-found).  However, the difference
-        // is tiny for small maps like this one, and the code for the
-        // faster solution is slightly less readable.  Also, I wonder if
-        // the instantiation of the (often unused) pair to insert makes
-        // the first algorithm slower after all.
-        map<string, pair<uint64_t, uint64_t> >::iterator iter;
-        iter = checkpointServiceDuration_.find(serviceMethod.name_);
-        if (iter != checkpointServiceDuration_.end()) {
-          iter->second.first++;
-          iter->second.second += duration;
-        } else {
-          checkpointServiceDuration_.insert(make_pair(serviceMethod.name_,
-                                                      make_pair(1, duration)));
+    // lifetime counters
+    lifetimeServices_->add(1);
+
+    if (featureCheckpoint_) {
+
+      // per-service timing
+      getMethodStats(serviceMethod.name_)->record(duration);
+
+      // maybe report checkpoint
+      // note: ...if it's been long enough since the last report.  Only
+      // one thread reports; the others carry on recording.
+      time_t now = time(NULL);
+      if (checkpointDue(now) && statisticsMutex_.trylock()) {
+        // note: No exceptions expected from this code block.  Wrap in a try
+        // just to be safe.
+        try {
+          // check again, someone may have reported while we got the lock
+          if (checkpointDue(now)) {
+            reportCheckpoint(now);
+          }
+        } catch (...) {
+          statisticsMutex_.unlock();
+          throw;
         }
-
-        // maybe report checkpoint
-        // note: ...if it's been long enough since the last report.
-        time_t now = time(NULL);
-        uint64_t check_interval = now - checkpointTime_;
-        if (check_interval >= CHECKPOINT_MINIMUM_INTERVAL_SECONDS) {
-          reportCheckpoint();
-        }
-
-      } catch (...) {
         statisticsMutex_.unlock();
-        throw;
       }
-      statisticsMutex_.unlock();
 
     }
   }
 }
 
+bool
+ServiceTracker::checkpointDue(time_t now) const
+{
+  int64_t check_interval = now - checkpointTime_.load(boost::memory_order_relaxed);
+  return check_interval >= 0
+    && static_cast<uint64_t>(check_interval) >= CHECKPOINT_MINIMUM_INTERVAL_SECONDS;
+}
+
+/**
+ * Returns the statistics for a service method name, creating them on
+ * first use.  The buckets are lists that are only ever prepended to, so
+ * lookups never lock.
+ */
+ServiceTracker::MethodStats *
+ServiceTracker::getMethodStats(const string &name)
+{
+  uint32_t hash = 2166136261U;
+  for (string::const_iterator it = name.begin(); it != name.end(); ++it) {
+    hash = (hash ^ static_cast<unsigned char>(*it)) * 16777619U;
+  }
+  boost::atomic<MethodStats *> &bucket = methods_[hash % METHOD_BUCKETS];
+
+  MethodStats *head = bucket.load(boost::memory_order_acquire);
+  for (MethodStats *stats = head; stats != NULL; stats = stats->next_) {
+    if (stats->name_ == name) {
+      return stats;
+    }
+  }
+
+  MethodStats *created = new MethodStats(name, shards_);
+  for (;;) {
+    MethodStats *seen = head;
+    created->next_ = head;
+    if (bucket.compare_exchange_weak(head, created,
+                                     boost::memory_order_acq_rel)) {
+      return created;
+    }
+    for (MethodStats *stats = head; stats != seen; stats = stats->next_) {
+      if (stats->name_ == name) {
+        delete created;
+        return stats;
+      }
+    }
+  }
+}
+
 /**
  * Logs some statistics gathered since the last call to this method.
  *
- * note: Thread race conditions on this method could cause
- * misreporting and/or undefined behavior; the caller must protect
- * uses of the object variables (and calls to this method) with a
- * mutex.
+ * note: The caller must hold statisticsMutex_, so that only one thread
+ * drains the per-method shards and resets the checkpoint time.
  *
  */
 void
-ServiceTracker::reportCheckpoint()
+ServiceTracker::reportCheckpoint(time_t now)
 {
-  time_t now = time(NULL);
-
-  uint64_t check_count = checkpointServices_;
-  uint64_t check_interval = now - checkpointTime_;
-  uint64_t check_duration = checkpointDuration_;
+  uint64_t check_count = 0;
+  uint64_t check_interval = now - checkpointTime_.load(boost::memory_order_relaxed);
+  uint64_t check_duration = 0;
 
   // export counters for timing of service methods (by service name)
   handler_->setCounter("checkpoint_time", check_interval);
-  map<string, pair<uint64_t, uint64_t> >::iterator iter;
-  uint64_t count;
-  for (iter = checkpointServiceDuration_.begin();
-       iter != checkpointServiceDuration_.end();
-       ++iter) {
-    count = iter->second.first;
-    handler_->setCounter(string("checkpoint_count_") + iter->first, count);
-    if (count == 0) {
-      handler_->setCounter(string("checkpoint_speed_") + iter->first,
-                           0);
-    } else {
-      handler_->setCounter(string("checkpoint_speed_") + iter->first,
-                           iter->second.second / count);
+  stringstream method_message;
+  vector<uint64_t> buckets(THistogram::NUM_BUCKETS);
+  for (uint32_t i = 0; i < METHOD_BUCKETS; ++i) {
+    for (MethodStats *stats = methods_[i].load(boost::memory_order_acquire);
+         stats != NULL;
+         stats = stats->next_) {
+      fill(buckets.begin(), buckets.end(), 0);
+      uint64_t count = 0;
+      uint64_t duration = 0;
+      stats->drain(buckets, count, duration);
+      check_count += count;
+      check_duration += duration;
+
+      uint64_t p50 = percentile(buckets, count, 50.0);
+      uint64_t p99 = percentile(buckets, count, 99.0);
+      uint64_t p999 = percentile(buckets, count, 99.9);
+      const string &name = stats->name_;
+      handler_->setCounter(string("checkpoint_count_") + name, count);
+      handler_->setCounter(string("checkpoint_speed_") + name,
+                           count == 0 ? 0 : duration / count);
+      handler_->setCounter(string("checkpoint_p50_") + name, p50);
+      handler_->setCounter(string("checkpoint_p99_") + name, p99);
+      handler_->setCounter(string("checkpoint_p999_") + name, p999);
+      if (count != 0) {
+        method_message << "\n  " << name
+                       << " count:" << count
+                       << " speed:" << duration / count
+                       << " p50:" << p50
+                       << " p99:" << p99
+                       << " p999:" << p999;
+      }
     }
   }
 
-  // reset checkpoint variables
-  // note: Clearing the map while other threads are using it might
-  // cause undefined behavior.
-  checkpointServiceDuration_.clear();
-  checkpointTime_ = now;
-  checkpointServices_ = 0;
-  checkpointDuration_ = 0;
+  // reset checkpoint time
+  checkpointTime_.store(now, boost::memory_order_relaxed);
 
   // get lifetime variables
   uint64_t life_count = handler_->getCounter("lifetime_services");
@@ -288,6 +423,7 @@ ServiceTracker::reportCheckpoint()
     message << " total_workers:" << worker_count
             << " active_workers:" << (worker_count - idle_count);
   }
+  message << method_message.str();
   logMethod_(4, message.str());
 }
 
@@ -31,7 +31,7 @@
  *
  *   . A periodic logged checkpoint reporting lifetime time, lifetime
  *     service count, and per-method statistics since the last checkpoint
- *     time (at method finish).
+ *     time, including p50/p99/p999 durations (at method finish).
  *
  *   . Export of fb303 counters for lifetime and checkpoint statistics
  *     (at method finish).
@@ -78,7 +78,10 @@
  * finishService() methods are handled by the object's constructor and
  * destructor.
  *
- * The ServiceTracker is (intended to be) thread-safe.
+ * The ServiceTracker is (intended to be) thread-safe.  Durations are
+ * recorded without locking, into per-CPU histogram shards for each
+ * method name; the thread that finishes the first service after the
+ * checkpoint interval has passed drains the shards and reports.
  *
  * Future:
  *
@@ -98,6 +101,8 @@
 #include <sstream>
 #include <exception>
 #include <map>
+#include <vector>
+#include <boost/atomic.hpp>
 #include <boost/shared_ptr.hpp>
 
 #include <thrift/concurrency/Mutex.h>
@@ -113,6 +118,7 @@ namespace facebook { namespace fb303 {
 
 class FacebookBase;
 class ServiceMethod;
+class ShardedCounter;
 
 
 class Stopwatch
@@ -144,6 +150,7 @@ public:
                  bool featureThreadCheck = true,
                  Stopwatch::Unit stopwatchUnit
                  = Stopwatch::UNIT_MILLISECONDS);
+  ~ServiceTracker();
 
   void setThreadManager(boost::shared_ptr<apache::thrift::concurrency::ThreadManager> threadManager);
 
@@ -158,17 +165,23 @@ private:
   bool featureThreadCheck_;
   Stopwatch::Unit stopwatchUnit_;
 
+  class MethodStats;
+  static const uint32_t METHOD_BUCKETS = 64;
+
+  // only held while reporting a checkpoint, never while recording
   apache::thrift::concurrency::Mutex statisticsMutex_;
-  time_t checkpointTime_;
-  uint64_t checkpointServices_;
-  uint64_t checkpointDuration_;
-  std::map<std::string, std::pair<uint64_t, uint64_t> > checkpointServiceDuration_;
+  boost::atomic<int64_t> checkpointTime_;
+  ShardedCounter *lifetimeServices_;
+  uint32_t shards_;
+  boost::atomic<MethodStats *> methods_[METHOD_BUCKETS];
 
   void startService(const ServiceMethod &serviceMethod);
   int64_t stepService(const ServiceMethod &serviceMethod,
                       const std::string &stepName);
   void finishService(const ServiceMethod &serviceMethod);
-  void reportCheckpoint();
+  MethodStats *getMethodStats(const std::string &name);
+  bool checkpointDue(time_t now) const;
+  void reportCheckpoint(time_t now);
   static void defaultLogMethod(int level, const std::string &message);
 };
 
@@ -0,0 +1,101 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/**
+ * Measures the overhead ServiceTracker adds to each tracked call when many
+ * threads finish services concurrently.
+ *
+ *   ServiceTrackerBench [threads [calls_per_thread]]
+ *
+ * Defaults to 32 threads.  Logging is discarded so only the tracking
+ * itself is measured.
+ */
+
+#include <sys/time.h>
+#include <cstdlib>
+#include <iostream>
+#include <vector>
+
+#include "FacebookBase.h"
+#include "ServiceTracker.h"
+#include <thrift/concurrency/PlatformThreadFactory.h>
+
+using namespace std;
+using namespace facebook::fb303;
+using namespace apache::thrift::concurrency;
+
+class BenchHandler : public FacebookBase {
+ public:
+  BenchHandler() : FacebookBase("ServiceTrackerBench") {}
+  fb_status getStatus() { return facebook::fb303::ALIVE; }
+};
+
+static void discardLog(int, const string &) {}
+
+class BenchRunner : public Runnable {
+ public:
+  BenchRunner(ServiceTracker *tracker, int calls)
+    : tracker_(tracker), calls_(calls) {}
+
+  void run() {
+    static const char *names[] = {"get", "put", "scan", "delete"};
+    for (int i = 0; i < calls_; ++i) {
+      ServiceMethod method(tracker_, names[i % 4], i);
+    }
+  }
+
+ private:
+  ServiceTracker *tracker_;
+  int calls_;
+};
+
+static double now() {
+  timeval tv;
+  gettimeofday(&tv, NULL);
+  return tv.tv_sec + tv.tv_usec / 1000000.0;
+}
+
+int main(int argc, char **argv) {
+  int threads = argc > 1 ? atoi(argv[1]) : 32;
+  int calls = argc > 2 ? atoi(argv[2]) : 200000;
+
+  BenchHandler handler;
+  ServiceTracker tracker(&handler, &discardLog, true, false, false,
+                         Stopwatch::UNIT_MICROSECONDS);
+  ServiceTracker::CHECKPOINT_MINIMUM_INTERVAL_SECONDS = 1;
+
+  PlatformThreadFactory factory(false);
+  vector<apache::thrift::stdcxx::shared_ptr<Thread> > running;
+  double start = now();
+  for (int t = 0; t < threads; ++t) {
+    running.push_back(factory.newThread(
+        apache::thrift::stdcxx::shared_ptr<Runnable>(new BenchRunner(&tracker, calls))));
+    running.back()->start();
+  }
+  for (size_t t = 0; t < running.size(); ++t) {
+    running[t]->join();
+  }
+  double elapsed = now() - start;
+
+  double total = static_cast<double>(threads) * calls;
+  cout << threads << " threads, " << total << " tracked calls: "
+       << total / (1000 * elapsed) << " kHz, "
+       << elapsed * 1e9 * threads / total << " ns per call per thread" << endl;
+  return 0;
+}
@@ -0,0 +1,162 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include "ShardedCounters.h"
+
+#include <new>
+#include <unistd.h>
+#ifdef __linux__
+#include <sched.h>
+#endif
+
+using namespace facebook::fb303;
+using apache::thrift::concurrency::Guard;
+
+const size_t ShardedCounter::CACHE_LINE_SIZE;
+const uint32_t ShardedCounterMap::NUM_BUCKETS;
+
+uint32_t ShardedCounter::currentShard(uint32_t shards) {
+#ifdef __linux__
+  int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return static_cast<uint32_t>(cpu) % shards;
+  }
+#endif
+  // Threads run on distinct stacks, so the address of a local identifies
+  // the calling thread well enough to spread threads over the shards.
+  int marker;
+  uint64_t key = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&marker)) >> 16;
+  key *= 0x9E3779B97F4A7C15ULL;
+  return static_cast<uint32_t>(key >> 32) % shards;
+}
+
+ShardedCounter::ShardedCounter(const std::string& name, uint32_t shards) :
+  name_(name), shards_(shards), next_(NULL) {
+  // Over-allocate so the slots can start on a cache line boundary
+  memory_ = new char[sizeof(Slot) * shards_ + CACHE_LINE_SIZE];
+  uintptr_t aligned = (reinterpret_cast<uintptr_t>(memory_) + CACHE_LINE_SIZE - 1)
+                      & ~static_cast<uintptr_t>(CACHE_LINE_SIZE - 1);
+  slots_ = reinterpret_cast<Slot*>(aligned);
+  for (uint32_t i = 0; i < shards_; ++i) {
+    new (&slots_[i]) Slot();
+    slots_[i].value.store(0, boost::memory_order_relaxed);
+  }
+}
+
+ShardedCounter::~ShardedCounter() {
+  for (uint32_t i = 0; i < shards_; ++i) {
+    slots_[i].~Slot();
+  }
+  delete[] memory_;
+}
+
+int64_t ShardedCounter::get() const {
+  int64_t total = 0;
+  for (uint32_t i = 0; i < shards_; ++i) {
+    total += slots_[i].value.load(boost::memory_order_relaxed);
+  }
+  return total;
+}
+
+static uint32_t hashKey(const std::string& key) {
+  // FNV-1a
+  uint32_t hash = 2166136261U;
+  for (std::string::const_iterator it = key.begin(); it != key.end(); ++it) {
+    hash ^= static_cast<unsigned char>(*it);
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+ShardedCounterMap::ShardedCounterMap(uint32_t shards) :
+  shards_(shards) {
+  if (shards_ == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_CONF);
+    shards_ = cpus > 0 ? static_cast<uint32_t>(cpus) : 1;
+  }
+  for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+    buckets_[i].store(NULL, boost::memory_order_relaxed);
+  }
+}
+
+ShardedCounterMap::~ShardedCounterMap() {
+  for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+    ShardedCounter* counter = buckets_[i].load(boost::memory_order_relaxed);
+    while (counter != NULL) {
+      ShardedCounter* next = counter->next_;
+      delete counter;
+      counter = next;
+    }
+  }
+}
+
+ShardedCounter* ShardedCounterMap::find(const std::string& key) const {
+  const boost::atomic<ShardedCounter*>& bucket = buckets_[hashKey(key) % NUM_BUCKETS];
+  for (ShardedCounter* counter = bucket.load(boost::memory_order_acquire);
+       counter != NULL; counter = counter->next_) {
+    if (counter->name_ == key) {
+      return counter;
+    }
+  }
+  return NULL;
+}
+
+ShardedCounter* ShardedCounterMap::get(const std::string& key) {
+  boost::atomic<ShardedCounter*>& bucket = buckets_[hashKey(key) % NUM_BUCKETS];
+  ShardedCounter* head = bucket.load(boost::memory_order_acquire);
+  for (ShardedCounter* counter = head; counter != NULL; counter = counter->next_) {
+    if (counter->name_ == key) {
+      return counter;
+    }
+  }
+
+  ShardedCounter* created = new ShardedCounter(key, shards_);
+  for (;;) {
+    created->next_ = head;
+    ShardedCounter* seen = head;
+    if (bucket.compare_exchange_weak(head, created, boost::memory_order_acq_rel)) {
+      return created;
+    }
+    // Someone else prepended; only the new part of the list needs checking
+    for (ShardedCounter* counter = head; counter != seen; counter = counter->next_) {
+      if (counter->name_ == key) {
+        delete created;
+        return counter;
+      }
+    }
+  }
+}
+
+int64_t ShardedCounterMap::set(const std::string& key, int64_t value) {
+  ShardedCounter* counter = get(key);
+  // Adjusting by the difference keeps concurrent add()s; the lock only
+  // keeps two setters from both applying their difference.
+  Guard g(setLock_);
+  counter->slots_[0].value.fetch_add(value - counter->get(), boost::memory_order_relaxed);
+  return value;
+}
+
+void ShardedCounterMap::getAll(std::map<std::string, int64_t>& _return) const {
+  for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+    for (ShardedCounter* counter = buckets_[i].load(boost::memory_order_acquire);
+         counter != NULL; counter = counter->next_) {
+      _return[counter->name_] = counter->get();
+    }
+  }
+}
@@ -0,0 +1,130 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _FACEBOOK_TB303_SHARDEDCOUNTERS_H_
+#define _FACEBOOK_TB303_SHARDEDCOUNTERS_H_ 1
+
+#include <boost/atomic.hpp>
+#include <thrift/concurrency/Mutex.h>
+
+#include <stdint.h>
+#include <string>
+#include <map>
+
+namespace facebook { namespace fb303 {
+
+/**
+ * A counter split into cache line sized slots, one per shard.  add() only
+ * touches the slot of the CPU (or, where the CPU cannot be queried, the
+ * thread) it runs on, so threads incrementing the same hot counter do not
+ * bounce a shared cache line between them.  get() sums the slots.
+ *
+ * Counters are created by, and live as long as, their ShardedCounterMap;
+ * the pointer it hands out can be kept and used as a handle.
+ */
+class ShardedCounter {
+ public:
+  static const size_t CACHE_LINE_SIZE = 64;
+
+  void add(int64_t amount) {
+    slots_[currentShard(shards_)].value.fetch_add(amount, boost::memory_order_relaxed);
+  }
+
+  int64_t get() const;
+
+  const std::string& name() const { return name_; }
+
+  /**
+   * The shard the calling thread should use, in [0, shards).
+   */
+  static uint32_t currentShard(uint32_t shards);
+
+ private:
+  friend class ShardedCounterMap;
+
+  struct Slot {
+    boost::atomic<int64_t> value;
+    char pad[CACHE_LINE_SIZE - sizeof(boost::atomic<int64_t>)];
+  };
+
+  ShardedCounter(const std::string& name, uint32_t shards);
+  ~ShardedCounter();
+
+  const std::string name_;
+  const uint32_t shards_;
+  char* memory_;
+  Slot* slots_;
+  ShardedCounter* next_;
+
+  // not copyable
+  ShardedCounter(const ShardedCounter&);
+  ShardedCounter& operator=(const ShardedCounter&);
+};
+
+/**
+ * Name to ShardedCounter map that never locks on lookup.
+ *
+ * The map is a fixed array of buckets, each a singly linked list that is
+ * only ever prepended to with a compare and swap, so readers can walk it
+ * while other threads insert.  Counters are never removed.
+ */
+class ShardedCounterMap {
+ public:
+  /**
+   * shards == 0 picks one shard per configured CPU.
+   */
+  explicit ShardedCounterMap(uint32_t shards = 0);
+  ~ShardedCounterMap();
+
+  /**
+   * Returns the counter for key, creating it (at zero) if necessary.
+   */
+  ShardedCounter* get(const std::string& key);
+
+  /**
+   * Returns the counter for key, or NULL if it does not exist.
+   */
+  ShardedCounter* find(const std::string& key) const;
+
+  /**
+   * Sets the counter for key to value.  Increments that race with the set
+   * are kept on top of value rather than lost.
+   */
+  int64_t set(const std::string& key, int64_t value);
+
+  /**
+   * Adds the current value of every counter to _return.
+   */
+  void getAll(std::map<std::string, int64_t>& _return) const;
+
+ private:
+  static const uint32_t NUM_BUCKETS = 1024;
+
+  uint32_t shards_;
+  boost::atomic<ShardedCounter*> buckets_[NUM_BUCKETS];
+  apache::thrift::concurrency::Mutex setLock_;
+
+  // not copyable
+  ShardedCounterMap(const ShardedCounterMap&);
+  ShardedCounterMap& operator=(const ShardedCounterMap&);
+};
+
+}} // facebook::tb303
+
+#endif // _FACEBOOK_TB303_SHARDEDCOUNTERS_H_
@@ -0,0 +1,174 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define BOOST_TEST_MODULE ShardedCountersTest
+#include <boost/test/unit_test.hpp>
+
+#include <boost/atomic.hpp>
+#include <map>
+#include <vector>
+
+#include "ShardedCounters.h"
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/stdcxx.h>
+
+using namespace facebook::fb303;
+using namespace apache::thrift::concurrency;
+using apache::thrift::stdcxx::shared_ptr;
+
+namespace {
+
+const int THREADS = 8;
+const int64_t ADDS = 100000;
+
+/**
+ * Adds 1 to a counter ADDS times
+ */
+class Adder : public Runnable {
+ public:
+  explicit Adder(ShardedCounter* counter) : counter_(counter) {}
+
+  void run() {
+    for (int64_t i = 0; i < ADDS; ++i) {
+      counter_->add(1);
+    }
+  }
+
+ private:
+  ShardedCounter* counter_;
+};
+
+/**
+ * Reads a counter until told to stop, checking that it never goes down
+ */
+class Reader : public Runnable {
+ public:
+  explicit Reader(ShardedCounter* counter)
+    : counter_(counter), stop_(false), reads_(0), decreases_(0) {}
+
+  void run() {
+    int64_t last = 0;
+    while (!stop_) {
+      int64_t value = counter_->get();
+      if (value < last) {
+        ++decreases_;
+      }
+      last = value;
+      ++reads_;
+    }
+  }
+
+  void stop() { stop_ = true; }
+  int64_t reads() const { return reads_; }
+  int64_t decreases() const { return decreases_; }
+
+ private:
+  ShardedCounter* counter_;
+  boost::atomic<bool> stop_;
+  int64_t reads_;
+  int64_t decreases_;
+};
+
+/**
+ * Looks a counter up by name ADDS times and adds 1 to it
+ */
+class LookupAdder : public Runnable {
+ public:
+  LookupAdder(ShardedCounterMap* counters, const std::string& key)
+    : counters_(counters), key_(key) {}
+
+  void run() {
+    for (int64_t i = 0; i < ADDS; ++i) {
+      counters_->get(key_)->add(1);
+    }
+  }
+
+ private:
+  ShardedCounterMap* counters_;
+  std::string key_;
+};
+
+void runAll(const std::vector<shared_ptr<Runnable> >& runnables) {
+  PlatformThreadFactory factory;
+  factory.setDetached(false);
+  std::vector<shared_ptr<Thread> > threads;
+  for (size_t i = 0; i < runnables.size(); ++i) {
+    threads.push_back(factory.newThread(runnables[i]));
+    threads.back()->start();
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->join();
+  }
+}
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_add_and_get) {
+  ShardedCounterMap counters(4);
+  ShardedCounter* counter = counters.get("requests");
+
+  shared_ptr<Reader> reader(new Reader(counter));
+  PlatformThreadFactory factory;
+  factory.setDetached(false);
+  shared_ptr<Thread> readerThread = factory.newThread(reader);
+  readerThread->start();
+
+  std::vector<shared_ptr<Runnable> > adders;
+  for (int i = 0; i < THREADS; ++i) {
+    adders.push_back(shared_ptr<Runnable>(new Adder(counter)));
+  }
+  runAll(adders);
+
+  reader->stop();
+  readerThread->join();
+
+  BOOST_CHECK_EQUAL(THREADS * ADDS, counter->get());
+  BOOST_CHECK_EQUAL(THREADS * ADDS, counters.find("requests")->get());
+  BOOST_CHECK(reader->reads() > 0);
+  BOOST_CHECK_EQUAL(0, reader->decreases());
+}
+
+BOOST_AUTO_TEST_CASE(concurrent_lookups_share_one_counter) {
+  ShardedCounterMap counters(4);
+
+  std::vector<shared_ptr<Runnable> > adders;
+  for (int i = 0; i < THREADS; ++i) {
+    adders.push_back(shared_ptr<Runnable>(new LookupAdder(&counters, "requests")));
+  }
+  runAll(adders);
+
+  std::map<std::string, int64_t> all;
+  counters.getAll(all);
+  BOOST_CHECK_EQUAL(1u, all.size());
+  BOOST_CHECK_EQUAL(THREADS * ADDS, all["requests"]);
+}
+
+BOOST_AUTO_TEST_CASE(adds_after_set_build_on_it) {
+  ShardedCounterMap counters(4);
+  ShardedCounter* counter = counters.get("requests");
+
+  std::vector<shared_ptr<Runnable> > adders;
+  for (int i = 0; i < THREADS; ++i) {
+    adders.push_back(shared_ptr<Runnable>(new Adder(counter)));
+  }
+  counters.set("requests", 1000);
+  runAll(adders);
+
+  BOOST_CHECK_EQUAL(1000 + THREADS * ADDS, counter->get());
+  BOOST_CHECK(counters.find("missing") == NULL);
+}
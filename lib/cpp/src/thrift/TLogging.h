@@ -167,18 +167,26 @@
  *                                      virtual call debug messages disabled
  * T_GLOBAL_DEBUG_VIRTUAL = 1:          log a debug messages whenever an
  *                                      avoidable virtual call is made
- * T_GLOBAL_DEBUG_VIRTUAL = 2:          record detailed info that can be
- *                                      printed by calling
+ * T_GLOBAL_DEBUG_VIRTUAL = 2:          count the avoidable virtual calls by
+ *                                      type and method, and the calls that
+ *                                      templated processors could and could
+ *                                      not make without them, and take the
+ *                                      stack of one in every
+ *                                      apache::thrift::profile_set_sample_rate()
+ *                                      of those calls; print it all by
+ *                                      calling
  *                                      apache::thrift::profile_print_info()
  */
 #if T_GLOBAL_DEBUG_VIRTUAL > 1
-#define T_VIRTUAL_CALL() ::apache::thrift::profile_virtual_call(typeid(*this))
+#define T_VIRTUAL_CALL() ::apache::thrift::profile_virtual_call(typeid(*this), __FUNCTION__)
 #define T_GENERIC_PROTOCOL(template_class, generic_prot, specific_prot)                            \
   do {                                                                                             \
     if (!(specific_prot)) {                                                                        \
       ::apache::thrift::profile_generic_protocol(typeid(*template_class), typeid(*generic_prot));  \
     }                                                                                              \
   } while (0)
+#define T_TEMPLATED_PROTOCOL(template_class, specific_prot)                                        \
+  ::apache::thrift::profile_specific_protocol(typeid(*template_class), typeid(*specific_prot))
 #elif T_GLOBAL_DEBUG_VIRTUAL == 1
 #define T_VIRTUAL_CALL() fprintf(stderr, "[%s,%d] virtual call\n", __FILE__, __LINE__)
 #define T_GENERIC_PROTOCOL(template_class, generic_prot, specific_prot)                            \
@@ -187,9 +195,11 @@
       fprintf(stderr, "[%s,%d] failed to cast to specific protocol type\n", __FILE__, __LINE__);   \
     }                                                                                              \
   } while (0)
+#define T_TEMPLATED_PROTOCOL(template_class, specific_prot)
 #else
 #define T_VIRTUAL_CALL()
 #define T_GENERIC_PROTOCOL(template_class, generic_prot, specific_prot)
+#define T_TEMPLATED_PROTOCOL(template_class, specific_prot)
 #endif
 
 #endif // #ifndef _THRIFT_TLOGGING_H_
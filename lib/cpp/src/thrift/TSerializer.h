@@ -0,0 +1,61 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TSERIALIZER_H_
+#define _THRIFT_TSERIALIZER_H_ 1
+
+#include <string>
+
+#include <thrift/Thrift.h>
+#include <thrift/stdcxx.h>
+#include <thrift/transport/TBufferTransports.h>
+
+namespace apache {
+namespace thrift {
+
+/**
+ * Writes obj through proto, after making room in transport for all of it at
+ * once.  obj must be of a struct generated with the serialized_size option,
+ * and transport, the one proto writes to, a TMemoryBuffer, a
+ * TFramedTransport or another transport with reserve(uint32_t).
+ *
+ * @return the number of bytes written
+ */
+template <class Protocol_, class Object_, class Transport_>
+uint32_t writeReserved(const Object_& obj, Protocol_& proto, Transport_& transport) {
+  transport.reserve(obj.template serializedSize<Protocol_>());
+  return obj.write(&proto);
+}
+
+/**
+ * Serializes obj with Protocol_, such as TBinaryProtocolT<TMemoryBuffer>,
+ * into a buffer allocated once at the right size.
+ */
+template <class Protocol_, class Object_>
+std::string serializeToString(const Object_& obj) {
+  stdcxx::shared_ptr<transport::TMemoryBuffer> buffer(
+      new transport::TMemoryBuffer(obj.template serializedSize<Protocol_>()));
+  Protocol_ proto(buffer);
+  obj.write(&proto);
+  return buffer->getBufferAsString();
+}
+}
+} // apache::thrift
+
+#endif // #ifndef _THRIFT_TSERIALIZER_H_
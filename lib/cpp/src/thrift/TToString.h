@@ -21,6 +21,7 @@
 #define _THRIFT_TOSTRING_H_ 1
 
 #include <cmath>
+#include <cstdio>
 #include <limits>
 #include <map>
 #include <set>
@@ -28,6 +29,8 @@
 #include <string>
 #include <vector>
 
+#include <thrift/Thrift.h>
+
 namespace apache {
 namespace thrift {
 
@@ -108,6 +111,144 @@ std::string to_string(const std::set<T>& s) {
   o << "{" << to_string(s.begin(), s.end()) << "}";
   return o.str();
 }
+
+/**
+ * Append-only output for the generated printTo(TToStringBuffer&) methods and
+ * the append_to() overloads below.  Values are formatted straight onto the end
+ * of a caller-owned std::string, which can be clear()ed and reused, instead of
+ * going through a fresh std::ostringstream per value as to_string() does.
+ * Containers print at most maxElements() elements, followed by "...".
+ */
+class TToStringBuffer {
+public:
+  static const uint32_t UNLIMITED = 0xffffffff;
+
+  explicit TToStringBuffer(std::string& str, uint32_t max_elements = UNLIMITED)
+    : str_(str), max_elements_(max_elements) {}
+
+  void append(const char* s, size_t n) { str_.append(s, n); }
+
+  void append(const char* s) { str_.append(s); }
+
+  void append(const std::string& s) { str_.append(s); }
+
+  void append(char c) { str_.push_back(c); }
+
+  uint32_t maxElements() const { return max_elements_; }
+
+  void setMaxElements(uint32_t max_elements) { max_elements_ = max_elements; }
+
+  std::string& str() { return str_; }
+
+private:
+  std::string& str_;
+  uint32_t max_elements_;
+};
+
+/*
+ * append_to() formats a value the way to_string() does.  Generated code emits
+ * overloads for its structs and enums; anything else without an overload here
+ * goes through operator<<.
+ */
+
+template <typename T>
+void append_to(TToStringBuffer& out, const T& t) {
+  std::ostringstream o;
+  o << t;
+  out.append(o.str());
+}
+
+inline void append_to(TToStringBuffer& out, const std::string& s) {
+  out.append(s);
+}
+
+inline void append_to(TToStringBuffer& out, const char* s) {
+  out.append(s);
+}
+
+inline void append_to(TToStringBuffer& out, char c) {
+  out.append(c);
+}
+
+inline void append_to(TToStringBuffer& out, signed char c) {
+  out.append(static_cast<char>(c));
+}
+
+inline void append_to(TToStringBuffer& out, bool b) {
+  out.append(b ? '1' : '0');
+}
+
+#define THRIFT_APPEND_TO_FORMATTED(Type, Format)                                                   \
+  inline void append_to(TToStringBuffer& out, Type v) {                                           \
+    char buf[32];                                                                                  \
+    int len = std::snprintf(buf, sizeof(buf), Format, v);                                          \
+    out.append(buf, static_cast<size_t>(len));                                                     \
+  }
+
+THRIFT_APPEND_TO_FORMATTED(short, "%hd")
+THRIFT_APPEND_TO_FORMATTED(unsigned short, "%hu")
+THRIFT_APPEND_TO_FORMATTED(int, "%d")
+THRIFT_APPEND_TO_FORMATTED(unsigned int, "%u")
+THRIFT_APPEND_TO_FORMATTED(long, "%ld")
+THRIFT_APPEND_TO_FORMATTED(unsigned long, "%lu")
+THRIFT_APPEND_TO_FORMATTED(long long, "%lld")
+THRIFT_APPEND_TO_FORMATTED(unsigned long long, "%llu")
+// Same precision as to_string(float) and to_string(double)
+THRIFT_APPEND_TO_FORMATTED(float, "%.9g")
+THRIFT_APPEND_TO_FORMATTED(double, "%.17g")
+
+#undef THRIFT_APPEND_TO_FORMATTED
+
+template <typename K, typename V>
+void append_to(TToStringBuffer& out, const std::map<K, V>& m);
+
+template <typename T>
+void append_to(TToStringBuffer& out, const std::set<T>& s);
+
+template <typename T>
+void append_to(TToStringBuffer& out, const std::vector<T>& t);
+
+template <typename K, typename V>
+void append_to(TToStringBuffer& out, const typename std::pair<K, V>& v) {
+  append_to(out, v.first);
+  out.append(": ", 2);
+  append_to(out, v.second);
+}
+
+template <typename T>
+void append_to(TToStringBuffer& out, const T& beg, const T& end) {
+  uint32_t n = 0;
+  for (T it = beg; it != end; ++it, ++n) {
+    if (it != beg)
+      out.append(", ", 2);
+    if (n == out.maxElements()) {
+      out.append("...", 3);
+      break;
+    }
+    append_to(out, *it);
+  }
+}
+
+template <typename T>
+void append_to(TToStringBuffer& out, const std::vector<T>& t) {
+  out.append('[');
+  append_to(out, t.begin(), t.end());
+  out.append(']');
+}
+
+template <typename K, typename V>
+void append_to(TToStringBuffer& out, const std::map<K, V>& m) {
+  out.append('{');
+  append_to(out, m.begin(), m.end());
+  out.append('}');
+}
+
+template <typename T>
+void append_to(TToStringBuffer& out, const std::set<T>& s) {
+  out.append('{');
+  append_to(out, s.begin(), s.end());
+  out.append('}');
+}
 }
 } // apache::thrift
 
@@ -76,6 +76,9 @@ private:
   const char** names_;
 };
 
+// See TToString.h; declared here for the generated printTo() overloads.
+class TToStringBuffer;
+
 class TException : public std::exception {
 public:
   TException() : message_() {}
@@ -125,7 +128,10 @@ TDelayedException* TDelayedException::delayException(const E& e) {
 
 #if T_GLOBAL_DEBUG_VIRTUAL > 1
 void profile_virtual_call(const std::type_info& info);
+void profile_virtual_call(const std::type_info& info, const char* method);
 void profile_generic_protocol(const std::type_info& template_type, const std::type_info& prot_type);
+void profile_specific_protocol(const std::type_info& template_type, const std::type_info& prot_type);
+void profile_set_sample_rate(uint32_t rate);
 void profile_print_info(FILE* f);
 void profile_print_info();
 void profile_write_pprof(FILE* gen_calls_f, FILE* virtual_calls_f);
@@ -22,24 +22,31 @@
 // Do nothing if virtual call profiling is not enabled
 #if T_GLOBAL_DEBUG_VIRTUAL > 1
 
-// TODO: This code only works with g++ (since we rely on the fact
-// that all std::type_info instances referring to a particular type
-// always return the exact same pointer value from name().)
+// TODO: This code only works with g++ (since we rely on __thread and
+// abi::__cxa_demangle())
 #ifndef __GNUG__
 #error "Thrift virtual function profiling currently only works with gcc"
 #endif // !__GNUG__
 
-// TODO: We also require glibc for the backtrace() and backtrace_symbols()
-// functions.
-#ifndef __GLIBC__
-#error "Thrift virtual function profiling currently requires glibc"
-#endif // !__GLIBC__
-
 #include <thrift/concurrency/Mutex.h>
 
-#include <ext/hash_map>
-#include <execinfo.h>
+#include <boost/atomic.hpp>
+#include <algorithm>
+#include <cxxabi.h>
+#include <map>
+#include <pthread.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// Stacks are only taken where there is a backtrace(); the counts are kept
+// everywhere
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define THRIFT_HAVE_BACKTRACE 1
+#endif
 
 namespace apache {
 namespace thrift {
@@ -48,31 +55,15 @@ using ::apache::thrift::concurrency::Mutex;
 using ::apache::thrift::concurrency::Guard;
 
 static const unsigned int MAX_STACK_DEPTH = 15;
+static const uint32_t DEFAULT_SAMPLE_RATE = 1000;
 
 /**
  * A stack trace
  */
 class Backtrace {
 public:
-  Backtrace(int skip = 0);
-  Backtrace(Backtrace const& bt);
-
-  void operator=(Backtrace const& bt) {
-    numCallers_ = bt.numCallers_;
-    if (numCallers_ >= 0) {
-      memcpy(callers_, bt.callers_, numCallers_ * sizeof(void*));
-    }
-  }
-
-  bool operator==(Backtrace const& bt) const { return (cmp(bt) == 0); }
-
-  size_t hash() const {
-    intptr_t ret = 0;
-    for (int n = 0; n < numCallers_; ++n) {
-      ret ^= reinterpret_cast<intptr_t>(callers_[n]);
-    }
-    return static_cast<size_t>(ret);
-  }
+  Backtrace() : numCallers_(0), skip_(0) {}
+  Backtrace(int skip);
 
   int cmp(Backtrace const& bt) const {
     int depth_diff = (numCallers_ - bt.numCallers_);
@@ -81,10 +72,8 @@ public:
     }
 
     for (int n = 0; n < numCallers_; ++n) {
-      int diff = reinterpret_cast<intptr_t>(callers_[n])
-                 - reinterpret_cast<intptr_t>(bt.callers_[n]);
-      if (diff != 0) {
-        return diff;
+      if (callers_[n] != bt.callers_[n]) {
+        return (callers_[n] < bt.callers_[n]) ? -1 : 1;
       }
     }
 
@@ -92,6 +81,7 @@ public:
   }
 
   void print(FILE* f, int indent = 0, int start = 0) const {
+#ifdef THRIFT_HAVE_BACKTRACE
     char** strings = backtrace_symbols(callers_, numCallers_);
     if (strings) {
       start += skip_;
@@ -105,6 +95,10 @@ public:
     } else {
       fprintf(f, "%*s<failed to determine symbols>\n", indent, "");
     }
+#else
+    (void)start;
+    fprintf(f, "%*s<no stack on this platform>\n", indent, "");
+#endif
   }
 
   int getDepth() const { return numCallers_ - skip_; }
@@ -123,158 +117,315 @@ private:
   int skip_;
 };
 
-// Define the constructors non-inline, so they consistently add a single
+// Define the constructor non-inline, so it consistently adds a single
 // frame to the stack trace, regardless of whether optimization is enabled
-Backtrace::Backtrace(int skip)
+__attribute__((noinline)) Backtrace::Backtrace(int skip)
   : skip_(skip + 1) // ignore the constructor itself
 {
+#ifdef THRIFT_HAVE_BACKTRACE
   numCallers_ = backtrace(callers_, MAX_STACK_DEPTH);
+#else
+  numCallers_ = 0;
+#endif
   if (skip_ > numCallers_) {
     skip_ = numCallers_;
   }
 }
 
-Backtrace::Backtrace(Backtrace const& bt) : numCallers_(bt.numCallers_), skip_(bt.skip_) {
-  if (numCallers_ >= 0) {
-    memcpy(callers_, bt.callers_, numCallers_ * sizeof(void*));
+/**
+ * What was profiled
+ */
+enum CallKind {
+  VIRTUAL_CALL,     ///< a protocol or transport method, through a virtual call
+  GENERIC_PROTOCOL, ///< a templated processor, with a protocol of another type
+  SPECIFIC_PROTOCOL ///< a templated processor, with its own protocol type
+};
+
+static int cmpNames(const char* a, const char* b) {
+  // NOTE: With GNU libstdc++, every type_info object for the same type
+  // usually points to the same name string, but not across shared objects
+  if (a == b) {
+    return 0;
   }
+  if (a == NULL || b == NULL) {
+    return (a == NULL) ? -1 : 1;
+  }
+  return strcmp(a, b);
 }
 
 /**
- * A backtrace, plus one or two type names
+ * A call: its kind, one or two type names and, for virtual calls, the
+ * method.
  */
-class Key {
+class Call {
 public:
-  class Hash {
-  public:
-    size_t operator()(Key const& k) const { return k.hash(); }
-  };
+  Call() : kind_(VIRTUAL_CALL), typeName1_(NULL), typeName2_(NULL), method_(NULL) {}
 
-  Key(const Backtrace* bt, const std::type_info& type_info)
-    : backtrace_(bt), typeName1_(type_info.name()), typeName2_(NULL) {}
-
-  Key(const Backtrace* bt, const std::type_info& type_info1, const std::type_info& type_info2)
-    : backtrace_(bt), typeName1_(type_info1.name()), typeName2_(type_info2.name()) {}
-
-  Key(const Key& k)
-    : backtrace_(k.backtrace_), typeName1_(k.typeName1_), typeName2_(k.typeName2_) {}
-
-  void operator=(const Key& k) {
-    backtrace_ = k.backtrace_;
-    typeName1_ = k.typeName1_;
-    typeName2_ = k.typeName2_;
-  }
-
-  const Backtrace* getBacktrace() const { return backtrace_; }
+  Call(CallKind kind, const char* typeName1, const char* typeName2, const char* method)
+    : kind_(kind), typeName1_(typeName1), typeName2_(typeName2), method_(method) {}
 
+  CallKind getKind() const { return kind_; }
   const char* getTypeName() const { return typeName1_; }
-
   const char* getTypeName2() const { return typeName2_; }
-
-  void makePersistent() {
-    // Copy the Backtrace object
-    backtrace_ = new Backtrace(*backtrace_);
-
-    // NOTE: We don't copy the type name.
-    // The GNU libstdc++ implementation of type_info::name() returns a value
-    // that will be valid for the lifetime of the program.  (Although the C++
-    // standard doesn't guarantee this will be true on all implementations.)
-  }
+  const char* getMethod() const { return method_; }
 
   /**
-   * Clean up memory allocated by makePersistent()
-   *
-   * Should only be invoked if makePersistent() has previously been called.
-   * The Key should no longer be used after cleanup() is called.
+   * Whether c is this call with the very same names, which is cheaper to
+   * tell than cmp(c) == 0
    */
-  void cleanup() {
-    delete backtrace_;
-    backtrace_ = NULL;
+  bool same(const Call& c) const {
+    return kind_ == c.kind_ && typeName1_ == c.typeName1_ && typeName2_ == c.typeName2_
+           && method_ == c.method_;
   }
 
-  int cmp(const Key& k) const {
-    int ret = backtrace_->cmp(*k.backtrace_);
+  int cmp(const Call& c) const {
+    if (kind_ != c.kind_) {
+      return kind_ - c.kind_;
+    }
+    int ret = cmpNames(typeName1_, c.typeName1_);
     if (ret != 0) {
       return ret;
     }
-
-    // NOTE: We compare just the name pointers.
-    // With GNU libstdc++, every type_info object for the same type points to
-    // exactly the same name string.  (Although this isn't guaranteed by the
-    // C++ standard.)
-    ret = k.typeName1_ - typeName1_;
+    ret = cmpNames(typeName2_, c.typeName2_);
     if (ret != 0) {
       return ret;
     }
-    return k.typeName2_ - typeName2_;
+    return cmpNames(method_, c.method_);
   }
 
-  bool operator==(const Key& k) const { return cmp(k) == 0; }
-
-  size_t hash() const {
-    // NOTE: As above, we just use the name pointer value.
-    // Works with GNU libstdc++, but not guaranteed to be correct on all
-    // implementations.
-    return backtrace_->hash() ^ reinterpret_cast<size_t>(typeName1_)
-           ^ reinterpret_cast<size_t>(typeName2_);
-  }
+  bool operator<(const Call& c) const { return cmp(c) < 0; }
 
 private:
-  const Backtrace* backtrace_;
+  CallKind kind_;
   const char* typeName1_;
   const char* typeName2_;
+  const char* method_;
 };
 
 /**
- * A functor that determines which of two BacktraceMap entries
- * has a higher count.
+ * A call, plus the stack it was made from
  */
-class CountGreater {
+class Key {
 public:
-  bool operator()(std::pair<Key, size_t> bt1, std::pair<Key, size_t> bt2) const {
-    return bt1.second > bt2.second;
+  Key(const Call& call, const Backtrace& backtrace) : call_(call), backtrace_(backtrace) {}
+
+  const Call& getCall() const { return call_; }
+  const Backtrace& getBacktrace() const { return backtrace_; }
+
+  bool operator<(const Key& k) const {
+    int ret = call_.cmp(k.call_);
+    if (ret != 0) {
+      return ret < 0;
+    }
+    return backtrace_.cmp(k.backtrace_) < 0;
   }
+
+private:
+  Call call_;
+  Backtrace backtrace_;
 };
 
-typedef __gnu_cxx::hash_map<Key, size_t, Key::Hash> BacktraceMap;
+/**
+ * A count that only one thread increments, and any may read
+ */
+class Counter {
+public:
+  Counter() : value_(0) {}
+
+  void increment() {
+    // No read-modify-write is needed with a single writer
+    value_.store(value_.load(boost::memory_order_relaxed) + 1, boost::memory_order_relaxed);
+  }
+
+  uint64_t get() const { return value_.load(boost::memory_order_relaxed); }
+
+private:
+  boost::atomic<uint64_t> value_;
+};
+
+typedef std::map<Call, uint64_t> CallTotals;
+typedef std::map<Key, uint64_t> KeyTotals;
+
+static boost::atomic<uint32_t> sampleRate(DEFAULT_SAMPLE_RATE);
 
 /**
- * A map describing how many times T_VIRTUAL_CALL() has been invoked.
+ * The calls one thread made.
+ *
+ * Only the thread itself counts into its table, without a lock.  The mutex
+ * is only taken to add to the maps, so that a dump merging the tables of all
+ * threads does not read them while they change.
  */
-BacktraceMap virtual_calls;
-Mutex virtual_calls_mutex;
+class ThreadTable {
+public:
+  ThreadTable() : countdown_(1), lastCounter_(NULL) {}
+
+  ~ThreadTable() {
+    for (CallMap::iterator it = calls_.begin(); it != calls_.end(); ++it) {
+      delete it->second;
+    }
+    for (KeyMap::iterator it = samples_.begin(); it != samples_.end(); ++it) {
+      delete it->second;
+    }
+  }
+
+  /**
+   * Counts call, and takes the stack of one call in every sample rate.
+   */
+  void record(const Call& call) {
+    counter(call)->increment();
+    if (--countdown_ == 0) {
+      countdown_ = std::max(sampleRate.load(boost::memory_order_relaxed), 1U);
+      sample(call);
+    }
+  }
+
+  /**
+   * Adds the counts to calls and samples; the caller holds the mutex.
+   */
+  void addTo(CallTotals& calls, KeyTotals& samples) const {
+    for (CallMap::const_iterator it = calls_.begin(); it != calls_.end(); ++it) {
+      calls[it->first] += it->second->get();
+    }
+    for (KeyMap::const_iterator it = samples_.begin(); it != samples_.end(); ++it) {
+      samples[it->first] += it->second->get();
+    }
+  }
+
+  Mutex mutex_;
+
+private:
+  typedef std::map<Call, Counter*> CallMap;
+  typedef std::map<Key, Counter*> KeyMap;
+
+  Counter* counter(const Call& call) {
+    // Most calls repeat the call before them
+    if (lastCounter_ != NULL && call.same(lastCall_)) {
+      return lastCounter_;
+    }
+    CallMap::iterator it = calls_.find(call);
+    if (it == calls_.end()) {
+      Guard guard(mutex_);
+      it = calls_.insert(std::make_pair(call, new Counter())).first;
+    }
+    lastCall_ = call;
+    lastCounter_ = it->second;
+    return lastCounter_;
+  }
+
+  __attribute__((noinline)) void sample(const Call& call) {
+    // ignore this frame, record(), and the profile_ function that called it
+    int const skip = 3;
+    Key key(call, Backtrace(skip));
+    KeyMap::iterator it = samples_.find(key);
+    if (it == samples_.end()) {
+      Guard guard(mutex_);
+      it = samples_.insert(std::make_pair(key, new Counter())).first;
+    }
+    it->second->increment();
+  }
+
+  CallMap calls_;
+  KeyMap samples_;
+  uint32_t countdown_;
+  Call lastCall_;
+  Counter* lastCounter_;
+};
+
+/**
+ * The tables of the live threads, and what the threads that exited counted
+ */
+static Mutex tables_mutex;
+static std::vector<ThreadTable*> tables;
+static CallTotals retired_calls;
+static KeyTotals retired_samples;
+
+static __thread ThreadTable* thread_table = NULL;
+static pthread_key_t thread_table_key;
+static pthread_once_t thread_table_once = PTHREAD_ONCE_INIT;
+
+/**
+ * Folds the table of an exiting thread into the retired counts.
+ */
+static void retire_thread_table(void* arg) {
+  ThreadTable* table = static_cast<ThreadTable*>(arg);
+  {
+    Guard guard(tables_mutex);
+    tables.erase(std::remove(tables.begin(), tables.end(), table), tables.end());
+    table->addTo(retired_calls, retired_samples);
+  }
+  delete table;
+  // A destructor that runs after this one starts a new table
+  thread_table = NULL;
+}
+
+static void create_thread_table_key() {
+  pthread_key_create(&thread_table_key, retire_thread_table);
+}
+
+static ThreadTable* get_thread_table() {
+  ThreadTable* table = thread_table;
+  if (table == NULL) {
+    pthread_once(&thread_table_once, create_thread_table_key);
+    table = new ThreadTable();
+    {
+      Guard guard(tables_mutex);
+      tables.push_back(table);
+    }
+    pthread_setspecific(thread_table_key, table);
+    thread_table = table;
+  }
+  return table;
+}
 
 /**
- * A map describing how many times T_GENERIC_PROTOCOL() has been invoked.
+ * Merges the tables of all threads.
  */
-BacktraceMap generic_calls;
-Mutex generic_calls_mutex;
-
-void _record_backtrace(BacktraceMap* map, const Mutex& mutex, Key* k) {
-  Guard guard(mutex);
-
-  BacktraceMap::iterator it = map->find(*k);
-  if (it == map->end()) {
-    k->makePersistent();
-    map->insert(std::make_pair(*k, 1));
-  } else {
-    // increment the count
-    // NOTE: we could assert if it->second is 0 afterwards, since that would
-    // mean we've wrapped.
-    ++(it->second);
+static void snapshot(CallTotals& calls, KeyTotals& samples) {
+  Guard guard(tables_mutex);
+  calls = retired_calls;
+  samples = retired_samples;
+  for (std::vector<ThreadTable*>::const_iterator it = tables.begin(); it != tables.end(); ++it) {
+    Guard table_guard((*it)->mutex_);
+    (*it)->addTo(calls, samples);
   }
 }
 
+static std::string demangle(const char* name) {
+  if (name == NULL) {
+    return "";
+  }
+  int status = 0;
+  char* demangled = abi::__cxa_demangle(name, NULL, NULL, &status);
+  if (demangled == NULL) {
+    return name;
+  }
+  std::string ret(demangled);
+  free(demangled);
+  return ret;
+}
+
+/**
+ * A functor that determines which of two entries has a higher count.
+ */
+class CountGreater {
+public:
+  template <class T>
+  bool operator()(const std::pair<T, uint64_t>& a, const std::pair<T, uint64_t>& b) const {
+    return a.second > b.second;
+  }
+};
+
 /**
  * Record an unnecessary virtual function call.
  *
  * This method is invoked by the T_VIRTUAL_CALL() macro.
  */
+void profile_virtual_call(const std::type_info& type, const char* method) {
+  get_thread_table()->record(Call(VIRTUAL_CALL, type.name(), NULL, method));
+}
+
 void profile_virtual_call(const std::type_info& type) {
-  int const skip = 1; // ignore this frame
-  Backtrace bt(skip);
-  Key k(&bt, type);
-  _record_backtrace(&virtual_calls, virtual_calls_mutex, &k);
+  get_thread_table()->record(Call(VIRTUAL_CALL, type.name(), NULL, NULL));
 }
 
 /**
@@ -285,55 +436,128 @@ void profile_virtual_call(const std::type_info& type) {
  */
 void profile_generic_protocol(const std::type_info& template_type,
                               const std::type_info& prot_type) {
-  int const skip = 1; // ignore this frame
-  Backtrace bt(skip);
-  Key k(&bt, template_type, prot_type);
-  _record_backtrace(&generic_calls, generic_calls_mutex, &k);
+  get_thread_table()->record(
+      Call(GENERIC_PROTOCOL, template_type.name(), prot_type.name(), NULL));
+}
+
+/**
+ * Record a call to a template processor with the protocol specified in the
+ * template parameter.
+ *
+ * This method is invoked by the T_TEMPLATED_PROTOCOL() macro.
+ */
+void profile_specific_protocol(const std::type_info& template_type,
+                               const std::type_info& prot_type) {
+  get_thread_table()->record(
+      Call(SPECIFIC_PROTOCOL, template_type.name(), prot_type.name(), NULL));
+}
+
+/**
+ * Take the stack of one in every rate profiled calls; 1 takes every one.
+ * The calls themselves are all counted.
+ */
+void profile_set_sample_rate(uint32_t rate) {
+  sampleRate.store(rate);
 }
 
 /**
  * Print the recorded profiling information to the specified file.
  */
 void profile_print_info(FILE* f) {
-  typedef std::vector<std::pair<Key, size_t> > BacktraceVector;
+  typedef std::vector<std::pair<Key, uint64_t> > KeyVector;
+  typedef std::vector<std::pair<Call, uint64_t> > CallVector;
 
   CountGreater is_greater;
 
-  // Grab both locks for the duration of the print operation,
-  // to ensure the output is a consistent snapshot of a single point in time
-  Guard generic_calls_guard(generic_calls_mutex);
-  Guard virtual_calls_guard(virtual_calls_mutex);
+  // Merge the tables of all threads, for a snapshot of a single point in time
+  CallTotals calls;
+  KeyTotals samples;
+  snapshot(calls, samples);
+
+  // print how often each templated processor got the protocol type it was
+  // instantiated for, and with it the calls the templates devirtualise
+  typedef std::map<std::string, std::pair<uint64_t, uint64_t> > ProcessorTotals;
+  ProcessorTotals processors;
+  for (CallTotals::const_iterator it = calls.begin(); it != calls.end(); ++it) {
+    const Call& call = it->first;
+    if (call.getKind() == SPECIFIC_PROTOCOL) {
+      processors[demangle(call.getTypeName())].first += it->second;
+    } else if (call.getKind() == GENERIC_PROTOCOL) {
+      processors[demangle(call.getTypeName())].second += it->second;
+    }
+  }
+  fprintf(f, "Templated processors:\n");
+  for (ProcessorTotals::const_iterator it = processors.begin(); it != processors.end(); ++it) {
+    fprintf(f,
+            "  %s: %llu calls with its own protocol, %llu with another\n",
+            it->first.c_str(),
+            static_cast<unsigned long long>(it->second.first),
+            static_cast<unsigned long long>(it->second.second));
+    for (CallTotals::const_iterator c = calls.begin(); c != calls.end(); ++c) {
+      if (c->first.getKind() == GENERIC_PROTOCOL
+          && demangle(c->first.getTypeName()) == it->first) {
+        fprintf(f,
+                "    %llu with %s\n",
+                static_cast<unsigned long long>(c->second),
+                demangle(c->first.getTypeName2()).c_str());
+      }
+    }
+  }
+  fprintf(f, "\n");
+
+  // print the virtual calls, by type and method, the most frequent first
+  CallVector vc_sorted;
+  for (CallTotals::const_iterator it = calls.begin(); it != calls.end(); ++it) {
+    if (it->first.getKind() == VIRTUAL_CALL) {
+      vc_sorted.push_back(*it);
+    }
+  }
+  std::sort(vc_sorted.begin(), vc_sorted.end(), is_greater);
+  fprintf(f, "Virtual calls:\n");
+  for (CallVector::const_iterator it = vc_sorted.begin(); it != vc_sorted.end(); ++it) {
+    const Call& call = it->first;
+    fprintf(f,
+            "  %llu calls to %s on %s\n",
+            static_cast<unsigned long long>(it->second),
+            call.getMethod() ? call.getMethod() : "(unknown)",
+            demangle(call.getTypeName()).c_str());
+  }
+  fprintf(f, "\n");
 
-  // print the info from generic_calls, sorted by frequency
+  // print the sampled stacks, the most frequent first
   //
-  // We print the generic_calls info ahead of virtual_calls, since it is more
-  // useful in some cases.  All T_GENERIC_PROTOCOL calls can be eliminated
-  // from most programs.  Not all T_VIRTUAL_CALLs will be eliminated by
-  // converting to templates.
-  BacktraceVector gp_sorted(generic_calls.begin(), generic_calls.end());
-  std::sort(gp_sorted.begin(), gp_sorted.end(), is_greater);
-
-  for (BacktraceVector::const_iterator it = gp_sorted.begin(); it != gp_sorted.end(); ++it) {
-    Key const& key = it->first;
-    size_t const count = it->second;
+  // We print the generic protocol stacks ahead of the virtual calls, since
+  // they are more useful in some cases.  All T_GENERIC_PROTOCOL calls can be
+  // eliminated from most programs.  Not all T_VIRTUAL_CALLs will be
+  // eliminated by converting to templates.
+  KeyVector sorted(samples.begin(), samples.end());
+  std::stable_sort(sorted.begin(), sorted.end(), is_greater);
+
+  for (KeyVector::const_iterator it = sorted.begin(); it != sorted.end(); ++it) {
+    const Call& call = it->first.getCall();
+    if (call.getKind() != GENERIC_PROTOCOL) {
+      continue;
+    }
     fprintf(f,
-            "T_GENERIC_PROTOCOL: %zu calls to %s with a %s:\n",
-            count,
-            key.getTypeName(),
-            key.getTypeName2());
-    key.getBacktrace()->print(f, 2);
+            "T_GENERIC_PROTOCOL: %llu sampled calls to %s with a %s:\n",
+            static_cast<unsigned long long>(it->second),
+            demangle(call.getTypeName()).c_str(),
+            demangle(call.getTypeName2()).c_str());
+    it->first.getBacktrace().print(f, 2);
     fprintf(f, "\n");
   }
 
-  // print the info from virtual_calls, sorted by frequency
-  BacktraceVector vc_sorted(virtual_calls.begin(), virtual_calls.end());
-  std::sort(vc_sorted.begin(), vc_sorted.end(), is_greater);
-
-  for (BacktraceVector::const_iterator it = vc_sorted.begin(); it != vc_sorted.end(); ++it) {
-    Key const& key = it->first;
-    size_t const count = it->second;
-    fprintf(f, "T_VIRTUAL_CALL: %zu calls on %s:\n", count, key.getTypeName());
-    key.getBacktrace()->print(f, 2);
+  for (KeyVector::const_iterator it = sorted.begin(); it != sorted.end(); ++it) {
+    const Call& call = it->first.getCall();
+    if (call.getKind() != VIRTUAL_CALL) {
+      continue;
+    }
+    fprintf(f,
+            "T_VIRTUAL_CALL: %llu sampled calls to %s on %s:\n",
+            static_cast<unsigned long long>(it->second),
+            call.getMethod() ? call.getMethod() : "(unknown)",
+            demangle(call.getTypeName()).c_str());
+    it->first.getBacktrace().print(f, 2);
     fprintf(f, "\n");
   }
 }
@@ -346,24 +570,28 @@ void profile_print_info() {
 }
 
 /**
- * Write a BacktraceMap as Google CPU profiler binary data.
+ * Write the sampled stacks of one kind of call as Google CPU profiler
+ * binary data.
  */
-static void profile_write_pprof_file(FILE* f, BacktraceMap const& map) {
+static void profile_write_pprof_file(FILE* f, KeyTotals const& samples, CallKind kind) {
   // Write the header
   uintptr_t header[5] = {0, 3, 0, 0, 0};
   fwrite(&header, sizeof(header), 1, f);
 
   // Write the profile records
-  for (BacktraceMap::const_iterator it = map.begin(); it != map.end(); ++it) {
+  for (KeyTotals::const_iterator it = samples.begin(); it != samples.end(); ++it) {
+    if (it->first.getCall().getKind() != kind) {
+      continue;
+    }
     uintptr_t count = it->second;
     fwrite(&count, sizeof(count), 1, f);
 
-    Backtrace const* bt = it->first.getBacktrace();
-    uintptr_t num_pcs = bt->getDepth();
+    Backtrace const& bt = it->first.getBacktrace();
+    uintptr_t num_pcs = bt.getDepth();
     fwrite(&num_pcs, sizeof(num_pcs), 1, f);
 
     for (uintptr_t n = 0; n < num_pcs; ++n) {
-      void* pc = bt->getFrame(n);
+      void* pc = bt.getFrame(n);
       fwrite(&pc, sizeof(pc), 1, f);
     }
   }
@@ -391,9 +619,11 @@ static void profile_write_pprof_file(FILE* f, BacktraceMap const& map) {
 /**
  * Write the recorded profiling information as pprof files.
  *
- * This writes the information using the Google CPU profiler binary data
- * format, so it can be analyzed with pprof.  Note that information about the
- * protocol/transport data types cannot be stored in this file format.
+ * This writes the sampled stacks using the Google CPU profiler binary data
+ * format, so it can be analyzed with pprof.  The counts are of the sampled
+ * calls, one in every profile_set_sample_rate() calls.  Note that
+ * information about the protocol/transport data types cannot be stored in
+ * this file format.
  *
  * See http://code.google.com/p/google-perftools/ for more details.
  *
@@ -404,20 +634,15 @@ static void profile_write_pprof_file(FILE* f, BacktraceMap const& map) {
  *                        profile_virtual_call() will be written to this file.
  */
 void profile_write_pprof(FILE* gen_calls_f, FILE* virtual_calls_f) {
-  typedef std::vector<std::pair<Key, size_t> > BacktraceVector;
-
-  CountGreater is_greater;
-
-  // Grab both locks for the duration of the print operation,
-  // to ensure the output is a consistent snapshot of a single point in time
-  Guard generic_calls_guard(generic_calls_mutex);
-  Guard virtual_calls_guard(virtual_calls_mutex);
+  CallTotals calls;
+  KeyTotals samples;
+  snapshot(calls, samples);
 
   // write the info from generic_calls
-  profile_write_pprof_file(gen_calls_f, generic_calls);
+  profile_write_pprof_file(gen_calls_f, samples, GENERIC_PROTOCOL);
 
   // write the info from virtual_calls
-  profile_write_pprof_file(virtual_calls_f, virtual_calls);
+  profile_write_pprof_file(virtual_calls_f, samples, VIRTUAL_CALL);
 }
 }
 } // apache::thrift
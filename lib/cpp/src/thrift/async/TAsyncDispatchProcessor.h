@@ -44,6 +44,7 @@ public:
     Protocol_* specificIn = dynamic_cast<Protocol_*>(inRaw);
     Protocol_* specificOut = dynamic_cast<Protocol_*>(outRaw);
     if (specificIn && specificOut) {
+      T_TEMPLATED_PROTOCOL(this, specificIn);
       return processFast(_return, specificIn, specificOut);
     }
 
@@ -71,6 +71,17 @@ public:
    */
   virtual stdcxx::shared_ptr<TAsyncProcessor> getProcessor(const TConnectionInfo& connInfo) = 0;
 };
+
+class TSingletonAsyncProcessorFactory : public TAsyncProcessorFactory {
+public:
+  TSingletonAsyncProcessorFactory(stdcxx::shared_ptr<TAsyncProcessor> processor)
+    : processor_(processor) {}
+
+  stdcxx::shared_ptr<TAsyncProcessor> getProcessor(const TConnectionInfo&) { return processor_; }
+
+private:
+  stdcxx::shared_ptr<TAsyncProcessor> processor_;
+};
 }
 }
 } // apache::thrift::async
@@ -42,6 +42,9 @@ TConcurrentClientSyncInfo::TConcurrentClientSyncInfo() :
   mtypePending_(::apache::thrift::protocol::T_CALL)
 {
   freeMonitors_.reserve(MONITOR_CACHE_SIZE);
+  seqidMutex_.setName("TConcurrentClientSyncInfo::seqid");
+  writeMutex_.setName("TConcurrentClientSyncInfo::write");
+  readMutex_.setName("TConcurrentClientSyncInfo::read");
 }
 
 bool TConcurrentClientSyncInfo::getPending(
@@ -0,0 +1,384 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_ASYNC_TCOROUTINE_H_
+#define _THRIFT_ASYNC_TCOROUTINE_H_ 1
+
+/**
+ * C++20 coroutine support for asynchronous clients and handlers, used by
+ * the code the compiler generates with the "coroutines" option.
+ *
+ * Everything here needs a compiler with coroutines; elsewhere this header
+ * is empty, and THRIFT_HAVE_COROUTINES is left undefined so that generated
+ * code can include it from any language level.
+ */
+#if defined(__cpp_impl_coroutine) && __cpp_impl_coroutine >= 201902L && defined(__has_include)
+#if __has_include(<coroutine>)
+#define THRIFT_HAVE_COROUTINES 1
+#endif
+#endif
+
+#ifdef THRIFT_HAVE_COROUTINES
+
+#include <atomic>
+#include <coroutine>
+#include <exception>
+#include <optional>
+#include <utility>
+#include <vector>
+
+#include <thrift/Thrift.h>
+#include <thrift/async/TAsyncChannel.h>
+
+namespace apache {
+namespace thrift {
+namespace async {
+
+template <class T = void>
+class TTask;
+
+namespace detail {
+
+class TTaskPromiseBase {
+public:
+  std::suspend_always initial_suspend() noexcept { return {}; }
+
+  // Hand control straight to whoever awaits the task, without growing the
+  // stack
+  struct FinalAwaiter {
+    bool await_ready() noexcept { return false; }
+
+    template <class Promise>
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<Promise> handle) noexcept {
+      std::coroutine_handle<> continuation = handle.promise().continuation_;
+      return continuation ? continuation : std::noop_coroutine();
+    }
+
+    void await_resume() noexcept {}
+  };
+
+  FinalAwaiter final_suspend() noexcept { return {}; }
+
+  void unhandled_exception() noexcept { exception_ = std::current_exception(); }
+
+  void rethrowIfFailed() {
+    if (exception_) {
+      std::rethrow_exception(exception_);
+    }
+  }
+
+  std::coroutine_handle<> continuation_;
+  std::exception_ptr exception_;
+};
+
+template <class T>
+class TTaskPromise : public TTaskPromiseBase {
+public:
+  TTask<T> get_return_object() noexcept;
+
+  template <class U>
+  void return_value(U&& value) {
+    value_.emplace(std::forward<U>(value));
+  }
+
+  T result() {
+    rethrowIfFailed();
+    return std::move(*value_);
+  }
+
+private:
+  std::optional<T> value_;
+};
+
+template <>
+class TTaskPromise<void> : public TTaskPromiseBase {
+public:
+  TTask<void> get_return_object() noexcept;
+
+  void return_void() noexcept {}
+
+  void result() { rethrowIfFailed(); }
+};
+}
+
+/**
+ * The result of a coroutine that produces a T, or fails with an
+ * exception, some time later.
+ *
+ *   TTask<int32_t> total(MyServiceCoroClient& client) {
+ *     int32_t a = co_await client.count("a");
+ *     int32_t b = co_await client.count("b");
+ *     co_return a + b;
+ *   }
+ *
+ * A task does not run until it is awaited, and then runs on the awaiting
+ * thread until it suspends itself; when it completes, the awaiting
+ * coroutine continues on whatever thread completed it.  Tasks are moved,
+ * not copied, and awaited at most once; a task destroyed before it
+ * completes destroys its coroutine.  Use spawn() to run a task without
+ * awaiting it, and whenAll() to run several at once.
+ */
+template <class T>
+class TTask {
+public:
+  typedef detail::TTaskPromise<T> promise_type;
+  typedef std::coroutine_handle<promise_type> handle_type;
+
+  TTask() noexcept {}
+  explicit TTask(handle_type handle) noexcept : handle_(handle) {}
+  TTask(TTask&& other) noexcept : handle_(std::exchange(other.handle_, {})) {}
+
+  TTask& operator=(TTask&& other) noexcept {
+    if (this != &other) {
+      destroy();
+      handle_ = std::exchange(other.handle_, {});
+    }
+    return *this;
+  }
+
+  ~TTask() { destroy(); }
+
+  TTask(const TTask&) = delete;
+  TTask& operator=(const TTask&) = delete;
+
+  bool valid() const noexcept { return static_cast<bool>(handle_); }
+  bool done() const noexcept { return !handle_ || handle_.done(); }
+
+  bool await_ready() const noexcept { return done(); }
+
+  std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+    handle_.promise().continuation_ = awaiting;
+    return handle_;
+  }
+
+  T await_resume() { return handle_.promise().result(); }
+
+  /**
+   * Awaits the task completing without taking its result, which stays
+   * for a later co_await.
+   */
+  struct Completion {
+    bool await_ready() const noexcept { return !handle_ || handle_.done(); }
+
+    std::coroutine_handle<> await_suspend(std::coroutine_handle<> awaiting) noexcept {
+      handle_.promise().continuation_ = awaiting;
+      return handle_;
+    }
+
+    void await_resume() noexcept {}
+
+    handle_type handle_;
+  };
+
+  Completion completion() const noexcept { return Completion{handle_}; }
+
+private:
+  void destroy() noexcept {
+    if (handle_) {
+      handle_.destroy();
+      handle_ = {};
+    }
+  }
+
+  handle_type handle_;
+};
+
+namespace detail {
+
+template <class T>
+inline TTask<T> TTaskPromise<T>::get_return_object() noexcept {
+  return TTask<T>(std::coroutine_handle<TTaskPromise<T> >::from_promise(*this));
+}
+
+inline TTask<void> TTaskPromise<void>::get_return_object() noexcept {
+  return TTask<void>(std::coroutine_handle<TTaskPromise<void> >::from_promise(*this));
+}
+
+/**
+ * A coroutine nobody awaits: it starts right away and frees itself when
+ * done.
+ */
+struct TDetached {
+  struct promise_type {
+    TDetached get_return_object() noexcept { return TDetached(); }
+    std::suspend_never initial_suspend() noexcept { return {}; }
+    std::suspend_never final_suspend() noexcept { return {}; }
+    void return_void() noexcept {}
+
+    void unhandled_exception() noexcept {
+      try {
+        throw;
+      } catch (const std::exception& e) {
+        GlobalOutput.printf("spawned coroutine threw: %s", e.what());
+      } catch (...) {
+        GlobalOutput("spawned coroutine threw an unknown exception");
+      }
+    }
+  };
+};
+
+inline TDetached runDetached(TTask<void> task) {
+  co_await task;
+}
+
+/// Counts the tasks of a whenAll() down and resumes it after the last
+struct TWhenAllLatch {
+  explicit TWhenAllLatch(size_t count) : count_(count) {}
+
+  bool arrive() noexcept { return count_.fetch_sub(1, std::memory_order_acq_rel) == 1; }
+
+  std::atomic<size_t> count_;
+  std::coroutine_handle<> waiter_;
+};
+
+template <class T>
+TDetached runWhenAll(TTask<T>& task, TWhenAllLatch& latch) {
+  co_await task.completion();
+  if (latch.arrive()) {
+    latch.waiter_.resume();
+  }
+}
+
+template <class T>
+class TWhenAllAwaiter {
+public:
+  explicit TWhenAllAwaiter(std::vector<TTask<T> >& tasks) : tasks_(tasks), latch_(tasks.size() + 1) {}
+
+  bool await_ready() const noexcept { return tasks_.empty(); }
+
+  bool await_suspend(std::coroutine_handle<> awaiting) {
+    latch_.waiter_ = awaiting;
+    for (typename std::vector<TTask<T> >::iterator it = tasks_.begin(); it != tasks_.end(); ++it) {
+      runWhenAll(*it, latch_);
+    }
+    // Every task may have completed already
+    return !latch_.arrive();
+  }
+
+  void await_resume() noexcept {}
+
+private:
+  std::vector<TTask<T> >& tasks_;
+  TWhenAllLatch latch_;
+};
+
+/// Resumes a coroutine as a TAsyncChannel callback; small enough to be
+/// kept inside the callback without allocating
+struct TResume {
+  void operator()() const { handle_.resume(); }
+
+  std::coroutine_handle<> handle_;
+};
+}
+
+/**
+ * Runs a task to completion without awaiting it.  It starts on the calling
+ * thread; an exception it ends with is logged through GlobalOutput.
+ */
+inline void spawn(TTask<void> task) {
+  detail::runDetached(std::move(task));
+}
+
+/**
+ * Runs all the tasks at once and completes with their results, in the
+ * order of the tasks, once every one of them has completed.  If any
+ * failed, it fails with the exception of the first of those.
+ *
+ *   std::vector<TTask<std::string> > calls;
+ *   for (size_t i = 0; i < clients.size(); ++i) {
+ *     calls.push_back(clients[i]->lookup(key));
+ *   }
+ *   std::vector<std::string> values = co_await whenAll(std::move(calls));
+ */
+template <class T>
+TTask<std::vector<T> > whenAll(std::vector<TTask<T> > tasks) {
+  co_await detail::TWhenAllAwaiter<T>(tasks);
+  std::vector<T> results;
+  results.reserve(tasks.size());
+  for (typename std::vector<TTask<T> >::iterator it = tasks.begin(); it != tasks.end(); ++it) {
+    results.push_back(co_await std::move(*it));
+  }
+  co_return results;
+}
+
+inline TTask<void> whenAll(std::vector<TTask<void> > tasks) {
+  co_await detail::TWhenAllAwaiter<void>(tasks);
+  for (std::vector<TTask<void> >::iterator it = tasks.begin(); it != tasks.end(); ++it) {
+    co_await std::move(*it);
+  }
+}
+
+/**
+ * Awaits a TAsyncChannel: the coroutine suspends until the channel calls
+ * back, and resumes on the channel's thread.
+ *
+ *   co_await sendAndRecvMessage(*channel, sendBuf, recvBuf);
+ *
+ * The channel gets a callback that only holds the coroutine handle, which
+ * std::function keeps without allocating.
+ */
+class TChannelAwaiter {
+public:
+  TChannelAwaiter(TAsyncChannel& channel,
+                  apache::thrift::transport::TMemoryBuffer* sendBuf,
+                  apache::thrift::transport::TMemoryBuffer* recvBuf)
+    : channel_(channel), sendBuf_(sendBuf), recvBuf_(recvBuf) {}
+
+  bool await_ready() const noexcept { return false; }
+
+  void await_suspend(std::coroutine_handle<> awaiting) {
+    detail::TResume resume = {awaiting};
+    if (recvBuf_ != NULL) {
+      channel_.sendAndRecvMessage(resume, sendBuf_, recvBuf_);
+    } else {
+      channel_.sendMessage(resume, sendBuf_);
+    }
+  }
+
+  void await_resume() noexcept {}
+
+private:
+  TAsyncChannel& channel_;
+  apache::thrift::transport::TMemoryBuffer* sendBuf_;
+  apache::thrift::transport::TMemoryBuffer* recvBuf_;
+};
+
+/**
+ * Sends sendBuf and receives the response into recvBuf.
+ */
+inline TChannelAwaiter sendAndRecvMessage(TAsyncChannel& channel,
+                                          apache::thrift::transport::TMemoryBuffer* sendBuf,
+                                          apache::thrift::transport::TMemoryBuffer* recvBuf) {
+  return TChannelAwaiter(channel, sendBuf, recvBuf);
+}
+
+/**
+ * Sends message, expecting no response.
+ */
+inline TChannelAwaiter sendMessage(TAsyncChannel& channel,
+                                   apache::thrift::transport::TMemoryBuffer* message) {
+  return TChannelAwaiter(channel, message, NULL);
+}
+}
+}
+} // apache::thrift::async
+
+#endif // THRIFT_HAVE_COROUTINES
+
+#endif // #ifndef _THRIFT_ASYNC_TCOROUTINE_H_
@@ -0,0 +1,112 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_ASYNC_TEVENTBASESCHEDULER_H_
+#define _THRIFT_ASYNC_TEVENTBASESCHEDULER_H_ 1
+
+#include <thrift/async/TCoroutine.h>
+
+#ifdef THRIFT_HAVE_COROUTINES
+
+#include <event2/event.h>
+
+namespace apache {
+namespace thrift {
+namespace async {
+
+/**
+ * Runs coroutines on the thread of a libevent event_base, the loop that
+ * also drives channels such as TFramedAsyncChannel and TEvhttpClientChannel:
+ *
+ *   TEventBaseScheduler scheduler(base);
+ *   scheduler.spawn(fanOut(clients));
+ *   event_base_dispatch(base);
+ *
+ *   TTask<void> fanOut(...) {
+ *     co_await scheduler.sleepFor(10);   // let the loop run for a while
+ *     ...
+ *   }
+ *
+ * A coroutine awaiting schedule() or sleepFor() resumes from the loop.
+ * Awaiting them on another thread moves the coroutine onto the loop, which
+ * needs an event_base made thread safe with evthread_use_pthreads() or
+ * evthread_use_windows_threads().
+ */
+class TEventBaseScheduler {
+public:
+  explicit TEventBaseScheduler(struct event_base* base) : base_(base) {}
+
+  struct event_base* getEventBase() const { return base_; }
+
+  class Awaiter {
+  public:
+    Awaiter(struct event_base* base, int ms) : base_(base), ms_(ms) {}
+
+    bool await_ready() const noexcept { return false; }
+
+    void await_suspend(std::coroutine_handle<> awaiting) {
+      struct timeval tv;
+      tv.tv_sec = ms_ / 1000;
+      tv.tv_usec = (ms_ % 1000) * 1000;
+      if (event_base_once(base_, -1, EV_TIMEOUT, resume, awaiting.address(), &tv) != 0) {
+        throw TException("event_base_once failed");
+      }
+    }
+
+    void await_resume() noexcept {}
+
+  private:
+    static void resume(evutil_socket_t, short, void* arg) {
+      std::coroutine_handle<>::from_address(arg).resume();
+    }
+
+    struct event_base* base_;
+    int ms_;
+  };
+
+  /**
+   * Resumes the awaiting coroutine on the next round of the loop.
+   */
+  Awaiter schedule() const { return Awaiter(base_, 0); }
+
+  /**
+   * Resumes the awaiting coroutine from the loop after ms milliseconds.
+   */
+  Awaiter sleepFor(int ms) const { return Awaiter(base_, ms); }
+
+  /**
+   * Runs task on the loop, starting on its next round.
+   */
+  void spawn(TTask<void> task) const { async::spawn(runOn(*this, std::move(task))); }
+
+private:
+  static TTask<void> runOn(TEventBaseScheduler scheduler, TTask<void> task) {
+    co_await scheduler.schedule();
+    co_await task;
+  }
+
+  struct event_base* base_;
+};
+}
+}
+} // apache::thrift::async
+
+#endif // THRIFT_HAVE_COROUTINES
+
+#endif // #ifndef _THRIFT_ASYNC_TEVENTBASESCHEDULER_H_
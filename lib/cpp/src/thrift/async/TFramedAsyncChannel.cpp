@@ -0,0 +1,636 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/async/TFramedAsyncChannel.h>
+#include <event2/event.h>
+#include <thrift/concurrency/Util.h>
+#include <thrift/protocol/TProtocolException.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/TTransportException.h>
+
+#include <algorithm>
+#include <cstdlib>
+#include <cstring>
+#include <iostream>
+#include <limits>
+#include <sstream>
+
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_NETINET_IN_H
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#endif
+#ifdef HAVE_NETDB_H
+#include <netdb.h>
+#endif
+#ifdef HAVE_FCNTL_H
+#include <fcntl.h>
+#endif
+
+using apache::thrift::concurrency::Util;
+using apache::thrift::protocol::TProtocolException;
+using apache::thrift::transport::TMemoryBuffer;
+using apache::thrift::transport::TTransportException;
+
+namespace apache {
+namespace thrift {
+namespace async {
+
+const uint32_t TFramedAsyncChannel::DEFAULT_MAX_FRAME_SIZE;
+
+namespace {
+
+/// The least room to read into at a time
+const uint32_t MIN_READ = 4096;
+
+// Message headers, see TBinaryProtocol and TCompactProtocol
+const uint32_t BINARY_VERSION_MASK = 0xffff0000;
+const uint32_t BINARY_VERSION_1 = 0x80010000;
+const uint8_t COMPACT_PROTOCOL_ID = 0x82;
+const uint32_t MAX_VARINT32_LENGTH = 5;
+
+/**
+ * Where the sequence id is in a message: width bytes at offset, as a
+ * big endian int32 or as a compact protocol varint.
+ */
+struct SeqidField {
+  uint32_t offset;
+  uint32_t width;
+  bool varint;
+};
+
+uint32_t getFrameSize(const uint8_t* buf) {
+  return (static_cast<uint32_t>(buf[0]) << 24) | (static_cast<uint32_t>(buf[1]) << 16)
+         | (static_cast<uint32_t>(buf[2]) << 8) | static_cast<uint32_t>(buf[3]);
+}
+
+void putFrameSize(uint8_t* buf, uint32_t size) {
+  buf[0] = static_cast<uint8_t>(size >> 24);
+  buf[1] = static_cast<uint8_t>(size >> 16);
+  buf[2] = static_cast<uint8_t>(size >> 8);
+  buf[3] = static_cast<uint8_t>(size);
+}
+
+bool findSeqid(const uint8_t* buf, uint32_t len, SeqidField& field) {
+  if (len >= 2 && buf[0] == COMPACT_PROTOCOL_ID) {
+    // protocol id, version and type, then the sequence id
+    for (uint32_t width = 1; width <= MAX_VARINT32_LENGTH && 2 + width <= len; ++width) {
+      if ((buf[1 + width] & 0x80) == 0) {
+        field.offset = 2;
+        field.width = width;
+        field.varint = true;
+        return true;
+      }
+    }
+    return false;
+  }
+
+  if (len < 4) {
+    return false;
+  }
+  uint64_t offset;
+  uint32_t first = getFrameSize(buf);
+  if (first & 0x80000000) {
+    // strict: version and type, name, sequence id
+    if ((first & BINARY_VERSION_MASK) != BINARY_VERSION_1 || len < 8) {
+      return false;
+    }
+    uint32_t nameLen = getFrameSize(buf + 4);
+    if (nameLen & 0x80000000) {
+      return false;
+    }
+    offset = 8 + static_cast<uint64_t>(nameLen);
+  } else {
+    // old style: name, type, sequence id
+    offset = 4 + static_cast<uint64_t>(first) + 1;
+  }
+  if (offset + 4 > len) {
+    return false;
+  }
+  field.offset = static_cast<uint32_t>(offset);
+  field.width = 4;
+  field.varint = false;
+  return true;
+}
+
+int32_t getSeqid(const uint8_t* buf, const SeqidField& field) {
+  const uint8_t* p = buf + field.offset;
+  if (!field.varint) {
+    return static_cast<int32_t>(getFrameSize(p));
+  }
+  uint32_t value = 0;
+  for (uint32_t i = 0; i < field.width; ++i) {
+    value |= static_cast<uint32_t>(p[i] & 0x7f) << (7 * i);
+  }
+  return static_cast<int32_t>(value);
+}
+
+/// Encodes seqid as field does into out, returning its width
+uint32_t putSeqid(uint8_t* out, int32_t seqid, const SeqidField& field) {
+  if (!field.varint) {
+    putFrameSize(out, static_cast<uint32_t>(seqid));
+    return 4;
+  }
+  uint32_t value = static_cast<uint32_t>(seqid);
+  uint32_t width = 0;
+  while (value & ~0x7fu) {
+    out[width++] = static_cast<uint8_t>((value & 0x7f) | 0x80);
+    value >>= 7;
+  }
+  out[width++] = static_cast<uint8_t>(value);
+  return width;
+}
+}
+
+TFramedAsyncChannel::TFramedAsyncChannel(const std::string& host,
+                                         int port,
+                                         struct event_base* eb)
+  : host_(host),
+    port_(port),
+    eb_(eb),
+    socket_(THRIFT_INVALID_SOCKET),
+    readEvent_(NULL),
+    writeEvent_(NULL),
+    timer_(NULL),
+    connecting_(false),
+    error_(false),
+    timedOut_(false),
+    connTimeout_(0),
+    recvTimeout_(0),
+    maxFrameSize_(DEFAULT_MAX_FRAME_SIZE),
+    connDeadline_(0),
+    timerDeadline_(0),
+    nextSeqid_(1),
+    writeOffset_(0),
+    bytesWritten_(0),
+    bytesQueued_(0),
+    readBuf_(NULL),
+    readBufSize_(0),
+    readLen_(0) {
+  timer_ = evtimer_new(eb_, timerHandler, this);
+  if (timer_ == NULL) {
+    throw TException("evtimer_new failed");
+  }
+}
+
+TFramedAsyncChannel::~TFramedAsyncChannel() {
+  closeSocket();
+  if (readEvent_ != NULL) {
+    event_free(readEvent_);
+  }
+  if (writeEvent_ != NULL) {
+    event_free(writeEvent_);
+  }
+  event_free(timer_);
+  std::free(readBuf_);
+}
+
+void TFramedAsyncChannel::sendAndRecvMessage(const VoidCallback& cob,
+                                             TMemoryBuffer* sendBuf,
+                                             TMemoryBuffer* recvBuf) {
+  if (error_) {
+    throw TTransportException(TTransportException::NOT_OPEN, "TFramedAsyncChannel is not good");
+  }
+
+  uint8_t* obuf;
+  uint32_t sz;
+  sendBuf->getBuffer(&obuf, &sz);
+  SeqidField field;
+  if (!findSeqid(obuf, sz, field)) {
+    throw TProtocolException(TProtocolException::INVALID_DATA,
+                             "TFramedAsyncChannel can not find the sequence id of the message");
+  }
+
+  if (socket_ == THRIFT_INVALID_SOCKET) {
+    connect();
+  }
+
+  int32_t seqid = nextSeqid();
+  uint8_t encoded[MAX_VARINT32_LENGTH];
+  uint32_t encodedLen = putSeqid(encoded, seqid, field);
+  queueFrame(obuf, sz, field.offset, field.width, encoded, encodedLen);
+
+  Request& request = outstanding_[seqid];
+  request.cob = cob;
+  request.recvBuf = recvBuf;
+  request.seqid = getSeqid(obuf, field);
+  if (recvTimeout_ > 0) {
+    request.deadline = Util::currentTime() + recvTimeout_;
+    armTimer(request.deadline);
+  }
+}
+
+void TFramedAsyncChannel::sendMessage(const VoidCallback& cob, TMemoryBuffer* message) {
+  if (error_) {
+    throw TTransportException(TTransportException::NOT_OPEN, "TFramedAsyncChannel is not good");
+  }
+  if (socket_ == THRIFT_INVALID_SOCKET) {
+    connect();
+  }
+
+  uint8_t* obuf;
+  uint32_t sz;
+  message->getBuffer(&obuf, &sz);
+  queueFrame(obuf, sz, 0, 0, NULL, 0);
+  sendQueue_.push_back(std::make_pair(bytesQueued_, cob));
+}
+
+void TFramedAsyncChannel::recvMessage(const VoidCallback& cob, TMemoryBuffer* message) {
+  (void)cob;
+  (void)message;
+  throw TProtocolException(TProtocolException::NOT_IMPLEMENTED,
+                           "Unexpected call to TFramedAsyncChannel::recvMessage");
+}
+
+void TFramedAsyncChannel::connect() {
+  struct addrinfo hints;
+  struct addrinfo* res;
+  std::memset(&hints, 0, sizeof(hints));
+  hints.ai_family = PF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  char port[sizeof("65535")];
+  THRIFT_SNPRINTF(port, sizeof(port), "%d", port_);
+
+  int error = getaddrinfo(host_.c_str(), port, &hints, &res);
+  if (error != 0) {
+    error_ = true;
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TFramedAsyncChannel getaddrinfo() "
+                              + std::string(THRIFT_GAI_STRERROR(error)));
+  }
+
+  socket_ = socket(res->ai_family, res->ai_socktype, res->ai_protocol);
+  int errno_copy = THRIFT_GET_SOCKET_ERROR;
+  if (socket_ != THRIFT_INVALID_SOCKET) {
+    int flags = THRIFT_FCNTL(socket_, THRIFT_F_GETFL, 0);
+    THRIFT_FCNTL(socket_, THRIFT_F_SETFL, flags | THRIFT_O_NONBLOCK);
+    int one = 1;
+    setsockopt(socket_, IPPROTO_TCP, TCP_NODELAY, reinterpret_cast<const char*>(&one), sizeof(one));
+    if (::connect(socket_, res->ai_addr, static_cast<socklen_t>(res->ai_addrlen)) == 0) {
+      errno_copy = 0;
+    } else {
+      errno_copy = THRIFT_GET_SOCKET_ERROR;
+    }
+  }
+  freeaddrinfo(res);
+
+  if (socket_ == THRIFT_INVALID_SOCKET
+      || (errno_copy != 0 && errno_copy != THRIFT_EINPROGRESS
+          && errno_copy != THRIFT_EWOULDBLOCK)) {
+    closeSocket();
+    error_ = true;
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "TFramedAsyncChannel could not connect",
+                              errno_copy);
+  }
+
+  readEvent_ = event_new(eb_, socket_, EV_READ | EV_PERSIST, socketHandler, this);
+  writeEvent_ = event_new(eb_, socket_, EV_WRITE, socketHandler, this);
+  if (readEvent_ == NULL || writeEvent_ == NULL) {
+    closeSocket();
+    error_ = true;
+    throw TException("event_new failed");
+  }
+
+  // The socket turns writable once it is connected, or failed to
+  connecting_ = true;
+  event_add(writeEvent_, NULL);
+  if (connTimeout_ > 0) {
+    connDeadline_ = Util::currentTime() + connTimeout_;
+    armTimer(connDeadline_);
+  }
+}
+
+int32_t TFramedAsyncChannel::nextSeqid() {
+  int32_t seqid;
+  do {
+    seqid = nextSeqid_;
+    nextSeqid_ = nextSeqid_ == (std::numeric_limits<int32_t>::max)() ? 1 : nextSeqid_ + 1;
+  } while (outstanding_.find(seqid) != outstanding_.end());
+  return seqid;
+}
+
+void TFramedAsyncChannel::queueFrame(const uint8_t* buf,
+                                     uint32_t len,
+                                     uint32_t seqidOffset,
+                                     uint32_t seqidWidth,
+                                     const uint8_t* seqid,
+                                     uint32_t seqidLen) {
+  uint32_t frameSize = len - seqidWidth + seqidLen;
+  size_t at = writeBuf_.size();
+  writeBuf_.resize(at + 4 + frameSize);
+  uint8_t* out = &writeBuf_[at];
+  putFrameSize(out, frameSize);
+  out += 4;
+  std::memcpy(out, buf, seqidOffset);
+  std::memcpy(out + seqidOffset, seqid, seqidLen);
+  std::memcpy(out + seqidOffset + seqidLen,
+              buf + seqidOffset + seqidWidth,
+              len - seqidOffset - seqidWidth);
+  bytesQueued_ += 4 + frameSize;
+
+  scheduleWrite();
+}
+
+void TFramedAsyncChannel::scheduleWrite() {
+  // While connecting the write event is already waiting; otherwise it is
+  // written on the next round of the event loop, together with whatever
+  // else is sent until then
+  if (!connecting_) {
+    event_add(writeEvent_, NULL);
+  }
+}
+
+void TFramedAsyncChannel::handleConnect() {
+  int error = 0;
+  socklen_t len = sizeof(error);
+  if (getsockopt(socket_, SOL_SOCKET, SO_ERROR, reinterpret_cast<char*>(&error), &len) == -1) {
+    error = THRIFT_GET_SOCKET_ERROR;
+  }
+  if (error != 0) {
+    std::ostringstream why;
+    why << "could not connect to " << host_ << ":" << port_ << ": "
+        << TOutput::strerror_s(error);
+    fail(why.str(), false);
+    return;
+  }
+
+  connecting_ = false;
+  connDeadline_ = 0;
+  event_add(readEvent_, NULL);
+  handleWrite();
+}
+
+void TFramedAsyncChannel::handleWrite() {
+  int flags = 0;
+#ifdef MSG_NOSIGNAL
+  flags |= MSG_NOSIGNAL;
+#endif
+
+  while (writeOffset_ < writeBuf_.size()) {
+    THRIFT_SSIZET sent = send(socket_,
+                              reinterpret_cast<const char*>(&writeBuf_[writeOffset_]),
+                              writeBuf_.size() - writeOffset_,
+                              flags);
+    if (sent < 0) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      if (errno_copy == THRIFT_EINTR) {
+        continue;
+      }
+      if (errno_copy == THRIFT_EAGAIN || errno_copy == THRIFT_EWOULDBLOCK) {
+        break;
+      }
+      fail("send() failed: " + TOutput::strerror_s(errno_copy), false);
+      return;
+    }
+    writeOffset_ += sent;
+    bytesWritten_ += sent;
+  }
+
+  if (writeOffset_ == writeBuf_.size()) {
+    writeBuf_.clear();
+    writeOffset_ = 0;
+  } else {
+    if (writeOffset_ >= writeBuf_.size() / 2) {
+      writeBuf_.erase(writeBuf_.begin(), writeBuf_.begin() + writeOffset_);
+      writeOffset_ = 0;
+    }
+    event_add(writeEvent_, NULL);
+  }
+
+  while (!sendQueue_.empty() && sendQueue_.front().first <= bytesWritten_) {
+    VoidCallback cob = sendQueue_.front().second;
+    sendQueue_.pop_front();
+    invoke(cob);
+  }
+}
+
+void TFramedAsyncChannel::handleRead() {
+  // Make room for at least the frame being read, whole
+  uint32_t need = readLen_ + MIN_READ;
+  if (readLen_ >= 4) {
+    uint32_t frameSize = getFrameSize(readBuf_);
+    if (frameSize > maxFrameSize_) {
+      fail("response frame too large", false);
+      return;
+    }
+    need = (std::max)(need, 4 + frameSize);
+  }
+  if (need > readBufSize_) {
+    uint32_t newSize = (std::max)(need, 2 * readBufSize_);
+    uint8_t* newBuf = static_cast<uint8_t*>(std::realloc(readBuf_, newSize));
+    if (newBuf == NULL) {
+      fail("out of memory for a response", false);
+      return;
+    }
+    readBuf_ = newBuf;
+    readBufSize_ = newSize;
+  }
+
+  THRIFT_SSIZET got
+      = recv(socket_, reinterpret_cast<char*>(readBuf_ + readLen_), readBufSize_ - readLen_, 0);
+  if (got == 0) {
+    fail("connection closed by the server", false);
+    return;
+  }
+  if (got < 0) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    if (errno_copy != THRIFT_EINTR && errno_copy != THRIFT_EAGAIN
+        && errno_copy != THRIFT_EWOULDBLOCK) {
+      fail("recv() failed: " + TOutput::strerror_s(errno_copy), false);
+    }
+    return;
+  }
+  readLen_ += static_cast<uint32_t>(got);
+
+  // Hand over every complete frame where it lies, then keep what is left
+  // of the next one
+  uint32_t pos = 0;
+  while (readLen_ - pos >= 4) {
+    uint32_t frameSize = getFrameSize(readBuf_ + pos);
+    if (frameSize > maxFrameSize_) {
+      fail("response frame too large", false);
+      return;
+    }
+    if (readLen_ - pos - 4 < frameSize) {
+      break;
+    }
+    dispatch(readBuf_ + pos + 4, frameSize);
+    pos += 4 + frameSize;
+  }
+  if (pos > 0) {
+    std::memmove(readBuf_, readBuf_ + pos, readLen_ - pos);
+    readLen_ -= pos;
+  }
+}
+
+void TFramedAsyncChannel::dispatch(uint8_t* frame, uint32_t len) {
+  SeqidField field;
+  if (!findSeqid(frame, len, field)) {
+    GlobalOutput("TFramedAsyncChannel: dropped a response without a sequence id");
+    return;
+  }
+  RequestMap::iterator it = outstanding_.find(getSeqid(frame, field));
+  if (it == outstanding_.end()) {
+    // it timed out
+    return;
+  }
+  Request request = it->second;
+  outstanding_.erase(it);
+
+  // Put the caller's sequence id back.  A compact protocol varint may be
+  // shorter or longer than the one sent; the frame size in front of the
+  // frame leaves room for the message header to move into.
+  uint8_t encoded[MAX_VARINT32_LENGTH];
+  uint32_t encodedLen = putSeqid(encoded, request.seqid, field);
+  if (encodedLen != field.width) {
+    uint8_t* moved = frame + field.width - encodedLen;
+    std::memmove(moved, frame, field.offset);
+    len = len - field.width + encodedLen;
+    frame = moved;
+  }
+  std::memcpy(frame + field.offset, encoded, encodedLen);
+
+  request.recvBuf->resetBuffer(frame, len);
+  invoke(request.cob);
+}
+
+void TFramedAsyncChannel::armTimer(int64_t deadline) {
+  if (timerDeadline_ != 0 && timerDeadline_ <= deadline) {
+    return;
+  }
+  timerDeadline_ = deadline;
+  int64_t wait = (std::max)(deadline - Util::currentTime(), static_cast<int64_t>(0));
+  struct timeval tv;
+  tv.tv_sec = static_cast<long>(wait / 1000);
+  tv.tv_usec = static_cast<long>((wait % 1000) * 1000);
+  evtimer_add(timer_, &tv);
+}
+
+void TFramedAsyncChannel::handleTimeout() {
+  timerDeadline_ = 0;
+  int64_t now = Util::currentTime();
+  if (connecting_ && connDeadline_ != 0 && connDeadline_ <= now) {
+    fail("timed out connecting", true);
+    return;
+  }
+
+  std::vector<Request> expired;
+  int64_t next = connecting_ ? connDeadline_ : 0;
+  for (RequestMap::iterator it = outstanding_.begin(); it != outstanding_.end();) {
+    int64_t deadline = it->second.deadline;
+    if (deadline != 0 && deadline <= now) {
+      expired.push_back(it->second);
+      outstanding_.erase(it++);
+    } else {
+      if (deadline != 0 && (next == 0 || deadline < next)) {
+        next = deadline;
+      }
+      ++it;
+    }
+  }
+  if (next != 0) {
+    armTimer(next);
+  }
+
+  for (std::vector<Request>::iterator it = expired.begin(); it != expired.end(); ++it) {
+    it->recvBuf->resetBuffer();
+    invoke(it->cob);
+  }
+}
+
+void TFramedAsyncChannel::fail(const std::string& why, bool timedOut) {
+  if (error_) {
+    return;
+  }
+  GlobalOutput(("TFramedAsyncChannel: " + why).c_str());
+  error_ = true;
+  timedOut_ = timedOut;
+  closeSocket();
+
+  // Complete everything still waiting; the callbacks find the channel bad
+  RequestMap requests;
+  requests.swap(outstanding_);
+  SendQueue sends;
+  sends.swap(sendQueue_);
+  for (RequestMap::iterator it = requests.begin(); it != requests.end(); ++it) {
+    it->second.recvBuf->resetBuffer();
+    invoke(it->second.cob);
+  }
+  for (SendQueue::iterator it = sends.begin(); it != sends.end(); ++it) {
+    invoke(it->second);
+  }
+}
+
+void TFramedAsyncChannel::closeSocket() {
+  if (readEvent_ != NULL) {
+    event_del(readEvent_);
+  }
+  if (writeEvent_ != NULL) {
+    event_del(writeEvent_);
+  }
+  event_del(timer_);
+  timerDeadline_ = 0;
+  connecting_ = false;
+  if (socket_ != THRIFT_INVALID_SOCKET) {
+    ::THRIFT_CLOSESOCKET(socket_);
+    socket_ = THRIFT_INVALID_SOCKET;
+  }
+  writeBuf_.clear();
+  writeOffset_ = 0;
+  readLen_ = 0;
+}
+
+/* static */ void TFramedAsyncChannel::invoke(const VoidCallback& cob) {
+  try {
+    cob();
+  } catch (std::exception& e) {
+    // don't propagate a C++ exception in C code (e.g. libevent)
+    std::cerr << "TFramedAsyncChannel callback exception thrown (ignored): " << e.what()
+              << std::endl;
+  }
+}
+
+/* static */ void TFramedAsyncChannel::socketHandler(THRIFT_SOCKET fd, short which, void* arg) {
+  (void)fd;
+  TFramedAsyncChannel* self = static_cast<TFramedAsyncChannel*>(arg);
+  if (which & EV_WRITE) {
+    if (self->connecting_) {
+      self->handleConnect();
+    } else {
+      self->handleWrite();
+    }
+  }
+  if ((which & EV_READ) && !self->error_) {
+    self->handleRead();
+  }
+}
+
+/* static */ void TFramedAsyncChannel::timerHandler(THRIFT_SOCKET fd, short which, void* arg) {
+  (void)fd;
+  (void)which;
+  static_cast<TFramedAsyncChannel*>(arg)->handleTimeout();
+}
+}
+}
+} // apache::thrift::async
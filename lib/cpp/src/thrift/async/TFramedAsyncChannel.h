@@ -0,0 +1,212 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TFRAMED_ASYNC_CHANNEL_H_
+#define _THRIFT_TFRAMED_ASYNC_CHANNEL_H_ 1
+
+#include <deque>
+#include <map>
+#include <string>
+#include <utility>
+#include <vector>
+#include <thrift/stdcxx.h>
+#include <thrift/async/TAsyncChannel.h>
+#include <thrift/transport/PlatformSocket.h>
+
+struct event_base;
+struct event;
+
+namespace apache {
+namespace thrift {
+namespace transport {
+class TMemoryBuffer;
+}
+}
+}
+
+namespace apache {
+namespace thrift {
+namespace async {
+
+/**
+ * A TAsyncChannel speaking framed Thrift over a plain TCP connection, as
+ * TNonblockingServer and TFramedTransport do, for the cob style clients
+ * generated with the "cob_style" option:
+ *
+ *   shared_ptr<TFramedAsyncChannel> channel(new TFramedAsyncChannel("localhost", 9090, base));
+ *   channel->setRecvTimeout(1000);
+ *   MyServiceCobClient client(channel, &protocolFactory);
+ *   client.method(cob, args);
+ *   event_base_dispatch(base);
+ *
+ * Any number of requests may be outstanding on the channel at once, from
+ * one client or from several clients sharing it.  The channel numbers the
+ * requests itself, rewriting the sequence id of each message it sends, and
+ * matches responses by it, so they may come back in any order; the caller's
+ * sequence id is put back into the response before it is handed over.  This
+ * only knows where the sequence id is in messages of TBinaryProtocol and
+ * TCompactProtocol.
+ *
+ * Requests sent during one round of the event loop go out together in as
+ * few writes as the socket takes.  A response is handed to the recvBuf of
+ * its request without a copy: the buffer observes the channel's own memory,
+ * which stays valid until the callback returns.
+ *
+ * The connection is made when the first message is sent.  The host is
+ * resolved with getaddrinfo(), which blocks; pass a numeric address to
+ * avoid that.  If connecting fails or times out, or the connection breaks,
+ * the channel goes bad: every outstanding request completes with an empty
+ * recvBuf, so that the client's recv_ method throws, and later sends throw
+ * right away.  A request whose response does not arrive in time completes
+ * the same way, but leaves the channel good; its response is dropped if it
+ * still comes.
+ *
+ * All of it runs on the thread of the event base.  Callbacks must not
+ * destroy the channel.
+ */
+class TFramedAsyncChannel : public TAsyncChannel {
+public:
+  using TAsyncChannel::VoidCallback;
+
+  static const uint32_t DEFAULT_MAX_FRAME_SIZE = 256 * 1024 * 1024;
+
+  TFramedAsyncChannel(const std::string& host, int port, struct event_base* eb);
+  ~TFramedAsyncChannel();
+
+  /**
+   * How long to wait for the connection to be made, in milliseconds; 0,
+   * the default, waits as long as the system does.
+   */
+  void setConnTimeout(int ms) { connTimeout_ = ms; }
+
+  /**
+   * How long to wait for the response to a request, in milliseconds,
+   * counted from when it was sent; 0, the default, waits forever.  Applies
+   * to requests sent after the call.
+   */
+  void setRecvTimeout(int ms) { recvTimeout_ = ms; }
+
+  /**
+   * Responses larger than this break the connection.
+   */
+  void setMaxFrameSize(uint32_t size) { maxFrameSize_ = size; }
+  uint32_t getMaxFrameSize() const { return maxFrameSize_; }
+
+  /**
+   * Number of requests waiting for their response.
+   */
+  size_t getOutstandingCount() const { return outstanding_.size(); }
+
+  virtual void sendAndRecvMessage(const VoidCallback& cob,
+                                  apache::thrift::transport::TMemoryBuffer* sendBuf,
+                                  apache::thrift::transport::TMemoryBuffer* recvBuf);
+
+  /**
+   * Sends a oneway message; cob is called once it has been written out.
+   */
+  virtual void sendMessage(const VoidCallback& cob,
+                           apache::thrift::transport::TMemoryBuffer* message);
+
+  /**
+   * Not supported: responses are only matched to the requests sent with
+   * sendAndRecvMessage().
+   */
+  virtual void recvMessage(const VoidCallback& cob,
+                           apache::thrift::transport::TMemoryBuffer* message);
+
+  virtual bool good() const { return !error_; }
+  virtual bool error() const { return error_; }
+  virtual bool timedOut() const { return timedOut_; }
+
+private:
+  struct Request {
+    Request() : recvBuf(NULL), seqid(0), deadline(0) {}
+
+    VoidCallback cob;
+    apache::thrift::transport::TMemoryBuffer* recvBuf;
+    int32_t seqid;    ///< as the caller sent it
+    int64_t deadline; ///< in ms, 0 for none
+  };
+
+  typedef std::map<int32_t, Request> RequestMap;
+  /// Oneway sends, by how many bytes have to be written before they are out
+  typedef std::deque<std::pair<uint64_t, VoidCallback> > SendQueue;
+
+  void connect();
+  int32_t nextSeqid();
+  void queueFrame(const uint8_t* buf,
+                  uint32_t len,
+                  uint32_t seqidOffset,
+                  uint32_t seqidWidth,
+                  const uint8_t* seqid,
+                  uint32_t seqidLen);
+  void scheduleWrite();
+  void handleConnect();
+  void handleWrite();
+  void handleRead();
+  void handleTimeout();
+  void dispatch(uint8_t* frame, uint32_t len);
+  void armTimer(int64_t deadline);
+  void fail(const std::string& why, bool timedOut);
+  void closeSocket();
+
+  static void invoke(const VoidCallback& cob);
+  static void socketHandler(THRIFT_SOCKET fd, short which, void* arg);
+  static void timerHandler(THRIFT_SOCKET fd, short which, void* arg);
+
+  std::string host_;
+  int port_;
+  struct event_base* eb_;
+
+  THRIFT_SOCKET socket_;
+  struct event* readEvent_;
+  struct event* writeEvent_;
+  struct event* timer_;
+  bool connecting_;
+  bool error_;
+  bool timedOut_;
+
+  int connTimeout_;
+  int recvTimeout_;
+  uint32_t maxFrameSize_;
+  int64_t connDeadline_;
+  int64_t timerDeadline_;
+
+  int32_t nextSeqid_;
+  RequestMap outstanding_;
+  SendQueue sendQueue_;
+
+  std::vector<uint8_t> writeBuf_;
+  size_t writeOffset_;
+  uint64_t bytesWritten_;
+  uint64_t bytesQueued_;
+
+  uint8_t* readBuf_;
+  uint32_t readBufSize_;
+  uint32_t readLen_;
+
+  // not copyable
+  TFramedAsyncChannel(const TFramedAsyncChannel&);
+  TFramedAsyncChannel& operator=(const TFramedAsyncChannel&);
+};
+}
+}
+} // apache::thrift::async
+
+#endif // #ifndef _THRIFT_TFRAMED_ASYNC_CHANNEL_H_
@@ -0,0 +1,291 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/concurrency/AffinityThreadFactory.h>
+#include <thrift/concurrency/Exception.h>
+#include <thrift/TOutput.h>
+
+#include <fstream>
+#include <sstream>
+#include <string>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#ifdef __linux__
+#include <errno.h>
+#include <linux/mempolicy.h>
+#include <sched.h>
+#include <sys/syscall.h>
+#endif
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+using stdcxx::shared_ptr;
+
+namespace {
+
+/**
+ * Parses a sysfs CPU or node list, such as "0-3,8-11"
+ */
+std::vector<int> parseList(const std::string& text) {
+  std::vector<int> result;
+  std::istringstream in(text);
+  std::string range;
+  while (std::getline(in, range, ',')) {
+    int first = 0;
+    int last = 0;
+    char dash = 0;
+    std::istringstream parts(range);
+    if (!(parts >> first)) {
+      continue;
+    }
+    last = first;
+    if (parts >> dash >> last && dash != '-') {
+      last = first;
+    }
+    for (int i = first; i <= last; ++i) {
+      result.push_back(i);
+    }
+  }
+  return result;
+}
+
+std::vector<int> readList(const std::string& path) {
+  std::ifstream in(path.c_str());
+  std::string text;
+  std::getline(in, text);
+  return parseList(text);
+}
+
+std::string nodePath(int node, const char* file) {
+  std::ostringstream path;
+  path << "/sys/devices/system/node/node" << node << "/" << file;
+  return path.str();
+}
+
+#ifdef __linux__
+/**
+ * Moves the calling thread to the CPUs, or to any CPU if there are none
+ */
+bool setCpus(const std::vector<int>& cpus) {
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (cpus.empty()) {
+    long count = sysconf(_SC_NPROCESSORS_CONF);
+    for (long cpu = 0; cpu < count && cpu < CPU_SETSIZE; ++cpu) {
+      CPU_SET(cpu, &set);
+    }
+  } else {
+    for (size_t i = 0; i < cpus.size(); ++i) {
+      if (cpus[i] < 0 || cpus[i] >= CPU_SETSIZE) {
+        return false;
+      }
+      CPU_SET(cpus[i], &set);
+    }
+  }
+  return CPU_COUNT(&set) == 0 || sched_setaffinity(0, sizeof(set), &set) == 0;
+}
+
+bool setMemoryNode(int node) {
+  if (node < 0) {
+    return syscall(SYS_set_mempolicy, MPOL_DEFAULT, NULL, 0) == 0;
+  }
+  const size_t bits = 8 * sizeof(unsigned long);
+  std::vector<unsigned long> mask(node / bits + 1, 0);
+  mask[node / bits] = 1UL << (node % bits);
+  // The kernel takes one more than the number of bits in the mask
+  return syscall(SYS_set_mempolicy, MPOL_PREFERRED, &mask[0], mask.size() * bits + 1) == 0;
+}
+#endif
+
+/**
+ * Places the thread, then runs the Runnable it was made for
+ */
+class PlacedRunnable : public Runnable {
+public:
+  PlacedRunnable(shared_ptr<Runnable> runnable, const ThreadPlacement& placement)
+    : runnable_(runnable), placement_(placement) {}
+
+  void run() {
+    if (!placement_.apply()) {
+      GlobalOutput.printf("AffinityThreadFactory: could not place thread on %d cpus, node %d",
+                          static_cast<int>(placement_.getCpus().size()),
+                          placement_.getMemoryNode());
+    }
+    runnable_->run();
+  }
+
+private:
+  shared_ptr<Runnable> runnable_;
+  ThreadPlacement placement_;
+};
+
+/**
+ * The thread of the wrapped factory, but hosting the Runnable it was made
+ * for rather than the PlacedRunnable, as users such as ThreadManager expect
+ */
+class PlacedThread : public Thread {
+public:
+  PlacedThread(shared_ptr<Thread> thread, shared_ptr<Runnable> runnable) : thread_(thread) {
+    this->Thread::runnable(runnable);
+  }
+
+  void start() { thread_->start(); }
+  void join() { thread_->join(); }
+  Thread::id_t getId() { return thread_->getId(); }
+
+private:
+  shared_ptr<Thread> thread_;
+};
+}
+
+ThreadPlacement ThreadPlacement::onNode(int node) {
+  return ThreadPlacement(nodeCpus(node), numaNodes() > 1 ? node : -1);
+}
+
+ThreadPlacement ThreadPlacement::current() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  return ThreadPlacement(cpus);
+}
+
+int ThreadPlacement::numaNodes() {
+  std::vector<int> nodes = readList("/sys/devices/system/node/online");
+  return nodes.empty() ? 1 : nodes.back() + 1;
+}
+
+std::vector<int> ThreadPlacement::nodeCpus(int node) {
+  std::vector<int> cpus = readList(nodePath(node, "cpulist"));
+  if (cpus.empty() && node == 0 && numaNodes() == 1) {
+    long count = 1;
+#if defined(_SC_NPROCESSORS_CONF)
+    count = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+    for (int cpu = 0; cpu < count; ++cpu) {
+      cpus.push_back(cpu);
+    }
+  }
+  return cpus;
+}
+
+bool ThreadPlacement::apply() const {
+#ifdef __linux__
+  if (!setCpus(cpus_)) {
+    return false;
+  }
+  // Kernels without NUMA support have no memory policy to reset
+  return setMemoryNode(memoryNode_) || memoryNode_ < 0;
+#else
+  return isAnywhere();
+#endif
+}
+
+SavedThreadPlacement::SavedThreadPlacement()
+  : cpus_(ThreadPlacement::current().getCpus()), memoryMode_(-1) {
+#ifdef __linux__
+  // The mask has to have a bit for every node the kernel may have
+  const size_t bits = 8 * sizeof(unsigned long);
+  for (size_t words = 1; words <= 1024; words *= 2) {
+    memoryNodes_.assign(words, 0);
+    int mode = 0;
+    if (syscall(SYS_get_mempolicy, &mode, &memoryNodes_[0], words * bits, NULL, 0) == 0) {
+      memoryMode_ = mode;
+      return;
+    }
+    if (errno != EINVAL) {
+      break;
+    }
+  }
+  memoryNodes_.clear();
+#endif
+}
+
+bool SavedThreadPlacement::restore() const {
+#ifdef __linux__
+  if (!setCpus(cpus_)) {
+    return false;
+  }
+  if (memoryMode_ < 0) {
+    // Kernels without NUMA support have no memory policy to restore
+    return true;
+  }
+  const size_t bits = 8 * sizeof(unsigned long);
+  return syscall(SYS_set_mempolicy,
+                 memoryMode_,
+                 memoryMode_ == MPOL_DEFAULT ? NULL : &memoryNodes_[0],
+                 memoryMode_ == MPOL_DEFAULT ? 0 : memoryNodes_.size() * bits + 1) == 0;
+#else
+  return false;
+#endif
+}
+
+AffinityThreadFactory::AffinityThreadFactory(shared_ptr<ThreadFactory> factory,
+                                             const ThreadPlacement& placement)
+  : ThreadFactory(factory->isDetached()),
+    factory_(factory),
+    placements_(1, placement),
+    next_(0) {
+}
+
+AffinityThreadFactory::AffinityThreadFactory(shared_ptr<ThreadFactory> factory,
+                                             const std::vector<ThreadPlacement>& placements)
+  : ThreadFactory(factory->isDetached()),
+    factory_(factory),
+    placements_(placements),
+    next_(0) {
+  if (placements_.empty()) {
+    throw InvalidArgumentException();
+  }
+}
+
+shared_ptr<Thread> AffinityThreadFactory::newThread(shared_ptr<Runnable> runnable) const {
+  const ThreadPlacement& placement = placements_[next_.fetch_add(1) % placements_.size()];
+  shared_ptr<Thread> thread(new PlacedThread(
+      factory_->newThread(shared_ptr<Runnable>(new PlacedRunnable(runnable, placement))),
+      runnable));
+  runnable->thread(thread);
+  return thread;
+}
+
+Thread::id_t AffinityThreadFactory::getCurrentThreadId() const {
+  return factory_->getCurrentThreadId();
+}
+
+void AffinityThreadFactory::setDetached(bool detached) {
+  ThreadFactory::setDetached(detached);
+  factory_->setDetached(detached);
+}
+}
+}
+} // apache::thrift::concurrency
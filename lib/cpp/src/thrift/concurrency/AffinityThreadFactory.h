@@ -0,0 +1,167 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_CONCURRENCY_AFFINITYTHREADFACTORY_H_
+#define _THRIFT_CONCURRENCY_AFFINITYTHREADFACTORY_H_ 1
+
+#include <thrift/concurrency/Thread.h>
+#include <thrift/stdcxx.h>
+
+#include <boost/atomic.hpp>
+#include <vector>
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+/**
+ * Where a thread runs: on a set of CPUs, with its memory allocated on a NUMA
+ * node or wherever the system likes.  The default placement is anywhere.
+ *
+ * Placements only take effect on Linux; elsewhere, apply() fails for all of
+ * them but the default one.
+ */
+class ThreadPlacement {
+public:
+  /**
+   * Anywhere: on any CPU, with memory on any node
+   */
+  ThreadPlacement() : memoryNode_(-1) {}
+
+  /**
+   * On the given CPUs (any if empty), with memory preferably on memoryNode
+   * (any if negative)
+   */
+  explicit ThreadPlacement(const std::vector<int>& cpus, int memoryNode = -1)
+    : cpus_(cpus), memoryNode_(memoryNode) {}
+
+  /**
+   * On the CPUs of a NUMA node, with memory preferably on that node if
+   * the machine is NUMA
+   */
+  static ThreadPlacement onNode(int node);
+
+  /**
+   * The CPUs the calling thread may currently run on, with memory anywhere
+   */
+  static ThreadPlacement current();
+
+  /**
+   * The number of NUMA nodes of this machine, 1 if it is not NUMA or that
+   * is unknown
+   */
+  static int numaNodes();
+
+  /**
+   * The CPUs of a NUMA node, or all of them for node 0 of a machine that is
+   * not NUMA
+   */
+  static std::vector<int> nodeCpus(int node);
+
+  const std::vector<int>& getCpus() const { return cpus_; }
+  int getMemoryNode() const { return memoryNode_; }
+
+  bool isAnywhere() const { return cpus_.empty() && memoryNode_ < 0; }
+
+  /**
+   * Moves the calling thread here.  Memory the thread allocates from now on
+   * goes to the memory node, while it has room; memory it allocated before
+   * stays where it is.
+   *
+   * @return false if the thread could not be moved, and then stays where
+   *         it was
+   */
+  bool apply() const;
+
+private:
+  std::vector<int> cpus_;
+  int memoryNode_;
+};
+
+/**
+ * Where the calling thread ran when this was made: its CPUs and its memory
+ * policy, whichever that was (such as one set with numactl).  restore()
+ * moves the thread back there after a ThreadPlacement moved it.
+ */
+class SavedThreadPlacement {
+public:
+  SavedThreadPlacement();
+
+  /**
+   * Moves the calling thread back to the saved CPUs and memory policy
+   *
+   * @return false if the thread could not be moved back
+   */
+  bool restore() const;
+
+private:
+  std::vector<int> cpus_;
+  // The saved policy and its nodes, or -1 if the kernel has no policies
+  int memoryMode_;
+  std::vector<unsigned long> memoryNodes_;
+};
+
+/**
+ * A ThreadFactory that places the threads of another one, such as a
+ * PlatformThreadFactory: each thread moves to the placement as soon as it
+ * starts, before it runs its Runnable.  Threads that cannot be moved say so
+ * through GlobalOutput, and run where they are.
+ *
+ * To keep workers next to the data they work on, give each ThreadManager
+ * (or each TNonblockingServer IO thread, see
+ * TNonblockingServer::setIOThreadPlacements()) the placement of one node:
+ *
+ *   shared_ptr<ThreadFactory> factory(new AffinityThreadFactory(
+ *       shared_ptr<ThreadFactory>(new PlatformThreadFactory()),
+ *       ThreadPlacement::onNode(node)));
+ *
+ * Setting this factory detached or not sets the wrapped one the same way.
+ */
+class AffinityThreadFactory : public ThreadFactory {
+public:
+  AffinityThreadFactory(stdcxx::shared_ptr<ThreadFactory> factory,
+                        const ThreadPlacement& placement);
+
+  /**
+   * Places the threads on each placement in turn
+   */
+  AffinityThreadFactory(stdcxx::shared_ptr<ThreadFactory> factory,
+                        const std::vector<ThreadPlacement>& placements);
+
+  // From ThreadFactory;
+  stdcxx::shared_ptr<Thread> newThread(stdcxx::shared_ptr<Runnable> runnable) const;
+
+  // From ThreadFactory;
+  Thread::id_t getCurrentThreadId() const;
+
+  // From ThreadFactory;
+  void setDetached(bool detached);
+
+  const std::vector<ThreadPlacement>& getPlacements() const { return placements_; }
+
+private:
+  stdcxx::shared_ptr<ThreadFactory> factory_;
+  std::vector<ThreadPlacement> placements_;
+  mutable boost::atomic<size_t> next_;
+};
+}
+}
+} // apache::thrift::concurrency
+
+#endif // #ifndef _THRIFT_CONCURRENCY_AFFINITYTHREADFACTORY_H_
@@ -41,7 +41,7 @@ namespace concurrency {
  */
 class Mutex::impl : public boost::timed_mutex {};
 
-Mutex::Mutex(Initializer init) : impl_(new Mutex::impl()) {
+Mutex::Mutex(Initializer init) : impl_(new Mutex::impl()), name_(NULL) {
   THRIFT_UNUSED_VARIABLE(init);
 }
 
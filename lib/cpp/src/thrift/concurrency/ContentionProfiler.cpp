@@ -0,0 +1,364 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/concurrency/ContentionProfiler.h>
+#include <thrift/concurrency/Mutex.h>
+#include <thrift/concurrency/Util.h>
+
+#include <algorithm>
+#include <map>
+#include <stdlib.h>
+#include <string.h>
+#include <vector>
+
+#ifdef HAVE_PTHREAD_H
+#include <pthread.h>
+#else
+#include <thrift/transport/PlatformSocket.h>
+#endif
+
+#if defined(__GLIBC__) || defined(__APPLE__)
+#include <execinfo.h>
+#define THRIFT_HAVE_BACKTRACE 1
+#endif
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+namespace {
+
+const int MAX_STACK_DEPTH = 32;
+
+/**
+ * A lock, by name, and the stack that acquired it
+ */
+struct Site {
+  Site() : name(NULL), depth(0) {}
+
+  /**
+   * Takes the stack of the caller, less the skip frames below it.
+   */
+  void capture(int skip) {
+#ifdef THRIFT_HAVE_BACKTRACE
+    void* frames[MAX_STACK_DEPTH + 8];
+    int n = ::backtrace(frames, MAX_STACK_DEPTH + 8);
+    // and the frame of capture() itself
+    skip += 1;
+    depth = std::max(0, std::min(n - skip, MAX_STACK_DEPTH));
+    memcpy(callers, frames + skip, depth * sizeof(void*));
+#else
+    (void)skip;
+#endif
+  }
+
+  bool operator<(const Site& other) const {
+    int diff = strcmp(name ? name : "", other.name ? other.name : "");
+    if (diff != 0) {
+      return diff < 0;
+    }
+    if (depth != other.depth) {
+      return depth < other.depth;
+    }
+    return std::lexicographical_compare(callers,
+                                        callers + depth,
+                                        other.callers,
+                                        other.callers + other.depth);
+  }
+
+  const char* name;
+  int depth;
+  void* callers[MAX_STACK_DEPTH];
+};
+
+struct Totals {
+  Totals() : count(0), micros(0) {}
+
+  uint64_t count;
+  uint64_t micros;
+};
+
+typedef std::map<Site, Totals> SiteMap;
+typedef std::vector<std::pair<Site, Totals> > SiteVector;
+
+#ifdef HAVE_PTHREAD_H
+pthread_mutex_t profileMutex = PTHREAD_MUTEX_INITIALIZER;
+#else
+boost::atomic<bool> profileLock(false);
+#endif
+
+/**
+ * Guards the profile.  This cannot be a Mutex, which would report to it.
+ * Where there are no pthreads it spins, giving up the CPU between tries.
+ */
+class ProfileGuard {
+public:
+  ProfileGuard() {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_lock(&profileMutex);
+#else
+    while (profileLock.exchange(true, boost::memory_order_acquire)) {
+      THRIFT_SLEEP_USEC(0);
+    }
+#endif
+  }
+
+  ~ProfileGuard() {
+#ifdef HAVE_PTHREAD_H
+    pthread_mutex_unlock(&profileMutex);
+#else
+    profileLock.store(false, boost::memory_order_release);
+#endif
+  }
+
+private:
+  ProfileGuard(const ProfileGuard&);
+  ProfileGuard& operator=(const ProfileGuard&);
+};
+
+boost::atomic<int32_t> waitRate(0);
+boost::atomic<int32_t> holdRate(0);
+boost::atomic<int32_t> waitCountdown(0);
+boost::atomic<int32_t> holdCountdown(0);
+boost::atomic<bool> recording(false);
+
+// The rates the profile was last taken at, for pprof to scale it by
+int32_t waitPeriod = 1;
+int32_t holdPeriod = 1;
+
+SiteMap waits;
+SiteMap holds;
+
+#ifndef THRIFT_NO_CONTENTION_PROFILING
+MutexWaitCallback mutexProfilingCallback = 0;
+#endif
+
+/**
+ * Counts down to the next sample.  This is not exact: a thread may skip or
+ * repeat a sample when another counts down at the same time, which spares
+ * every lock a read-modify-write of the counter.
+ */
+bool countDown(boost::atomic<int32_t>& counter, const boost::atomic<int32_t>& rate) {
+  int32_t every = rate.load(boost::memory_order_relaxed);
+  if (every <= 0) {
+    return false;
+  }
+  int32_t left = counter.load(boost::memory_order_relaxed) - 1;
+  if (left > 0) {
+    counter.store(left, boost::memory_order_relaxed);
+    return false;
+  }
+  counter.store(every, boost::memory_order_relaxed);
+  return true;
+}
+
+void record(SiteMap& map, const Site& site, int64_t micros) {
+  ProfileGuard guard;
+  Totals& totals = map[site];
+  totals.count++;
+  totals.micros += static_cast<uint64_t>(micros);
+}
+
+bool moreTime(const std::pair<Site, Totals>& a, const std::pair<Site, Totals>& b) {
+  return a.second.micros > b.second.micros;
+}
+
+SiteVector snapshot(const SiteMap& map) {
+  SiteVector sites;
+  {
+    ProfileGuard guard;
+    sites.assign(map.begin(), map.end());
+  }
+  std::sort(sites.begin(), sites.end(), moreTime);
+  return sites;
+}
+
+void printSites(FILE* f, const char* what, const SiteVector& sites) {
+  for (SiteVector::const_iterator it = sites.begin(); it != sites.end(); ++it) {
+    const Site& site = it->first;
+    fprintf(f,
+            "%s %llu us in %llu samples on %s:\n",
+            what,
+            static_cast<unsigned long long>(it->second.micros),
+            static_cast<unsigned long long>(it->second.count),
+            site.name ? site.name : "(unnamed lock)");
+#ifdef THRIFT_HAVE_BACKTRACE
+    char** strings = backtrace_symbols(site.callers, site.depth);
+    if (strings) {
+      for (int n = 0; n < site.depth; ++n) {
+        fprintf(f, "  #%-2d %s\n", n, strings[n]);
+      }
+      free(strings);
+    } else {
+      fprintf(f, "  <failed to determine symbols>\n");
+    }
+#endif
+    fprintf(f, "\n");
+  }
+}
+
+/**
+ * Writes a contention profile in the legacy text format of pprof, with the
+ * times in microseconds as the cycles.
+ */
+void writePprof(FILE* f, const SiteVector& sites, int32_t period) {
+  fprintf(f, "--- contention:\n");
+  fprintf(f, "cycles/second = 1000000\n");
+  fprintf(f, "sampling period = %d\n", period);
+  for (SiteVector::const_iterator it = sites.begin(); it != sites.end(); ++it) {
+    fprintf(f,
+            "%llu %llu @",
+            static_cast<unsigned long long>(it->second.micros),
+            static_cast<unsigned long long>(it->second.count));
+    for (int n = 0; n < it->first.depth; ++n) {
+      fprintf(f, " %p", it->first.callers[n]);
+    }
+    fprintf(f, "\n");
+  }
+
+#ifdef __linux__
+  // pprof needs the mappings to find the symbols
+  FILE* procMaps = fopen("/proc/self/maps", "r");
+  if (procMaps) {
+    fprintf(f, "--- Memory map: ---\n");
+    char buf[4096];
+    size_t bytesRead;
+    while ((bytesRead = fread(buf, 1, sizeof(buf), procMaps)) > 0) {
+      fwrite(buf, 1, bytesRead, f);
+    }
+    fclose(procMaps);
+  }
+#endif
+}
+}
+
+class ContentionProfiler::Hold {
+public:
+  Site site;
+  int64_t start;
+};
+
+boost::atomic<bool> ContentionProfiler::active_(false);
+
+void ContentionProfiler::update() {
+  bool callback = false;
+#ifndef THRIFT_NO_CONTENTION_PROFILING
+  callback = (mutexProfilingCallback != 0);
+#endif
+  bool profiling = recording.load(boost::memory_order_relaxed);
+  active_.store((profiling || callback)
+                && (waitRate.load(boost::memory_order_relaxed) > 0
+                    || holdRate.load(boost::memory_order_relaxed) > 0));
+}
+
+bool ContentionProfiler::sampleWait() {
+  return countDown(waitCountdown, waitRate);
+}
+
+bool ContentionProfiler::sampleHold() {
+  return recording.load(boost::memory_order_relaxed) && countDown(holdCountdown, holdRate);
+}
+
+void ContentionProfiler::waited(const void* id, const char* name, int64_t micros) {
+#ifndef THRIFT_NO_CONTENTION_PROFILING
+  MutexWaitCallback callback = mutexProfilingCallback;
+  if (callback) {
+    (*callback)(id, micros);
+  }
+#else
+  (void)id;
+#endif
+  if (micros > 0 && recording.load(boost::memory_order_relaxed)) {
+    Site site;
+    site.name = name;
+    site.capture(1);
+    record(waits, site, micros);
+  }
+}
+
+ContentionProfiler::Hold* ContentionProfiler::holding(const char* name) {
+  Hold* hold = new Hold();
+  hold->site.name = name;
+  hold->site.capture(1);
+  hold->start = Util::currentTimeUsec();
+  return hold;
+}
+
+void ContentionProfiler::released(Hold* hold) {
+  int64_t micros = Util::currentTimeUsec() - hold->start;
+  record(holds, hold->site, std::max(micros, static_cast<int64_t>(0)));
+  delete hold;
+}
+
+void enableContentionProfiling(int32_t waitSampleRate, int32_t holdSampleRate) {
+  {
+    ProfileGuard guard;
+    waitPeriod = std::max(waitSampleRate, 1);
+    holdPeriod = std::max(holdSampleRate, 1);
+  }
+  waitRate.store(waitSampleRate);
+  holdRate.store(holdSampleRate);
+  recording.store(true);
+  ContentionProfiler::update();
+}
+
+void disableContentionProfiling() {
+  recording.store(false);
+  holdRate.store(0);
+  ContentionProfiler::update();
+}
+
+void clearContentionProfile() {
+  ProfileGuard guard;
+  waits.clear();
+  holds.clear();
+}
+
+void printContentionProfile(FILE* f) {
+  printSites(f, "waited", snapshot(waits));
+  printSites(f, "held", snapshot(holds));
+}
+
+void writeContentionPprof(FILE* waitsFile, FILE* holdsFile) {
+  int32_t waitEvery, holdEvery;
+  {
+    ProfileGuard guard;
+    waitEvery = waitPeriod;
+    holdEvery = holdPeriod;
+  }
+  if (waitsFile) {
+    writePprof(waitsFile, snapshot(waits), waitEvery);
+  }
+  if (holdsFile) {
+    writePprof(holdsFile, snapshot(holds), holdEvery);
+  }
+}
+
+#ifndef THRIFT_NO_CONTENTION_PROFILING
+void enableMutexProfiling(int32_t profilingSampleRate, MutexWaitCallback callback) {
+  mutexProfilingCallback = callback;
+  waitRate.store(profilingSampleRate);
+  ContentionProfiler::update();
+}
+#endif
+}
+}
+} // apache::thrift::concurrency
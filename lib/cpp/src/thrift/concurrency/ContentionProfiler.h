@@ -0,0 +1,125 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_CONCURRENCY_CONTENTIONPROFILER_H_
+#define _THRIFT_CONCURRENCY_CONTENTIONPROFILER_H_ 1
+
+#include <boost/atomic.hpp>
+#include <stdint.h>
+#include <stdio.h>
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+/**
+ * Profiles lock contention in Mutex, ReadWriteMutex and Monitor, to tell
+ * which locks a program waits for, and where:
+ *
+ *   enableContentionProfiling(100, 1000);
+ *   ...
+ *   writeContentionPprof(waitsFile, holdsFile);
+ *
+ * One in every waitSampleRate blocking acquisitions is sampled: if the lock
+ * is taken, the time until it is acquired is charged to the stack that
+ * acquired it and to the name given to the lock with setName().  Likewise,
+ * one in every holdSampleRate exclusive acquisitions is timed until the lock
+ * is released; read locks of a ReadWriteMutex are not, as other readers may
+ * share them.  A Monitor wait releases its lock, which ends the hold.  A
+ * rate of 0 turns that kind of sampling off.
+ *
+ * The locks of the thrift library itself are named, see ThreadManager,
+ * TimerManager and TConcurrentClientSyncInfo.  Only the POSIX threads
+ * implementation of the locks, the default one, and the futex one are
+ * profiled.
+ *
+ * While profiling is off, a lock costs one more relaxed atomic load.
+ */
+void enableContentionProfiling(int32_t waitSampleRate, int32_t holdSampleRate);
+
+/**
+ * Stops sampling; what has been collected stays until
+ * clearContentionProfile().
+ */
+void disableContentionProfiling();
+
+void clearContentionProfile();
+
+/**
+ * Prints what has been collected, by lock name and stack, the most time
+ * first.
+ */
+void printContentionProfile(FILE* f);
+
+/**
+ * Writes what has been collected as two contention profiles in the legacy
+ * text format of pprof, one of the waits and one of the holds; either file
+ * may be NULL.  pprof scales the counts and times by the sample rates.  The
+ * lock names are not part of the format, see printContentionProfile().
+ */
+void writeContentionPprof(FILE* waitsFile, FILE* holdsFile);
+
+/**
+ * The hooks the lock implementations report samples to.
+ */
+class ContentionProfiler {
+public:
+  /**
+   * A sampled hold in progress.
+   */
+  class Hold;
+
+  /**
+   * Whether any sampling is on: anything else is only worth calling if so.
+   */
+  static bool active() { return active_.load(boost::memory_order_relaxed); }
+
+  /**
+   * Whether to sample this acquisition.
+   */
+  static bool sampleWait();
+  static bool sampleHold();
+
+  /**
+   * Reports a sampled acquisition of the lock id named name, which waited
+   * micros for it; 0 if the lock was free.
+   */
+  static void waited(const void* id, const char* name, int64_t micros);
+
+  /**
+   * Starts timing the hold of a lock just acquired; the result goes to
+   * released() when it is released.
+   */
+  static Hold* holding(const char* name);
+  static void released(Hold* hold);
+
+  /**
+   * Recomputes active() after the sample rates or the callback of
+   * enableMutexProfiling() change.
+   */
+  static void update();
+
+private:
+  static boost::atomic<bool> active_;
+};
+}
+}
+} // apache::thrift::concurrency
+
+#endif // #ifndef _THRIFT_CONCURRENCY_CONTENTIONPROFILER_H_
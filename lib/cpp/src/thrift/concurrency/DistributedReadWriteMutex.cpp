@@ -0,0 +1,172 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/concurrency/DistributedReadWriteMutex.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+#if defined(__linux__) && defined(__GLIBC__)
+#include <sched.h>
+#endif
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+namespace {
+
+const uint32_t MAX_SLOTS = 64;
+
+uint32_t slotCount() {
+  long cpus = 16;
+#if defined(_SC_NPROCESSORS_CONF)
+  cpus = sysconf(_SC_NPROCESSORS_CONF);
+#endif
+  uint32_t count = 1;
+  while (count < MAX_SLOTS && static_cast<long>(count) < cpus) {
+    count *= 2;
+  }
+  return count;
+}
+
+/**
+ * The CPU the calling thread runs on, or where that is unknown, a number
+ * that tells threads apart by their stacks.  Either may change between the
+ * acquisition of a read lock and its release; the slots only have to add up.
+ */
+uint32_t currentCpu() {
+#if defined(__linux__) && defined(__GLIBC__)
+  int cpu = sched_getcpu();
+  if (cpu >= 0) {
+    return static_cast<uint32_t>(cpu);
+  }
+#endif
+  char here;
+  uint32_t stack = static_cast<uint32_t>(reinterpret_cast<uintptr_t>(&here) >> 16);
+  return (stack * 2654435761u) >> 16;
+}
+}
+
+struct DistributedReadWriteMutex::Slot {
+  Slot() : readers(0) {}
+
+  // The readers that entered here, less those that left here
+  boost::atomic<int32_t> readers;
+  // Two slots never share a cache line, wherever the array starts
+  char padding[128 - sizeof(boost::atomic<int32_t>)];
+};
+
+DistributedReadWriteMutex::DistributedReadWriteMutex()
+  : slotMask_(slotCount() - 1), writer_(false), written_(false) {
+  slots_.reset(new Slot[slotMask_ + 1]);
+  monitor_.mutex().setName("DistributedReadWriteMutex");
+}
+
+DistributedReadWriteMutex::~DistributedReadWriteMutex() {
+}
+
+DistributedReadWriteMutex::Slot& DistributedReadWriteMutex::slot() const {
+  return slots_[currentCpu() & slotMask_];
+}
+
+bool DistributedReadWriteMutex::enterRead(Slot& slot) const {
+  // Either this sees the writer, or the writer sees this reader
+  slot.readers.fetch_add(1);
+  if (!writer_.load()) {
+    return true;
+  }
+  leaveRead(slot);
+  return false;
+}
+
+void DistributedReadWriteMutex::leaveRead(Slot& slot) const {
+  slot.readers.fetch_sub(1);
+  if (writer_.load()) {
+    // The writer may be waiting for the last reader
+    Synchronized s(monitor_);
+    monitor_.notifyAll();
+  }
+}
+
+int64_t DistributedReadWriteMutex::readers() const {
+  int64_t readers = 0;
+  for (uint32_t i = 0; i <= slotMask_; ++i) {
+    readers += slots_[i].readers.load();
+  }
+  return readers;
+}
+
+void DistributedReadWriteMutex::acquireRead() const {
+  while (!enterRead(slot())) {
+    Synchronized s(monitor_);
+    while (writer_.load()) {
+      monitor_.wait();
+    }
+  }
+}
+
+bool DistributedReadWriteMutex::attemptRead() const {
+  return enterRead(slot());
+}
+
+void DistributedReadWriteMutex::acquireWrite() const {
+  Synchronized s(monitor_);
+  while (writer_.load()) {
+    monitor_.wait();
+  }
+  // From here on, new readers wait
+  writer_.store(true);
+  while (readers() != 0) {
+    monitor_.wait();
+  }
+  written_ = true;
+}
+
+bool DistributedReadWriteMutex::attemptWrite() const {
+  Guard g(monitor_.mutex(), -1);
+  if (!g || writer_.load()) {
+    return false;
+  }
+  writer_.store(true);
+  if (readers() != 0) {
+    writer_.store(false);
+    monitor_.notifyAll();
+    return false;
+  }
+  written_ = true;
+  return true;
+}
+
+void DistributedReadWriteMutex::release() const {
+  // While the writer holds the lock, there is no reader to release it
+  if (written_) {
+    Synchronized s(monitor_);
+    written_ = false;
+    writer_.store(false);
+    monitor_.notifyAll();
+  } else {
+    leaveRead(slot());
+  }
+}
+}
+}
+} // apache::thrift::concurrency
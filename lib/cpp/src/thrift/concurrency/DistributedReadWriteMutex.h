@@ -0,0 +1,92 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_CONCURRENCY_DISTRIBUTEDREADWRITEMUTEX_H_
+#define _THRIFT_CONCURRENCY_DISTRIBUTEDREADWRITEMUTEX_H_ 1
+
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/concurrency/Mutex.h>
+
+#include <boost/atomic.hpp>
+#include <boost/scoped_array.hpp>
+#include <stdint.h>
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+/**
+ * A ReadWriteMutex for data that is read far more often than it is written,
+ * by many threads at once: counters, server lists, configuration snapshots.
+ *
+ * A plain rwlock counts its readers in one word, whose cache line every
+ * reader writes, so that readers on different CPUs slow each other down
+ * although none waits for another.  This one (a "big-reader" lock) counts
+ * them in one slot per CPU instead: a reader only touches the slot of the
+ * CPU it runs on, and a writer sums them all.  A read lock is thus as cheap
+ * with 64 readers as with one, and a write lock costs more, in proportion
+ * to the number of CPUs.
+ *
+ * Writers come first: once one waits, new readers wait for it as well, as
+ * with a NoStarveReadWriteMutex.  Neither kind of lock is recursive.  Only
+ * the internal lock that writers and waiting readers take, named
+ * "DistributedReadWriteMutex", shows in contention profiles.
+ */
+class DistributedReadWriteMutex : public ReadWriteMutex {
+public:
+  DistributedReadWriteMutex();
+  virtual ~DistributedReadWriteMutex();
+
+  virtual void acquireRead() const;
+  virtual void acquireWrite() const;
+
+  virtual bool attemptRead() const;
+  virtual bool attemptWrite() const;
+
+  virtual void release() const;
+
+  /**
+   * The number of reader slots, a power of two no smaller than the number
+   * of CPUs, up to 64.
+   */
+  uint32_t slots() const { return slotMask_ + 1; }
+
+private:
+  struct Slot;
+
+  Slot& slot() const;
+  bool enterRead(Slot& slot) const;
+  void leaveRead(Slot& slot) const;
+  int64_t readers() const;
+
+  boost::scoped_array<Slot> slots_;
+  uint32_t slotMask_;
+
+  // A writer holds the lock or waits for it
+  mutable boost::atomic<bool> writer_;
+  // The writer holds it: every release() is the writer's
+  mutable bool written_;
+  // Readers wait on it for writers, and writers for readers and writers
+  Monitor monitor_;
+};
+}
+}
+} // apache::thrift::concurrency
+
+#endif // #ifndef _THRIFT_CONCURRENCY_DISTRIBUTEDREADWRITEMUTEX_H_
@@ -0,0 +1,123 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_CONCURRENCY_FUTEX_H_
+#define _THRIFT_CONCURRENCY_FUTEX_H_ 1
+
+/**
+ * The Linux futex calls the futex implementation of Mutex, ReadWriteMutex
+ * and Monitor (WITH_FUTEX) is built on.  Like Util.h, this is meant for the
+ * concurrency library implementation, not for API headers.
+ */
+#ifdef __linux__
+
+#include <boost/atomic.hpp>
+#include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <stdint.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+typedef boost::atomic<int32_t> FutexWord;
+
+namespace detail {
+
+inline int32_t* futexAddress(const FutexWord& word) {
+  // boost::atomic<int32_t> is lock free here, so it is the int32_t itself
+  return reinterpret_cast<int32_t*>(const_cast<FutexWord*>(&word));
+}
+}
+
+/**
+ * Sleeps while word holds expected, until futexWake() or the deadline, an
+ * absolute time on CLOCK_MONOTONIC, or on CLOCK_REALTIME if realtime is
+ * set; NULL waits forever.
+ *
+ * Returns 0 once woken, ETIMEDOUT at the deadline, or EAGAIN if word did not
+ * hold expected.  As the word may change again before this returns, the
+ * caller checks it once more in any case; a return of 0 does not tell what
+ * it holds.
+ */
+inline int futexWait(const FutexWord& word,
+                     int32_t expected,
+                     const struct timespec* deadline = NULL,
+                     bool realtime = false) {
+  int op = FUTEX_WAIT_BITSET | FUTEX_PRIVATE_FLAG | (realtime ? FUTEX_CLOCK_REALTIME : 0);
+  long ret = syscall(SYS_futex,
+                     detail::futexAddress(word),
+                     op,
+                     expected,
+                     deadline,
+                     NULL,
+                     FUTEX_BITSET_MATCH_ANY);
+  if (ret == 0) {
+    return 0;
+  }
+  // EINTR is as good as a wakeup to callers that check the word again
+  return errno == EINTR ? 0 : errno;
+}
+
+/**
+ * Wakes up to count threads sleeping in futexWait() on word.
+ */
+inline void futexWake(const FutexWord& word, int count = INT_MAX) {
+  syscall(SYS_futex, detail::futexAddress(word), FUTEX_WAKE | FUTEX_PRIVATE_FLAG, count, NULL, NULL, 0);
+}
+
+/**
+ * The time milliseconds from now on CLOCK_MONOTONIC, which, unlike the time
+ * of day, no clock adjustment moves.
+ */
+inline void futexDeadline(struct timespec& deadline, int64_t milliseconds) {
+  clock_gettime(CLOCK_MONOTONIC, &deadline);
+  deadline.tv_sec += static_cast<time_t>(milliseconds / 1000);
+  deadline.tv_nsec += static_cast<long>((milliseconds % 1000) * 1000000);
+  if (deadline.tv_nsec >= 1000000000L) {
+    deadline.tv_sec += 1;
+    deadline.tv_nsec -= 1000000000L;
+  } else if (deadline.tv_nsec < 0) {
+    deadline.tv_sec -= 1;
+    deadline.tv_nsec += 1000000000L;
+  }
+}
+
+/**
+ * Tells the CPU that this is a spin loop, which leaves more of a shared core
+ * to the thread the loop waits for.
+ */
+inline void cpuRelax() {
+#if defined(__i386__) || defined(__x86_64__)
+  __builtin_ia32_pause();
+#elif defined(__aarch64__)
+  __asm__ __volatile__("yield" ::: "memory");
+#endif
+}
+}
+}
+} // apache::thrift::concurrency
+
+#endif // __linux__
+
+#endif // #ifndef _THRIFT_CONCURRENCY_FUTEX_H_
@@ -0,0 +1,203 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/concurrency/Exception.h>
+#include <thrift/concurrency/Futex.h>
+#include <thrift/transport/PlatformSocket.h>
+#include <thrift/stdcxx.h>
+
+#include <assert.h>
+
+namespace apache {
+namespace thrift {
+
+using stdcxx::scoped_ptr;
+
+namespace concurrency {
+
+/**
+ * Monitor implementation on a Linux futex
+ *
+ * A wait sleeps on wakeups_ for as long as no notify() bumps it.  Relative
+ * timeouts are deadlines on CLOCK_MONOTONIC, which clock adjustments do not
+ * move, and the absolute ones are on CLOCK_REALTIME, as with pthreads.  The
+ * futex is only called while there are waiters.
+ */
+class Monitor::Impl {
+
+public:
+  Impl() : ownedMutex_(new Mutex()), mutex_(ownedMutex_.get()), wakeups_(0), waiters_(0) {}
+
+  Impl(Mutex* mutex) : mutex_(mutex), wakeups_(0), waiters_(0) {}
+
+  Impl(Monitor* monitor) : mutex_(&(monitor->mutex())), wakeups_(0), waiters_(0) {}
+
+  Mutex& mutex() { return *mutex_; }
+  void lock() { mutex().lock(); }
+  void unlock() { mutex().unlock(); }
+
+  /**
+   * Exception-throwing version of waitForTimeRelative(), called simply
+   * wait(int64) for historical reasons.  Timeout is in milliseconds.
+   *
+   * If the condition occurs,  this function returns cleanly; on timeout or
+   * error an exception is thrown.
+   */
+  void wait(int64_t timeout_ms) const {
+    int result = waitForTimeRelative(timeout_ms);
+    if (result == THRIFT_ETIMEDOUT) {
+      throw TimedOutException();
+    } else if (result != 0) {
+      throw TException("futex wait failed");
+    }
+  }
+
+  /**
+   * Waits until the specified timeout in milliseconds for the condition to
+   * occur, or waits forever if timeout_ms == 0.
+   *
+   * Returns 0 if condition occurs, THRIFT_ETIMEDOUT on timeout, or an error code.
+   */
+  int waitForTimeRelative(int64_t timeout_ms) const {
+    if (timeout_ms == 0LL) {
+      return waitForever();
+    }
+
+    struct timespec deadline;
+    futexDeadline(deadline, timeout_ms);
+    return waitUntil(&deadline, false);
+  }
+
+  /**
+   * Waits until the absolute time specified using struct THRIFT_TIMESPEC.
+   * Returns 0 if condition occurs, THRIFT_ETIMEDOUT on timeout, or an error code.
+   */
+  int waitForTime(const THRIFT_TIMESPEC* abstime) const { return waitUntil(abstime, true); }
+
+  int waitForTime(const struct timeval* abstime) const {
+    struct THRIFT_TIMESPEC temp;
+    temp.tv_sec = abstime->tv_sec;
+    temp.tv_nsec = abstime->tv_usec * 1000;
+    return waitForTime(&temp);
+  }
+
+  /**
+   * Waits forever until the condition occurs.
+   * Returns 0 if condition occurs, or an error code otherwise.
+   */
+  int waitForever() const { return waitUntil(NULL, false); }
+
+  void notify() {
+    wakeups_.fetch_add(1);
+    if (waiters_.load() > 0) {
+      futexWake(wakeups_, 1);
+    }
+  }
+
+  void notifyAll() {
+    wakeups_.fetch_add(1);
+    if (waiters_.load() > 0) {
+      futexWake(wakeups_);
+    }
+  }
+
+private:
+  int waitUntil(const struct timespec* deadline, bool realtime) const {
+    assert(mutex_);
+
+    // XXX Need to assert that caller owns mutex
+    // A notify() after this sees the waiter, and changes wakeups_ before
+    // the wait can sleep
+    int32_t wakeups = wakeups_.load();
+    waiters_.fetch_add(1);
+    mutex_->unlock();
+    int result = futexWait(wakeups_, wakeups, deadline, realtime);
+    mutex_->lock();
+    waiters_.fetch_sub(1);
+
+    if (result == ETIMEDOUT) {
+      return THRIFT_ETIMEDOUT;
+    }
+    // Woken up, or notified before the wait could sleep
+    return (result == 0 || result == EAGAIN) ? 0 : result;
+  }
+
+  scoped_ptr<Mutex> ownedMutex_;
+  Mutex* mutex_;
+
+  mutable FutexWord wakeups_;
+  mutable boost::atomic<int32_t> waiters_;
+};
+
+Monitor::Monitor() : impl_(new Monitor::Impl()) {
+}
+Monitor::Monitor(Mutex* mutex) : impl_(new Monitor::Impl(mutex)) {
+}
+Monitor::Monitor(Monitor* monitor) : impl_(new Monitor::Impl(monitor)) {
+}
+
+Monitor::~Monitor() {
+  delete impl_;
+}
+
+Mutex& Monitor::mutex() const {
+  return impl_->mutex();
+}
+
+void Monitor::lock() const {
+  impl_->lock();
+}
+
+void Monitor::unlock() const {
+  impl_->unlock();
+}
+
+void Monitor::wait(int64_t timeout) const {
+  impl_->wait(timeout);
+}
+
+int Monitor::waitForTime(const THRIFT_TIMESPEC* abstime) const {
+  return impl_->waitForTime(abstime);
+}
+
+int Monitor::waitForTime(const timeval* abstime) const {
+  return impl_->waitForTime(abstime);
+}
+
+int Monitor::waitForTimeRelative(int64_t timeout_ms) const {
+  return impl_->waitForTimeRelative(timeout_ms);
+}
+
+int Monitor::waitForever() const {
+  return impl_->waitForever();
+}
+
+void Monitor::notify() const {
+  impl_->notify();
+}
+
+void Monitor::notifyAll() const {
+  impl_->notifyAll();
+}
+}
+}
+} // apache::thrift::concurrency
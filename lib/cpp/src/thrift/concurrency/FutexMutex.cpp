@@ -0,0 +1,533 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/Thrift.h>
+#include <thrift/concurrency/ContentionProfiler.h>
+#include <thrift/concurrency/Exception.h>
+#include <thrift/concurrency/Futex.h>
+#include <thrift/concurrency/Mutex.h>
+#include <thrift/concurrency/Util.h>
+
+#include <algorithm>
+#include <pthread.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <boost/format.hpp>
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+#ifndef THRIFT_NO_CONTENTION_PROFILING
+#define PROFILE_MUTEX_ACTIVE() ContentionProfiler::active()
+#else
+#define PROFILE_MUTEX_ACTIVE() false
+#endif
+
+namespace {
+
+// The longest a lock spins before it sleeps, in cpuRelax() rounds
+const int32_t MAX_SPINS = 100;
+
+/**
+ * MAX_SPINS, or 0 on a single CPU, where the thread a lock waits for cannot
+ * run while it spins
+ */
+int32_t maxSpins() {
+  static const int32_t spins = (sysconf(_SC_NPROCESSORS_ONLN) > 1) ? MAX_SPINS : 0;
+  return spins;
+}
+
+// The kinds of Mutex the initializers ask for
+enum Kind { NORMAL, ERRORCHECK, RECURSIVE };
+
+void throwSre(const char* call, int error) {
+  throw SystemResourceException(
+      boost::str(boost::format("%1% returned %2% (%3%)") % call % error % ::strerror(error)));
+}
+}
+
+/**
+ * Implementation of Mutex class on a Linux futex
+ *
+ * The lock is one word: UNLOCKED, LOCKED, or CONTENDED when it is locked and
+ * a thread may sleep on it, which is what unlock() wakes threads for (see
+ * "Futexes Are Tricky", Ulrich Drepper).  Before it sleeps, a thread spins
+ * for a while the lock is only LOCKED; like the adaptive pthread mutex, it
+ * spins for about as long as the last acquisitions took, up to maxSpins().
+ *
+ * Throws apache::thrift::concurrency::SystemResourceException on error.
+ */
+class Mutex::impl {
+public:
+  static const int32_t UNLOCKED = 0;
+  static const int32_t LOCKED = 1;
+  static const int32_t CONTENDED = 2;
+
+  impl(Initializer init) : state_(UNLOCKED), spins_(0), kind_(NORMAL), owner_(0), count_(0), hold_(NULL) {
+    init(&kind_);
+  }
+
+  void lock() const {
+    if (reenter("lock()")) {
+      return;
+    }
+    if (!acquire()) {
+      acquireSlow(NULL);
+    }
+    setOwner();
+  }
+
+  bool trylock() const {
+    if (kind_ == RECURSIVE && ownedHere()) {
+      ++count_;
+      return true;
+    }
+    if (!acquire()) {
+      return false;
+    }
+    setOwner();
+    return true;
+  }
+
+  bool timedlock(int64_t milliseconds) const {
+    if (reenter("timedlock()")) {
+      return true;
+    }
+    if (!acquire()) {
+      struct timespec deadline;
+      futexDeadline(deadline, milliseconds);
+      if (!acquireSlow(&deadline)) {
+        return false;
+      }
+    }
+    setOwner();
+    return true;
+  }
+
+  void unlock() const {
+    if (kind_ != NORMAL) {
+      if (!ownedHere()) {
+        throwSre("unlock()", EPERM);
+      }
+      if (count_ > 0) {
+        --count_;
+        return;
+      }
+      owner_.store(0, boost::memory_order_relaxed);
+    }
+    // Only the owner may look at hold_, so it has to be taken first
+    ContentionProfiler::Hold* hold = hold_;
+    hold_ = NULL;
+    if (state_.exchange(UNLOCKED, boost::memory_order_release) == CONTENDED) {
+      futexWake(state_, 1);
+    }
+    if (hold) {
+      ContentionProfiler::released(hold);
+    }
+  }
+
+  /**
+   * lock() and timedlock(), sampling the wait for and the hold of the lock
+   * while contention profiling is on.
+   */
+  void profiledLock(const void* id, const char* name) const {
+    if (ContentionProfiler::sampleWait()) {
+      int64_t micros = 0;
+      if (!trylock()) {
+        int64_t start = Util::currentTimeUsec();
+        lock();
+        micros = Util::currentTimeUsec() - start;
+      }
+      ContentionProfiler::waited(id, name, micros);
+    } else {
+      lock();
+    }
+    startHold(name);
+  }
+
+  bool profiledTimedlock(const void* id, const char* name, int64_t milliseconds) const {
+    bool locked;
+    if (ContentionProfiler::sampleWait()) {
+      int64_t micros = 0;
+      locked = trylock();
+      if (!locked) {
+        int64_t start = Util::currentTimeUsec();
+        locked = timedlock(milliseconds);
+        micros = Util::currentTimeUsec() - start;
+      }
+      ContentionProfiler::waited(id, name, micros);
+    } else {
+      locked = timedlock(milliseconds);
+    }
+    if (locked) {
+      startHold(name);
+    }
+    return locked;
+  }
+
+  /**
+   * Samples the hold of the lock just acquired.  A recursive mutex keeps the
+   * sample of its outermost lock.
+   */
+  void startHold(const char* name) const {
+    if (hold_ == NULL && ContentionProfiler::sampleHold()) {
+      hold_ = ContentionProfiler::holding(name);
+    }
+  }
+
+  void endHold() const {
+    if (hold_) {
+      ContentionProfiler::released(hold_);
+      hold_ = NULL;
+    }
+  }
+
+  void* getUnderlyingImpl() const { return &state_; }
+
+private:
+  bool acquire() const {
+    int32_t unlocked = UNLOCKED;
+    return state_.compare_exchange_strong(unlocked,
+                                          LOCKED,
+                                          boost::memory_order_acquire,
+                                          boost::memory_order_relaxed);
+  }
+
+  /**
+   * Spins, then sleeps until the lock is acquired, or until the deadline if
+   * there is one.
+   */
+  bool acquireSlow(const struct timespec* deadline) const {
+    // A lock others already sleep on will not be free soon enough to spin for
+    int32_t spins = spins_.load(boost::memory_order_relaxed);
+    int32_t limit = std::min(maxSpins(), spins * 2 + 10);
+    int32_t n = 0;
+    for (; n < limit; ++n) {
+      cpuRelax();
+      int32_t state = state_.load(boost::memory_order_relaxed);
+      if (state == CONTENDED) {
+        break;
+      }
+      if (state == UNLOCKED && acquire()) {
+        spins_.store(spins + (n - spins) / 8, boost::memory_order_relaxed);
+        return true;
+      }
+    }
+    spins_.store(spins + (n - spins) / 8, boost::memory_order_relaxed);
+
+    // Once a thread has slept, the lock stays CONTENDED until it is
+    // released, as others may still sleep on it
+    int32_t state = state_.exchange(CONTENDED, boost::memory_order_acquire);
+    while (state != UNLOCKED) {
+      if (futexWait(state_, CONTENDED, deadline) == ETIMEDOUT) {
+        return false;
+      }
+      state = state_.exchange(CONTENDED, boost::memory_order_acquire);
+    }
+    return true;
+  }
+
+  /**
+   * Whether the calling thread holds the mutex already, which only an
+   * ERRORCHECK or RECURSIVE mutex keeps track of.
+   */
+  bool ownedHere() const {
+    return owner_.load(boost::memory_order_relaxed) == static_cast<unsigned long>(pthread_self());
+  }
+
+  /**
+   * Relocks a mutex the calling thread holds: counts the lock of a
+   * RECURSIVE one, and fails with EDEADLK on an ERRORCHECK one.
+   */
+  bool reenter(const char* call) const {
+    if (kind_ == NORMAL || !ownedHere()) {
+      return false;
+    }
+    if (kind_ == ERRORCHECK) {
+      throwSre(call, EDEADLK);
+    }
+    ++count_;
+    return true;
+  }
+
+  void setOwner() const {
+    if (kind_ != NORMAL) {
+      owner_.store(static_cast<unsigned long>(pthread_self()), boost::memory_order_relaxed);
+    }
+  }
+
+  mutable FutexWord state_;
+  mutable boost::atomic<int32_t> spins_;
+  int kind_;
+  // The thread that holds an ERRORCHECK or RECURSIVE mutex, and how many
+  // more times it has locked a RECURSIVE one
+  mutable boost::atomic<unsigned long> owner_;
+  mutable int32_t count_;
+  mutable ContentionProfiler::Hold* hold_;
+};
+
+Mutex::Mutex(Initializer init) : impl_(new Mutex::impl(init)), name_(NULL) {
+}
+
+void* Mutex::getUnderlyingImpl() const {
+  return impl_->getUnderlyingImpl();
+}
+
+void Mutex::lock() const {
+  if (PROFILE_MUTEX_ACTIVE()) {
+    impl_->profiledLock(this, name_);
+  } else {
+    impl_->lock();
+  }
+}
+
+bool Mutex::trylock() const {
+  bool locked = impl_->trylock();
+  if (locked && PROFILE_MUTEX_ACTIVE()) {
+    impl_->startHold(name_);
+  }
+  return locked;
+}
+
+bool Mutex::timedlock(int64_t ms) const {
+  if (PROFILE_MUTEX_ACTIVE()) {
+    return impl_->profiledTimedlock(this, name_, ms);
+  }
+  return impl_->timedlock(ms);
+}
+
+void Mutex::unlock() const {
+  impl_->unlock();
+}
+
+void Mutex::endHold() const {
+  impl_->endHold();
+}
+
+// The initializers get the kind of the mutex to set; every kind spins
+// adaptively, so ADAPTIVE is the default one
+
+void Mutex::DEFAULT_INITIALIZER(void* arg) {
+  *static_cast<int*>(arg) = NORMAL;
+}
+
+void Mutex::ADAPTIVE_INITIALIZER(void* arg) {
+  *static_cast<int*>(arg) = NORMAL;
+}
+
+void Mutex::ERRORCHECK_INITIALIZER(void* arg) {
+  *static_cast<int*>(arg) = ERRORCHECK;
+}
+
+void Mutex::RECURSIVE_INITIALIZER(void* arg) {
+  *static_cast<int*>(arg) = RECURSIVE;
+}
+
+/**
+ * Implementation of ReadWriteMutex class on a Linux futex
+ *
+ * state_ counts the readers, or is WRITER.  Threads that cannot take the
+ * lock sleep on wakeups_, which a release bumps when it may let them in;
+ * they all wake up and try again, as a pthread rwlock prefers no one either.
+ * A release takes the count of sleepers with it, so that the next ones do
+ * not wake anyone again before those have run.
+ */
+class ReadWriteMutex::impl {
+public:
+  static const int32_t WRITER = -1;
+
+  impl() : state_(0), wakeups_(0), sleepers_(0), hold_(NULL) {}
+
+  void acquireRead() const {
+    if (!attemptRead()) {
+      acquireSlow(false);
+    }
+  }
+
+  void acquireWrite() const {
+    if (!attemptWrite()) {
+      acquireSlow(true);
+    }
+  }
+
+  bool attemptRead() const {
+    int32_t state = state_.load();
+    while (state != WRITER) {
+      if (state_.compare_exchange_weak(state, state + 1)) {
+        return true;
+      }
+    }
+    return false;
+  }
+
+  bool attemptWrite() const {
+    int32_t unlocked = 0;
+    return state_.compare_exchange_strong(unlocked, WRITER);
+  }
+
+  void release() const {
+    // Only a writer sets hold_, and readers leave it alone
+    ContentionProfiler::Hold* hold = hold_;
+    int32_t state = state_.load();
+    if (state == 0) {
+      throwSre("release()", EPERM);
+    }
+    bool unlocked;
+    if (state == WRITER) {
+      hold_ = NULL;
+      state_.store(0);
+      unlocked = true;
+    } else {
+      unlocked = (state_.fetch_sub(1) == 1);
+    }
+    // Only a writer can be waiting while readers hold the lock
+    if (unlocked && sleepers_.load() > 0 && sleepers_.exchange(0) > 0) {
+      wakeups_.fetch_add(1);
+      futexWake(wakeups_);
+    }
+    if (hold) {
+      ContentionProfiler::released(hold);
+    }
+  }
+
+  /**
+   * acquireRead() and acquireWrite(), sampling the wait for the lock, and the
+   * hold of a write lock, while contention profiling is on.
+   */
+  void profiledAcquire(const void* id, const char* name, bool write) const {
+    if (ContentionProfiler::sampleWait()) {
+      int64_t micros = 0;
+      if (!(write ? attemptWrite() : attemptRead())) {
+        int64_t start = Util::currentTimeUsec();
+        write ? acquireWrite() : acquireRead();
+        micros = Util::currentTimeUsec() - start;
+      }
+      ContentionProfiler::waited(id, name, micros);
+    } else {
+      write ? acquireWrite() : acquireRead();
+    }
+    if (write) {
+      startHold(name);
+    }
+  }
+
+  void startHold(const char* name) const {
+    if (ContentionProfiler::sampleHold()) {
+      hold_ = ContentionProfiler::holding(name);
+    }
+  }
+
+private:
+  void acquireSlow(bool write) const {
+    for (int32_t n = 0, limit = maxSpins(); n < limit; ++n) {
+      cpuRelax();
+      if (write ? attemptWrite() : attemptRead()) {
+        return;
+      }
+    }
+
+    // A release after the attempt below sees the sleeper, and bumps
+    // wakeups_ before the wait can sleep.  One that is woken up counts
+    // itself again if it has to go back to sleep.
+    for (;;) {
+      int32_t wakeups = wakeups_.load();
+      sleepers_.fetch_add(1);
+      if (write ? attemptWrite() : attemptRead()) {
+        return;
+      }
+      futexWait(wakeups_, wakeups);
+    }
+  }
+
+  mutable FutexWord state_;
+  mutable FutexWord wakeups_;
+  mutable boost::atomic<int32_t> sleepers_;
+  mutable ContentionProfiler::Hold* hold_;
+};
+
+ReadWriteMutex::ReadWriteMutex() : impl_(new ReadWriteMutex::impl()), name_(NULL) {
+}
+
+void ReadWriteMutex::acquireRead() const {
+  if (PROFILE_MUTEX_ACTIVE()) {
+    impl_->profiledAcquire(this, name_, false);
+  } else {
+    impl_->acquireRead();
+  }
+}
+
+void ReadWriteMutex::acquireWrite() const {
+  if (PROFILE_MUTEX_ACTIVE()) {
+    impl_->profiledAcquire(this, name_, true);
+  } else {
+    impl_->acquireWrite();
+  }
+}
+
+bool ReadWriteMutex::attemptRead() const {
+  return impl_->attemptRead();
+}
+
+bool ReadWriteMutex::attemptWrite() const {
+  bool locked = impl_->attemptWrite();
+  if (locked && PROFILE_MUTEX_ACTIVE()) {
+    impl_->startHold(name_);
+  }
+  return locked;
+}
+
+void ReadWriteMutex::release() const {
+  impl_->release();
+}
+
+NoStarveReadWriteMutex::NoStarveReadWriteMutex() : writerWaiting_(false) {
+}
+
+void NoStarveReadWriteMutex::acquireRead() const {
+  if (writerWaiting_) {
+    // writer is waiting, block on the writer's mutex until he's done with it
+    mutex_.lock();
+    mutex_.unlock();
+  }
+
+  ReadWriteMutex::acquireRead();
+}
+
+void NoStarveReadWriteMutex::acquireWrite() const {
+  // if we can acquire the rwlock the easy way, we're done
+  if (attemptWrite()) {
+    return;
+  }
+
+  // failed to get the rwlock, do it the hard way:
+  // locking the mutex and setting writerWaiting will cause all new readers to
+  // block on the mutex rather than on the rwlock.
+  mutex_.lock();
+  writerWaiting_ = true;
+  ReadWriteMutex::acquireWrite();
+  writerWaiting_ = false;
+  mutex_.unlock();
+}
+}
+}
+} // apache::thrift::concurrency
@@ -106,6 +106,7 @@ public:
     assert(mutexImpl);
 
     // XXX Need to assert that caller owns mutex
+    mutex_->endHold();
     return pthread_cond_timedwait(&pthread_cond_, mutexImpl, abstime);
   }
 
@@ -123,6 +124,7 @@ public:
     assert(mutex_);
     pthread_mutex_t* mutexImpl = reinterpret_cast<pthread_mutex_t*>(mutex_->getUnderlyingImpl());
     assert(mutexImpl);
+    mutex_->endHold();
     return pthread_cond_wait(&pthread_cond_, mutexImpl);
   }
 
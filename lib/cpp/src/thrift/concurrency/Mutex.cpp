@@ -23,6 +23,7 @@
 #include <thrift/thrift-config.h>
 
 #include <thrift/Thrift.h>
+#include <thrift/concurrency/ContentionProfiler.h>
 #include <thrift/concurrency/Exception.h>
 #include <thrift/concurrency/Mutex.h>
 #include <thrift/concurrency/Util.h>
@@ -30,7 +31,6 @@
 #include <assert.h>
 #include <stdlib.h>
 #include <pthread.h>
-#include <signal.h>
 #include <string.h>
 
 #include <boost/format.hpp>
@@ -39,80 +39,11 @@ namespace apache {
 namespace thrift {
 namespace concurrency {
 
-// Enable this to turn on mutex contention profiling support
-// #define THRIFT_PTHREAD_MUTEX_CONTENTION_PROFILING
-
-#ifdef THRIFT_PTHREAD_MUTEX_CONTENTION_PROFILING
-
-static int32_t mutexProfilingCounter = 0;
-static int32_t mutexProfilingSampleRate = 0;
-static MutexWaitCallback mutexProfilingCallback = 0;
-
-void enableMutexProfiling(int32_t profilingSampleRate, MutexWaitCallback callback) {
-  mutexProfilingSampleRate = profilingSampleRate;
-  mutexProfilingCallback = callback;
-}
-
-#define PROFILE_MUTEX_START_LOCK() int64_t _lock_startTime = maybeGetProfilingStartTime();
-
-#define PROFILE_MUTEX_NOT_LOCKED()                                                                 \
-  do {                                                                                             \
-    if (_lock_startTime > 0) {                                                                     \
-      int64_t endTime = Util::currentTimeUsec();                                                   \
-      (*mutexProfilingCallback)(this, endTime - _lock_startTime);                                  \
-    }                                                                                              \
-  } while (0)
-
-#define PROFILE_MUTEX_LOCKED()                                                                     \
-  do {                                                                                             \
-    profileTime_ = _lock_startTime;                                                                \
-    if (profileTime_ > 0) {                                                                        \
-      profileTime_ = Util::currentTimeUsec() - profileTime_;                                       \
-    }                                                                                              \
-  } while (0)
-
-#define PROFILE_MUTEX_START_UNLOCK()                                                               \
-  int64_t _temp_profileTime = profileTime_;                                                        \
-  profileTime_ = 0;
-
-#define PROFILE_MUTEX_UNLOCKED()                                                                   \
-  do {                                                                                             \
-    if (_temp_profileTime > 0) {                                                                   \
-      (*mutexProfilingCallback)(this, _temp_profileTime);                                          \
-    }                                                                                              \
-  } while (0)
-
-static inline int64_t maybeGetProfilingStartTime() {
-  if (mutexProfilingSampleRate && mutexProfilingCallback) {
-    // This block is unsynchronized, but should produce a reasonable sampling
-    // rate on most architectures.  The main race conditions are the gap
-    // between the decrement and the test, the non-atomicity of decrement, and
-    // potential caching of different values at different CPUs.
-    //
-    // - if two decrements race, the likeliest result is that the counter
-    //      decrements slowly (perhaps much more slowly) than intended.
-    //
-    // - many threads could potentially decrement before resetting the counter
-    //      to its large value, causing each additional incoming thread to
-    //      profile every call.  This situation is unlikely to persist for long
-    //      as the critical gap is quite short, but profiling could be bursty.
-    sig_atomic_t localValue = --mutexProfilingCounter;
-    if (localValue <= 0) {
-      mutexProfilingCounter = mutexProfilingSampleRate;
-      return Util::currentTimeUsec();
-    }
-  }
-
-  return 0;
-}
-
+#ifndef THRIFT_NO_CONTENTION_PROFILING
+#define PROFILE_MUTEX_ACTIVE() ContentionProfiler::active()
 #else
-#define PROFILE_MUTEX_START_LOCK()
-#define PROFILE_MUTEX_NOT_LOCKED()
-#define PROFILE_MUTEX_LOCKED()
-#define PROFILE_MUTEX_START_UNLOCK()
-#define PROFILE_MUTEX_UNLOCKED()
-#endif // THRIFT_PTHREAD_MUTEX_CONTENTION_PROFILING
+#define PROFILE_MUTEX_ACTIVE() false
+#endif
 
 #define EINTR_LOOP(_CALL)          int ret; do { ret = _CALL; } while (ret == EINTR)
 #define ABORT_ONFAIL(_CALL)      { EINTR_LOOP(_CALL); if (ret) { abort(); } }
@@ -129,10 +60,7 @@ static inline int64_t maybeGetProfilingStartTime() {
  */
 class Mutex::impl {
 public:
-  impl(Initializer init) : initialized_(false) {
-#ifdef THRIFT_PTHREAD_MUTEX_CONTENTION_PROFILING
-    profileTime_ = 0;
-#endif
+  impl(Initializer init) : initialized_(false), depth_(0), hold_(NULL) {
     init(&pthread_mutex_);
     initialized_ = true;
   }
@@ -145,27 +73,30 @@ public:
   }
 
   void lock() const {
-    PROFILE_MUTEX_START_LOCK();
     THROW_SRE_ONFAIL(pthread_mutex_lock(&pthread_mutex_));
-    PROFILE_MUTEX_LOCKED();
+    ++depth_;
   }
 
   bool trylock() const {
-    THROW_SRE_TRYFAIL(pthread_mutex_trylock(&pthread_mutex_));
+    EINTR_LOOP(pthread_mutex_trylock(&pthread_mutex_));
+    if (ret == 0) {
+      ++depth_;
+      return true;
+    } else if (ret == EBUSY) {
+      return false;
+    }
+    THROW_SRE("pthread_mutex_trylock(&pthread_mutex_)", ret);
   }
 
   bool timedlock(int64_t milliseconds) const {
 #if defined(_POSIX_TIMEOUTS) && _POSIX_TIMEOUTS >= 200112L
-    PROFILE_MUTEX_START_LOCK();
-
     struct THRIFT_TIMESPEC ts;
     Util::toTimespec(ts, milliseconds + Util::currentTime());
     EINTR_LOOP(pthread_mutex_timedlock(&pthread_mutex_, &ts));
     if (ret == 0) {
-      PROFILE_MUTEX_LOCKED();
+      ++depth_;
       return true;
     } else if (ret == ETIMEDOUT) {
-      PROFILE_MUTEX_NOT_LOCKED();
       return false;
     }
 
@@ -193,9 +124,79 @@ public:
   }
 
   void unlock() const {
-    PROFILE_MUTEX_START_UNLOCK();
-    THROW_SRE_ONFAIL(pthread_mutex_unlock(&pthread_mutex_));
-    PROFILE_MUTEX_UNLOCKED();
+    // Only the owner may look at depth_ and hold_, so they have to be taken
+    // first; only the outermost unlock of a recursive mutex ends the hold
+    ContentionProfiler::Hold* hold = NULL;
+    if (--depth_ == 0) {
+      hold = hold_;
+      hold_ = NULL;
+    }
+    int ret = pthread_mutex_unlock(&pthread_mutex_);
+    if (ret) {
+      if (depth_++ == 0) {
+        hold_ = hold;
+      }
+      THROW_SRE("pthread_mutex_unlock(&pthread_mutex_)", ret);
+    }
+    if (hold) {
+      ContentionProfiler::released(hold);
+    }
+  }
+
+  /**
+   * lock() and timedlock(), sampling the wait for and the hold of the lock
+   * while contention profiling is on.
+   */
+  void profiledLock(const void* id, const char* name) const {
+    if (ContentionProfiler::sampleWait()) {
+      int64_t micros = 0;
+      if (!trylock()) {
+        int64_t start = Util::currentTimeUsec();
+        lock();
+        micros = Util::currentTimeUsec() - start;
+      }
+      ContentionProfiler::waited(id, name, micros);
+    } else {
+      lock();
+    }
+    startHold(name);
+  }
+
+  bool profiledTimedlock(const void* id, const char* name, int64_t milliseconds) const {
+    bool locked;
+    if (ContentionProfiler::sampleWait()) {
+      int64_t micros = 0;
+      locked = trylock();
+      if (!locked) {
+        int64_t start = Util::currentTimeUsec();
+        locked = timedlock(milliseconds);
+        micros = Util::currentTimeUsec() - start;
+      }
+      ContentionProfiler::waited(id, name, micros);
+    } else {
+      locked = timedlock(milliseconds);
+    }
+    if (locked) {
+      startHold(name);
+    }
+    return locked;
+  }
+
+  /**
+   * Samples the hold of the lock just acquired.  A recursive mutex keeps the
+   * sample of its outermost lock.
+   */
+  void startHold(const char* name) const {
+    if (hold_ == NULL && ContentionProfiler::sampleHold()) {
+      hold_ = ContentionProfiler::holding(name);
+    }
+  }
+
+  void endHold() const {
+    if (hold_) {
+      ContentionProfiler::released(hold_);
+      hold_ = NULL;
+    }
   }
 
   void* getUnderlyingImpl() const { return (void*)&pthread_mutex_; }
@@ -203,12 +204,12 @@ public:
 private:
   mutable pthread_mutex_t pthread_mutex_;
   mutable bool initialized_;
-#ifdef THRIFT_PTHREAD_MUTEX_CONTENTION_PROFILING
-  mutable int64_t profileTime_;
-#endif
+  // How many times the owner holds the lock, more than once if recursive
+  mutable int32_t depth_;
+  mutable ContentionProfiler::Hold* hold_;
 };
 
-Mutex::Mutex(Initializer init) : impl_(new Mutex::impl(init)) {
+Mutex::Mutex(Initializer init) : impl_(new Mutex::impl(init)), name_(NULL) {
 }
 
 void* Mutex::getUnderlyingImpl() const {
@@ -216,14 +217,25 @@ void* Mutex::getUnderlyingImpl() const {
 }
 
 void Mutex::lock() const {
-  impl_->lock();
+  if (PROFILE_MUTEX_ACTIVE()) {
+    impl_->profiledLock(this, name_);
+  } else {
+    impl_->lock();
+  }
 }
 
 bool Mutex::trylock() const {
-  return impl_->trylock();
+  bool locked = impl_->trylock();
+  if (locked && PROFILE_MUTEX_ACTIVE()) {
+    impl_->startHold(name_);
+  }
+  return locked;
 }
 
 bool Mutex::timedlock(int64_t ms) const {
+  if (PROFILE_MUTEX_ACTIVE()) {
+    return impl_->profiledTimedlock(this, name_, ms);
+  }
   return impl_->timedlock(ms);
 }
 
@@ -231,6 +243,10 @@ void Mutex::unlock() const {
   impl_->unlock();
 }
 
+void Mutex::endHold() const {
+  impl_->endHold();
+}
+
 void Mutex::DEFAULT_INITIALIZER(void* arg) {
   pthread_mutex_t* pthread_mutex = (pthread_mutex_t*)arg;
   THROW_SRE_ONFAIL(pthread_mutex_init(pthread_mutex, NULL));
@@ -279,10 +295,7 @@ void Mutex::RECURSIVE_INITIALIZER(void* arg) {
  */
 class ReadWriteMutex::impl {
 public:
-  impl() : initialized_(false) {
-#ifdef THRIFT_PTHREAD_MUTEX_CONTENTION_PROFILING
-    profileTime_ = 0;
-#endif
+  impl() : initialized_(false), hold_(NULL) {
     THROW_SRE_ONFAIL(pthread_rwlock_init(&rw_lock_, NULL));
     initialized_ = true;
   }
@@ -294,45 +307,80 @@ public:
     }
   }
 
-  void acquireRead() const {
-    PROFILE_MUTEX_START_LOCK();
-    THROW_SRE_ONFAIL(pthread_rwlock_rdlock(&rw_lock_));
-    PROFILE_MUTEX_NOT_LOCKED(); // not exclusive, so use not-locked path
-  }
+  void acquireRead() const { THROW_SRE_ONFAIL(pthread_rwlock_rdlock(&rw_lock_)); }
 
-  void acquireWrite() const {
-    PROFILE_MUTEX_START_LOCK();
-    THROW_SRE_ONFAIL(pthread_rwlock_wrlock(&rw_lock_));
-    PROFILE_MUTEX_LOCKED();
-  }
+  void acquireWrite() const { THROW_SRE_ONFAIL(pthread_rwlock_wrlock(&rw_lock_)); }
 
   bool attemptRead() const { THROW_SRE_TRYFAIL(pthread_rwlock_tryrdlock(&rw_lock_)); }
 
   bool attemptWrite() const { THROW_SRE_TRYFAIL(pthread_rwlock_trywrlock(&rw_lock_)); }
 
   void release() const {
-    PROFILE_MUTEX_START_UNLOCK();
-    THROW_SRE_ONFAIL(pthread_rwlock_unlock(&rw_lock_));
-    PROFILE_MUTEX_UNLOCKED();
+    // Only a writer sets hold_, and readers leave it alone
+    ContentionProfiler::Hold* hold = hold_;
+    if (hold) {
+      hold_ = NULL;
+    }
+    int ret = pthread_rwlock_unlock(&rw_lock_);
+    if (ret) {
+      hold_ = hold;
+      THROW_SRE("pthread_rwlock_unlock(&rw_lock_)", ret);
+    }
+    if (hold) {
+      ContentionProfiler::released(hold);
+    }
+  }
+
+  /**
+   * acquireRead() and acquireWrite(), sampling the wait for the lock, and the
+   * hold of a write lock, while contention profiling is on.
+   */
+  void profiledAcquire(const void* id, const char* name, bool write) const {
+    if (ContentionProfiler::sampleWait()) {
+      int64_t micros = 0;
+      if (!(write ? attemptWrite() : attemptRead())) {
+        int64_t start = Util::currentTimeUsec();
+        write ? acquireWrite() : acquireRead();
+        micros = Util::currentTimeUsec() - start;
+      }
+      ContentionProfiler::waited(id, name, micros);
+    } else {
+      write ? acquireWrite() : acquireRead();
+    }
+    if (write) {
+      startHold(name);
+    }
+  }
+
+  void startHold(const char* name) const {
+    if (ContentionProfiler::sampleHold()) {
+      hold_ = ContentionProfiler::holding(name);
+    }
   }
 
 private:
   mutable pthread_rwlock_t rw_lock_;
   mutable bool initialized_;
-#ifdef THRIFT_PTHREAD_MUTEX_CONTENTION_PROFILING
-  mutable int64_t profileTime_;
-#endif
+  mutable ContentionProfiler::Hold* hold_;
 };
 
-ReadWriteMutex::ReadWriteMutex() : impl_(new ReadWriteMutex::impl()) {
+ReadWriteMutex::ReadWriteMutex() : impl_(new ReadWriteMutex::impl()), name_(NULL) {
 }
 
 void ReadWriteMutex::acquireRead() const {
-  impl_->acquireRead();
+  if (PROFILE_MUTEX_ACTIVE()) {
+    impl_->profiledAcquire(this, name_, false);
+  } else {
+    impl_->acquireRead();
+  }
 }
 
 void ReadWriteMutex::acquireWrite() const {
-  impl_->acquireWrite();
+  if (PROFILE_MUTEX_ACTIVE()) {
+    impl_->profiledAcquire(this, name_, true);
+  } else {
+    impl_->acquireWrite();
+  }
 }
 
 bool ReadWriteMutex::attemptRead() const {
@@ -340,7 +388,11 @@ bool ReadWriteMutex::attemptRead() const {
 }
 
 bool ReadWriteMutex::attemptWrite() const {
-  return impl_->attemptWrite();
+  bool locked = impl_->attemptWrite();
+  if (locked && PROFILE_MUTEX_ACTIVE()) {
+    impl_->startHold(name_);
+  }
+  return locked;
 }
 
 void ReadWriteMutex::release() const {
@@ -40,7 +40,9 @@ namespace concurrency {
  *
  * The callback will get called with the wait time taken to lock the mutex in
  * usec and a (void*) that uniquely identifies the Mutex (or ReadWriteMutex)
- * being locked.
+ * being locked, right after it is locked.  The sample rate is the wait
+ * sample rate of enableContentionProfiling(), which profiles the waits by
+ * call site; see ContentionProfiler.h.
  *
  * The enableMutexProfiling() function is unsynchronized; calling this function
  * while profiling is already enabled may result in race conditions.  On
@@ -77,16 +79,31 @@ public:
 
   void* getUnderlyingImpl() const;
 
+  /**
+   * Names the mutex in contention profiles.  The name is not copied: it must
+   * outlive the mutex, as a string literal does.
+   */
+  void setName(const char* name) { name_ = name; }
+  const char* getName() const { return name_; }
+
   // If you attempt to use one of these and it fails to link, it means
   // your version of pthreads does not support it - try another one.
+  // The futex implementation (WITH_FUTEX) has them all, and no other
+  // initializer applies to it: they do not get a pthread_mutex_t there.
   static void ADAPTIVE_INITIALIZER(void*);
   static void DEFAULT_INITIALIZER(void*);
   static void ERRORCHECK_INITIALIZER(void*);
   static void RECURSIVE_INITIALIZER(void*);
 
 private:
+  friend class Monitor;
+
+  // Monitor waits release the mutex without unlock(), which ends its hold
+  void endHold() const;
+
   class impl;
   stdcxx::shared_ptr<impl> impl_;
+  const char* name_;
 };
 
 class ReadWriteMutex {
@@ -105,9 +122,16 @@ public:
   // this releases both read and write locks
   virtual void release() const;
 
+  /**
+   * Names the mutex in contention profiles, as Mutex::setName() does.
+   */
+  void setName(const char* name) { name_ = name; }
+  const char* getName() const { return name_; }
+
 private:
   class impl;
   stdcxx::shared_ptr<impl> impl_;
+  const char* name_;
 };
 
 /**
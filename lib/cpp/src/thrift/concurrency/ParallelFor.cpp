@@ -0,0 +1,168 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/concurrency/ParallelFor.h>
+#include <thrift/concurrency/Exception.h>
+#include <thrift/concurrency/Monitor.h>
+
+#include <algorithm>
+#include <exception>
+#include <string>
+#include <vector>
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+using stdcxx::shared_ptr;
+
+namespace {
+
+/**
+ * The chunks of one parallelFor() call, shared by the calling thread and the
+ * helpers, which may outlive the call if they only run after it returned
+ */
+class Chunks {
+public:
+  Chunks(size_t begin, size_t end, const stdcxx::function<void(size_t)>& body, size_t grain)
+    : end_(end),
+      body_(body),
+      grain_(grain),
+      next_(begin),
+      running_(0),
+      failed_(false) {}
+
+  /**
+   * Runs chunks until there are none left to start
+   */
+  void work() {
+    for (;;) {
+      size_t first;
+      size_t last;
+      {
+        Synchronized s(monitor_);
+        if (next_ == end_ || failed_) {
+          return;
+        }
+        first = next_;
+        next_ += std::min(grain_, end_ - next_);
+        last = next_;
+        ++running_;
+      }
+
+      std::string failure;
+      bool failed = false;
+      try {
+        for (size_t i = first; i < last; ++i) {
+          body_(i);
+        }
+      } catch (const std::exception& e) {
+        failure = e.what();
+        failed = true;
+      } catch (...) {
+        failure = "parallelFor: unknown exception";
+        failed = true;
+      }
+
+      Synchronized s(monitor_);
+      if (failed && !failed_) {
+        failure_ = failure;
+        failed_ = true;
+      }
+      if (--running_ == 0) {
+        monitor_.notifyAll();
+      }
+    }
+  }
+
+  /**
+   * Waits for the chunks others started, once there are none left to start
+   */
+  void join() {
+    Synchronized s(monitor_);
+    while (running_ > 0) {
+      monitor_.wait();
+    }
+    if (failed_) {
+      throw TException(failure_);
+    }
+  }
+
+private:
+  const size_t end_;
+  const stdcxx::function<void(size_t)> body_;
+  const size_t grain_;
+
+  Monitor monitor_;
+  size_t next_;
+  size_t running_;
+  bool failed_;
+  std::string failure_;
+};
+
+class Helper : public Runnable {
+public:
+  Helper(shared_ptr<Chunks> chunks) : chunks_(chunks) {}
+
+  void run() { chunks_->work(); }
+
+private:
+  shared_ptr<Chunks> chunks_;
+};
+}
+
+void parallelFor(ThreadManager& threadManager,
+                 size_t begin,
+                 size_t end,
+                 const stdcxx::function<void(size_t)>& body,
+                 size_t grain) {
+  if (grain == 0) {
+    throw InvalidArgumentException();
+  }
+  if (end <= begin) {
+    return;
+  }
+
+  shared_ptr<Chunks> chunks(new Chunks(begin, end, body, grain));
+
+  // The calling thread takes one chunk, the helpers the others
+  const size_t count = (end - begin - 1) / grain + 1;
+  const size_t helpers = std::min(count - 1, threadManager.workerCount());
+  if (helpers > 0) {
+    std::vector<shared_ptr<Runnable> > tasks;
+    tasks.reserve(helpers);
+    for (size_t i = 0; i < helpers; ++i) {
+      tasks.push_back(shared_ptr<Runnable>(new Helper(chunks)));
+    }
+    try {
+      threadManager.addBatch(tasks);
+    } catch (const TooManyPendingTasksException&) {
+      // A worker cannot wait for room; the helpers that found some help, and
+      // the calling thread does the rest
+    }
+  }
+
+  chunks->work();
+  chunks->join();
+}
+}
+}
+} // apache::thrift::concurrency
@@ -0,0 +1,61 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_CONCURRENCY_PARALLELFOR_H_
+#define _THRIFT_CONCURRENCY_PARALLELFOR_H_ 1
+
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/stdcxx.h>
+
+namespace apache {
+namespace thrift {
+namespace concurrency {
+
+/**
+ * Calls body(i) for each i in [begin, end), on the workers of threadManager
+ * and on the calling thread, and returns once all calls are done.
+ *
+ * The range is cut into chunks of grain indices, which the calling thread
+ * and helper tasks take in turn.  The helpers, at most one per worker, are
+ * added with a single ThreadManager::addBatch(), which waits for room as
+ * add() does.  The calling thread works through the chunks itself as well,
+ * so that all get done even when the workers are busy, or when the calling
+ * thread is one of the workers (which adds only the helpers there is room
+ * for).
+ *
+ * If body throws, the chunks nobody has started are skipped, and once the
+ * started ones are done parallelFor throws a TException with the message of
+ * the first exception.
+ *
+ *   parallelFor(*threadManager, 0, backends.size(),
+ *               stdcxx::bind(&Gatherer::query, &gatherer, stdcxx::placeholders::_1));
+ *
+ * @throws InvalidArgumentException if grain is 0
+ * @throws IllegalStateException if threadManager is not started
+ */
+void parallelFor(ThreadManager& threadManager,
+                 size_t begin,
+                 size_t end,
+                 const stdcxx::function<void(size_t)>& body,
+                 size_t grain = 1);
+}
+}
+} // apache::thrift::concurrency
+
+#endif // #ifndef _THRIFT_CONCURRENCY_PARALLELFOR_H_
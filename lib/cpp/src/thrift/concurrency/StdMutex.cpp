@@ -39,7 +39,7 @@ namespace concurrency {
  */
 class Mutex::impl : public std::timed_mutex {};
 
-Mutex::Mutex(Initializer init) : impl_(new Mutex::impl()) {
+Mutex::Mutex(Initializer init) : impl_(new Mutex::impl()), name_(NULL) {
   ((void)init);
 }
 
@@ -149,7 +149,7 @@ public:
   /**
    * Sets the detached disposition of newly created threads.
    */
-  void setDetached(bool detached) { detached_ = detached; }
+  virtual void setDetached(bool detached) { detached_ = detached; }
 
   /**
    * Create a new thread.
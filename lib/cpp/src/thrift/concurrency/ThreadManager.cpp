@@ -26,8 +26,9 @@
 
 #include <thrift/stdcxx.h>
 
+#include <algorithm>
 #include <stdexcept>
-#include <deque>
+#include <map>
 #include <set>
 
 namespace apache {
@@ -37,6 +38,308 @@ namespace concurrency {
 using stdcxx::shared_ptr;
 using stdcxx::dynamic_pointer_cast;
 
+/**
+ * A task and how it is scheduled.  Tasks are not reference counted: the
+ * TaskQueue owns them, lends the one it pops to the worker that runs it, and
+ * takes it back afterwards to reuse it, so that adding a task does not
+ * allocate once the queue has held as many at once before.
+ */
+class ThreadManager::Task {
+
+public:
+  enum STATE { WAITING, EXECUTING, TIMEDOUT, COMPLETE };
+
+  Task() : state_(WAITING), expireTime_(0LL), next_(NULL) {}
+
+  void run() {
+    if (state_ == EXECUTING) {
+      runnable_->run();
+      state_ = COMPLETE;
+    }
+  }
+
+  const shared_ptr<Runnable>& getRunnable() const { return runnable_; }
+
+  int64_t getExpireTime() const { return expireTime_; }
+
+  const TaskClass& getTaskClass() const { return taskClass_; }
+
+private:
+  shared_ptr<Runnable> runnable_;
+  friend class ThreadManager::Worker;
+  friend class ThreadManager::TaskQueue;
+  STATE state_;
+  int64_t expireTime_;
+  TaskClass taskClass_;
+  // The next task of its flow, or of the free list
+  Task* next_;
+};
+
+/**
+ * The pending tasks, in one lane per priority.  Within a lane each key has
+ * its own FIFO, and the keys with pending tasks take turns in deficit round
+ * robin order: a key's turn grants it the quantum, and it keeps running
+ * tasks until the next one costs more than it has left.  With a single key,
+ * as when tasks are added without a TaskClass, a lane is a plain FIFO.
+ *
+ * The FIFOs and the turn order are lists linked through the tasks and the
+ * flows themselves.  Tasks that are done go to a free list, and flows whose
+ * last task is done stay in their lane for their key's next task, up to
+ * MAX_IDLE_FLOWS, so that a steady flow of tasks does not allocate.
+ *
+ * Not synchronized; the manager only uses it under its mutex.
+ */
+class ThreadManager::TaskQueue {
+
+public:
+  TaskQueue() : size_(0), quantum_(1), free_(NULL), freeCount_(0) {}
+
+  ~TaskQueue() {
+    for (int priority = 0; priority < N_PRIORITIES; ++priority) {
+      for (Flow* flow = lanes_[priority].first; flow != NULL; flow = flow->next) {
+        deleteAll(flow->first);
+      }
+    }
+    deleteAll(free_);
+  }
+
+  bool empty() const { return size_ == 0; }
+
+  size_t size() const { return size_; }
+
+  size_t size(PRIORITY lane) const { return lanes_[lane].size; }
+
+  uint32_t quantum() const { return quantum_; }
+
+  void quantum(uint32_t value) { quantum_ = value > 0 ? value : 1; }
+
+  /**
+   * Queues runnable, in a task from the free list if there is one.
+   */
+  void push(const shared_ptr<Runnable>& runnable, int64_t expiration, const TaskClass& taskClass) {
+    Task* task = free_;
+    if (task != NULL) {
+      free_ = task->next_;
+      --freeCount_;
+    } else {
+      task = new Task();
+    }
+    task->runnable_ = runnable;
+    task->state_ = Task::WAITING;
+    task->expireTime_ = expiration != 0LL ? Util::currentTime() + expiration : 0LL;
+    task->taskClass_ = taskClass;
+    task->next_ = NULL;
+
+    Lane& lane = lanes_[taskClass.priority];
+    std::map<uint64_t, Flow>::iterator it = lane.flows.find(taskClass.key);
+    if (it == lane.flows.end()) {
+      it = lane.flows.insert(std::make_pair(taskClass.key, Flow())).first;
+      it->second.key = taskClass.key;
+    } else if (it->second.first == NULL) {
+      --lane.idleFlows;
+    }
+    Flow* flow = &it->second;
+    if (flow->first == NULL) {
+      activate(lane, flow);
+      flow->first = task;
+    } else {
+      flow->last->next_ = task;
+    }
+    flow->last = task;
+    ++lane.size;
+    ++size_;
+  }
+
+  /**
+   * Removes and returns the task to run next, or NULL.  Give it back with
+   * recycle() once it is done.
+   */
+  Task* pop() {
+    for (int priority = 0; priority < N_PRIORITIES; ++priority) {
+      Lane& lane = lanes_[priority];
+      if (lane.size == 0) {
+        continue;
+      }
+      for (;;) {
+        Flow* flow = lane.first;
+        if (!flow->inTurn) {
+          flow->deficit += quantum_;
+          flow->inTurn = true;
+        }
+        uint32_t cost = flow->first->getTaskClass().cost;
+        if (cost <= flow->deficit) {
+          flow->deficit -= cost;
+          return take(lane, flow, NULL, flow->first);
+        }
+        // Turn over; the deficit carries to its next turn
+        flow->inTurn = false;
+        deactivate(lane, flow);
+        activate(lane, flow);
+      }
+    }
+    return NULL;
+  }
+
+  /**
+   * Removes the first pending task running runnable.
+   *
+   * @return the task, to recycle(), or NULL if none was found
+   */
+  Task* remove(const shared_ptr<Runnable>& runnable) {
+    for (int priority = 0; priority < N_PRIORITIES; ++priority) {
+      Lane& lane = lanes_[priority];
+      for (Flow* flow = lane.first; flow != NULL; flow = flow->next) {
+        for (Task *prev = NULL, *task = flow->first; task != NULL; prev = task, task = task->next_) {
+          if (task->getRunnable() == runnable) {
+            return take(lane, flow, prev, task);
+          }
+        }
+      }
+    }
+    return NULL;
+  }
+
+  /**
+   * Removes tasks that expired before now, passing each to callback.
+   *
+   * @return the number of tasks removed
+   */
+  size_t removeExpired(int64_t now, bool justOne, const ExpireCallback& callback) {
+    size_t count = 0;
+    for (int priority = 0; priority < N_PRIORITIES; ++priority) {
+      Lane& lane = lanes_[priority];
+      for (Flow* flow = lane.first; flow != NULL;) {
+        Flow* nextFlow = flow->next;
+        for (Task *prev = NULL, *task = flow->first; task != NULL;) {
+          Task* next = task->next_;
+          if (task->getExpireTime() > 0LL && task->getExpireTime() < now) {
+            if (callback) {
+              callback(task->getRunnable());
+            }
+            recycle(take(lane, flow, prev, task));
+            ++count;
+            if (justOne) {
+              return count;
+            }
+          } else {
+            prev = task;
+          }
+          task = next;
+        }
+        flow = nextFlow;
+      }
+    }
+    return count;
+  }
+
+  /**
+   * Takes back a task that pop() or remove() returned, for reuse.
+   */
+  void recycle(Task* task) {
+    task->runnable_.reset();
+    if (freeCount_ < MAX_FREE_TASKS) {
+      task->next_ = free_;
+      free_ = task;
+      ++freeCount_;
+    } else {
+      delete task;
+    }
+  }
+
+private:
+  // Most tasks and flows kept for reuse, beyond which they are freed
+  static const size_t MAX_FREE_TASKS = 1024;
+  static const size_t MAX_IDLE_FLOWS = 64;
+
+  struct Flow {
+    Flow()
+      : key(0), first(NULL), last(NULL), deficit(0), inTurn(false), prev(NULL), next(NULL) {}
+
+    uint64_t key;
+    Task* first;
+    Task* last;
+    uint32_t deficit;
+    bool inTurn;
+    // Neighbours in turn order, while the flow has pending tasks
+    Flow* prev;
+    Flow* next;
+  };
+
+  struct Lane {
+    Lane() : size(0), idleFlows(0), first(NULL), last(NULL) {}
+
+    size_t size;
+    size_t idleFlows;
+    std::map<uint64_t, Flow> flows;
+    Flow* first; // flows with pending tasks, in turn order
+    Flow* last;
+  };
+
+  void activate(Lane& lane, Flow* flow) {
+    flow->prev = lane.last;
+    flow->next = NULL;
+    if (lane.last != NULL) {
+      lane.last->next = flow;
+    } else {
+      lane.first = flow;
+    }
+    lane.last = flow;
+  }
+
+  void deactivate(Lane& lane, Flow* flow) {
+    (flow->prev != NULL ? flow->prev->next : lane.first) = flow->next;
+    (flow->next != NULL ? flow->next->prev : lane.last) = flow->prev;
+    flow->prev = NULL;
+    flow->next = NULL;
+  }
+
+  /**
+   * Unlinks task, which follows prev in flow, and drops the flow if it is
+   * left empty.
+   */
+  Task* take(Lane& lane, Flow* flow, Task* prev, Task* task) {
+    (prev != NULL ? prev->next_ : flow->first) = task->next_;
+    if (flow->last == task) {
+      flow->last = prev;
+    }
+    task->next_ = NULL;
+    --lane.size;
+    --size_;
+    if (flow->first == NULL) {
+      drop(lane, flow);
+    }
+    return task;
+  }
+
+  /**
+   * Forgets an empty flow's turn, and with it any deficit it had left.
+   */
+  void drop(Lane& lane, Flow* flow) {
+    deactivate(lane, flow);
+    if (lane.idleFlows < MAX_IDLE_FLOWS) {
+      flow->deficit = 0;
+      flow->inTurn = false;
+      ++lane.idleFlows;
+    } else {
+      lane.flows.erase(flow->key);
+    }
+  }
+
+  static void deleteAll(Task* task) {
+    while (task != NULL) {
+      Task* next = task->next_;
+      delete task;
+      task = next;
+    }
+  }
+
+  size_t size_;
+  uint32_t quantum_;
+  Lane lanes_[N_PRIORITIES];
+  Task* free_;
+  size_t freeCount_;
+};
+
 /**
  * ThreadManager class
  *
@@ -62,7 +365,13 @@ public:
       state_(ThreadManager::UNINITIALIZED),
       monitor_(&mutex_),
       maxMonitor_(&mutex_),
-      workerMonitor_(&mutex_) {}
+      workerMonitor_(&mutex_) {
+    mutex_.setName("ThreadManager");
+    for (int lane = 0; lane < N_PRIORITIES; ++lane) {
+      laneCountMax_[lane] = 0;
+      laneExpiration_[lane] = 0LL;
+    }
+  }
 
   ~Impl() { stop(); }
 
@@ -105,11 +414,28 @@ public:
     return tasks_.size() + workerCount_ - idleCount_;
   }
 
+  size_t pendingTaskCount(PRIORITY lane) const {
+    Guard g(mutex_);
+    return lane < N_PRIORITIES ? tasks_.size(lane) : 0;
+  }
+
   size_t pendingTaskCountMax() const {
     Guard g(mutex_);
     return pendingTaskCountMax_;
   }
 
+  void setLaneLimits(PRIORITY lane, size_t pendingTaskCountMax, int64_t expiration);
+
+  uint32_t fairShareQuantum() const {
+    Guard g(mutex_);
+    return tasks_.quantum();
+  }
+
+  void fairShareQuantum(uint32_t quantum) {
+    Guard g(mutex_);
+    tasks_.quantum(quantum);
+  }
+
   size_t expiredTaskCount() {
     Guard g(mutex_);
     return expiredCount_;
@@ -120,7 +446,25 @@ public:
     pendingTaskCountMax_ = value;
   }
 
-  void add(shared_ptr<Runnable> value, int64_t timeout, int64_t expiration);
+  void add(shared_ptr<Runnable> value, int64_t timeout, int64_t expiration) {
+    addClassified(value, TaskClass(), timeout, expiration);
+  }
+
+  void addClassified(shared_ptr<Runnable> value,
+                     const TaskClass& taskClass,
+                     int64_t timeout,
+                     int64_t expiration);
+
+  void addBatch(const std::vector<shared_ptr<Runnable> >& tasks,
+                int64_t timeout,
+                int64_t expiration) {
+    addClassifiedBatch(tasks, TaskClass(), timeout, expiration);
+  }
+
+  void addClassifiedBatch(const std::vector<shared_ptr<Runnable> >& tasks,
+                          const TaskClass& taskClass,
+                          int64_t timeout,
+                          int64_t expiration);
 
   void remove(shared_ptr<Runnable> task);
 
@@ -144,6 +488,37 @@ private:
    */
   bool canSleep() const;
 
+  /**
+   * \returns whether a task for lane has to wait for room in the queue
+   */
+  bool isFull(PRIORITY lane) const {
+    return (pendingTaskCountMax_ > 0 && tasks_.size() >= pendingTaskCountMax_)
+           || (laneCountMax_[lane] > 0 && tasks_.size(lane) >= laneCountMax_[lane]);
+  }
+
+  /**
+   * Blocks until there is room in lane for one more task, or throws as
+   * add() does.  The caller must hold the mutex_.
+   */
+  void waitForRoom(PRIORITY lane, int64_t timeout);
+
+  /**
+   * Wakes up one idle worker per task added, as far as there are any;
+   * otherwise all workers are running and will get around to the tasks in
+   * time.  The caller must hold the mutex_.
+   */
+  void wakeWorkers(size_t added) {
+    for (size_t n = std::min(added, idleCount_); n > 0; --n) {
+      monitor_.notify();
+    }
+  }
+
+  /**
+   * Wakes up adders blocked on a full queue after a task left lane.  The
+   * caller must hold the mutex_.
+   */
+  void taskDequeued(PRIORITY lane);
+
   /**
    * Lowers the maximum worker count and blocks until enough worker threads complete
    * to get to the new maximum worker limit.  The caller is responsible for acquiring
@@ -155,6 +530,8 @@ private:
   size_t workerMaxCount_;
   size_t idleCount_;
   size_t pendingTaskCountMax_;
+  size_t laneCountMax_[N_PRIORITIES];
+  int64_t laneExpiration_[N_PRIORITIES];
   size_t expiredCount_;
   ExpireCallback expireCallback_;
 
@@ -162,7 +539,6 @@ private:
   shared_ptr<ThreadFactory> threadFactory_;
 
   friend class ThreadManager::Task;
-  typedef std::deque<shared_ptr<Task> > TaskQueue;
   TaskQueue tasks_;
   Mutex mutex_;
   Monitor monitor_;
@@ -175,36 +551,6 @@ private:
   std::map<const Thread::id_t, shared_ptr<Thread> > idMap_;
 };
 
-class ThreadManager::Task : public Runnable {
-
-public:
-  enum STATE { WAITING, EXECUTING, TIMEDOUT, COMPLETE };
-
-  Task(shared_ptr<Runnable> runnable, int64_t expiration = 0LL)
-    : runnable_(runnable),
-      state_(WAITING),
-      expireTime_(expiration != 0LL ? Util::currentTime() + expiration : 0LL) {}
-
-  ~Task() {}
-
-  void run() {
-    if (state_ == EXECUTING) {
-      runnable_->run();
-      state_ = COMPLETE;
-    }
-  }
-
-  shared_ptr<Runnable> getRunnable() { return runnable_; }
-
-  int64_t getExpireTime() const { return expireTime_; }
-
-private:
-  shared_ptr<Runnable> runnable_;
-  friend class ThreadManager::Worker;
-  STATE state_;
-  int64_t expireTime_;
-};
-
 class ThreadManager::Worker : public Runnable {
   enum STATE { UNINITIALIZED, STARTING, STARTED, STOPPING, STOPPED };
 
@@ -270,12 +616,11 @@ public:
         manager_->idleCount_--;
       }
 
-      shared_ptr<ThreadManager::Task> task;
+      ThreadManager::Task* task = NULL;
 
       if (active) {
         if (!manager_->tasks_.empty()) {
-          task = manager_->tasks_.front();
-          manager_->tasks_.pop_front();
+          task = manager_->tasks_.pop();
           if (task->state_ == ThreadManager::Task::WAITING) {
             // If the state is changed to anything other than EXECUTING or TIMEDOUT here
             // then the execution loop needs to be changed below.
@@ -284,13 +629,7 @@ public:
                     ThreadManager::Task::TIMEDOUT :
                     ThreadManager::Task::EXECUTING;
           }
-        }
-
-        /* If we have a pending task max and we just dropped below it, wakeup any
-            thread that might be blocked on add. */
-        if (manager_->pendingTaskCountMax_ != 0
-            && manager_->tasks_.size() <= manager_->pendingTaskCountMax_ - 1) {
-          manager_->maxMonitor_.notify();
+          manager_->taskDequeued(task->getTaskClass().priority);
         }
       }
 
@@ -319,6 +658,7 @@ public:
           manager_->expireCallback_(task->getRunnable());
           manager_->expiredCount_++;
         }
+        manager_->tasks_.recycle(task);
       }
     }
 
@@ -448,7 +788,42 @@ bool ThreadManager::Impl::canSleep() const {
   return idMap_.find(id) == idMap_.end();
 }
 
-void ThreadManager::Impl::add(shared_ptr<Runnable> value, int64_t timeout, int64_t expiration) {
+void ThreadManager::Impl::setLaneLimits(PRIORITY lane,
+                                        size_t pendingTaskCountMax,
+                                        int64_t expiration) {
+  if (lane >= N_PRIORITIES) {
+    throw InvalidArgumentException();
+  }
+  Guard g(mutex_);
+  laneCountMax_[lane] = pendingTaskCountMax;
+  laneExpiration_[lane] = expiration;
+}
+
+void ThreadManager::Impl::taskDequeued(PRIORITY lane) {
+  /* If we have a pending task max and we just dropped below it, wakeup any
+      thread that might be blocked on add. */
+  bool laneLimited = false;
+  for (int ix = 0; ix < N_PRIORITIES; ++ix) {
+    laneLimited = laneLimited || laneCountMax_[ix] != 0;
+  }
+  if (!laneLimited) {
+    if (pendingTaskCountMax_ != 0 && tasks_.size() <= pendingTaskCountMax_ - 1) {
+      maxMonitor_.notify();
+    }
+  } else if (!isFull(lane)) {
+    // The waiters may be waiting for different lanes, so wake them all
+    maxMonitor_.notifyAll();
+  }
+}
+
+void ThreadManager::Impl::addClassified(shared_ptr<Runnable> value,
+                                        const TaskClass& taskClass,
+                                        int64_t timeout,
+                                        int64_t expiration) {
+  if (taskClass.priority >= N_PRIORITIES) {
+    throw InvalidArgumentException();
+  }
+
   Guard g(mutex_, timeout);
 
   if (!g) {
@@ -461,14 +836,65 @@ void ThreadManager::Impl::add(shared_ptr<Runnable> value, int64_t timeout, int64
         "not started");
   }
 
+  const PRIORITY lane = taskClass.priority;
+  waitForRoom(lane, timeout);
+
+  if (expiration == 0LL) {
+    expiration = laneExpiration_[lane];
+  }
+  tasks_.push(value, expiration, taskClass);
+  wakeWorkers(1);
+}
+
+void ThreadManager::Impl::addClassifiedBatch(const std::vector<shared_ptr<Runnable> >& tasks,
+                                             const TaskClass& taskClass,
+                                             int64_t timeout,
+                                             int64_t expiration) {
+  if (taskClass.priority >= N_PRIORITIES) {
+    throw InvalidArgumentException();
+  }
+
+  Guard g(mutex_, timeout);
+
+  if (!g) {
+    throw TimedOutException();
+  }
+
+  if (state_ != ThreadManager::STARTED) {
+    throw IllegalStateException(
+        "ThreadManager::Impl::addBatch ThreadManager "
+        "not started");
+  }
+
+  const PRIORITY lane = taskClass.priority;
+  if (expiration == 0LL) {
+    expiration = laneExpiration_[lane];
+  }
+
+  size_t added = 0;
+  for (std::vector<shared_ptr<Runnable> >::const_iterator it = tasks.begin(); it != tasks.end();
+       ++it) {
+    if (isFull(lane)) {
+      // Only workers can make room, so let them at the tasks added so far
+      wakeWorkers(added);
+      added = 0;
+      waitForRoom(lane, timeout);
+    }
+    tasks_.push(*it, expiration, taskClass);
+    ++added;
+  }
+  wakeWorkers(added);
+}
+
+void ThreadManager::Impl::waitForRoom(PRIORITY lane, int64_t timeout) {
   // if we're at a limit, remove an expired task to see if the limit clears
-  if (pendingTaskCountMax_ > 0 && (tasks_.size() >= pendingTaskCountMax_)) {
+  if (isFull(lane)) {
     removeExpired(true);
   }
 
-  if (pendingTaskCountMax_ > 0 && (tasks_.size() >= pendingTaskCountMax_)) {
+  if (isFull(lane)) {
     if (canSleep() && timeout >= 0) {
-      while (pendingTaskCountMax_ > 0 && tasks_.size() >= pendingTaskCountMax_) {
+      while (isFull(lane)) {
         // This is thread safe because the mutex is shared between monitors.
         maxMonitor_.wait(timeout);
       }
@@ -476,14 +902,6 @@ void ThreadManager::Impl::add(shared_ptr<Runnable> value, int64_t timeout, int64
       throw TooManyPendingTasksException();
     }
   }
-
-  tasks_.push_back(shared_ptr<ThreadManager::Task>(new ThreadManager::Task(value, expiration)));
-
-  // If idle thread is available notify it, otherwise all worker threads are
-  // running and will get around to this task in time.
-  if (idleCount_ > 0) {
-    monitor_.notify();
-  }
 }
 
 void ThreadManager::Impl::remove(shared_ptr<Runnable> task) {
@@ -494,13 +912,9 @@ void ThreadManager::Impl::remove(shared_ptr<Runnable> task) {
         "started");
   }
 
-  for (TaskQueue::iterator it = tasks_.begin(); it != tasks_.end(); ++it)
-  {
-    if ((*it)->getRunnable() == task)
-    {
-      tasks_.erase(it);
-      return;
-    }
+  ThreadManager::Task* removed = tasks_.remove(task);
+  if (removed != NULL) {
+    tasks_.recycle(removed);
   }
 }
 
@@ -512,41 +926,21 @@ stdcxx::shared_ptr<Runnable> ThreadManager::Impl::removeNextPending() {
         "ThreadManager not started");
   }
 
-  if (tasks_.empty()) {
+  ThreadManager::Task* task = tasks_.pop();
+  if (task == NULL) {
     return stdcxx::shared_ptr<Runnable>();
   }
-
-  shared_ptr<ThreadManager::Task> task = tasks_.front();
-  tasks_.pop_front();
-
-  return task->getRunnable();
+  stdcxx::shared_ptr<Runnable> runnable = task->getRunnable();
+  tasks_.recycle(task);
+  return runnable;
 }
 
 void ThreadManager::Impl::removeExpired(bool justOne) {
   // this is always called under a lock
-  int64_t now = 0LL;
-
-  for (TaskQueue::iterator it = tasks_.begin(); it != tasks_.end(); )
-  {
-    if (now == 0LL) {
-      now = Util::currentTime();
-    }
-
-    if ((*it)->getExpireTime() > 0LL && (*it)->getExpireTime() < now) {
-      if (expireCallback_) {
-        expireCallback_((*it)->getRunnable());
-      }
-      it = tasks_.erase(it);
-      ++expiredCount_;
-      if (justOne) {
-        return;
-      }
-    }
-    else
-    {
-      ++it;
-    }
+  if (tasks_.empty()) {
+    return;
   }
+  expiredCount_ += tasks_.removeExpired(Util::currentTime(), justOne, expireCallback_);
 }
 
 void ThreadManager::Impl::setExpireCallback(ExpireCallback expireCallback) {
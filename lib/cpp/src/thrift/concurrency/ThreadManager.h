@@ -21,9 +21,12 @@
 #define _THRIFT_CONCURRENCY_THREADMANAGER_H_ 1
 
 #include <sys/types.h>
+#include <stdint.h>
 #include <thrift/concurrency/Thread.h>
 #include <thrift/stdcxx.h>
 
+#include <vector>
+
 namespace apache {
 namespace thrift {
 namespace concurrency {
@@ -51,6 +54,13 @@ class ThreadManager;
  * handle basic worker thread management and worker task execution and focus on
  * policy issues. The simplest policy, StaticPolicy, does nothing other than
  * create a fixed number of threads.
+ *
+ * Pending tasks are kept in one lane per PRIORITY.  Workers always take a
+ * task from the highest priority lane that has one.  Within a lane, tasks
+ * are grouped by the key of their TaskClass (typically a client or tenant)
+ * and the keys are served by deficit round robin, so a key with a deep
+ * backlog cannot starve the others.  Tasks added without a TaskClass all go
+ * to the same key of the NORMAL_PRIORITY lane, which is a plain FIFO.
  */
 class ThreadManager {
 
@@ -82,6 +92,26 @@ public:
 
   enum STATE { UNINITIALIZED, STARTING, STARTED, JOINING, STOPPING, STOPPED };
 
+  /**
+   * Priority lanes, highest first.
+   */
+  enum PRIORITY { HIGH_PRIORITY, NORMAL_PRIORITY, LOW_PRIORITY, N_PRIORITIES };
+
+  /**
+   * How a task is scheduled: its lane, the key it shares the lane fairly
+   * by, and its cost relative to the other tasks of the lane (for instance
+   * the expected run time in some unit).  Each key in turn may run tasks
+   * worth fairShareQuantum() before the next key gets its turn.
+   */
+  struct TaskClass {
+    explicit TaskClass(PRIORITY priority = NORMAL_PRIORITY, uint64_t key = 0, uint32_t cost = 1)
+      : priority(priority), key(key), cost(cost) {}
+
+    PRIORITY priority;
+    uint64_t key;
+    uint32_t cost;
+  };
+
   virtual STATE state() const = 0;
 
   /**
@@ -131,11 +161,47 @@ public:
    */
   virtual size_t totalTaskCount() const = 0;
 
+  /**
+   * Gets the current number of pending tasks in one lane.  Managers without
+   * lanes keep all tasks in NORMAL_PRIORITY.
+   */
+  virtual size_t pendingTaskCount(PRIORITY lane) const {
+    return lane == NORMAL_PRIORITY ? pendingTaskCount() : 0;
+  }
+
   /**
    * Gets the maximum pending task count.  0 indicates no maximum
    */
   virtual size_t pendingTaskCountMax() const = 0;
 
+  /**
+   * Limits one lane in addition to the overall pendingTaskCountMax().
+   *
+   * @param lane the lane to configure
+   * @param pendingTaskCountMax the most tasks the lane may hold, 0 for no limit
+   * @param expiration the expiration, in milliseconds, of tasks added to the
+   * lane without one; 0 for none
+   * @throws InvalidArgumentException if lane is not a valid PRIORITY
+   *
+   * Ignored by managers without lanes.
+   */
+  virtual void setLaneLimits(PRIORITY lane, size_t pendingTaskCountMax, int64_t expiration = 0LL) {
+    (void)lane;
+    (void)pendingTaskCountMax;
+    (void)expiration;
+  }
+
+  /**
+   * Gets the cost each key of a lane may run per round; 1 by default.
+   */
+  virtual uint32_t fairShareQuantum() const { return 1; }
+
+  /**
+   * Sets the cost each key of a lane may run per round.  Ignored by
+   * managers without fair sharing.
+   */
+  virtual void fairShareQuantum(uint32_t quantum) { (void)quantum; }
+
   /**
    * Gets the number of tasks which have been expired without being run
    * since start() was called.
@@ -160,18 +226,74 @@ public:
    * to be run; if exceeded, the task will be dropped off the queue and not run.
    *
    * @throws TooManyPendingTasksException Pending task count exceeds max pending task count
+   *
+   * This is addClassified() with a default TaskClass.
    */
   virtual void add(stdcxx::shared_ptr<Runnable> task,
                    int64_t timeout = 0LL,
                    int64_t expiration = 0LL) = 0;
 
+  /**
+   * Adds a task to the lane and key given by taskClass.  Behaves like add()
+   * otherwise, except that it also blocks (or throws) while the lane is at
+   * the limit set with setLaneLimits(), and that an expiration of 0 means
+   * the lane's default expiration.
+   *
+   * @throws InvalidArgumentException if taskClass.priority is not a valid PRIORITY
+   *
+   * Managers without lanes just add() the task.
+   */
+  virtual void addClassified(stdcxx::shared_ptr<Runnable> task,
+                             const TaskClass& taskClass,
+                             int64_t timeout = 0LL,
+                             int64_t expiration = 0LL) {
+    (void)taskClass;
+    add(task, timeout, expiration);
+  }
+
+  /**
+   * Adds tasks in order, taking the lock once and waking up as many idle
+   * workers as there are tasks, rather than once per task.  Behaves like
+   * add() otherwise, except that it blocks (or throws) when there is no room
+   * for the next task, and then only after waking up workers for the tasks
+   * it already added.  Those stay queued if it throws.
+   *
+   * This is addClassifiedBatch() with a default TaskClass.
+   *
+   * Managers that cannot do better add() the tasks one by one.
+   */
+  virtual void addBatch(const std::vector<stdcxx::shared_ptr<Runnable> >& tasks,
+                        int64_t timeout = 0LL,
+                        int64_t expiration = 0LL) {
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      add(tasks[i], timeout, expiration);
+    }
+  }
+
+  /**
+   * Adds tasks to the lane and key given by taskClass, as addBatch() does.
+   *
+   * @throws InvalidArgumentException if taskClass.priority is not a valid PRIORITY
+   *
+   * Managers that cannot do better addClassified() the tasks one by one.
+   */
+  virtual void addClassifiedBatch(const std::vector<stdcxx::shared_ptr<Runnable> >& tasks,
+                                  const TaskClass& taskClass,
+                                  int64_t timeout = 0LL,
+                                  int64_t expiration = 0LL) {
+    for (size_t i = 0; i < tasks.size(); ++i) {
+      addClassified(tasks[i], taskClass, timeout, expiration);
+    }
+  }
+
   /**
    * Removes a pending task
    */
   virtual void remove(stdcxx::shared_ptr<Runnable> task) = 0;
 
   /**
-   * Remove the next pending task which would be run.
+   * Remove the next pending task which would be run, honouring priorities
+   * and fair sharing.
    *
    * @return the task removed.
    */
@@ -190,18 +312,27 @@ public:
    */
   virtual void setExpireCallback(ExpireCallback expireCallback) = 0;
 
+  /**
+   * Creates a thread manager without workers, which keeps queued tasks for
+   * reuse as newSimpleThreadManager() ones do
+   */
   static stdcxx::shared_ptr<ThreadManager> newThreadManager();
 
   /**
    * Creates a simple thread manager the uses count number of worker threads and has
    * a pendingTaskCountMax maximum pending tasks. The default, 0, specified no limit
    * on pending tasks
+   *
+   * Queued tasks are kept for reuse, so that once as many tasks have been
+   * pending at once before, adding one does not allocate memory.
    */
   static stdcxx::shared_ptr<ThreadManager> newSimpleThreadManager(size_t count = 4,
                                                                  size_t pendingTaskCountMax = 0);
 
   class Task;
 
+  class TaskQueue;
+
   class Worker;
 
   class Impl;
@@ -153,6 +153,7 @@ TimerManager::TimerManager()
   : taskCount_(0),
     state_(TimerManager::UNINITIALIZED),
     dispatcher_(shared_ptr<Dispatcher>(new Dispatcher(this))) {
+  monitor_.mutex().setName("TimerManager");
 }
 
 #if defined(_MSC_VER)
@@ -25,6 +25,7 @@
 #if defined(HAVE_SYS_TIME_H)
 #include <sys/time.h>
 #endif
+#include <time.h>
 
 namespace apache {
 namespace thrift {
@@ -39,6 +40,16 @@ int64_t Util::currentTimeTicks(int64_t ticksPerSec) {
   toTicks(result, now, ticksPerSec);
   return result;
 }
+
+int64_t Util::monotonicTimeUsec() {
+#if defined(CLOCK_MONOTONIC) && !defined(_WIN32)
+  struct timespec now;
+  if (clock_gettime(CLOCK_MONOTONIC, &now) == 0) {
+    return static_cast<int64_t>(now.tv_sec) * US_PER_S + now.tv_nsec / NS_PER_US;
+  }
+#endif
+  return currentTimeUsec();
+}
 }
 }
 } // apache::thrift::concurrency
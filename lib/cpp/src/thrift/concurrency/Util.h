@@ -143,6 +143,13 @@ public:
    * Get current time as micros from epoch
    */
   static int64_t currentTimeUsec() { return currentTimeTicks(US_PER_S); }
+
+  /**
+   * Get the time of a clock that does not jump when the system time is set,
+   * as micros from an unspecified start.  Only good for measuring intervals;
+   * falls back to currentTimeUsec() where there is no such clock.
+   */
+  static int64_t monotonicTimeUsec();
 };
 }
 }
@@ -0,0 +1,577 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/processor/TMetricsEventHandler.h>
+#include <thrift/concurrency/Util.h>
+
+#include <algorithm>
+#include <cmath>
+#include <sstream>
+
+namespace apache {
+namespace thrift {
+namespace processor {
+
+using apache::thrift::concurrency::Util;
+
+namespace {
+
+const uint64_t SUB_BUCKET_COUNT = 1ULL << THistogram::SUB_BUCKET_BITS;
+const uint64_t SUB_BUCKET_MASK = SUB_BUCKET_COUNT - 1;
+
+inline uint32_t highestBit(uint64_t value) {
+#if defined(__GNUC__)
+  return 63 - __builtin_clzll(value);
+#else
+  uint32_t bit = 0;
+  while (value >>= 1) {
+    ++bit;
+  }
+  return bit;
+#endif
+}
+
+inline uint64_t elapsed(int64_t from, int64_t to) {
+  return to > from ? static_cast<uint64_t>(to - from) : 0;
+}
+
+#if __cplusplus >= 201103L
+#define THRIFT_METRICS_THREAD_LOCAL thread_local
+#elif defined(__GNUC__)
+#define THRIFT_METRICS_THREAD_LOCAL __thread
+#elif defined(_MSC_VER)
+#define THRIFT_METRICS_THREAD_LOCAL __declspec(thread)
+#endif
+
+#ifdef THRIFT_METRICS_THREAD_LOCAL
+boost::atomic<uint32_t> threadsSeen(0);
+
+// One more than the index of the calling thread, 0 until it records a call
+THRIFT_METRICS_THREAD_LOCAL uint32_t threadIndex = 0;
+#endif
+
+/**
+ * Picks the shard for the calling thread.  Threads are numbered in the
+ * order they first record a call and take the shards in turn, so that up to
+ * as many threads as there are shards never share one.
+ */
+inline uint32_t currentShard(uint32_t shards) {
+#ifdef THRIFT_METRICS_THREAD_LOCAL
+  if (threadIndex == 0) {
+    threadIndex = threadsSeen.fetch_add(1, boost::memory_order_relaxed) + 1;
+  }
+  return (threadIndex - 1) % shards;
+#else
+  // Without thread locals, threads are told apart by their stacks
+  int marker;
+  uint64_t key = static_cast<uint64_t>(reinterpret_cast<uintptr_t>(&marker)) >> 16;
+  key *= 0x9E3779B97F4A7C15ULL;
+  return static_cast<uint32_t>(key >> 32) % shards;
+#endif
+}
+
+uint32_t hashName(const char* name) {
+  // FNV-1a
+  uint32_t hash = 2166136261U;
+  for (const unsigned char* p = reinterpret_cast<const unsigned char*>(name); *p; ++p) {
+    hash ^= *p;
+    hash *= 16777619U;
+  }
+  return hash;
+}
+
+/**
+ * Concurrently updated counterpart of THistogram.
+ */
+struct AtomicHistogram {
+  AtomicHistogram() : sum(0), min(~0ULL), max(0) {
+    for (uint32_t i = 0; i < THistogram::NUM_BUCKETS; ++i) {
+      buckets[i].store(0, boost::memory_order_relaxed);
+    }
+  }
+
+  void record(uint64_t value) {
+    if (value > THistogram::MAX_VALUE) {
+      value = THistogram::MAX_VALUE;
+    }
+    buckets[THistogram::bucketFor(value)].fetch_add(1, boost::memory_order_relaxed);
+    sum.fetch_add(value, boost::memory_order_relaxed);
+
+    uint64_t cur = min.load(boost::memory_order_relaxed);
+    while (value < cur && !min.compare_exchange_weak(cur, value, boost::memory_order_relaxed)) {
+    }
+    cur = max.load(boost::memory_order_relaxed);
+    while (value > cur && !max.compare_exchange_weak(cur, value, boost::memory_order_relaxed)) {
+    }
+  }
+
+  boost::atomic<uint64_t> buckets[THistogram::NUM_BUCKETS];
+  boost::atomic<uint64_t> sum;
+  boost::atomic<uint64_t> min;
+  boost::atomic<uint64_t> max;
+};
+
+enum Phase { PHASE_READ = 0, PHASE_HANDLE, PHASE_WRITE, NUM_PHASES };
+
+const char* const PHASE_NAMES[NUM_PHASES] = {"read", "handle", "write"};
+
+struct Shard {
+  Shard() : calls(0), errors(0), bytesRead(0), bytesWritten(0) {}
+
+  boost::atomic<uint64_t> calls;
+  boost::atomic<uint64_t> errors;
+  boost::atomic<uint64_t> bytesRead;
+  boost::atomic<uint64_t> bytesWritten;
+  AtomicHistogram latency[NUM_PHASES];
+  // The counters of one shard and the histogram maxima of the one before
+  // never share a cache line, wherever the array starts
+  char padding[128];
+};
+
+/**
+ * The context of one call
+ */
+struct Call {
+  explicit Call(Shard* shard)
+    : shard(shard),
+      phaseStart(0),
+      readDone(false),
+      handleDone(false),
+      completed(false),
+      failed(false) {}
+
+  void endHandle(int64_t now) {
+    if (readDone && !handleDone) {
+      shard->latency[PHASE_HANDLE].record(elapsed(phaseStart, now));
+      handleDone = true;
+    }
+  }
+
+  Shard* shard;
+  int64_t phaseStart;
+  bool readDone;
+  bool handleDone;
+  bool completed;
+  bool failed;
+};
+
+#if __cplusplus >= 201103L
+/**
+ * The contexts of the calls that ended on this thread, for the next ones to
+ * start on it, so that recording a call does not allocate.
+ */
+class CallCache {
+public:
+  CallCache() : size_(0) {}
+
+  ~CallCache() {
+    for (uint32_t i = 0; i < size_; ++i) {
+      delete calls_[i];
+    }
+  }
+
+  Call* get(Shard* shard) {
+    if (size_ == 0) {
+      return new Call(shard);
+    }
+    Call* call = calls_[--size_];
+    *call = Call(shard);
+    return call;
+  }
+
+  void put(Call* call) {
+    if (size_ < MAX_SIZE) {
+      calls_[size_++] = call;
+    } else {
+      delete call;
+    }
+  }
+
+private:
+  // Enough for calls nested in the handler of another call
+  static const uint32_t MAX_SIZE = 8;
+
+  Call* calls_[MAX_SIZE];
+  uint32_t size_;
+};
+
+thread_local CallCache callCache;
+
+inline Call* newCall(Shard* shard) {
+  return callCache.get(shard);
+}
+
+inline void deleteCall(Call* call) {
+  callCache.put(call);
+}
+#else
+inline Call* newCall(Shard* shard) {
+  return new Call(shard);
+}
+
+inline void deleteCall(Call* call) {
+  delete call;
+}
+#endif
+
+std::string escapeLabel(const std::string& value) {
+  std::string result;
+  result.reserve(value.size());
+  for (std::string::const_iterator it = value.begin(); it != value.end(); ++it) {
+    switch (*it) {
+    case '\\':
+      result += "\\\\";
+      break;
+    case '"':
+      result += "\\\"";
+      break;
+    case '\n':
+      result += "\\n";
+      break;
+    default:
+      result += *it;
+    }
+  }
+  return result;
+}
+
+bool byName(const TMethodMetrics& a, const TMethodMetrics& b) {
+  return a.name < b.name;
+}
+}
+
+const uint32_t THistogram::SUB_BUCKET_BITS;
+const uint32_t THistogram::MAX_VALUE_BITS;
+const uint64_t THistogram::MAX_VALUE;
+const uint32_t THistogram::NUM_BUCKETS;
+
+THistogram::THistogram() : buckets_(NUM_BUCKETS, 0), count_(0), sum_(0), min_(~0ULL), max_(0) {
+}
+
+uint32_t THistogram::bucketFor(uint64_t value) {
+  if (value > MAX_VALUE) {
+    value = MAX_VALUE;
+  }
+  if (value < SUB_BUCKET_COUNT) {
+    return static_cast<uint32_t>(value);
+  }
+  uint32_t shift = highestBit(value) - SUB_BUCKET_BITS;
+  return ((shift + 1) << SUB_BUCKET_BITS)
+         + static_cast<uint32_t>((value >> shift) & SUB_BUCKET_MASK);
+}
+
+uint64_t THistogram::bucketUpperBound(uint32_t bucket) {
+  if (bucket < SUB_BUCKET_COUNT) {
+    return bucket;
+  }
+  uint32_t shift = (bucket >> SUB_BUCKET_BITS) - 1;
+  uint64_t lower = (SUB_BUCKET_COUNT + (bucket & SUB_BUCKET_MASK)) << shift;
+  return lower + (1ULL << shift) - 1;
+}
+
+void THistogram::record(uint64_t value) {
+  if (value > MAX_VALUE) {
+    value = MAX_VALUE;
+  }
+  ++buckets_[bucketFor(value)];
+  ++count_;
+  sum_ += value;
+  min_ = (std::min)(min_, value);
+  max_ = (std::max)(max_, value);
+}
+
+void THistogram::merge(const THistogram& other) {
+  for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+    buckets_[i] += other.buckets_[i];
+  }
+  count_ += other.count_;
+  sum_ += other.sum_;
+  min_ = (std::min)(min_, other.min_);
+  max_ = (std::max)(max_, other.max_);
+}
+
+uint64_t THistogram::percentile(double p) const {
+  if (count_ == 0) {
+    return 0;
+  }
+  p = (std::max)(0.0, (std::min)(100.0, p));
+  uint64_t target = static_cast<uint64_t>(std::ceil(p / 100.0 * static_cast<double>(count_)));
+  if (target == 0) {
+    target = 1;
+  }
+  uint64_t seen = 0;
+  for (uint32_t i = 0; i < NUM_BUCKETS; ++i) {
+    seen += buckets_[i];
+    if (seen >= target) {
+      return (std::min)(bucketUpperBound(i), max_);
+    }
+  }
+  return max_;
+}
+
+struct TMetricsEventHandler::Method {
+  Method(const char* name, uint32_t shards) : name(name), shards(new Shard[shards]) {}
+  ~Method() { delete[] shards; }
+
+  const std::string name;
+  Shard* const shards;
+};
+
+const char* const TMetricsEventHandler::OVERFLOW_METHOD = "__overflow__";
+
+TMetricsEventHandler::TMetricsEventHandler(uint32_t maxMethods, uint32_t shards)
+  : maxMethods_(maxMethods), shards_(shards ? shards : 1), numMethods_(0) {
+  uint32_t capacity = 16;
+  while (capacity < 2 * maxMethods_) {
+    capacity <<= 1;
+  }
+  tableMask_ = capacity - 1;
+  table_ = new boost::atomic<Method*>[capacity];
+  for (uint32_t i = 0; i < capacity; ++i) {
+    table_[i].store(NULL, boost::memory_order_relaxed);
+  }
+  overflow_ = new Method(OVERFLOW_METHOD, shards_);
+}
+
+TMetricsEventHandler::~TMetricsEventHandler() {
+  for (uint32_t i = 0; i <= tableMask_; ++i) {
+    delete table_[i].load(boost::memory_order_relaxed);
+  }
+  delete[] table_;
+  delete overflow_;
+}
+
+TMetricsEventHandler::Method* TMetricsEventHandler::find(const char* fn_name) const {
+  uint32_t hash = hashName(fn_name);
+  for (uint32_t i = 0; i <= tableMask_; ++i) {
+    Method* method = table_[(hash + i) & tableMask_].load(boost::memory_order_acquire);
+    if (method == NULL) {
+      break;
+    }
+    if (method->name == fn_name) {
+      return method;
+    }
+  }
+  return NULL;
+}
+
+TMetricsEventHandler::Method* TMetricsEventHandler::lookup(const char* fn_name) {
+  uint32_t hash = hashName(fn_name);
+  for (uint32_t i = 0; i <= tableMask_; ++i) {
+    boost::atomic<Method*>& slot = table_[(hash + i) & tableMask_];
+    Method* method = slot.load(boost::memory_order_acquire);
+    if (method == NULL) {
+      if (numMethods_.fetch_add(1, boost::memory_order_relaxed) >= maxMethods_) {
+        numMethods_.fetch_sub(1, boost::memory_order_relaxed);
+        return overflow_;
+      }
+      Method* created = new Method(fn_name, shards_);
+      if (slot.compare_exchange_strong(method, created, boost::memory_order_acq_rel)) {
+        return created;
+      }
+      // Lost the race for this slot; method now holds the winner.
+      delete created;
+      numMethods_.fetch_sub(1, boost::memory_order_relaxed);
+    }
+    if (method->name == fn_name) {
+      return method;
+    }
+  }
+  return overflow_;
+}
+
+void* TMetricsEventHandler::getContext(const char* fn_name, void* serverContext) {
+  (void)serverContext;
+  Method* method = lookup(fn_name);
+  return newCall(&method->shards[currentShard(shards_)]);
+}
+
+void TMetricsEventHandler::freeContext(void* ctx, const char* fn_name) {
+  (void)fn_name;
+  Call* call = static_cast<Call*>(ctx);
+  if (call == NULL) {
+    return;
+  }
+  call->shard->calls.fetch_add(1, boost::memory_order_relaxed);
+  if (call->failed || !call->completed) {
+    call->shard->errors.fetch_add(1, boost::memory_order_relaxed);
+  }
+  deleteCall(call);
+}
+
+void TMetricsEventHandler::preRead(void* ctx, const char* fn_name) {
+  (void)fn_name;
+  static_cast<Call*>(ctx)->phaseStart = Util::monotonicTimeUsec();
+}
+
+void TMetricsEventHandler::postRead(void* ctx, const char* fn_name, uint32_t bytes) {
+  (void)fn_name;
+  Call* call = static_cast<Call*>(ctx);
+  int64_t now = Util::monotonicTimeUsec();
+  call->shard->latency[PHASE_READ].record(elapsed(call->phaseStart, now));
+  call->shard->bytesRead.fetch_add(bytes, boost::memory_order_relaxed);
+  call->phaseStart = now;
+  call->readDone = true;
+}
+
+void TMetricsEventHandler::preWrite(void* ctx, const char* fn_name) {
+  (void)fn_name;
+  Call* call = static_cast<Call*>(ctx);
+  int64_t now = Util::monotonicTimeUsec();
+  call->endHandle(now);
+  call->phaseStart = now;
+}
+
+void TMetricsEventHandler::postWrite(void* ctx, const char* fn_name, uint32_t bytes) {
+  (void)fn_name;
+  Call* call = static_cast<Call*>(ctx);
+  call->shard->latency[PHASE_WRITE].record(elapsed(call->phaseStart, Util::monotonicTimeUsec()));
+  call->shard->bytesWritten.fetch_add(bytes, boost::memory_order_relaxed);
+  call->completed = true;
+}
+
+void TMetricsEventHandler::asyncComplete(void* ctx, const char* fn_name) {
+  (void)fn_name;
+  Call* call = static_cast<Call*>(ctx);
+  call->endHandle(Util::monotonicTimeUsec());
+  call->completed = true;
+}
+
+void TMetricsEventHandler::handlerError(void* ctx, const char* fn_name) {
+  (void)fn_name;
+  Call* call = static_cast<Call*>(ctx);
+  call->endHandle(Util::monotonicTimeUsec());
+  call->failed = true;
+}
+
+void TMetricsEventHandler::merge(const Method* method, TMethodMetrics& out) const {
+  out = TMethodMetrics();
+  out.name = method->name;
+  for (uint32_t i = 0; i < shards_; ++i) {
+    const Shard& shard = method->shards[i];
+    out.calls += shard.calls.load(boost::memory_order_relaxed);
+    out.errors += shard.errors.load(boost::memory_order_relaxed);
+    out.bytesRead += shard.bytesRead.load(boost::memory_order_relaxed);
+    out.bytesWritten += shard.bytesWritten.load(boost::memory_order_relaxed);
+    THistogram* histograms[NUM_PHASES] = {&out.readLatency, &out.handleLatency, &out.writeLatency};
+    for (int p = 0; p < NUM_PHASES; ++p) {
+      const AtomicHistogram& from = shard.latency[p];
+      THistogram merged;
+      for (uint32_t b = 0; b < THistogram::NUM_BUCKETS; ++b) {
+        uint64_t n = from.buckets[b].load(boost::memory_order_relaxed);
+        // count is derived from the buckets so that percentiles stay
+        // consistent with it while recording is in flight.
+        merged.buckets_[b] = n;
+        merged.count_ += n;
+      }
+      if (merged.count_ != 0) {
+        merged.sum_ = from.sum.load(boost::memory_order_relaxed);
+        merged.min_ = from.min.load(boost::memory_order_relaxed);
+        merged.max_ = from.max.load(boost::memory_order_relaxed);
+        histograms[p]->merge(merged);
+      }
+    }
+  }
+}
+
+void TMetricsEventHandler::snapshot(std::vector<TMethodMetrics>& out) const {
+  out.clear();
+  for (uint32_t i = 0; i <= tableMask_; ++i) {
+    const Method* method = table_[i].load(boost::memory_order_acquire);
+    if (method != NULL) {
+      out.push_back(TMethodMetrics());
+      merge(method, out.back());
+    }
+  }
+  TMethodMetrics overflow;
+  merge(overflow_, overflow);
+  if (overflow.calls != 0) {
+    out.push_back(overflow);
+  }
+  std::sort(out.begin(), out.end(), byName);
+}
+
+bool TMetricsEventHandler::getMethod(const std::string& name, TMethodMetrics& out) const {
+  const Method* method = (name == OVERFLOW_METHOD) ? overflow_ : find(name.c_str());
+  if (method == NULL) {
+    return false;
+  }
+  merge(method, out);
+  return true;
+}
+
+void TMetricsEventHandler::dump(std::ostream& out, const std::string& prefix) const {
+  static const double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+  static const size_t NUM_QUANTILES = sizeof(QUANTILES) / sizeof(QUANTILES[0]);
+
+  std::vector<TMethodMetrics> methods;
+  snapshot(methods);
+
+  struct Counter {
+    const char* name;
+    const char* help;
+    uint64_t TMethodMetrics::*field;
+  };
+  static const Counter COUNTERS[] = {
+      {"calls_total", "Calls, including failed ones.", &TMethodMetrics::calls},
+      {"errors_total", "Calls that failed or were abandoned.", &TMethodMetrics::errors},
+      {"read_bytes_total", "Request bytes read.", &TMethodMetrics::bytesRead},
+      {"written_bytes_total", "Response bytes written.", &TMethodMetrics::bytesWritten}};
+
+  for (size_t c = 0; c < sizeof(COUNTERS) / sizeof(COUNTERS[0]); ++c) {
+    const std::string metric = prefix + "_" + COUNTERS[c].name;
+    out << "# HELP " << metric << " " << COUNTERS[c].help << "\n";
+    out << "# TYPE " << metric << " counter\n";
+    for (std::vector<TMethodMetrics>::const_iterator it = methods.begin(); it != methods.end();
+         ++it) {
+      out << metric << "{method=\"" << escapeLabel(it->name) << "\"} " << (*it).*(COUNTERS[c].field)
+          << "\n";
+    }
+  }
+
+  const std::string metric = prefix + "_latency_us";
+  out << "# HELP " << metric << " Call latency in microseconds by phase.\n";
+  out << "# TYPE " << metric << " summary\n";
+  for (std::vector<TMethodMetrics>::const_iterator it = methods.begin(); it != methods.end();
+       ++it) {
+    const THistogram* histograms[NUM_PHASES]
+        = {&it->readLatency, &it->handleLatency, &it->writeLatency};
+    const std::string method = escapeLabel(it->name);
+    for (int p = 0; p < NUM_PHASES; ++p) {
+      const std::string labels = "method=\"" + method + "\",phase=\"" + PHASE_NAMES[p] + "\"";
+      for (size_t q = 0; q < NUM_QUANTILES; ++q) {
+        out << metric << "{" << labels << ",quantile=\"" << QUANTILES[q] << "\"} "
+            << histograms[p]->percentile(QUANTILES[q] * 100.0) << "\n";
+      }
+      out << metric << "_sum{" << labels << "} " << histograms[p]->sum() << "\n";
+      out << metric << "_count{" << labels << "} " << histograms[p]->count() << "\n";
+    }
+  }
+}
+
+std::string TMetricsEventHandler::dump() const {
+  std::ostringstream out;
+  dump(out);
+  return out.str();
+}
+}
+}
+} // apache::thrift::processor
@@ -0,0 +1,182 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_PROCESSOR_TMETRICSEVENTHANDLER_H_
+#define _THRIFT_PROCESSOR_TMETRICSEVENTHANDLER_H_ 1
+
+#include <boost/atomic.hpp>
+#include <ostream>
+#include <string>
+#include <vector>
+#include <thrift/TProcessor.h>
+
+namespace apache {
+namespace thrift {
+namespace processor {
+
+/**
+ * Log-linear latency histogram in the style of HdrHistogram.
+ *
+ * Values below 2^SUB_BUCKET_BITS get a bucket each; above that every power
+ * of two is split into 2^SUB_BUCKET_BITS buckets, so a recorded value is
+ * reported with at most 12.5% relative error.  Values above MAX_VALUE are
+ * clamped.  This is the plain (not thread safe) value type returned by
+ * TMetricsEventHandler::snapshot(); the handler records into atomic shards
+ * and merges them into one of these on scrape.
+ */
+class THistogram {
+public:
+  static const uint32_t SUB_BUCKET_BITS = 3;
+  static const uint32_t MAX_VALUE_BITS = 40;
+  static const uint64_t MAX_VALUE = (1ULL << MAX_VALUE_BITS) - 1;
+  static const uint32_t NUM_BUCKETS = (MAX_VALUE_BITS - SUB_BUCKET_BITS + 1) << SUB_BUCKET_BITS;
+
+  THistogram();
+
+  void record(uint64_t value);
+  void merge(const THistogram& other);
+
+  uint64_t count() const { return count_; }
+  uint64_t sum() const { return sum_; }
+  uint64_t min() const { return count_ ? min_ : 0; }
+  uint64_t max() const { return max_; }
+  double mean() const { return count_ ? static_cast<double>(sum_) / count_ : 0.0; }
+
+  /**
+   * Smallest recorded value v such that at least p percent of the recorded
+   * values are <= v, up to bucket resolution.  p is in [0, 100].
+   */
+  uint64_t percentile(double p) const;
+
+  uint64_t bucketCount(uint32_t bucket) const { return buckets_[bucket]; }
+
+  /** Bucket index for a value. */
+  static uint32_t bucketFor(uint64_t value);
+
+  /** Largest value that lands in the given bucket. */
+  static uint64_t bucketUpperBound(uint32_t bucket);
+
+private:
+  friend class TMetricsEventHandler;
+
+  std::vector<uint64_t> buckets_;
+  uint64_t count_;
+  uint64_t sum_;
+  uint64_t min_;
+  uint64_t max_;
+};
+
+/**
+ * Merged per-method statistics.  Latencies are in microseconds:
+ *  - read:   preRead to postRead (deserializing the arguments)
+ *  - handle: postRead to preWrite (running the handler); for oneway calls
+ *            and failed calls this ends at asyncComplete / handlerError
+ *  - write:  preWrite to postWrite (serializing and flushing the reply)
+ */
+struct TMethodMetrics {
+  TMethodMetrics() : calls(0), errors(0), bytesRead(0), bytesWritten(0) {}
+
+  std::string name;
+  uint64_t calls;
+  uint64_t errors;
+  uint64_t bytesRead;
+  uint64_t bytesWritten;
+  THistogram readLatency;
+  THistogram handleLatency;
+  THistogram writeLatency;
+};
+
+/**
+ * TProcessorEventHandler that records per-method call and error counts,
+ * request/response byte totals and read/handle/write latency histograms.
+ *
+ *   stdcxx::shared_ptr<TMetricsEventHandler> metrics(new TMetricsEventHandler());
+ *   processor->setEventHandler(metrics);
+ *   ...
+ *   metrics->dump(std::cout);
+ *
+ * Recording never takes a lock.  Each method owns a small array of shards
+ * and a call records into the shard of its calling thread with relaxed
+ * atomic adds; threads take the shards in turn, so up to shards threads
+ * never share a cache line.  Call contexts are reused by the thread that
+ * frees them.  snapshot()
+ * and dump() merge the shards; they may run concurrently with recording and
+ * see a call partially recorded, but never lose one.
+ *
+ * A call counts as an error if the handler threw (handlerError) or the call
+ * was abandoned before its reply was written, e.g. on a protocol error
+ * while reading the arguments.
+ *
+ * Methods are looked up by name in a fixed size lock-free table.  Once
+ * maxMethods distinct names have been seen further ones are accounted to a
+ * single entry named OVERFLOW_METHOD.
+ */
+class TMetricsEventHandler : public TProcessorEventHandler {
+public:
+  static const char* const OVERFLOW_METHOD;
+
+  TMetricsEventHandler(uint32_t maxMethods = 256, uint32_t shards = 8);
+  virtual ~TMetricsEventHandler();
+
+  virtual void* getContext(const char* fn_name, void* serverContext);
+  virtual void freeContext(void* ctx, const char* fn_name);
+  virtual void preRead(void* ctx, const char* fn_name);
+  virtual void postRead(void* ctx, const char* fn_name, uint32_t bytes);
+  virtual void preWrite(void* ctx, const char* fn_name);
+  virtual void postWrite(void* ctx, const char* fn_name, uint32_t bytes);
+  virtual void asyncComplete(void* ctx, const char* fn_name);
+  virtual void handlerError(void* ctx, const char* fn_name);
+
+  /**
+   * Merged statistics for every method seen so far, sorted by name.
+   */
+  void snapshot(std::vector<TMethodMetrics>& out) const;
+
+  /**
+   * Merged statistics for one method.  Returns false if it was never called.
+   */
+  bool getMethod(const std::string& name, TMethodMetrics& out) const;
+
+  /**
+   * Writes all metrics in the Prometheus text exposition format, with
+   * latencies as summaries (quantiles 0.5, 0.9, 0.99 and 0.999).
+   * Metric names are prefixed with prefix followed by an underscore.
+   */
+  void dump(std::ostream& out, const std::string& prefix = "thrift") const;
+  std::string dump() const;
+
+private:
+  struct Method;
+
+  Method* lookup(const char* fn_name);
+  Method* find(const char* fn_name) const;
+  void merge(const Method* method, TMethodMetrics& out) const;
+
+  uint32_t maxMethods_;
+  uint32_t shards_;
+  uint32_t tableMask_;
+  boost::atomic<Method*>* table_;
+  boost::atomic<uint32_t> numMethods_;
+  Method* overflow_;
+};
+}
+}
+} // apache::thrift::processor
+
+#endif // #ifndef _THRIFT_PROCESSOR_TMETRICSEVENTHANDLER_H_
@@ -21,6 +21,14 @@
 
 #include <boost/static_assert.hpp>
 
+#include <cstring>
+
+#if (defined(__x86_64__) || defined(__i386__))                                                    \
+    && (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define THRIFT_BASE64_X86_SIMD 1
+#include <immintrin.h>
+#endif
+
 using std::string;
 
 namespace apache {
@@ -312,6 +320,296 @@ void base64_decode(uint8_t* buf, uint32_t len) {
     }
   }
 }
+
+/*
+ * Whole-buffer codecs.  The SIMD versions are the pshufb based ones described
+ * by Wojciech Muła and Daniel Lemire ("Faster Base64 Encoding and Decoding
+ * using AVX2 Instructions"); they handle as many full blocks as they can and
+ * leave the rest to the scalar code.  Each block of input that contains a
+ * character outside the base64 alphabet is decoded by the scalar code too, so
+ * every implementation produces exactly the same bytes.
+ */
+
+static uint32_t encode_scalar(const uint8_t* in, uint32_t len, uint8_t* out) {
+  uint8_t* start = out;
+  while (len >= 3) {
+    out[0] = kBase64EncodeTable[in[0] >> 2];
+    out[1] = kBase64EncodeTable[((in[0] << 4) & 0x30) | (in[1] >> 4)];
+    out[2] = kBase64EncodeTable[((in[1] << 2) & 0x3c) | (in[2] >> 6)];
+    out[3] = kBase64EncodeTable[in[2] & 0x3f];
+    in += 3;
+    out += 4;
+    len -= 3;
+  }
+  if (len) {
+    base64_encode(in, len, out);
+    out += len + 1;
+  }
+  return static_cast<uint32_t>(out - start);
+}
+
+static uint32_t decode_scalar(const uint8_t* in, uint32_t len, uint8_t* out) {
+  uint8_t* start = out;
+  while (len >= 4) {
+    uint8_t a = kBase64DecodeTable[in[0]];
+    uint8_t b = kBase64DecodeTable[in[1]];
+    uint8_t c = kBase64DecodeTable[in[2]];
+    uint8_t d = kBase64DecodeTable[in[3]];
+    out[0] = static_cast<uint8_t>((a << 2) | (b >> 4));
+    out[1] = static_cast<uint8_t>(((b << 4) & 0xf0) | (c >> 2));
+    out[2] = static_cast<uint8_t>(((c << 6) & 0xc0) | d);
+    in += 4;
+    out += 3;
+    len -= 4;
+  }
+  if (len > 1) {
+    uint8_t tmp[4];
+    std::memcpy(tmp, in, len);
+    base64_decode(tmp, len);
+    std::memcpy(out, tmp, len - 1);
+    out += len - 1;
+  }
+  return static_cast<uint32_t>(out - start);
+}
+
+#ifdef THRIFT_BASE64_X86_SIMD
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_reshuffle_ssse3(__m128i in) {
+  in = _mm_shuffle_epi8(in, _mm_set_epi8(10, 11, 9, 10, 7, 8, 6, 7, 4, 5, 3, 4, 1, 2, 0, 1));
+  const __m128i t0 = _mm_and_si128(in, _mm_set1_epi32(0x0fc0fc00));
+  const __m128i t1 = _mm_mulhi_epu16(t0, _mm_set1_epi32(0x04000040));
+  const __m128i t2 = _mm_and_si128(in, _mm_set1_epi32(0x003f03f0));
+  const __m128i t3 = _mm_mullo_epi16(t2, _mm_set1_epi32(0x01000010));
+  return _mm_or_si128(t1, t3);
+}
+
+__attribute__((target("ssse3")))
+static inline __m128i enc_translate_ssse3(__m128i in) {
+  const __m128i lut = _mm_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4, -4, -4, -4, -4, -19, -16, 0, 0);
+  __m128i indices = _mm_subs_epu8(in, _mm_set1_epi8(51));
+  const __m128i mask = _mm_cmpgt_epi8(in, _mm_set1_epi8(25));
+  indices = _mm_sub_epi8(indices, mask);
+  return _mm_add_epi8(in, _mm_shuffle_epi8(lut, indices));
+}
+
+__attribute__((target("ssse3")))
+static uint32_t encode_ssse3(const uint8_t* in, uint32_t len, uint8_t* out) {
+  uint8_t* start = out;
+  // Each block reads 16 bytes but consumes 12
+  while (len >= 16) {
+    __m128i v = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    v = enc_translate_ssse3(enc_reshuffle_ssse3(v));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(out), v);
+    in += 12;
+    out += 16;
+    len -= 12;
+  }
+  out += encode_scalar(in, len, out);
+  return static_cast<uint32_t>(out - start);
+}
+
+// Returns false (leaving *out unset) if the block has non-base64 characters
+__attribute__((target("ssse3")))
+static inline bool dec_block_ssse3(__m128i str, __m128i* out) {
+  const __m128i lut_lo = _mm_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                       0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m128i lut_hi = _mm_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                       0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m128i lut_roll = _mm_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71, 0, 0, 0, 0, 0, 0, 0, 0);
+  const __m128i mask_2f = _mm_set1_epi8(0x2f);
+
+  const __m128i hi_nibbles = _mm_and_si128(_mm_srli_epi32(str, 4), mask_2f);
+  const __m128i lo_nibbles = _mm_and_si128(str, mask_2f);
+  const __m128i hi = _mm_shuffle_epi8(lut_hi, hi_nibbles);
+  const __m128i lo = _mm_shuffle_epi8(lut_lo, lo_nibbles);
+  if (_mm_movemask_epi8(_mm_cmpgt_epi8(_mm_and_si128(lo, hi), _mm_setzero_si128())) != 0) {
+    return false;
+  }
+  const __m128i eq_2f = _mm_cmpeq_epi8(str, mask_2f);
+  const __m128i roll = _mm_shuffle_epi8(lut_roll, _mm_add_epi8(eq_2f, hi_nibbles));
+  str = _mm_add_epi8(str, roll);
+
+  // Pack the 6-bit values into 12 bytes at the bottom of the register
+  const __m128i merged = _mm_maddubs_epi16(str, _mm_set1_epi32(0x01400140));
+  str = _mm_madd_epi16(merged, _mm_set1_epi32(0x00011000));
+  const __m128i pack = _mm_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+  *out = _mm_shuffle_epi8(str, pack);
+  return true;
+}
+
+__attribute__((target("ssse3")))
+static uint32_t decode_ssse3(const uint8_t* in, uint32_t len, uint8_t* out) {
+  uint8_t* start = out;
+  while (len >= 16) {
+    __m128i v;
+    if (dec_block_ssse3(_mm_loadu_si128(reinterpret_cast<const __m128i*>(in)), &v)) {
+      // Store 12 bytes; out may trail in by a quarter, so nothing unread is touched
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(out), v);
+      uint32_t last = static_cast<uint32_t>(_mm_cvtsi128_si32(_mm_srli_si128(v, 8)));
+      std::memcpy(out + 8, &last, 4);
+    } else {
+      decode_scalar(in, 16, out);
+    }
+    in += 16;
+    out += 12;
+    len -= 16;
+  }
+  out += decode_scalar(in, len, out);
+  return static_cast<uint32_t>(out - start);
+}
+
+__attribute__((target("avx2")))
+static uint32_t encode_avx2(const uint8_t* in, uint32_t len, uint8_t* out) {
+  uint8_t* start = out;
+  const __m256i shuf = _mm256_setr_epi8(1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10,
+                                        1, 0, 2, 1, 4, 3, 5, 4, 7, 6, 8, 7, 10, 9, 11, 10);
+  const __m256i lut = _mm256_setr_epi8(65, 71, -4, -4, -4, -4, -4, -4,
+                                       -4, -4, -4, -4, -19, -16, 0, 0,
+                                       65, 71, -4, -4, -4, -4, -4, -4,
+                                       -4, -4, -4, -4, -19, -16, 0, 0);
+  // Each block reads 12 bytes into each 128-bit lane (28 bytes in all) and
+  // consumes 24
+  while (len >= 28) {
+    __m128i lo = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in));
+    __m128i hi = _mm_loadu_si128(reinterpret_cast<const __m128i*>(in + 12));
+    __m256i v = _mm256_inserti128_si256(_mm256_castsi128_si256(lo), hi, 1);
+
+    v = _mm256_shuffle_epi8(v, shuf);
+    const __m256i t0 = _mm256_and_si256(v, _mm256_set1_epi32(0x0fc0fc00));
+    const __m256i t1 = _mm256_mulhi_epu16(t0, _mm256_set1_epi32(0x04000040));
+    const __m256i t2 = _mm256_and_si256(v, _mm256_set1_epi32(0x003f03f0));
+    const __m256i t3 = _mm256_mullo_epi16(t2, _mm256_set1_epi32(0x01000010));
+    v = _mm256_or_si256(t1, t3);
+
+    __m256i indices = _mm256_subs_epu8(v, _mm256_set1_epi8(51));
+    const __m256i mask = _mm256_cmpgt_epi8(v, _mm256_set1_epi8(25));
+    indices = _mm256_sub_epi8(indices, mask);
+    v = _mm256_add_epi8(v, _mm256_shuffle_epi8(lut, indices));
+
+    _mm256_storeu_si256(reinterpret_cast<__m256i*>(out), v);
+    in += 24;
+    out += 32;
+    len -= 24;
+  }
+  out += encode_ssse3(in, len, out);
+  return static_cast<uint32_t>(out - start);
+}
+
+__attribute__((target("avx2")))
+static uint32_t decode_avx2(const uint8_t* in, uint32_t len, uint8_t* out) {
+  uint8_t* start = out;
+  const __m256i lut_lo = _mm256_setr_epi8(0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                          0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a,
+                                          0x15, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11, 0x11,
+                                          0x11, 0x11, 0x13, 0x1a, 0x1b, 0x1b, 0x1b, 0x1a);
+  const __m256i lut_hi = _mm256_setr_epi8(0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                          0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10,
+                                          0x10, 0x10, 0x01, 0x02, 0x04, 0x08, 0x04, 0x08,
+                                          0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10, 0x10);
+  const __m256i lut_roll = _mm256_setr_epi8(0, 16, 19, 4, -65, -65, -71, -71,
+                                            0, 0, 0, 0, 0, 0, 0, 0,
+                                            0, 16, 19, 4, -65, -65, -71, -71,
+                                            0, 0, 0, 0, 0, 0, 0, 0);
+  const __m256i mask_2f = _mm256_set1_epi8(0x2f);
+  const __m256i pack = _mm256_setr_epi8(2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1,
+                                        2, 1, 0, 6, 5, 4, 10, 9, 8, 14, 13, 12, -1, -1, -1, -1);
+
+  while (len >= 32) {
+    __m256i str = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(in));
+    const __m256i hi_nibbles = _mm256_and_si256(_mm256_srli_epi32(str, 4), mask_2f);
+    const __m256i lo_nibbles = _mm256_and_si256(str, mask_2f);
+    const __m256i hi = _mm256_shuffle_epi8(lut_hi, hi_nibbles);
+    const __m256i lo = _mm256_shuffle_epi8(lut_lo, lo_nibbles);
+    if (!_mm256_testz_si256(lo, hi)) {
+      decode_scalar(in, 32, out);
+    } else {
+      const __m256i eq_2f = _mm256_cmpeq_epi8(str, mask_2f);
+      const __m256i roll = _mm256_shuffle_epi8(lut_roll, _mm256_add_epi8(eq_2f, hi_nibbles));
+      str = _mm256_add_epi8(str, roll);
+
+      const __m256i merged = _mm256_maddubs_epi16(str, _mm256_set1_epi32(0x01400140));
+      str = _mm256_madd_epi16(merged, _mm256_set1_epi32(0x00011000));
+      str = _mm256_shuffle_epi8(str, pack);
+      // Move the two 12-byte lane results next to each other
+      str = _mm256_permutevar8x32_epi32(str, _mm256_setr_epi32(0, 1, 2, 4, 5, 6, 3, 7));
+
+      _mm_storeu_si128(reinterpret_cast<__m128i*>(out), _mm256_castsi256_si128(str));
+      _mm_storel_epi64(reinterpret_cast<__m128i*>(out + 16), _mm256_extracti128_si256(str, 1));
+    }
+    in += 32;
+    out += 24;
+    len -= 32;
+  }
+  out += decode_ssse3(in, len, out);
+  return static_cast<uint32_t>(out - start);
+}
+
+#endif // THRIFT_BASE64_X86_SIMD
+
+bool base64_impl_supported(Base64Impl impl) {
+#ifdef THRIFT_BASE64_X86_SIMD
+  // We may run from a static initializer, before libgcc has set this up
+  __builtin_cpu_init();
+#endif
+  switch (impl) {
+  case BASE64_IMPL_SCALAR:
+    return true;
+#ifdef THRIFT_BASE64_X86_SIMD
+  case BASE64_IMPL_SSSE3:
+    return __builtin_cpu_supports("ssse3");
+  case BASE64_IMPL_AVX2:
+    return __builtin_cpu_supports("avx2");
+#endif
+  default:
+    return false;
+  }
+}
+
+Base64Impl base64_best_impl() {
+  if (base64_impl_supported(BASE64_IMPL_AVX2)) {
+    return BASE64_IMPL_AVX2;
+  } else if (base64_impl_supported(BASE64_IMPL_SSSE3)) {
+    return BASE64_IMPL_SSSE3;
+  }
+  return BASE64_IMPL_SCALAR;
+}
+
+static const Base64Impl kBase64Impl = base64_best_impl();
+
+uint32_t base64_encode_buffer(const uint8_t* in, uint32_t len, uint8_t* out, Base64Impl impl) {
+  switch (impl) {
+#ifdef THRIFT_BASE64_X86_SIMD
+  case BASE64_IMPL_AVX2:
+    return encode_avx2(in, len, out);
+  case BASE64_IMPL_SSSE3:
+    return encode_ssse3(in, len, out);
+#endif
+  default:
+    return encode_scalar(in, len, out);
+  }
+}
+
+uint32_t base64_encode_buffer(const uint8_t* in, uint32_t len, uint8_t* out) {
+  return base64_encode_buffer(in, len, out, kBase64Impl);
+}
+
+uint32_t base64_decode_buffer(const uint8_t* in, uint32_t len, uint8_t* out, Base64Impl impl) {
+  switch (impl) {
+#ifdef THRIFT_BASE64_X86_SIMD
+  case BASE64_IMPL_AVX2:
+    return decode_avx2(in, len, out);
+  case BASE64_IMPL_SSSE3:
+    return decode_ssse3(in, len, out);
+#endif
+  default:
+    return decode_scalar(in, len, out);
+  }
+}
+
+uint32_t base64_decode_buffer(const uint8_t* in, uint32_t len, uint8_t* out) {
+  return base64_decode_buffer(in, len, out, kBase64Impl);
+}
 }
 }
 } // apache::thrift::protocol
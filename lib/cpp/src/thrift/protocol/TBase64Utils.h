@@ -38,6 +38,36 @@ void base64_encode(const uint8_t* in, uint32_t len, uint8_t* buf);
 // len is number of bytes to consume from input (must be 2, 3, or 4)
 // no '=' padding should be included in the input
 void base64_decode(uint8_t* buf, uint32_t len);
+
+// Implementations behind the whole-buffer functions below.  The best one the
+// CPU supports is picked at startup; the others are exposed for tests and
+// benchmarks.
+enum Base64Impl { BASE64_IMPL_SCALAR, BASE64_IMPL_SSSE3, BASE64_IMPL_AVX2 };
+
+bool base64_impl_supported(Base64Impl impl);
+
+Base64Impl base64_best_impl();
+
+// number of characters base64_encode_buffer() produces for len input bytes
+inline uint32_t base64_encoded_size(uint32_t len) {
+  return (len / 3) * 4 + (len % 3 ? len % 3 + 1 : 0);
+}
+
+// in must be at least len bytes
+// out must hold base64_encoded_size(len) bytes and may not overlap in
+// the data is not padded with '='; the caller can do this if desired
+// returns the number of characters written
+uint32_t base64_encode_buffer(const uint8_t* in, uint32_t len, uint8_t* out);
+uint32_t base64_encode_buffer(const uint8_t* in, uint32_t len, uint8_t* out, Base64Impl impl);
+
+// in must contain len base64 encoded values, with no '=' padding
+// out must hold len * 3 / 4 bytes; it may be the same buffer as in (to decode
+// in place) but may not otherwise overlap it
+// invalid characters decode to unspecified bytes, as with base64_decode()
+// a single leftover character at the end is ignored
+// returns the number of bytes written
+uint32_t base64_decode_buffer(const uint8_t* in, uint32_t len, uint8_t* out);
+uint32_t base64_decode_buffer(const uint8_t* in, uint32_t len, uint8_t* out, Base64Impl impl);
 }
 }
 } // apache::thrift::protocol
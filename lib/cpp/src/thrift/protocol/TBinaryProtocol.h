@@ -29,6 +29,84 @@ namespace apache {
 namespace thrift {
 namespace protocol {
 
+/**
+ * Computes the number of bytes TBinaryProtocolT would write for each value,
+ * without touching a transport.  Every size is either a constant or depends
+ * only on a string length, so structs made entirely of fixed-width fields
+ * fold down to a compile-time constant once inlined.
+ *
+ * Message headers are sized assuming strict writes (the default).
+ */
+class TBinaryProtocolSizer {
+public:
+  static uint32_t messageBeginSize(const std::string& name) {
+    return 4 + stringSize(name) + 4;
+  }
+
+  static uint32_t fieldBeginSize(const TType fieldType, const int16_t fieldId) {
+    (void)fieldType;
+    (void)fieldId;
+    return 3;
+  }
+
+  static uint32_t fieldStopSize() { return 1; }
+
+  static uint32_t mapBeginSize(const TType keyType, const TType valType, const uint32_t size) {
+    (void)keyType;
+    (void)valType;
+    (void)size;
+    return 6;
+  }
+
+  static uint32_t listBeginSize(const TType elemType, const uint32_t size) {
+    (void)elemType;
+    (void)size;
+    return 5;
+  }
+
+  static uint32_t setBeginSize(const TType elemType, const uint32_t size) {
+    (void)elemType;
+    (void)size;
+    return 5;
+  }
+
+  static uint32_t boolSize(const bool value) {
+    (void)value;
+    return 1;
+  }
+
+  static uint32_t byteSize(const int8_t byte) {
+    (void)byte;
+    return 1;
+  }
+
+  static uint32_t i16Size(const int16_t i16) {
+    (void)i16;
+    return 2;
+  }
+
+  static uint32_t i32Size(const int32_t i32) {
+    (void)i32;
+    return 4;
+  }
+
+  static uint32_t i64Size(const int64_t i64) {
+    (void)i64;
+    return 8;
+  }
+
+  static uint32_t doubleSize(const double dub) {
+    (void)dub;
+    return 8;
+  }
+
+  static uint32_t stringSize(const std::string& str) {
+    return 4 + static_cast<uint32_t>(str.size());
+  }
+
+  static uint32_t binarySize(const std::string& str) { return stringSize(str); }
+};
+
 /**
  * The default binary protocol for thrift. Writes all data in a very basic
  * binary format, essentially just spitting out the raw bytes.
@@ -41,6 +119,9 @@ public:
   static const int32_t VERSION_1 = ((int32_t)0x80010000);
   // VERSION_2 (0x80020000) was taken by TDenseProtocol (which has since been removed)
 
+  // Used by generated serializedSize<Protocol_>() methods.
+  typedef TBinaryProtocolSizer Sizer;
+
   TBinaryProtocolT(stdcxx::shared_ptr<Transport_> trans)
     : TVirtualProtocol<TBinaryProtocolT<Transport_, ByteOrder_> >(trans),
       trans_(trans.get()),
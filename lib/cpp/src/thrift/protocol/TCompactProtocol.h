@@ -29,6 +29,107 @@ namespace apache {
 namespace thrift {
 namespace protocol {
 
+/**
+ * Computes the number of bytes TCompactProtocolT would write for each value,
+ * without touching a transport.  Like the protocol itself it remembers the
+ * last field id so that delta-encoded field headers are sized correctly, so
+ * use one sizer per struct.
+ */
+class TCompactProtocolSizer {
+public:
+  TCompactProtocolSizer() : lastFieldId_(0), boolFieldPending_(false) {}
+
+  static uint32_t messageBeginSize(const std::string& name, const int32_t seqid) {
+    return 2 + varint32Size(static_cast<uint32_t>(seqid)) + stringSize(name);
+  }
+
+  uint32_t fieldBeginSize(const TType fieldType, const int16_t fieldId) {
+    // Boolean field values are folded into the field header.
+    boolFieldPending_ = (fieldType == T_BOOL);
+    uint32_t size = 1;
+    if (!(fieldId > lastFieldId_ && fieldId - lastFieldId_ <= 15)) {
+      size += i16Size(fieldId);
+    }
+    lastFieldId_ = fieldId;
+    return size;
+  }
+
+  static uint32_t fieldStopSize() { return 1; }
+
+  static uint32_t mapBeginSize(const TType keyType, const TType valType, const uint32_t size) {
+    (void)keyType;
+    (void)valType;
+    return size == 0 ? 1 : varint32Size(size) + 1;
+  }
+
+  static uint32_t listBeginSize(const TType elemType, const uint32_t size) {
+    (void)elemType;
+    return size <= 14 ? 1 : 1 + varint32Size(size);
+  }
+
+  static uint32_t setBeginSize(const TType elemType, const uint32_t size) {
+    return listBeginSize(elemType, size);
+  }
+
+  uint32_t boolSize(const bool value) {
+    (void)value;
+    if (boolFieldPending_) {
+      boolFieldPending_ = false;
+      return 0;
+    }
+    return 1;
+  }
+
+  static uint32_t byteSize(const int8_t byte) {
+    (void)byte;
+    return 1;
+  }
+
+  static uint32_t i16Size(const int16_t i16) { return i32Size(i16); }
+
+  static uint32_t i32Size(const int32_t i32) {
+    return varint32Size((static_cast<uint32_t>(i32) << 1) ^ static_cast<uint32_t>(i32 >> 31));
+  }
+
+  static uint32_t i64Size(const int64_t i64) {
+    return varint64Size((static_cast<uint64_t>(i64) << 1) ^ static_cast<uint64_t>(i64 >> 63));
+  }
+
+  static uint32_t doubleSize(const double dub) {
+    (void)dub;
+    return 8;
+  }
+
+  static uint32_t stringSize(const std::string& str) {
+    uint32_t ssize = static_cast<uint32_t>(str.size());
+    return varint32Size(ssize) + ssize;
+  }
+
+  static uint32_t binarySize(const std::string& str) { return stringSize(str); }
+
+  static uint32_t varint32Size(uint32_t n) {
+    uint32_t size = 1;
+    while (n > 0x7f) {
+      n >>= 7;
+      ++size;
+    }
+    return size;
+  }
+
+  static uint32_t varint64Size(uint64_t n) {
+    uint32_t size = 1;
+    while (n > 0x7f) {
+      n >>= 7;
+      ++size;
+    }
+    return size;
+  }
+
+private:
+  int16_t lastFieldId_;
+  bool boolFieldPending_;
+};
+
 /**
  * C++ Implementation of the Compact Protocol as described in THRIFT-110
  */
@@ -39,6 +140,9 @@ public:
   static const int8_t VERSION_N = 1;
   static const int8_t VERSION_MASK = 0x1f;       // 0001 1111
 
+  // Used by generated serializedSize<Protocol_>() methods.
+  typedef TCompactProtocolSizer Sizer;
+
 protected:
   static const int8_t TYPE_MASK = (int8_t)0xE0u; // 1110 0000
   static const int8_t TYPE_BITS = 0x07;          // 0000 0111
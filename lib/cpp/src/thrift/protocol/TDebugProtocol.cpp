@@ -23,6 +23,7 @@
 #include <cassert>
 #include <cctype>
 #include <cstdio>
+#include <cstring>
 #include <stdexcept>
 #include <boost/static_assert.hpp>
 
@@ -41,7 +42,7 @@ namespace apache {
 namespace thrift {
 namespace protocol {
 
-string TDebugProtocol::fieldTypeName(TType type) {
+static const char* type_name(TType type) {
   switch (type) {
   case T_STOP:
     return "stop";
@@ -80,6 +81,10 @@ string TDebugProtocol::fieldTypeName(TType type) {
   }
 }
 
+string TDebugProtocol::fieldTypeName(TType type) {
+  return type_name(type);
+}
+
 void TDebugProtocol::indentUp() {
   indent_str_ += string(indent_inc, ' ');
 }
@@ -389,6 +394,383 @@ uint32_t TDebugProtocol::writeBinary(const string& str) {
   // XXX Hex?
   return TDebugProtocol::writeString(str);
 }
+
+void TDebugBufferProtocol::put(const char* str, uint32_t len) {
+  if (truncated_) {
+    return;
+  }
+  uint32_t room = cap_ - pos_;
+  if (len <= room) {
+    std::memcpy(buf_ + pos_, str, len);
+    pos_ += len;
+    return;
+  }
+
+  // Fill what is left and mark the cut.
+  std::memcpy(buf_ + pos_, str, room);
+  pos_ = cap_;
+  truncated_ = true;
+  uint32_t mark = cap_ < 3 ? cap_ : 3;
+  std::memcpy(buf_ + cap_ - mark, "...", mark);
+}
+
+void TDebugBufferProtocol::putIndent() {
+  static const char spaces[] = "                                "; // 32
+  uint32_t left = indent_;
+  while (left > 0) {
+    uint32_t n = (std::min)(left, static_cast<uint32_t>(sizeof(spaces) - 1));
+    put(spaces, n);
+    left -= n;
+  }
+}
+
+bool TDebugBufferProtocol::startItem() {
+  Frame& frame = frames_[depth_];
+  char idx[16];
+  int len;
+
+  switch (frame.state) {
+  case UNINIT:
+  case STRUCT:
+    return true;
+  case SET:
+  case MAP_KEY:
+    if (frame.items++ >= max_elems_) {
+      return false;
+    }
+    putIndent();
+    return true;
+  case MAP_VALUE:
+    // The key bumped the count; the value follows its key.
+    if (frame.items > max_elems_) {
+      return false;
+    }
+    put(" -> ", 4);
+    return true;
+  case LIST:
+    if (frame.items >= max_elems_) {
+      frame.items++;
+      return false;
+    }
+    len = std::snprintf(idx, sizeof(idx), "[%u] = ", frame.items++);
+    putIndent();
+    put(idx, static_cast<uint32_t>(len));
+    return true;
+  default:
+    throw std::logic_error("Invalid enum value.");
+  }
+}
+
+void TDebugBufferProtocol::endItem(bool visible) {
+  Frame& frame = frames_[depth_];
+
+  switch (frame.state) {
+  case UNINIT:
+    return;
+  case MAP_KEY:
+    frame.state = MAP_VALUE;
+    return;
+  case MAP_VALUE:
+    frame.state = MAP_KEY;
+    break;
+  default:
+    break;
+  }
+  if (visible) {
+    put(",\n", 2);
+  }
+}
+
+uint32_t TDebugBufferProtocol::writeItem(const char* str, uint32_t len) {
+  if (muted_) {
+    return 0;
+  }
+  uint32_t start = pos_;
+  bool visible = startItem();
+  if (visible) {
+    put(str, len);
+  }
+  endItem(visible);
+  return pos_ - start;
+}
+
+uint32_t TDebugBufferProtocol::beginNested(write_state_t state,
+                                           const char* prefix,
+                                           const char* name,
+                                           TType elemType,
+                                           TType valType,
+                                           uint32_t size) {
+  if (muted_) {
+    ++muted_;
+    return 0;
+  }
+  uint32_t start = pos_;
+  bool visible = startItem();
+  if (!visible) {
+    // Past max_elems_: swallow everything up to the matching end.
+    muted_ = 1;
+    elided_visible_ = false;
+    return pos_ - start;
+  }
+
+  if (name) {
+    put(name);
+  } else {
+    char num[16];
+    int len = std::snprintf(num, sizeof(num), "[%u]", size);
+    put(prefix);
+    put(type_name(elemType));
+    if (state == MAP_KEY) {
+      put(",", 1);
+      put(type_name(valType));
+    }
+    put(">", 1);
+    put(num, static_cast<uint32_t>(len));
+  }
+
+  if (depth_ >= max_depth_) {
+    put(" {...}", 6);
+    muted_ = 1;
+    elided_visible_ = true;
+    return pos_ - start;
+  }
+
+  put(" {\n", 3);
+  indent_ += indent_inc;
+  ++depth_;
+  frames_[depth_].state = state;
+  frames_[depth_].items = 0;
+  return pos_ - start;
+}
+
+uint32_t TDebugBufferProtocol::endNested() {
+  uint32_t start = pos_;
+  if (muted_) {
+    if (--muted_ == 0) {
+      endItem(elided_visible_);
+    }
+    return pos_ - start;
+  }
+
+  if (depth_ == 0) {
+    throw TProtocolException(TProtocolException::INVALID_DATA);
+  }
+  if (frames_[depth_].state != STRUCT && frames_[depth_].items > max_elems_) {
+    putIndent();
+    put("...\n", 4);
+  }
+  --depth_;
+  indent_ -= indent_inc;
+  putIndent();
+  put("}", 1);
+  endItem(true);
+  return pos_ - start;
+}
+
+uint32_t TDebugBufferProtocol::writeMessageBegin(const std::string& name,
+                                                 const TMessageType messageType,
+                                                 const int32_t seqid) {
+  (void)seqid;
+  const char* mtype = "";
+  switch (messageType) {
+  case T_CALL:
+    mtype = "(call) ";
+    break;
+  case T_REPLY:
+    mtype = "(reply) ";
+    break;
+  case T_EXCEPTION:
+    mtype = "(exn) ";
+    break;
+  case T_ONEWAY:
+    mtype = "(oneway) ";
+    break;
+  }
+
+  uint32_t start = pos_;
+  putIndent();
+  put(mtype);
+  put(name.data(), static_cast<uint32_t>(name.length()));
+  put("(", 1);
+  indent_ += indent_inc;
+  return pos_ - start;
+}
+
+uint32_t TDebugBufferProtocol::writeMessageEnd() {
+  if (indent_ < indent_inc) {
+    throw TProtocolException(TProtocolException::INVALID_DATA);
+  }
+  uint32_t start = pos_;
+  indent_ -= indent_inc;
+  putIndent();
+  put(")\n", 2);
+  return pos_ - start;
+}
+
+uint32_t TDebugBufferProtocol::writeStructBegin(const char* name) {
+  return beginNested(STRUCT, NULL, name, T_STOP, T_STOP, 0);
+}
+
+uint32_t TDebugBufferProtocol::writeStructEnd() {
+  return endNested();
+}
+
+uint32_t TDebugBufferProtocol::writeFieldBegin(const char* name,
+                                               const TType fieldType,
+                                               const int16_t fieldId) {
+  if (muted_) {
+    return 0;
+  }
+  char id[16];
+  int len = std::snprintf(id, sizeof(id), "%02d: ", (int)fieldId);
+
+  uint32_t start = pos_;
+  putIndent();
+  put(id, static_cast<uint32_t>(len));
+  put(name);
+  put(" (", 2);
+  put(type_name(fieldType));
+  put(") = ", 4);
+  return pos_ - start;
+}
+
+uint32_t TDebugBufferProtocol::writeMapBegin(const TType keyType,
+                                             const TType valType,
+                                             const uint32_t size) {
+  return beginNested(MAP_KEY, "map<", NULL, keyType, valType, size);
+}
+
+uint32_t TDebugBufferProtocol::writeMapEnd() {
+  return endNested();
+}
+
+uint32_t TDebugBufferProtocol::writeListBegin(const TType elemType, const uint32_t size) {
+  return beginNested(LIST, "list<", NULL, elemType, T_STOP, size);
+}
+
+uint32_t TDebugBufferProtocol::writeListEnd() {
+  return endNested();
+}
+
+uint32_t TDebugBufferProtocol::writeSetBegin(const TType elemType, const uint32_t size) {
+  return beginNested(SET, "set<", NULL, elemType, T_STOP, size);
+}
+
+uint32_t TDebugBufferProtocol::writeSetEnd() {
+  return endNested();
+}
+
+uint32_t TDebugBufferProtocol::writeBool(const bool value) {
+  return value ? writeItem("true", 4) : writeItem("false", 5);
+}
+
+uint32_t TDebugBufferProtocol::writeByte(const int8_t byte) {
+  char buf[8];
+  int len = std::snprintf(buf, sizeof(buf), "0x%02x", (int)(uint8_t)byte);
+  return writeItem(buf, static_cast<uint32_t>(len));
+}
+
+uint32_t TDebugBufferProtocol::writeI16(const int16_t i16) {
+  char buf[8];
+  int len = std::snprintf(buf, sizeof(buf), "%d", (int)i16);
+  return writeItem(buf, static_cast<uint32_t>(len));
+}
+
+uint32_t TDebugBufferProtocol::writeI32(const int32_t i32) {
+  char buf[16];
+  int len = std::snprintf(buf, sizeof(buf), "%d", i32);
+  return writeItem(buf, static_cast<uint32_t>(len));
+}
+
+uint32_t TDebugBufferProtocol::writeI64(const int64_t i64) {
+  char buf[24];
+  int len = std::snprintf(buf, sizeof(buf), "%" PRId64, i64);
+  return writeItem(buf, static_cast<uint32_t>(len));
+}
+
+uint32_t TDebugBufferProtocol::writeDouble(const double dub) {
+  // Same precision as to_string(double)
+  char buf[32];
+  int len = std::snprintf(buf, sizeof(buf), "%.17g", dub);
+  return writeItem(buf, static_cast<uint32_t>(len));
+}
+
+uint32_t TDebugBufferProtocol::writeString(const string& str) {
+  if (muted_) {
+    return 0;
+  }
+  uint32_t start = pos_;
+  bool visible = startItem();
+  if (visible) {
+    string::size_type len = str.length();
+    bool clipped = len > (string::size_type)string_limit_;
+    if (clipped) {
+      len = (std::min)(len, (string::size_type)string_prefix_size_);
+    }
+
+    // Copy runs of printable characters in one go, escape the rest.
+    const char* data = str.data();
+    const char* run = data;
+    put("\"", 1);
+    for (const char* it = data; it != data + len; ++it) {
+      const char* esc;
+      char hex[5];
+      switch (*it) {
+      case '\\':
+        esc = "\\\\";
+        break;
+      case '"':
+        esc = "\\\"";
+        break;
+      case '\a':
+        esc = "\\a";
+        break;
+      case '\b':
+        esc = "\\b";
+        break;
+      case '\f':
+        esc = "\\f";
+        break;
+      case '\n':
+        esc = "\\n";
+        break;
+      case '\r':
+        esc = "\\r";
+        break;
+      case '\t':
+        esc = "\\t";
+        break;
+      case '\v':
+        esc = "\\v";
+        break;
+      default:
+        // passing characters <0 to std::isprint causes asserts.
+        if (std::isprint((unsigned char)*it)) {
+          continue;
+        }
+        std::snprintf(hex, sizeof(hex), "\\x%02x", (int)(uint8_t)*it);
+        esc = hex;
+      }
+      put(run, static_cast<uint32_t>(it - run));
+      put(esc);
+      run = it + 1;
+    }
+    put(run, static_cast<uint32_t>(data + len - run));
+
+    if (clipped) {
+      char size[32];
+      int n = std::snprintf(size, sizeof(size), "[...](%lu)", (unsigned long)str.length());
+      put(size, static_cast<uint32_t>(n));
+    }
+    put("\"", 1);
+  }
+  endItem(visible);
+  return pos_ - start;
+}
+
+uint32_t TDebugBufferProtocol::writeBinary(const string& str) {
+  return TDebugBufferProtocol::writeString(str);
+}
 }
 }
 } // apache::thrift::protocol
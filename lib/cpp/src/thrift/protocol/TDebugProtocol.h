@@ -24,6 +24,8 @@
 
 #include <thrift/stdcxx.h>
 
+#include <cstring>
+
 namespace apache {
 namespace thrift {
 namespace protocol {
@@ -133,6 +135,159 @@ private:
   std::vector<int> list_idx_;
 };
 
+/**
+ * Streaming variant of TDebugProtocol for logging hot paths.
+ *
+ * Produces the same text as TDebugProtocol, but writes it straight into a
+ * caller-provided character buffer and does not allocate.  Output is cut
+ * short rather than grown:
+ *  - once the buffer is full its last bytes are replaced by "...",
+ *  - containers print at most max_elems elements, followed by a "..." line,
+ *  - structs and containers nested deeper than max_depth print as "{...}".
+ * Strings are clipped like TDebugProtocol's (string limit and prefix size).
+ *
+ * There is no underlying transport; reading is not supported.
+ */
+class TDebugBufferProtocol : public TVirtualProtocol<TDebugBufferProtocol> {
+private:
+  enum write_state_t { UNINIT, STRUCT, LIST, SET, MAP_KEY, MAP_VALUE };
+
+  struct Frame {
+    write_state_t state;
+    uint32_t items;
+  };
+
+public:
+  TDebugBufferProtocol(char* buf, uint32_t len)
+    : TVirtualProtocol<TDebugBufferProtocol>(stdcxx::shared_ptr<TTransport>()),
+      max_elems_(DEFAULT_MAX_ELEMS),
+      max_depth_(DEFAULT_MAX_DEPTH),
+      string_limit_(TDebugProtocol::DEFAULT_STRING_LIMIT),
+      string_prefix_size_(TDebugProtocol::DEFAULT_STRING_PREFIX_SIZE) {
+    resetBuffer(buf, len);
+  }
+
+  static const uint32_t DEFAULT_MAX_ELEMS = 16;
+  static const uint32_t DEFAULT_MAX_DEPTH = 8;
+  static const uint32_t MAX_DEPTH = 32;
+
+  /**
+   * Start over with a new output buffer, keeping the limits.
+   */
+  void resetBuffer(char* buf, uint32_t len) {
+    buf_ = buf;
+    cap_ = len;
+    pos_ = 0;
+    truncated_ = false;
+    indent_ = 0;
+    depth_ = 0;
+    muted_ = 0;
+    elided_visible_ = false;
+    frames_[0].state = UNINIT;
+    frames_[0].items = 0;
+  }
+
+  void setMaxContainerElements(uint32_t max_elems) { max_elems_ = max_elems; }
+
+  void setMaxDepth(uint32_t max_depth) {
+    max_depth_ = max_depth < MAX_DEPTH ? max_depth : MAX_DEPTH;
+  }
+
+  void setStringSizeLimit(int32_t string_limit) { string_limit_ = string_limit; }
+
+  void setStringPrefixSize(int32_t string_prefix_size) { string_prefix_size_ = string_prefix_size; }
+
+  /**
+   * Number of bytes written to the buffer so far.
+   */
+  uint32_t size() const { return pos_; }
+
+  /**
+   * Whether the output was cut short because the buffer filled up.
+   */
+  bool truncated() const { return truncated_; }
+
+  uint32_t writeMessageBegin(const std::string& name,
+                             const TMessageType messageType,
+                             const int32_t seqid);
+
+  uint32_t writeMessageEnd();
+
+  uint32_t writeStructBegin(const char* name);
+
+  uint32_t writeStructEnd();
+
+  uint32_t writeFieldBegin(const char* name, const TType fieldType, const int16_t fieldId);
+
+  uint32_t writeFieldEnd() { return 0; }
+
+  uint32_t writeFieldStop() { return 0; }
+
+  uint32_t writeMapBegin(const TType keyType, const TType valType, const uint32_t size);
+
+  uint32_t writeMapEnd();
+
+  uint32_t writeListBegin(const TType elemType, const uint32_t size);
+
+  uint32_t writeListEnd();
+
+  uint32_t writeSetBegin(const TType elemType, const uint32_t size);
+
+  uint32_t writeSetEnd();
+
+  uint32_t writeBool(const bool value);
+
+  uint32_t writeByte(const int8_t byte);
+
+  uint32_t writeI16(const int16_t i16);
+
+  uint32_t writeI32(const int32_t i32);
+
+  uint32_t writeI64(const int64_t i64);
+
+  uint32_t writeDouble(const double dub);
+
+  uint32_t writeString(const std::string& str);
+
+  uint32_t writeBinary(const std::string& str);
+
+private:
+  void put(const char* str, uint32_t len);
+  void put(const char* str) { put(str, static_cast<uint32_t>(std::strlen(str))); }
+  void putIndent();
+  bool startItem();
+  void endItem(bool visible);
+  uint32_t writeItem(const char* str, uint32_t len);
+  uint32_t beginNested(write_state_t state,
+                       const char* prefix,
+                       const char* name,
+                       TType elemType,
+                       TType valType,
+                       uint32_t size);
+  uint32_t endNested();
+
+  char* buf_;
+  uint32_t cap_;
+  uint32_t pos_;
+  bool truncated_;
+
+  uint32_t max_elems_;
+  uint32_t max_depth_;
+  int32_t string_limit_;
+  int32_t string_prefix_size_;
+
+  uint32_t indent_;
+  static const uint32_t indent_inc = 2;
+
+  // frames_[0] is the top level, frames_[depth_] the innermost open struct or
+  // container.  While muted_ is non-zero we are inside an elided struct or
+  // container (muted_ counts its nesting) and nothing is printed.
+  Frame frames_[MAX_DEPTH + 1];
+  uint32_t depth_;
+  uint32_t muted_;
+  bool elided_visible_;
+};
+
 /**
  * Constructs debug protocol handlers
  */
@@ -171,6 +326,21 @@ std::string ThriftDebugString(const ThriftStruct& ts) {
   return std::string((char*)buf, (unsigned int)size);
 }
 
+/**
+ * Renders ts into buf with TDebugBufferProtocol's default limits, without
+ * allocating.  The result is always NUL-terminated; returns its length.
+ */
+template <typename ThriftStruct>
+uint32_t ThriftDebugString(const ThriftStruct& ts, char* buf, uint32_t len) {
+  if (len == 0) {
+    return 0;
+  }
+  protocol::TDebugBufferProtocol protocol(buf, len - 1);
+  ts.write(&protocol);
+  buf[protocol.size()] = '\0';
+  return protocol.size();
+}
+
 // TODO(dreiss): This is badly broken.  Don't use it unless you are me.
 #if 0
 template<typename Object>
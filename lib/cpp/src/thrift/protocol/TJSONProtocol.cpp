@@ -23,6 +23,7 @@
 #include <boost/math/special_functions/fpclassify.hpp>
 #include <boost/math/special_functions/sign.hpp>
 
+#include <algorithm>
 #include <cmath>
 #include <limits>
 #include <locale>
@@ -477,24 +478,27 @@ uint32_t TJSONProtocol::writeJSONBase64(const std::string& str) {
   uint32_t result = context_->write(*trans_);
   result += 2; // For quotes
   trans_->write(&kJSONStringDelimiter, 1);
-  uint8_t b[4];
-  const uint8_t* bytes = (const uint8_t*)str.c_str();
-  if (str.length() > (std::numeric_limits<uint32_t>::max)())
+  const uint8_t* bytes = (const uint8_t*)str.data();
+  if (str.length() > (std::numeric_limits<uint32_t>::max)() / 4 * 3)
     throw TProtocolException(TProtocolException::SIZE_LIMIT);
   uint32_t len = static_cast<uint32_t>(str.length());
-  while (len >= 3) {
-    // Encode 3 bytes at a time
-    base64_encode(bytes, 3, b);
-    trans_->write(b, 4);
-    result += 4;
-    bytes += 3;
-    len -= 3;
-  }
-  if (len) { // Handle remainder
-    base64_encode(bytes, len, b);
-    trans_->write(b, len + 1);
-    result += len + 1;
+  uint32_t encoded = base64_encoded_size(len);
+
+  TMemoryBuffer* mem = dynamic_cast<TMemoryBuffer*>(trans_);
+  if (mem) {
+    // Encode straight into the transport's buffer
+    uint8_t* out = mem->getWritePtr(encoded);
+    mem->wroteBytes(base64_encode_buffer(bytes, len, out));
+  } else {
+    uint8_t b[4096];
+    while (len > 0) {
+      uint32_t chunk = (std::min)(len, static_cast<uint32_t>(sizeof(b) / 4 * 3));
+      trans_->write(b, base64_encode_buffer(bytes, chunk, b));
+      bytes += chunk;
+      len -= chunk;
+    }
   }
+  result += encoded;
   trans_->write(&kJSONStringDelimiter, 1);
   return result;
 }
@@ -799,30 +803,25 @@ uint32_t TJSONProtocol::readJSONString(std::string& str, bool skipContext) {
 uint32_t TJSONProtocol::readJSONBase64(std::string& str) {
   std::string tmp;
   uint32_t result = readJSONString(tmp);
-  uint8_t* b = (uint8_t*)tmp.c_str();
   if (tmp.length() > (std::numeric_limits<uint32_t>::max)())
     throw TProtocolException(TProtocolException::SIZE_LIMIT);
   uint32_t len = static_cast<uint32_t>(tmp.length());
-  str.clear();
   // Ignore padding
   if (len >= 2)  {
     uint32_t bound = len - 2;
-    for (uint32_t i = len - 1; i >= bound && b[i] == '='; --i) {
+    for (uint32_t i = len - 1; i >= bound && tmp[i] == '='; --i) {
       --len;
     }
   }
-  while (len >= 4) {
-    base64_decode(b, 4);
-    str.append((const char*)b, 3);
-    b += 4;
-    len -= 4;
-  }
-  // Don't decode if we hit the end or got a single leftover byte (invalid
-  // base64 but legal for skip of regular string type)
-  if (len > 1) {
-    base64_decode(b, len);
-    str.append((const char*)b, len - 1);
+  // Decode in place; a single leftover byte (invalid base64 but legal for
+  // skip of regular string type) is dropped
+  if (len) {
+    uint8_t* b = (uint8_t*)&tmp[0];
+    tmp.resize(base64_decode_buffer(b, len, b));
+  } else {
+    tmp.clear();
   }
+  str.swap(tmp);
   return result;
 }
 
@@ -0,0 +1,89 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_PROTOCOL_TSPECIALIZEDPROTOCOLFACTORY_H_
+#define _THRIFT_PROTOCOL_TSPECIALIZEDPROTOCOLFACTORY_H_ 1
+
+#include <thrift/protocol/TProtocol.h>
+#include <thrift/transport/TTransportException.h>
+
+#include <string>
+#include <typeinfo>
+
+namespace apache {
+namespace thrift {
+namespace protocol {
+
+/**
+ * Protocol factory for servers that run a processor generated with
+ * "--gen cpp:templates" instantiated on a concrete protocol, e.g.
+ * FooProcessorT<TCompactProtocolT<TMemoryBuffer> >.
+ *
+ * TDispatchProcessorT only takes the devirtualised processFast() path when
+ * both protocols handed to it by the server are exactly Protocol_; otherwise
+ * it quietly falls back to virtual dispatch.  TBinaryProtocolFactoryT and
+ * TCompactProtocolFactoryT also fall back quietly to a generic protocol when
+ * the server's transport is not the one they were instantiated on.  This
+ * factory wraps one of those and throws TTransportException::BAD_ARGS instead,
+ * so a server whose transports do not match the processor fails loudly rather
+ * than running the slow path.
+ *
+ * The transport to instantiate on depends on the server:
+ *  - TNonblockingServer reads and writes through TMemoryBuffer (with the
+ *    default transport factories).
+ *  - TServerFramework based servers use whatever their transport factory
+ *    returns, e.g. TFramedTransport for TFramedTransportFactory.
+ * TBufferBase covers both of these.
+ */
+template <class Protocol_>
+class TSpecializedProtocolFactory : public TProtocolFactory {
+public:
+  TSpecializedProtocolFactory(stdcxx::shared_ptr<TProtocolFactory> factory) : factory_(factory) {}
+
+  virtual ~TSpecializedProtocolFactory() {}
+
+  stdcxx::shared_ptr<TProtocol> getProtocol(stdcxx::shared_ptr<TTransport> trans) {
+    return check(factory_->getProtocol(trans));
+  }
+
+  stdcxx::shared_ptr<TProtocol> getProtocol(stdcxx::shared_ptr<TTransport> inTrans,
+                                            stdcxx::shared_ptr<TTransport> outTrans) {
+    return check(factory_->getProtocol(inTrans, outTrans));
+  }
+
+  stdcxx::shared_ptr<TProtocolFactory> getUnderlyingFactory() const { return factory_; }
+
+private:
+  stdcxx::shared_ptr<TProtocol> check(const stdcxx::shared_ptr<TProtocol>& prot) {
+    if (dynamic_cast<Protocol_*>(prot.get()) == NULL) {
+      throw transport::TTransportException(transport::TTransportException::BAD_ARGS,
+                                           std::string("TSpecializedProtocolFactory: got ")
+                                           + (prot ? typeid(*prot).name() : "NULL")
+                                           + ", expected " + typeid(Protocol_).name());
+    }
+    return prot;
+  }
+
+  stdcxx::shared_ptr<TProtocolFactory> factory_;
+};
+}
+}
+} // apache::thrift::protocol
+
+#endif // #define _THRIFT_PROTOCOL_TSPECIALIZEDPROTOCOLFACTORY_H_ 1
@@ -0,0 +1,69 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/server/TCoDel.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+TCoDel::TCoDel(int64_t targetUsec, int64_t intervalUsec)
+  : targetUsec_(targetUsec),
+    intervalUsec_(intervalUsec),
+    intervalEnd_(0),
+    minDelay_(0),
+    resetDelay_(true),
+    overloaded_(false) {
+}
+
+bool TCoDel::shouldShed(int64_t delayUsec, int64_t nowUsec) {
+  const int64_t target = targetUsec_.load(boost::memory_order_relaxed);
+
+  // Close the interval; testing before the exchange keeps the flag's cache
+  // line shared in the common case
+  if (nowUsec > intervalEnd_.load(boost::memory_order_relaxed)
+      && !resetDelay_.load(boost::memory_order_acquire) && !resetDelay_.exchange(true)) {
+    intervalEnd_.store(nowUsec + intervalUsec_.load(boost::memory_order_relaxed),
+                       boost::memory_order_relaxed);
+    overloaded_.store(minDelay_.load(boost::memory_order_relaxed) > target,
+                      boost::memory_order_relaxed);
+  }
+
+  // Exactly one thread restarts the minimum, after the interval was closed
+  if (resetDelay_.load(boost::memory_order_acquire) && resetDelay_.exchange(false)) {
+    minDelay_.store(delayUsec, boost::memory_order_relaxed);
+    // The very first request starts the first interval
+    int64_t unset = 0;
+    intervalEnd_.compare_exchange_strong(unset,
+                                         nowUsec + intervalUsec_.load(boost::memory_order_relaxed),
+                                         boost::memory_order_relaxed);
+    // More than one request has to arrive in an interval before shedding
+    return false;
+  }
+
+  int64_t minDelay = minDelay_.load(boost::memory_order_relaxed);
+  while (delayUsec < minDelay
+         && !minDelay_.compare_exchange_weak(minDelay, delayUsec, boost::memory_order_relaxed)) {
+  }
+
+  return overloaded_.load(boost::memory_order_relaxed) && delayUsec > 2 * target;
+}
+}
+}
+} // apache::thrift::server
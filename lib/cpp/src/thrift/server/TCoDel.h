@@ -0,0 +1,98 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TCODEL_H_
+#define _THRIFT_SERVER_TCODEL_H_ 1
+
+#include <boost/atomic.hpp>
+#include <stdint.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * Adaptive load shedding based on how long requests waited in a queue,
+ * after the CoDel (controlled delay) queue management algorithm.
+ *
+ * Every request reports its queueing delay as it is dequeued.  The smallest
+ * delay seen during an interval tells whether the queue ever drained: if
+ * even the luckiest request waited longer than the target, the queue is
+ * standing and the server is overloaded for the next interval.  While
+ * overloaded, requests that waited more than twice the target are shed, so
+ * the work that is done is work whose caller is likely still waiting.
+ * Unlike a fixed queue length limit this adapts to how expensive requests
+ * actually are, and unlike proper CoDel it does not adjust the interval
+ * between drops, which behaves better for RPC servers.
+ *
+ * All methods are thread safe and lock free.
+ */
+class TCoDel {
+public:
+  /**
+   * @param targetUsec    acceptable queueing delay in microseconds.
+   * @param intervalUsec  how often the overload state is re-evaluated.
+   */
+  explicit TCoDel(int64_t targetUsec = 5000, int64_t intervalUsec = 100000);
+
+  /**
+   * Reports that a request waited delayUsec before being dequeued at
+   * nowUsec (any monotonic microsecond clock, used consistently).
+   *
+   * @return true if the request should be shed rather than processed.
+   */
+  bool shouldShed(int64_t delayUsec, int64_t nowUsec);
+
+  /**
+   * Whether the last completed interval found a standing queue.
+   */
+  bool isOverloaded() const { return overloaded_.load(boost::memory_order_relaxed); }
+
+  int64_t getTarget() const { return targetUsec_.load(boost::memory_order_relaxed); }
+  void setTarget(int64_t targetUsec) { targetUsec_.store(targetUsec, boost::memory_order_relaxed); }
+
+  int64_t getInterval() const { return intervalUsec_.load(boost::memory_order_relaxed); }
+  void setInterval(int64_t intervalUsec) {
+    intervalUsec_.store(intervalUsec, boost::memory_order_relaxed);
+  }
+
+private:
+  boost::atomic<int64_t> targetUsec_;
+  boost::atomic<int64_t> intervalUsec_;
+
+  /// End of the current interval
+  boost::atomic<int64_t> intervalEnd_;
+
+  /// Smallest delay seen in the current interval
+  boost::atomic<int64_t> minDelay_;
+
+  /// Set by the thread that closed an interval until minDelay_ is restarted
+  boost::atomic<bool> resetDelay_;
+
+  boost::atomic<bool> overloaded_;
+
+  // not copyable
+  TCoDel(const TCoDel&);
+  TCoDel& operator=(const TCoDel&);
+};
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TCODEL_H_
@@ -42,58 +42,84 @@ TConnectedClient::TConnectedClient(const shared_ptr<TProcessor>& processor,
     outputProtocol_(outputProtocol),
     eventHandler_(eventHandler),
     client_(client),
-    opaqueContext_(0) {
+    opaqueContext_(0),
+    contextCreated_(false) {
 }
 
 TConnectedClient::~TConnectedClient() {
 }
 
+void TConnectedClient::setFlightRecorder(const shared_ptr<TFlightRecorder>& flightRecorder) {
+  flightRecorder_ = flightRecorder;
+  record_.clear();
+  markPhase(TFlightRecorder::ACCEPTED);
+}
+
 void TConnectedClient::run() {
-  if (eventHandler_) {
-    opaqueContext_ = eventHandler_->createContext(inputProtocol_, outputProtocol_);
+  markPhase(TFlightRecorder::DEQUEUED);
+  while (processNext()) {
   }
 
-  for (bool done = false; !done;) {
+  cleanup();
+}
+
+bool TConnectedClient::processNext() {
+  if (!contextCreated_) {
     if (eventHandler_) {
-      eventHandler_->processContext(opaqueContext_, client_);
+      opaqueContext_ = eventHandler_->createContext(inputProtocol_, outputProtocol_);
     }
+    contextCreated_ = true;
+  }
 
-    try {
-      if (!processor_->process(inputProtocol_, outputProtocol_, opaqueContext_)) {
-        break;
+  if (eventHandler_) {
+    eventHandler_->processContext(opaqueContext_, client_);
+  }
+
+  try {
+    if (!flightRecorder_) {
+      return processor_->process(inputProtocol_, outputProtocol_, opaqueContext_);
+    }
+
+    // The processor reads, handles and answers the request in one call, so
+    // only its first byte and the end of the response are told apart
+    if (record_.time[TFlightRecorder::FIRST_BYTE] == 0) {
+      if (!inputProtocol_->getTransport()->peek()) {
+        return false;
       }
-    } catch (const TTransportException& ttx) {
-      switch (ttx.getType()) {
-        case TTransportException::END_OF_FILE:
-        case TTransportException::INTERRUPTED:
-        case TTransportException::TIMED_OUT:
-          // Client disconnected or was interrupted or did not respond within the receive timeout.
-          // No logging needed.  Done.
-          done = true;
-          break;
-
-        default: {
-          // All other transport exceptions are logged.
-          // State of connection is unknown.  Done.
-          string errStr = string("TConnectedClient died: ") + ttx.what();
-          GlobalOutput(errStr.c_str());
-          done = true;
-          break;
-        }
+      record_.mark(TFlightRecorder::FIRST_BYTE);
+    }
+    bool more = processor_->process(inputProtocol_, outputProtocol_, opaqueContext_);
+    record_.mark(TFlightRecorder::LAST_BYTE_WRITTEN);
+    flightRecorder_->record(record_);
+    record_.clear();
+    return more;
+  } catch (const TTransportException& ttx) {
+    switch (ttx.getType()) {
+      case TTransportException::END_OF_FILE:
+      case TTransportException::INTERRUPTED:
+      case TTransportException::TIMED_OUT:
+        // Client disconnected or was interrupted or did not respond within the receive timeout.
+        // No logging needed.  Done.
+        break;
+
+      default: {
+        // All other transport exceptions are logged.
+        // State of connection is unknown.  Done.
+        string errStr = string("TConnectedClient died: ") + ttx.what();
+        GlobalOutput(errStr.c_str());
+        break;
       }
-    } catch (const TException& tex) {
-      string errStr = string("TConnectedClient processing exception: ") + tex.what();
-      GlobalOutput(errStr.c_str());
-      // Disconnect from client, because we could not process the message.
-      done = true;
     }
+  } catch (const TException& tex) {
+    string errStr = string("TConnectedClient processing exception: ") + tex.what();
+    GlobalOutput(errStr.c_str());
+    // Disconnect from client, because we could not process the message.
   }
-
-  cleanup();
+  return false;
 }
 
 void TConnectedClient::cleanup() {
-  if (eventHandler_) {
+  if (eventHandler_ && contextCreated_) {
     eventHandler_->deleteContext(opaqueContext_, inputProtocol_, outputProtocol_);
   }
 
@@ -23,6 +23,7 @@
 #include <thrift/stdcxx.h>
 #include <thrift/TProcessor.h>
 #include <thrift/protocol/TProtocol.h>
+#include <thrift/server/TFlightRecorder.h>
 #include <thrift/server/TServer.h>
 #include <thrift/transport/TTransport.h>
 
@@ -78,13 +79,53 @@ public:
    */
   virtual void run() /* override */;
 
+  /**
+   * Process a single request, for servers that hand a connection to a
+   * thread only while it has a request to process rather than for its
+   * whole lifetime.  The first call acquires the event handler context.
+   * Exceptions are handled as in run().
+   *
+   * \returns false once the client is done, after which it must be
+   *          closed with finish()
+   */
+  bool processNext();
+
+  /**
+   * Close a client driven by processNext(), see cleanup().
+   */
+  void finish() { cleanup(); }
+
+  /**
+   * \returns the TTransport representing the client
+   */
+  const stdcxx::shared_ptr<apache::thrift::transport::TTransport>& getClient() const {
+    return client_;
+  }
+
+  /**
+   * Records the timeline of each request into flightRecorder, starting
+   * with the client being accepted now.  With a recorder, each request is
+   * waited for with peek() before it is processed, to time its first byte.
+   */
+  void setFlightRecorder(const stdcxx::shared_ptr<TFlightRecorder>& flightRecorder);
+
+  /**
+   * Timestamps phase of the current request, if there is a flight recorder.
+   */
+  void markPhase(TFlightRecorder::Phase phase) {
+    if (flightRecorder_) {
+      record_.mark(phase);
+    }
+  }
+
 protected:
   /**
    * Cleanup after a client.  This happens if the client disconnects,
    * or if the server is stopped, or if an exception occurs.
    *
    * The cleanup processing is:
-   * [optional] call eventHandler->deleteContext once
+   * [optional] call eventHandler->deleteContext once, if the context
+   *            was acquired
    *            close the inputProtocol's TTransport
    *            close the outputProtocol's TTransport
    *            close the client
@@ -102,6 +143,18 @@ private:
    * Context acquired from the eventHandler_ if one exists.
    */
   void* opaqueContext_;
+
+  /**
+   * Whether the context has been acquired.
+   */
+  bool contextCreated_;
+
+  stdcxx::shared_ptr<TFlightRecorder> flightRecorder_;
+
+  /**
+   * The timeline of the current request.
+   */
+  TFlightRecorder::Record record_;
 };
 }
 }
@@ -0,0 +1,450 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <algorithm>
+#include <stdexcept>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+#ifdef HAVE_SYS_POLL_H
+#include <sys/poll.h>
+#endif
+
+#include <thrift/concurrency/Exception.h>
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/server/TElasticServer.h>
+#include <thrift/transport/TSocket.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+using apache::thrift::concurrency::Guard;
+using apache::thrift::concurrency::PlatformThreadFactory;
+using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::Synchronized;
+using apache::thrift::concurrency::Thread;
+using apache::thrift::concurrency::TimedOutException;
+using apache::thrift::protocol::TProtocolFactory;
+using apache::thrift::transport::TServerTransport;
+using apache::thrift::transport::TSocket;
+using apache::thrift::transport::TTransportFactory;
+using stdcxx::shared_ptr;
+using std::string;
+
+const size_t TElasticServer::DEFAULT_MIN_WORKERS;
+const size_t TElasticServer::DEFAULT_MAX_WORKERS;
+const int64_t TElasticServer::DEFAULT_IDLE_TIMEOUT;
+
+class TElasticServer::Worker : public Runnable {
+public:
+  Worker(TElasticServer* server) : server_(server) {}
+  void run() { server_->workerLoop(); }
+
+private:
+  TElasticServer* server_;
+};
+
+class TElasticServer::Poller : public Runnable {
+public:
+  Poller(TElasticServer* server) : server_(server) {}
+  void run() { server_->pollLoop(); }
+
+private:
+  TElasticServer* server_;
+};
+
+/**
+ * The socket to poll for a client, or THRIFT_INVALID_SOCKET if it has none.
+ */
+static THRIFT_SOCKET socketOf(const shared_ptr<TConnectedClient>& client) {
+  shared_ptr<TSocket> socket = stdcxx::dynamic_pointer_cast<TSocket>(client->getClient());
+  return socket ? socket->getSocketFD() : THRIFT_INVALID_SOCKET;
+}
+
+static bool readable(THRIFT_SOCKET fd) {
+  THRIFT_POLLFD pfd;
+  pfd.fd = fd;
+  pfd.events = THRIFT_POLLIN;
+  pfd.revents = 0;
+  return THRIFT_POLL(&pfd, 1, 0) > 0;
+}
+
+TElasticServer::TElasticServer(const shared_ptr<TProcessorFactory>& processorFactory,
+                               const shared_ptr<TServerTransport>& serverTransport,
+                               const shared_ptr<TTransportFactory>& transportFactory,
+                               const shared_ptr<TProtocolFactory>& protocolFactory)
+  : TServerFramework(processorFactory, serverTransport, transportFactory, protocolFactory),
+    minWorkers_(DEFAULT_MIN_WORKERS),
+    maxWorkers_(DEFAULT_MAX_WORKERS),
+    idleTimeout_(DEFAULT_IDLE_TIMEOUT),
+    workers_(0),
+    idleWorkers_(0),
+    stopping_(false),
+    pollerStopped_(true),
+    wakePending_(false),
+    wakeReader_(THRIFT_INVALID_SOCKET),
+    wakeWriter_(THRIFT_INVALID_SOCKET),
+    workerFactory_(new PlatformThreadFactory()) {
+}
+
+TElasticServer::TElasticServer(const shared_ptr<TProcessor>& processor,
+                               const shared_ptr<TServerTransport>& serverTransport,
+                               const shared_ptr<TTransportFactory>& transportFactory,
+                               const shared_ptr<TProtocolFactory>& protocolFactory)
+  : TServerFramework(processor, serverTransport, transportFactory, protocolFactory),
+    minWorkers_(DEFAULT_MIN_WORKERS),
+    maxWorkers_(DEFAULT_MAX_WORKERS),
+    idleTimeout_(DEFAULT_IDLE_TIMEOUT),
+    workers_(0),
+    idleWorkers_(0),
+    stopping_(false),
+    pollerStopped_(true),
+    wakePending_(false),
+    wakeReader_(THRIFT_INVALID_SOCKET),
+    wakeWriter_(THRIFT_INVALID_SOCKET),
+    workerFactory_(new PlatformThreadFactory()) {
+}
+
+TElasticServer::TElasticServer(const shared_ptr<TProcessorFactory>& processorFactory,
+                               const shared_ptr<TServerTransport>& serverTransport,
+                               const shared_ptr<TTransportFactory>& inputTransportFactory,
+                               const shared_ptr<TTransportFactory>& outputTransportFactory,
+                               const shared_ptr<TProtocolFactory>& inputProtocolFactory,
+                               const shared_ptr<TProtocolFactory>& outputProtocolFactory)
+  : TServerFramework(processorFactory,
+                     serverTransport,
+                     inputTransportFactory,
+                     outputTransportFactory,
+                     inputProtocolFactory,
+                     outputProtocolFactory),
+    minWorkers_(DEFAULT_MIN_WORKERS),
+    maxWorkers_(DEFAULT_MAX_WORKERS),
+    idleTimeout_(DEFAULT_IDLE_TIMEOUT),
+    workers_(0),
+    idleWorkers_(0),
+    stopping_(false),
+    pollerStopped_(true),
+    wakePending_(false),
+    wakeReader_(THRIFT_INVALID_SOCKET),
+    wakeWriter_(THRIFT_INVALID_SOCKET),
+    workerFactory_(new PlatformThreadFactory()) {
+}
+
+TElasticServer::TElasticServer(const shared_ptr<TProcessor>& processor,
+                               const shared_ptr<TServerTransport>& serverTransport,
+                               const shared_ptr<TTransportFactory>& inputTransportFactory,
+                               const shared_ptr<TTransportFactory>& outputTransportFactory,
+                               const shared_ptr<TProtocolFactory>& inputProtocolFactory,
+                               const shared_ptr<TProtocolFactory>& outputProtocolFactory)
+  : TServerFramework(processor,
+                     serverTransport,
+                     inputTransportFactory,
+                     outputTransportFactory,
+                     inputProtocolFactory,
+                     outputProtocolFactory),
+    minWorkers_(DEFAULT_MIN_WORKERS),
+    maxWorkers_(DEFAULT_MAX_WORKERS),
+    idleTimeout_(DEFAULT_IDLE_TIMEOUT),
+    workers_(0),
+    idleWorkers_(0),
+    stopping_(false),
+    pollerStopped_(true),
+    wakePending_(false),
+    wakeReader_(THRIFT_INVALID_SOCKET),
+    wakeWriter_(THRIFT_INVALID_SOCKET),
+    workerFactory_(new PlatformThreadFactory()) {
+}
+
+TElasticServer::~TElasticServer() {
+}
+
+void TElasticServer::serve() {
+  THRIFT_SOCKET sv[2];
+  if (-1 == THRIFT_SOCKETPAIR(AF_LOCAL, SOCK_STREAM, 0, sv)) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    GlobalOutput.perror("TElasticServer::serve() socketpair() ", errno_copy);
+    throw TException("TElasticServer: could not create poller wakeup sockets");
+  }
+  wakeReader_ = sv[0];
+  wakeWriter_ = sv[1];
+
+  {
+    Guard g(parkMutex_);
+    pollerStopped_ = false;
+    wakePending_ = false;
+  }
+  {
+    Synchronized s(poolMonitor_);
+    stopping_ = false;
+    for (size_t i = workers_; i < (std::min)(minWorkers_, maxWorkers_); ++i) {
+      addWorker();
+    }
+  }
+
+  shared_ptr<Thread> poller
+      = PlatformThreadFactory(false).newThread(shared_ptr<Runnable>(new Poller(this)));
+  poller->start();
+
+  TServerFramework::serve();
+
+  // The poller closes the parked clients, then the workers finish the
+  // readable ones; TServerFramework::stop() has interrupted their reads.
+  {
+    Guard g(parkMutex_);
+    pollerStopped_ = true;
+    wakePoller();
+  }
+  poller->join();
+
+  {
+    Synchronized s(poolMonitor_);
+    stopping_ = true;
+    poolMonitor_.notifyAll();
+    while (workers_ > 0) {
+      poolMonitor_.wait();
+    }
+  }
+
+  ::THRIFT_CLOSESOCKET(wakeReader_);
+  ::THRIFT_CLOSESOCKET(wakeWriter_);
+  wakeReader_ = THRIFT_INVALID_SOCKET;
+  wakeWriter_ = THRIFT_INVALID_SOCKET;
+}
+
+size_t TElasticServer::getMinWorkers() const {
+  Synchronized s(poolMonitor_);
+  return minWorkers_;
+}
+
+void TElasticServer::setMinWorkers(size_t value) {
+  Synchronized s(poolMonitor_);
+  minWorkers_ = value;
+}
+
+size_t TElasticServer::getMaxWorkers() const {
+  Synchronized s(poolMonitor_);
+  return maxWorkers_;
+}
+
+void TElasticServer::setMaxWorkers(size_t value) {
+  if (value < 1) {
+    throw std::invalid_argument("value must be greater than zero");
+  }
+  Synchronized s(poolMonitor_);
+  maxWorkers_ = value;
+}
+
+int64_t TElasticServer::getIdleTimeout() const {
+  Synchronized s(poolMonitor_);
+  return idleTimeout_;
+}
+
+void TElasticServer::setIdleTimeout(int64_t value) {
+  Synchronized s(poolMonitor_);
+  idleTimeout_ = value;
+}
+
+size_t TElasticServer::getWorkerCount() const {
+  Synchronized s(poolMonitor_);
+  return workers_;
+}
+
+size_t TElasticServer::getIdleWorkerCount() const {
+  Synchronized s(poolMonitor_);
+  return idleWorkers_;
+}
+
+void TElasticServer::onClientConnected(const shared_ptr<TConnectedClient>& pClient) {
+  if (socketOf(pClient) == THRIFT_INVALID_SOCKET) {
+    Synchronized s(poolMonitor_);
+    dispatch(pClient);
+  } else {
+    park(pClient);
+  }
+}
+
+void TElasticServer::onClientDisconnected(TConnectedClient* pClient) {
+  (void)pClient;
+}
+
+void TElasticServer::park(const shared_ptr<TConnectedClient>& client) {
+  {
+    Guard g(parkMutex_);
+    if (!pollerStopped_) {
+      parked_.push_back(client);
+      wakePoller();
+      return;
+    }
+  }
+  client->finish();
+}
+
+void TElasticServer::wakePoller() {
+  if (!wakePending_) {
+    wakePending_ = true;
+    char one = 1;
+    if (-1 == send(wakeWriter_, &one, 1, 0)) {
+      GlobalOutput.perror("TElasticServer::wakePoller() send() ", THRIFT_GET_SOCKET_ERROR);
+    }
+  }
+}
+
+void TElasticServer::dispatch(const shared_ptr<TConnectedClient>& client) {
+  ready_.push_back(client);
+  if (ready_.size() > idleWorkers_ && workers_ < maxWorkers_) {
+    addWorker();
+  }
+  poolMonitor_.notify();
+}
+
+void TElasticServer::addWorker() {
+  try {
+    workerFactory_->newThread(shared_ptr<Runnable>(new Worker(this)))->start();
+    ++workers_;
+  } catch (const TException& tx) {
+    // Carry on with the workers there are
+    string errStr = string("TElasticServer could not start a worker: ") + tx.what();
+    GlobalOutput(errStr.c_str());
+  }
+}
+
+void TElasticServer::pollLoop() {
+  // fds[0] is the wakeup socket, fds[i + 1] belongs to clients[i]
+  std::vector<THRIFT_POLLFD> fds;
+  std::vector<shared_ptr<TConnectedClient> > clients;
+
+  for (;;) {
+    {
+      Guard g(parkMutex_);
+      if (pollerStopped_) {
+        clients.insert(clients.end(), parked_.begin(), parked_.end());
+        parked_.clear();
+        break;
+      }
+      clients.insert(clients.end(), parked_.begin(), parked_.end());
+      parked_.clear();
+    }
+
+    fds.resize(clients.size() + 1);
+    fds[0].fd = wakeReader_;
+    fds[0].events = THRIFT_POLLIN;
+    fds[0].revents = 0;
+    for (size_t i = 0; i < clients.size(); ++i) {
+      fds[i + 1].fd = socketOf(clients[i]);
+      fds[i + 1].events = THRIFT_POLLIN;
+      fds[i + 1].revents = 0;
+    }
+
+    int ret = THRIFT_POLL(&fds[0], static_cast<unsigned long>(fds.size()), -1);
+    if (ret < 0) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      if (errno_copy == THRIFT_EINTR) {
+        continue;
+      }
+      GlobalOutput.perror("TElasticServer::pollLoop() poll() ", errno_copy);
+      break;
+    }
+
+    if (fds[0].revents != 0) {
+      char buf[16];
+      Guard g(parkMutex_);
+      if (-1 == recv(wakeReader_, buf, sizeof(buf), 0)) {
+        GlobalOutput.perror("TElasticServer::pollLoop() recv() ", THRIFT_GET_SOCKET_ERROR);
+      }
+      wakePending_ = false;
+    }
+
+    // Hand readable clients (including those that hung up) to the workers
+    size_t kept = 0;
+    {
+      Synchronized s(poolMonitor_);
+      for (size_t i = 0; i < clients.size(); ++i) {
+        if (fds[i + 1].revents != 0) {
+          clients[i]->markPhase(TFlightRecorder::FIRST_BYTE);
+          clients[i]->markPhase(TFlightRecorder::ENQUEUED);
+          dispatch(clients[i]);
+        } else {
+          clients[kept++].swap(clients[i]);
+        }
+      }
+    }
+    clients.resize(kept);
+  }
+
+  for (size_t i = 0; i < clients.size(); ++i) {
+    clients[i]->finish();
+  }
+}
+
+void TElasticServer::workerLoop() {
+  for (;;) {
+    shared_ptr<TConnectedClient> client;
+    {
+      Synchronized s(poolMonitor_);
+      while (ready_.empty()) {
+        if (stopping_) {
+          --workers_;
+          poolMonitor_.notifyAll();
+          return;
+        }
+        bool timedOut = false;
+        ++idleWorkers_;
+        try {
+          poolMonitor_.wait(idleTimeout_);
+        } catch (const TimedOutException&) {
+          timedOut = true;
+        }
+        --idleWorkers_;
+        if (timedOut && ready_.empty() && workers_ > minWorkers_) {
+          --workers_;
+          poolMonitor_.notifyAll();
+          return;
+        }
+      }
+      client = ready_.front();
+      ready_.pop_front();
+    }
+    client->markPhase(TFlightRecorder::DEQUEUED);
+    serveClient(client);
+  }
+}
+
+void TElasticServer::serveClient(const shared_ptr<TConnectedClient>& client) {
+  THRIFT_SOCKET fd = socketOf(client);
+  if (fd == THRIFT_INVALID_SOCKET) {
+    client->run();
+    return;
+  }
+
+  // Stay with the client while its next request is already waiting
+  do {
+    if (!client->processNext()) {
+      client->finish();
+      return;
+    }
+  } while (readable(fd));
+
+  park(client);
+}
+}
+}
+} // apache::thrift::server
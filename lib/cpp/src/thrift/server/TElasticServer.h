@@ -0,0 +1,192 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TELASTICSERVER_H_
+#define _THRIFT_SERVER_TELASTICSERVER_H_ 1
+
+#include <deque>
+#include <vector>
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/concurrency/Thread.h>
+#include <thrift/server/TServerFramework.h>
+#include <thrift/transport/PlatformSocket.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * Manage clients using an elastic pool of threads that only hold on to a
+ * client while it has a request to process.  Idle clients are parked on a
+ * single poller thread; when one becomes readable it is handed to a worker,
+ * which processes requests for as long as more are waiting and then parks
+ * the client again.  Workers are started on demand up to a maximum, and
+ * exit after they have been idle for a while, down to a minimum.
+ *
+ * This serves many mostly idle clients with the blocking transports and
+ * processors of the other TServerFramework servers, but with only as many
+ * threads as there are requests in progress.  Processing a request still
+ * blocks its worker, including while the rest of a partially arrived
+ * request is read.
+ *
+ * Clients are polled on their TSocket, so the input transport must not read
+ * ahead of the request being processed: a request held in a buffer is not
+ * seen by the poller.  TFramedTransport reads exactly one frame and is a
+ * good fit; TBufferedTransport and SSL sockets are not.  Clients that are
+ * not TSockets are served to completion by a worker each.
+ */
+class TElasticServer : public TServerFramework {
+public:
+  static const size_t DEFAULT_MIN_WORKERS = 1;
+  static const size_t DEFAULT_MAX_WORKERS = 64;
+  static const int64_t DEFAULT_IDLE_TIMEOUT = 60000;
+
+  TElasticServer(
+      const stdcxx::shared_ptr<apache::thrift::TProcessorFactory>& processorFactory,
+      const stdcxx::shared_ptr<apache::thrift::transport::TServerTransport>& serverTransport,
+      const stdcxx::shared_ptr<apache::thrift::transport::TTransportFactory>& transportFactory,
+      const stdcxx::shared_ptr<apache::thrift::protocol::TProtocolFactory>& protocolFactory);
+
+  TElasticServer(
+      const stdcxx::shared_ptr<apache::thrift::TProcessor>& processor,
+      const stdcxx::shared_ptr<apache::thrift::transport::TServerTransport>& serverTransport,
+      const stdcxx::shared_ptr<apache::thrift::transport::TTransportFactory>& transportFactory,
+      const stdcxx::shared_ptr<apache::thrift::protocol::TProtocolFactory>& protocolFactory);
+
+  TElasticServer(
+      const stdcxx::shared_ptr<apache::thrift::TProcessorFactory>& processorFactory,
+      const stdcxx::shared_ptr<apache::thrift::transport::TServerTransport>& serverTransport,
+      const stdcxx::shared_ptr<apache::thrift::transport::TTransportFactory>& inputTransportFactory,
+      const stdcxx::shared_ptr<apache::thrift::transport::TTransportFactory>& outputTransportFactory,
+      const stdcxx::shared_ptr<apache::thrift::protocol::TProtocolFactory>& inputProtocolFactory,
+      const stdcxx::shared_ptr<apache::thrift::protocol::TProtocolFactory>& outputProtocolFactory);
+
+  TElasticServer(
+      const stdcxx::shared_ptr<apache::thrift::TProcessor>& processor,
+      const stdcxx::shared_ptr<apache::thrift::transport::TServerTransport>& serverTransport,
+      const stdcxx::shared_ptr<apache::thrift::transport::TTransportFactory>& inputTransportFactory,
+      const stdcxx::shared_ptr<apache::thrift::transport::TTransportFactory>& outputTransportFactory,
+      const stdcxx::shared_ptr<apache::thrift::protocol::TProtocolFactory>& inputProtocolFactory,
+      const stdcxx::shared_ptr<apache::thrift::protocol::TProtocolFactory>& outputProtocolFactory);
+
+  virtual ~TElasticServer();
+
+  /**
+   * Post-conditions (return guarantees):
+   *   There will be no clients connected.
+   *   All workers will have exited.
+   */
+  virtual void serve();
+
+  /**
+   * The number of workers kept even when idle, started when serving
+   * starts.  The default is DEFAULT_MIN_WORKERS.
+   */
+  virtual size_t getMinWorkers() const;
+  virtual void setMinWorkers(size_t value);
+
+  /**
+   * The most workers that run at once; further readable clients wait for
+   * one to become free.  The default is DEFAULT_MAX_WORKERS.
+   * \throws std::invalid_argument if value is less than 1
+   */
+  virtual size_t getMaxWorkers() const;
+  virtual void setMaxWorkers(size_t value);
+
+  /**
+   * How long, in milliseconds, a worker above the minimum waits for work
+   * before it exits; 0 keeps them forever.  The default is
+   * DEFAULT_IDLE_TIMEOUT.
+   */
+  virtual int64_t getIdleTimeout() const;
+  virtual void setIdleTimeout(int64_t value);
+
+  /**
+   * \returns the number of running workers
+   */
+  virtual size_t getWorkerCount() const;
+
+  /**
+   * \returns the number of running workers waiting for work
+   */
+  virtual size_t getIdleWorkerCount() const;
+
+protected:
+  virtual void onClientConnected(const stdcxx::shared_ptr<TConnectedClient>& pClient) /* override */;
+  virtual void onClientDisconnected(TConnectedClient* pClient) /* override */;
+
+private:
+  class Worker;
+  class Poller;
+
+  /**
+   * Parks a client on the poller until it is readable, or closes it if the
+   * server is shutting down.
+   */
+  void park(const stdcxx::shared_ptr<TConnectedClient>& client);
+
+  /**
+   * Queues a client for a worker, starting one if none is free.
+   * Call with poolMonitor_ held.
+   */
+  void dispatch(const stdcxx::shared_ptr<TConnectedClient>& client);
+
+  /**
+   * Starts a worker.  Call with poolMonitor_ held.
+   */
+  void addWorker();
+
+  void pollLoop();
+  void workerLoop();
+  void serveClient(const stdcxx::shared_ptr<TConnectedClient>& client);
+
+  /**
+   * Wakes up the poller.  Call with parkMutex_ held.
+   */
+  void wakePoller();
+
+  /**
+   * Guards the worker pool and the queue of readable clients.
+   */
+  apache::thrift::concurrency::Monitor poolMonitor_;
+  std::deque<stdcxx::shared_ptr<TConnectedClient> > ready_;
+  size_t minWorkers_;
+  size_t maxWorkers_;
+  int64_t idleTimeout_;
+  size_t workers_;
+  size_t idleWorkers_;
+  bool stopping_;
+
+  /**
+   * Guards the hand over of clients to the poller.
+   */
+  apache::thrift::concurrency::Mutex parkMutex_;
+  std::vector<stdcxx::shared_ptr<TConnectedClient> > parked_;
+  bool pollerStopped_;
+  bool wakePending_;
+  THRIFT_SOCKET wakeReader_;
+  THRIFT_SOCKET wakeWriter_;
+
+  stdcxx::shared_ptr<apache::thrift::concurrency::ThreadFactory> workerFactory_;
+};
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TELASTICSERVER_H_
@@ -0,0 +1,235 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/server/TFlightRecorder.h>
+#include <thrift/concurrency/Util.h>
+
+#include <sstream>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+using apache::thrift::concurrency::Util;
+
+const size_t TFlightRecorder::DEFAULT_CAPACITY;
+const size_t TFlightRecorder::DEFAULT_SLOW_CAPACITY;
+const int64_t TFlightRecorder::DEFAULT_SLOW_THRESHOLD;
+
+static const char* const PHASE_NAMES[TFlightRecorder::NUM_PHASES] = {"accepted",
+                                                                     "first_byte",
+                                                                     "frame_complete",
+                                                                     "enqueued",
+                                                                     "dequeued",
+                                                                     "handler_done",
+                                                                     "last_byte_written"};
+
+const char* TFlightRecorder::phaseName(Phase phase) {
+  return phase >= 0 && phase < NUM_PHASES ? PHASE_NAMES[phase] : "unknown";
+}
+
+void TFlightRecorder::Record::clear() {
+  for (int p = 0; p < NUM_PHASES; ++p) {
+    time[p] = 0;
+  }
+}
+
+void TFlightRecorder::Record::mark(Phase phase) {
+  time[phase] = Util::currentTimeUsec();
+}
+
+int64_t TFlightRecorder::Record::start() const {
+  int64_t first = 0;
+  for (int p = 0; p < NUM_PHASES; ++p) {
+    if (time[p] != 0 && (first == 0 || time[p] < first)) {
+      first = time[p];
+    }
+  }
+  return first;
+}
+
+int64_t TFlightRecorder::Record::end() const {
+  int64_t last = 0;
+  for (int p = 0; p < NUM_PHASES; ++p) {
+    if (time[p] > last) {
+      last = time[p];
+    }
+  }
+  return last;
+}
+
+int64_t TFlightRecorder::Record::duration() const {
+  // A connection may sit idle between being accepted and its first request
+  int64_t from = time[FIRST_BYTE] != 0 ? time[FIRST_BYTE] : start();
+  int64_t to = end();
+  return to > from ? to - from : 0;
+}
+
+std::string TFlightRecorder::Record::toString() const {
+  std::ostringstream out;
+  int64_t first = start();
+  out << "at " << first << ": " << duration() << "us (";
+  bool separate = false;
+  for (int p = 0; p < NUM_PHASES; ++p) {
+    if (time[p] != 0) {
+      out << (separate ? ", " : "") << PHASE_NAMES[p] << " +" << time[p] - first;
+      separate = true;
+    }
+  }
+  out << ")";
+  return out.str();
+}
+
+/**
+ * A ring of records, written with a sequence lock per slot so that readers
+ * can tell a complete record from one being written.
+ */
+class TFlightRecorder::Ring {
+public:
+  explicit Ring(size_t capacity) : mask_(0), next_(0) {
+    size_t size = 1;
+    while (size < capacity) {
+      size <<= 1;
+    }
+    slots_ = new Slot[size];
+    mask_ = size - 1;
+  }
+
+  ~Ring() { delete[] slots_; }
+
+  void push(const Record& record) {
+    uint64_t ticket = next_.fetch_add(1, boost::memory_order_relaxed);
+    Slot& slot = slots_[ticket & mask_];
+
+    // Give up the slot rather than wait if a writer a whole ring ahead or
+    // behind holds it
+    uint64_t seq = slot.seq.load(boost::memory_order_relaxed);
+    if ((seq & 1) || seq > 2 * ticket
+        || !slot.seq.compare_exchange_strong(seq, 2 * ticket + 1, boost::memory_order_relaxed)) {
+      return;
+    }
+    boost::atomic_thread_fence(boost::memory_order_release);
+    for (int p = 0; p < NUM_PHASES; ++p) {
+      slot.time[p].store(record.time[p], boost::memory_order_relaxed);
+    }
+    slot.seq.store(2 * ticket + 2, boost::memory_order_release);
+  }
+
+  void snapshot(std::vector<Record>& out) const {
+    uint64_t next = next_.load(boost::memory_order_acquire);
+    uint64_t first = next > mask_ + 1 ? next - (mask_ + 1) : 0;
+    for (uint64_t ticket = first; ticket < next; ++ticket) {
+      const Slot& slot = slots_[ticket & mask_];
+      const uint64_t written = 2 * ticket + 2;
+      if (slot.seq.load(boost::memory_order_acquire) != written) {
+        continue;
+      }
+      Record record;
+      for (int p = 0; p < NUM_PHASES; ++p) {
+        record.time[p] = slot.time[p].load(boost::memory_order_relaxed);
+      }
+      boost::atomic_thread_fence(boost::memory_order_acquire);
+      if (slot.seq.load(boost::memory_order_relaxed) == written) {
+        out.push_back(record);
+      }
+    }
+  }
+
+  uint64_t count() const { return next_.load(boost::memory_order_relaxed); }
+
+private:
+  struct Slot {
+    Slot() : seq(0) {
+      for (int p = 0; p < NUM_PHASES; ++p) {
+        time[p].store(0, boost::memory_order_relaxed);
+      }
+    }
+
+    /// 2 * ticket + 1 while a record is written, 2 * ticket + 2 once it is
+    boost::atomic<uint64_t> seq;
+    boost::atomic<int64_t> time[NUM_PHASES];
+  };
+
+  Slot* slots_;
+  size_t mask_;
+  boost::atomic<uint64_t> next_;
+};
+
+TFlightRecorder::TFlightRecorder(size_t capacity, size_t slowCapacity)
+  : recent_(new Ring(capacity)),
+    slow_(new Ring(slowCapacity)),
+    slowThreshold_(DEFAULT_SLOW_THRESHOLD) {
+}
+
+TFlightRecorder::~TFlightRecorder() {
+  delete recent_;
+  delete slow_;
+}
+
+void TFlightRecorder::record(const Record& record) {
+  recent_->push(record);
+  int64_t threshold = slowThreshold_.load(boost::memory_order_relaxed);
+  if (threshold > 0 && record.duration() >= threshold) {
+    slow_->push(record);
+  }
+}
+
+void TFlightRecorder::recent(std::vector<Record>& out) const {
+  out.clear();
+  recent_->snapshot(out);
+}
+
+void TFlightRecorder::slow(std::vector<Record>& out) const {
+  out.clear();
+  slow_->snapshot(out);
+}
+
+uint64_t TFlightRecorder::getRecordedCount() const {
+  return recent_->count();
+}
+
+uint64_t TFlightRecorder::getSlowCount() const {
+  return slow_->count();
+}
+
+void TFlightRecorder::dump(std::ostream& out) const {
+  std::vector<Record> records;
+  slow(records);
+  out << "# slow requests (at least " << getSlowThreshold() << "us): " << getSlowCount()
+      << " recorded, last " << records.size() << "\n";
+  for (std::vector<Record>::const_iterator it = records.begin(); it != records.end(); ++it) {
+    out << it->toString() << "\n";
+  }
+
+  recent(records);
+  out << "# recent requests: " << getRecordedCount() << " recorded, last " << records.size()
+      << "\n";
+  for (std::vector<Record>::const_iterator it = records.begin(); it != records.end(); ++it) {
+    out << it->toString() << "\n";
+  }
+}
+
+std::string TFlightRecorder::dump() const {
+  std::ostringstream out;
+  dump(out);
+  return out.str();
+}
+}
+}
+} // apache::thrift::server
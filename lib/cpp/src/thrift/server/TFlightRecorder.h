@@ -0,0 +1,168 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TFLIGHTRECORDER_H_
+#define _THRIFT_SERVER_TFLIGHTRECORDER_H_ 1
+
+#include <boost/atomic.hpp>
+#include <ostream>
+#include <stdint.h>
+#include <string>
+#include <vector>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * Keeps the timeline of the most recent requests a server handled, to tell
+ * where the time of a slow request went: reading it, waiting for a worker,
+ * in the handler or writing the response.
+ *
+ *   stdcxx::shared_ptr<TFlightRecorder> recorder(new TFlightRecorder());
+ *   recorder->setSlowThreshold(100000);
+ *   server->setFlightRecorder(recorder);
+ *   ...
+ *   recorder->dump(std::cerr);
+ *
+ * Servers timestamp each phase of a request in a Record and hand it to
+ * record() once the request is done.  Records go into a fixed size ring of
+ * recent requests, and those that took longer than the slow threshold also
+ * into a second ring, so that they are still there after a burst of fast
+ * requests.
+ *
+ * record() never takes a lock or allocates; recent(), slow() and dump() may
+ * run concurrently with it.  A record that is being overwritten while it is
+ * read is skipped, and when a ring wraps around while a record is being
+ * written into the same slot, one of the two is dropped.
+ */
+class TFlightRecorder {
+public:
+  /**
+   * The phases of a request, in the order they happen.  Not every server
+   * sees every phase, see TNonblockingServer and TServerFramework.
+   */
+  enum Phase {
+    ACCEPTED,          ///< the connection was accepted (its first request only)
+    FIRST_BYTE,        ///< the first byte of the request was read
+    FRAME_COMPLETE,    ///< the whole request was read
+    ENQUEUED,          ///< handed to a thread pool
+    DEQUEUED,          ///< taken up by a worker thread
+    HANDLER_DONE,      ///< the response was built
+    LAST_BYTE_WRITTEN, ///< the response was written out
+    NUM_PHASES
+  };
+
+  static const char* phaseName(Phase phase);
+
+  /**
+   * The timeline of one request: when each phase was reached, in
+   * microseconds since the epoch, or 0 where it was not.
+   */
+  struct Record {
+    Record() { clear(); }
+
+    void clear();
+
+    /// Timestamps phase now
+    void mark(Phase phase);
+
+    /// The first and the last phase reached, 0 if none was
+    int64_t start() const;
+    int64_t end() const;
+
+    /**
+     * How long the request took, from its first byte (or the first phase
+     * reached, without one) to the last phase reached.
+     */
+    int64_t duration() const;
+
+    /**
+     * One line: the duration, then each phase reached with its offset
+     * from the start.
+     */
+    std::string toString() const;
+
+    int64_t time[NUM_PHASES];
+  };
+
+  static const size_t DEFAULT_CAPACITY = 1024;
+  static const size_t DEFAULT_SLOW_CAPACITY = 64;
+  static const int64_t DEFAULT_SLOW_THRESHOLD = 1000000;
+
+  /**
+   * @param capacity      how many recent requests to keep
+   * @param slowCapacity  how many slow requests to keep
+   * Both are rounded up to a power of two.
+   */
+  explicit TFlightRecorder(size_t capacity = DEFAULT_CAPACITY,
+                           size_t slowCapacity = DEFAULT_SLOW_CAPACITY);
+  ~TFlightRecorder();
+
+  /**
+   * Requests that took at least this long, in microseconds, are kept in
+   * the ring of slow requests; 0 keeps none there.  The default is
+   * DEFAULT_SLOW_THRESHOLD.
+   */
+  int64_t getSlowThreshold() const { return slowThreshold_.load(boost::memory_order_relaxed); }
+  void setSlowThreshold(int64_t usec) { slowThreshold_.store(usec, boost::memory_order_relaxed); }
+
+  /**
+   * Records a finished request.
+   */
+  void record(const Record& record);
+
+  /**
+   * The requests recorded so far and still kept, oldest first.
+   */
+  void recent(std::vector<Record>& out) const;
+
+  /**
+   * The slow requests recorded so far and still kept, oldest first.
+   */
+  void slow(std::vector<Record>& out) const;
+
+  /**
+   * Total number of requests recorded, and of those the slow ones.
+   */
+  uint64_t getRecordedCount() const;
+  uint64_t getSlowCount() const;
+
+  /**
+   * Writes the slow requests, then the recent ones, one per line.
+   */
+  void dump(std::ostream& out) const;
+  std::string dump() const;
+
+private:
+  class Ring;
+
+  Ring* recent_;
+  Ring* slow_;
+  boost::atomic<int64_t> slowThreshold_;
+
+  // not copyable
+  TFlightRecorder(const TFlightRecorder&);
+  TFlightRecorder& operator=(const TFlightRecorder&);
+};
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TFLIGHTRECORDER_H_
@@ -20,12 +20,18 @@
 #include <thrift/thrift-config.h>
 
 #include <thrift/server/TNonblockingServer.h>
+#include <thrift/TApplicationException.h>
 #include <thrift/concurrency/Exception.h>
+#include <thrift/concurrency/Util.h>
+#include <thrift/transport/THeaderTransport.h>
 #include <thrift/transport/TSocket.h>
 #include <thrift/concurrency/PlatformThreadFactory.h>
 #include <thrift/transport/PlatformSocket.h>
 
+#include <boost/atomic.hpp>
+
 #include <algorithm>
+#include <deque>
 #include <iostream>
 
 #ifdef HAVE_POLL_H
@@ -121,6 +127,9 @@ private:
   /// TProcessor
   stdcxx::shared_ptr<TProcessor> processor_;
 
+  /// TAsyncProcessor, instead of processor_ for async processing
+  stdcxx::shared_ptr<async::TAsyncProcessor> asyncProcessor_;
+
   /// Object wrapping network socket
   stdcxx::shared_ptr<TSocket> tSocket_;
 
@@ -185,6 +194,80 @@ private:
   /// Thrift call context, if any
   void* connectionContext_;
 
+  /// When the client stops waiting for the current request, in usec of
+  /// Util::monotonicTimeUsec() (0 == no deadline)
+  int64_t deadline_;
+
+  /// Flight recorder, if the server has one
+  stdcxx::shared_ptr<TFlightRecorder> flightRecorder_;
+
+  /// Timeline of the request being read, or processed and answered
+  TFlightRecorder::Record record_;
+
+  /**
+   * Whether requests are pipelined: read while earlier ones are processed
+   * and answered as they complete (see setMaxInFlightPerConnection()).
+   * The members below are only used in this mode.
+   */
+  bool pipelined_;
+
+  /// Requests dispatched whose completion the IO thread has not yet seen
+  uint32_t inFlight_;
+
+  /// A completed request: its response, if any, and its timeline
+  struct Response {
+    Response() {}
+    Response(const stdcxx::shared_ptr<TMemoryBuffer>& buffer, const TFlightRecorder::Record& record)
+      : buffer(buffer), record(record) {}
+
+    stdcxx::shared_ptr<TMemoryBuffer> buffer;
+    TFlightRecorder::Record record;
+  };
+
+  /// Framed responses waiting to be written, in completion order
+  std::deque<Response> responses_;
+
+  /// The response being written from writeBuffer_, if any
+  stdcxx::shared_ptr<TMemoryBuffer> sendingResponse_;
+
+  /// Timeline of the request whose response is being written
+  TFlightRecorder::Record sendingRecord_;
+
+  /// Set once the connection is to be closed as soon as no task refers to it
+  bool closing_;
+
+  /// Guards completed_ and closeRequested_, which tasks hand back through
+  Mutex completedMutex_;
+
+  /// One entry per completed task, NULL where it produced no response
+  std::deque<Response> completed_;
+
+  /// Set by a task that was expired or drained instead of run
+  bool closeRequested_;
+
+  /// Set while the async processor is called for a request
+  bool dispatching_;
+
+  /// Async calls completed on the IO thread while dispatching_, not yet collected
+  uint32_t deferred_;
+
+  /**
+   * What the async calls of a connection share with it.  A call that
+   * completes after the connection was closed, or its server destroyed,
+   * finds connection NULL and drops its response.
+   */
+  struct AsyncCalls {
+    explicit AsyncCalls(TConnection* connection) : connection(connection) {}
+
+    /// Read locked by completing calls, write locked to close the connection
+    ReadWriteMutex mutex;
+    /// guarded by mutex
+    TConnection* connection;
+  };
+
+  /// Shared with this connection's async calls; reset on close
+  stdcxx::shared_ptr<AsyncCalls> asyncCalls_;
+
   /// Go into read mode
   void setRead() { setFlags(EV_READ | EV_PERSIST); }
 
@@ -194,6 +277,21 @@ private:
   /// Set socket idle
   void setIdle() { setFlags(0); }
 
+  /// Timestamps phase of the current request, if there is a flight recorder
+  void markPhase(TFlightRecorder::Phase phase) {
+    if (flightRecorder_) {
+      record_.mark(phase);
+    }
+  }
+
+  /// Hands the timeline of a finished request to the flight recorder, if any
+  void recordRequest(TFlightRecorder::Record& record) {
+    if (flightRecorder_) {
+      flightRecorder_->record(record);
+      record.clear();
+    }
+  }
+
   /**
    * Set event flags for this connection.
    *
@@ -209,8 +307,53 @@ private:
    */
   void workSocket();
 
+  /**
+   * Libevent handler for pipelined connections, which may be reading and
+   * writing at the same time; which tells the two apart.
+   */
+  void workPipelined(short which);
+
+  /// Hands the request in the read buffer to the ThreadManager (pipelined)
+  void dispatchRequest();
+
+  /// Hands the request to the async processor, on the IO thread
+  void processAsync(const stdcxx::shared_ptr<TProtocol>& input,
+                    const stdcxx::shared_ptr<TProtocol>& output,
+                    const stdcxx::shared_ptr<TMemoryBuffer>& response);
+
+  /**
+   * Collects the response of a completed task (pipelined).
+   *
+   * @return true if that closed the connection.
+   */
+  bool collectResponse();
+
+  /// Writes what the socket takes of the queued responses (pipelined)
+  bool sendResponses();
+
+  /// Moves the next queued response into the write buffer, if any
+  void nextResponse();
+
+  /// Reads while under the in-flight limit, writes while responses wait
+  void setPipelinedFlags();
+
+  /**
+   * Closes this connection, or, while tasks still refer to it, stops
+   * serving it and leaves the close to the last of them.
+   *
+   * @return true if the connection was closed.
+   */
+  bool closeWhenIdle();
+
 public:
   class Task;
+  class AsyncCall;
+
+private:
+  /// The Task of the last in-order request, reused for the next one
+  stdcxx::shared_ptr<Task> task_;
+
+public:
 
   /// Constructor
   TConnection(stdcxx::shared_ptr<TSocket> socket,
@@ -266,9 +409,24 @@ public:
    * @param which the flags associated with the event.
    * @param v void* callback arg where we placed TConnection's "this".
    */
-  static void eventHandler(evutil_socket_t fd, short /* which */, void* v) {
+  static void eventHandler(evutil_socket_t fd, short which, void* v) {
     assert(fd == static_cast<evutil_socket_t>(((TConnection*)v)->getTSocket()->getSocketFD()));
-    ((TConnection*)v)->workSocket();
+    if (((TConnection*)v)->pipelined_) {
+      ((TConnection*)v)->workPipelined(which);
+    } else {
+      ((TConnection*)v)->workSocket();
+    }
+  }
+
+  /**
+   * Called on the IO thread for each notification sent by notifyIOThread().
+   */
+  void notified() {
+    if (pipelined_ && appState_ != APP_INIT) {
+      collectResponse();
+    } else {
+      transition();
+    }
   }
 
   /**
@@ -288,8 +446,57 @@ public:
    */
   int getIOThreadNumber() const { return ioThread_->getThreadNumber(); }
 
+  /**
+   * Hands a completed task's response, NULL if it has none, and timeline
+   * back to the IO thread (pipelined).  With close set the connection is
+   * closed instead.
+   */
+  void completeTask(const stdcxx::shared_ptr<TMemoryBuffer>& response,
+                    const TFlightRecorder::Record& record,
+                    bool close) {
+    {
+      Guard g(completedMutex_);
+      completed_.push_back(Response(response, record));
+      closeRequested_ = closeRequested_ || close;
+    }
+    if (!notifyIOThread()) {
+      // The connection can not be closed here, other tasks may refer to it
+      server_->decrementActiveProcessors();
+      throw TException("TConnection::completeTask: failed write on notify pipe");
+    }
+  }
+
+  /// Whether the calling thread is the IO thread of this connection
+  bool onIOThread() const { return Thread::is_current(ioThread_->getThreadId()); }
+
+  /**
+   * Like completeTask(), for an async call completing on the IO thread
+   * itself; the response is then collected without going through the
+   * notification pipe.
+   */
+  void completeAsyncCall(const stdcxx::shared_ptr<TMemoryBuffer>& response,
+                         const TFlightRecorder::Record& record,
+                         bool close) {
+    {
+      Guard g(completedMutex_);
+      completed_.push_back(Response(response, record));
+      closeRequested_ = closeRequested_ || close;
+    }
+    // processAsync() collects it once the processor has returned
+    if (dispatching_) {
+      ++deferred_;
+    } else {
+      collectResponse();
+    }
+  }
+
   /// Force connection shutdown for this connection.
   void forceClose() {
+    if (pipelined_) {
+      // Stands in for the task that will not run
+      completeTask(stdcxx::shared_ptr<TMemoryBuffer>(), TFlightRecorder::Record(), true);
+      return;
+    }
     appState_ = APP_CLOSE_CONNECTION;
     if (!notifyIOThread()) {
       server_->decrementActiveProcessors();
@@ -304,6 +511,9 @@ public:
   /// get state of connection.
   TAppState getState() const { return appState_; }
 
+  /// whether requests on this connection are pipelined
+  bool isPipelined() const { return pipelined_; }
+
   /// return the TSocket transport wrapping this network connection
   stdcxx::shared_ptr<TSocket> getTSocket() const { return tSocket_; }
 
@@ -319,23 +529,47 @@ public:
   Task(stdcxx::shared_ptr<TProcessor> processor,
        stdcxx::shared_ptr<TProtocol> input,
        stdcxx::shared_ptr<TProtocol> output,
-       TConnection* connection)
+       TConnection* connection,
+       int64_t enqueueTime,
+       int64_t deadline,
+       stdcxx::shared_ptr<TMemoryBuffer> response = stdcxx::shared_ptr<TMemoryBuffer>())
     : processor_(processor),
       input_(input),
       output_(output),
       connection_(connection),
       serverEventHandler_(connection_->getServerEventHandler()),
-      connectionContext_(connection_->getConnectionContext()) {}
+      connectionContext_(connection_->getConnectionContext()),
+      enqueueTime_(enqueueTime),
+      deadline_(deadline),
+      response_(response),
+      record_(connection->record_) {}
+
+  /**
+   * Readies the task for the connection's next in-order request, which it
+   * processes just as the last one.
+   */
+  void reuse(int64_t enqueueTime, int64_t deadline) {
+    enqueueTime_ = enqueueTime;
+    deadline_ = deadline;
+    record_ = connection_->record_;
+  }
 
   void run() {
+    markPhase(TFlightRecorder::DEQUEUED);
     try {
-      for (;;) {
-        if (serverEventHandler_) {
-          serverEventHandler_->processContext(connectionContext_, connection_->getTSocket());
-        }
-        if (!processor_->process(input_, output_, connectionContext_)
-            || !input_->getTransport()->peek()) {
-          break;
+      if (deadline_ != 0 && Util::monotonicTimeUsec() > deadline_) {
+        // Too late to be of use; the IO thread drops the (empty) response
+      } else if (connection_->server_->shedDequeuedTask(enqueueTime_)) {
+        reject("TNonblockingServer: request shed, server overloaded");
+      } else {
+        for (;;) {
+          if (serverEventHandler_) {
+            serverEventHandler_->processContext(connectionContext_, connection_->getTSocket());
+          }
+          if (!processor_->process(input_, output_, connectionContext_)
+              || !input_->getTransport()->peek()) {
+            break;
+          }
         }
       }
     } catch (const TTransportException& ttx) {
@@ -351,7 +585,17 @@ public:
       GlobalOutput.printf("TNonblockingServer: unknown exception while processing.");
     }
 
-    // Signal completion back to the libevent thread via a pipe
+    markPhase(TFlightRecorder::HANDLER_DONE);
+
+    // A pipelined request hands its own response back
+    if (response_) {
+      connection_->completeTask(response_, record_, false);
+      return;
+    }
+    connection_->record_ = record_;
+
+    // Signal completion back to the libevent thread via a pipe.  Once it
+    // went through, the connection may reuse this task for its next request.
     if (!connection_->notifyIOThread()) {
       GlobalOutput.printf("TNonblockingServer: failed to notifyIOThread, closing.");
       connection_->server_->decrementActiveProcessors();
@@ -363,12 +607,112 @@ public:
   TConnection* getTConnection() { return connection_; }
 
 private:
+  void markPhase(TFlightRecorder::Phase phase) {
+    if (connection_->flightRecorder_) {
+      record_.mark(phase);
+    }
+  }
+
+  /**
+   * Answers the request with an exception instead of processing it, the
+   * way the processor answers an unknown method.  Oneway requests are
+   * dropped silently.
+   */
+  void reject(const char* reason) {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    input_->readMessageBegin(name, type, seqid);
+    input_->skip(T_STRUCT);
+    input_->readMessageEnd();
+    input_->getTransport()->readEnd();
+    if (type != T_CALL) {
+      return;
+    }
+
+    TApplicationException x(TApplicationException::INTERNAL_ERROR, reason);
+    output_->writeMessageBegin(name, T_EXCEPTION, seqid);
+    x.write(output_.get());
+    output_->writeMessageEnd();
+    output_->getTransport()->writeEnd();
+    output_->getTransport()->flush();
+  }
+
   stdcxx::shared_ptr<TProcessor> processor_;
   stdcxx::shared_ptr<TProtocol> input_;
   stdcxx::shared_ptr<TProtocol> output_;
   TConnection* connection_;
   stdcxx::shared_ptr<TServerEventHandler> serverEventHandler_;
   void* connectionContext_;
+  int64_t enqueueTime_;
+  int64_t deadline_;
+  stdcxx::shared_ptr<TMemoryBuffer> response_;
+  TFlightRecorder::Record record_;
+};
+
+/**
+ * Completion callback of a request handed to an async processor.  Keeps the
+ * request's protocols, which the processor writes the response through,
+ * until it is called.
+ *
+ * The call only reaches its connection through the AsyncCalls they share,
+ * so that completing it after the connection was closed does no harm.  A
+ * call the processor lets go of without completing it fails, rather than
+ * keep the connection waiting for it.
+ */
+class TNonblockingServer::TConnection::AsyncCall {
+public:
+  AsyncCall(const stdcxx::shared_ptr<TProtocol>& input,
+            const stdcxx::shared_ptr<TProtocol>& output,
+            const stdcxx::shared_ptr<TMemoryBuffer>& response,
+            TConnection* connection)
+    : input_(input),
+      output_(output),
+      response_(response),
+      calls_(connection->asyncCalls_),
+      record_(connection->record_),
+      done_(false) {}
+
+  ~AsyncCall() { complete(false); }
+
+  /**
+   * Hands the response back.  A processor that is not healthy could not
+   * make sense of the request; the connection is then closed.
+   */
+  void complete(bool healthy) {
+    if (done_.exchange(true)) {
+      return;
+    }
+    TConnection* connection;
+    {
+      RWGuard g(calls_->mutex);
+      connection = calls_->connection;
+      if (connection == NULL) {
+        // Failed when the connection was closed
+        return;
+      }
+      if (connection->flightRecorder_) {
+        record_.mark(TFlightRecorder::HANDLER_DONE);
+      }
+      if (!connection->onIOThread()) {
+        // Holding the lock keeps a server that shuts down from closing the
+        // connection meanwhile
+        connection->completeTask(response_, record_, !healthy);
+        return;
+      }
+    }
+    // Only the IO thread, which this is, closes the connection, which the
+    // response may lead to
+    connection->completeAsyncCall(response_, record_, !healthy);
+  }
+
+private:
+  stdcxx::shared_ptr<TProtocol> input_;
+  stdcxx::shared_ptr<TProtocol> output_;
+  stdcxx::shared_ptr<TMemoryBuffer> response_;
+  stdcxx::shared_ptr<AsyncCalls> calls_;
+  TFlightRecorder::Record record_;
+  boost::atomic<bool> done_;
 };
 
 void TNonblockingServer::TConnection::init(TNonblockingIOThread* ioThread) {
@@ -379,6 +723,11 @@ void TNonblockingServer::TConnection::init(TNonblockingIOThread* ioThread) {
 
   readBufferPos_ = 0;
   readWant_ = 0;
+  deadline_ = 0;
+
+  flightRecorder_ = server_->getFlightRecorder();
+  record_.clear();
+  markPhase(TFlightRecorder::ACCEPTED);
 
   writeBuffer_ = NULL;
   writeBufferSize_ = 0;
@@ -388,6 +737,19 @@ void TNonblockingServer::TConnection::init(TNonblockingIOThread* ioThread) {
   socketState_ = SOCKET_RECV_FRAMING;
   callsForResize_ = 0;
 
+  pipelined_ = (server_->isAsyncProcessing()
+                || (server_->getMaxInFlightPerConnection() > 1 && server_->isThreadPoolProcessing()))
+               && !server_->getHeaderTransport();
+  inFlight_ = 0;
+  responses_.clear();
+  sendingResponse_.reset();
+  sendingRecord_.clear();
+  closing_ = false;
+  completed_.clear();
+  closeRequested_ = false;
+  dispatching_ = false;
+  deferred_ = 0;
+
   // get input/transports
   factoryInputTransport_ = server_->getInputTransportFactory()->getTransport(inputTransport_);
   factoryOutputTransport_ = server_->getOutputTransportFactory()->getTransport(outputTransport_);
@@ -411,7 +773,12 @@ void TNonblockingServer::TConnection::init(TNonblockingIOThread* ioThread) {
   }
 
   // Get the processor
-  processor_ = server_->getProcessor(inputProtocol_, outputProtocol_, tSocket_);
+  if (server_->isAsyncProcessing()) {
+    asyncProcessor_ = server_->getAsyncProcessor(inputProtocol_, outputProtocol_, tSocket_);
+    asyncCalls_.reset(new AsyncCalls(this));
+  } else {
+    processor_ = server_->getProcessor(inputProtocol_, outputProtocol_, tSocket_);
+  }
 }
 
 void TNonblockingServer::TConnection::setSocket(stdcxx::shared_ptr<TSocket> socket) {
@@ -438,16 +805,19 @@ void TNonblockingServer::TConnection::workSocket() {
                              uint32_t(sizeof(framing.size) - readBufferPos_));
       if (fetch == 0) {
         // Whenever we get here it means a remote disconnect
-        close();
+        closeWhenIdle();
         return;
       }
+      if (readBufferPos_ == 0) {
+        markPhase(TFlightRecorder::FIRST_BYTE);
+      }
       readBufferPos_ += fetch;
     } catch (TTransportException& te) {
       //In Nonblocking SSLSocket some operations need to be retried again.
       //Current approach is parsing exception message, but a better solution needs to be investigated.
       if(!strstr(te.what(), "retry")) {
         GlobalOutput.printf("TConnection::workSocket(): %s", te.what());
-        close();
+        closeWhenIdle();
 
         return;
       }
@@ -471,7 +841,7 @@ void TNonblockingServer::TConnection::workSocket() {
           readWant_,
           (uint64_t)server_->getMaxFrameSize(),
           tSocket_->getSocketInfo().c_str());
-      close();
+      closeWhenIdle();
       return;
     }
     // size known; now get the rest of the frame
@@ -503,7 +873,7 @@ void TNonblockingServer::TConnection::workSocket() {
       //Current approach is parsing exception message, but a better solution needs to be investigated.
       if(!strstr(te.what(), "retry")) {
         GlobalOutput.printf("TConnection::workSocket(): %s", te.what());
-        close();
+        closeWhenIdle();
       }
 
       return;
@@ -524,7 +894,7 @@ void TNonblockingServer::TConnection::workSocket() {
     }
 
     // Whenever we get down here it means a remote disconnect
-    close();
+    closeWhenIdle();
 
     return;
 
@@ -587,11 +957,30 @@ void TNonblockingServer::TConnection::transition() {
   switch (appState_) {
 
   case APP_READ_REQUEST:
+    markPhase(TFlightRecorder::FRAME_COMPLETE);
+    if (pipelined_) {
+      dispatchRequest();
+      return;
+    }
+
     // We are done reading the request, package the read buffer into transport
     // and get back some data from the dispatch function
+    deadline_ = 0;
     if (server_->getHeaderTransport()) {
       inputTransport_->resetBuffer(readBuffer_, readBufferPos_);
       outputTransport_->resetBuffer();
+
+      // The client's timeout is relative, so it is anchored to our clock here
+      std::string timeout;
+      if (THeaderTransport::findHeader(readBuffer_ + 4,
+                                       readBufferPos_ - 4,
+                                       THeaderTransport::CLIENT_TIMEOUT_HEADER,
+                                       timeout)) {
+        int64_t timeoutMs = std::strtoll(timeout.c_str(), NULL, 10);
+        if (timeoutMs > 0) {
+          deadline_ = Util::monotonicTimeUsec() + timeoutMs * 1000;
+        }
+      }
     } else {
       // We saved room for the framing size in case header transport needed it,
       // but just skip it for the non-header case
@@ -608,10 +997,27 @@ void TNonblockingServer::TConnection::transition() {
 
     if (server_->isThreadPoolProcessing()) {
       // We are setting up a Task to do this work and we will wait on it
-
-      // Create task and dispatch to the thread manager
-      stdcxx::shared_ptr<Runnable> task = stdcxx::shared_ptr<Runnable>(
-          new Task(processor_, inputProtocol_, outputProtocol_, this));
+      markPhase(TFlightRecorder::ENQUEUED);
+
+      // Create task, or reuse the last one, and dispatch to the thread
+      // manager.  The last task notified this thread before we got here and
+      // touches nothing of its own after that, so it is free for reuse even
+      // if its worker has yet to drop its reference.
+      if (task_) {
+        task_->reuse(Util::monotonicTimeUsec(), deadline_);
+      } else {
+        task_.reset(new Task(processor_, inputProtocol_, outputProtocol_, this,
+                             Util::monotonicTimeUsec(), deadline_));
+      }
+      stdcxx::shared_ptr<Runnable> task = task_;
+      ThreadManager::TaskClass taskClass;
+      if (server_->getRequestClassifier()) {
+        TRequestInfo request(readBuffer_ + 4,
+                             readBufferPos_ - 4,
+                             server_->getHeaderTransport(),
+                             server_->getInputProtocolFactory());
+        taskClass = server_->getRequestClassifier()->classify(request);
+      }
       // The application is now waiting on the task to finish
       appState_ = APP_WAIT_TASK;
 
@@ -621,7 +1027,7 @@ void TNonblockingServer::TConnection::transition() {
       setIdle();
 
       try {
-        server_->addTask(task);
+        server_->addTask(task, taskClass, getIOThreadNumber());
       } catch (IllegalStateException& ise) {
         // The ThreadManager is not ready to handle any more tasks (it's probably shutting down).
         GlobalOutput.printf("IllegalStateException: Server::process() %s", ise.what());
@@ -641,6 +1047,7 @@ void TNonblockingServer::TConnection::transition() {
         }
         // Invoke the processor
         processor_->process(inputProtocol_, outputProtocol_, connectionContext_);
+        markPhase(TFlightRecorder::HANDLER_DONE);
       } catch (const TTransportException& ttx) {
         GlobalOutput.printf(
             "TNonblockingServer transport error in "
@@ -671,9 +1078,17 @@ void TNonblockingServer::TConnection::transition() {
   case APP_WAIT_TASK:
     // We have now finished processing a task and the result has been written
     // into the outputTransport_, so we grab its contents and place them into
-    // the writeBuffer_ for actual writing by the libevent thread
+    // the writeBuffer_ for actual writing by the libevent thread.  A
+    // request stays active until its response has been written.
+
+    // Nobody is waiting for the result any more
+    if (deadline_ != 0 && Util::monotonicTimeUsec() > deadline_) {
+      server_->decrementActiveProcessors();
+      server_->incrementDeadlineDropped();
+      recordRequest(record_);
+      goto LABEL_APP_INIT;
+    }
 
-    server_->decrementActiveProcessors();
     // Get the result of the operation
     outputTransport_->getBuffer(&writeBuffer_, &writeBufferSize_);
 
@@ -699,9 +1114,15 @@ void TNonblockingServer::TConnection::transition() {
 
     // In this case, the request was oneway and we should fall through
     // right back into the read frame header state
+    server_->decrementActiveProcessors();
+    recordRequest(record_);
     goto LABEL_APP_INIT;
 
   case APP_SEND_RESULT:
+    server_->decrementActiveProcessors();
+    markPhase(TFlightRecorder::LAST_BYTE_WRITTEN);
+    recordRequest(record_);
+
     // it's now safe to perform buffer size housekeeping.
     if (writeBufferSize_ > largestWriteBufferSize_) {
       largestWriteBufferSize_ = writeBufferSize_;
@@ -778,6 +1199,222 @@ void TNonblockingServer::TConnection::transition() {
   }
 }
 
+void TNonblockingServer::TConnection::dispatchRequest() {
+  // The request gets its own buffers so that the next one can be read into
+  // readBuffer_ while it is processed
+  stdcxx::shared_ptr<TMemoryBuffer> input(
+      new TMemoryBuffer(readBuffer_ + 4, readBufferPos_ - 4, TMemoryBuffer::COPY));
+  stdcxx::shared_ptr<TMemoryBuffer> output(
+      new TMemoryBuffer(static_cast<uint32_t>(server_->getWriteBufferDefaultSize())));
+  // Room for the frame size
+  output->getWritePtr(4);
+  output->wroteBytes(4);
+
+  stdcxx::shared_ptr<TProtocol> inputProtocol = server_->getInputProtocolFactory()->getProtocol(
+      server_->getInputTransportFactory()->getTransport(input));
+  stdcxx::shared_ptr<TProtocol> outputProtocol = server_->getOutputProtocolFactory()->getProtocol(
+      server_->getOutputTransportFactory()->getTransport(output));
+
+  if (asyncProcessor_) {
+    processAsync(inputProtocol, outputProtocol, output);
+    return;
+  }
+
+  ThreadManager::TaskClass taskClass;
+  if (server_->getRequestClassifier()) {
+    TRequestInfo request(readBuffer_ + 4,
+                         readBufferPos_ - 4,
+                         false,
+                         server_->getInputProtocolFactory());
+    taskClass = server_->getRequestClassifier()->classify(request);
+  }
+
+  markPhase(TFlightRecorder::ENQUEUED);
+  stdcxx::shared_ptr<Runnable> task(new Task(processor_, inputProtocol, outputProtocol, this,
+                                             Util::monotonicTimeUsec(), 0, output));
+  // The task took the timeline along
+  record_.clear();
+  server_->incrementActiveProcessors();
+  ++inFlight_;
+
+  try {
+    server_->addTask(task, taskClass, getIOThreadNumber());
+  } catch (IllegalStateException& ise) {
+    GlobalOutput.printf("IllegalStateException: Server::process() %s", ise.what());
+    --inFlight_;
+    server_->decrementActiveProcessors();
+    closeWhenIdle();
+    return;
+  } catch (TimedOutException& to) {
+    GlobalOutput.printf("[ERROR] TimedOutException: Server::process() %s", to.what());
+    --inFlight_;
+    server_->decrementActiveProcessors();
+    closeWhenIdle();
+    return;
+  }
+
+  // On to the next request
+  socketState_ = SOCKET_RECV_FRAMING;
+  appState_ = APP_READ_FRAME_SIZE;
+  readBufferPos_ = 0;
+  setPipelinedFlags();
+}
+
+void TNonblockingServer::TConnection::processAsync(const stdcxx::shared_ptr<TProtocol>& input,
+                                                  const stdcxx::shared_ptr<TProtocol>& output,
+                                                  const stdcxx::shared_ptr<TMemoryBuffer>& response) {
+  stdcxx::shared_ptr<AsyncCall> call(new AsyncCall(input, output, response, this));
+  // The call took the timeline along
+  record_.clear();
+  server_->incrementActiveProcessors();
+  ++inFlight_;
+
+  // On to the next request; the call may complete before process() returns
+  socketState_ = SOCKET_RECV_FRAMING;
+  appState_ = APP_READ_FRAME_SIZE;
+  readBufferPos_ = 0;
+
+  dispatching_ = true;
+  try {
+    if (serverEventHandler_) {
+      serverEventHandler_->processContext(connectionContext_, getTSocket());
+    }
+    asyncProcessor_->process(stdcxx::bind(&AsyncCall::complete, call, stdcxx::placeholders::_1),
+                             input,
+                             output);
+  } catch (const std::exception& x) {
+    GlobalOutput.printf("TNonblockingServer: async process() exception: %s: %s",
+                        typeid(x).name(),
+                        x.what());
+    call->complete(false);
+  } catch (...) {
+    GlobalOutput.printf("TNonblockingServer: unknown exception from async process()");
+    call->complete(false);
+  }
+  dispatching_ = false;
+
+  // Calls that completed meanwhile; collecting them may close the connection
+  while (deferred_ > 0) {
+    --deferred_;
+    if (collectResponse()) {
+      return;
+    }
+  }
+  if (!closing_) {
+    setPipelinedFlags();
+  }
+}
+
+bool TNonblockingServer::TConnection::collectResponse() {
+  Response response;
+  {
+    Guard g(completedMutex_);
+    assert(!completed_.empty());
+    response = completed_.front();
+    completed_.pop_front();
+    if (closeRequested_) {
+      closing_ = true;
+    }
+  }
+  --inFlight_;
+
+  if (closing_) {
+    server_->decrementActiveProcessors();
+    return closeWhenIdle();
+  }
+
+  uint8_t* buf = NULL;
+  uint32_t size = 0;
+  if (response.buffer) {
+    response.buffer->getBuffer(&buf, &size);
+  }
+  // Nothing but the room for the frame size for oneway requests
+  if (size > 4) {
+    // The request stays active until the response has been written
+    int32_t frameSize = (int32_t)htonl(size - 4);
+    memcpy(buf, &frameSize, 4);
+    responses_.push_back(response);
+  } else {
+    server_->decrementActiveProcessors();
+    recordRequest(response.record);
+  }
+
+  if (!sendingResponse_) {
+    nextResponse();
+  }
+  setPipelinedFlags();
+  return false;
+}
+
+void TNonblockingServer::TConnection::nextResponse() {
+  writeBuffer_ = NULL;
+  writeBufferPos_ = 0;
+  writeBufferSize_ = 0;
+  sendingResponse_.reset();
+  if (!responses_.empty()) {
+    sendingResponse_ = responses_.front().buffer;
+    sendingRecord_ = responses_.front().record;
+    responses_.pop_front();
+    sendingResponse_->getBuffer(&writeBuffer_, &writeBufferSize_);
+  }
+}
+
+bool TNonblockingServer::TConnection::sendResponses() {
+  uint32_t sent = 0;
+  try {
+    sent = tSocket_->write_partial(writeBuffer_ + writeBufferPos_,
+                                   writeBufferSize_ - writeBufferPos_);
+  } catch (TTransportException& te) {
+    GlobalOutput.printf("TConnection::sendResponses(): %s ", te.what());
+    closeWhenIdle();
+    return false;
+  }
+
+  writeBufferPos_ += sent;
+  assert(writeBufferPos_ <= writeBufferSize_);
+  if (writeBufferPos_ == writeBufferSize_) {
+    server_->decrementActiveProcessors();
+    if (flightRecorder_) {
+      sendingRecord_.mark(TFlightRecorder::LAST_BYTE_WRITTEN);
+      recordRequest(sendingRecord_);
+    }
+    nextResponse();
+  }
+  setPipelinedFlags();
+  return true;
+}
+
+void TNonblockingServer::TConnection::workPipelined(short which) {
+  if ((which & EV_WRITE) && sendingResponse_ && !sendResponses()) {
+    return;
+  }
+  if ((which & EV_READ) && (eventFlags_ & EV_READ)) {
+    workSocket();
+  }
+}
+
+void TNonblockingServer::TConnection::setPipelinedFlags() {
+  size_t outstanding = inFlight_ + responses_.size() + (sendingResponse_ ? 1 : 0);
+  short flags = 0;
+  if (outstanding < server_->getMaxInFlightPerConnection()) {
+    flags |= EV_READ;
+  }
+  if (sendingResponse_) {
+    flags |= EV_WRITE;
+  }
+  setFlags(flags ? flags | EV_PERSIST : 0);
+}
+
+bool TNonblockingServer::TConnection::closeWhenIdle() {
+  if (inFlight_ == 0) {
+    close();
+    return true;
+  }
+  closing_ = true;
+  setIdle();
+  return false;
+}
+
 void TNonblockingServer::TConnection::setFlags(short eventFlags) {
   // Catch the do nothing case
   if (eventFlags_ == eventFlags) {
@@ -838,6 +1475,24 @@ void TNonblockingServer::TConnection::setFlags(short eventFlags) {
  * Closes a connection
  */
 void TNonblockingServer::TConnection::close() {
+  // Async calls that complete from now on find the connection gone
+  if (asyncCalls_) {
+    RWGuard g(asyncCalls_->mutex, RW_WRITE);
+    asyncCalls_->connection = NULL;
+  }
+  asyncCalls_.reset();
+
+  // Requests are only still in flight when the server shuts down; they,
+  // and the responses of those that completed, are given up
+  if (inFlight_ > 0) {
+    server_->decrementActiveProcessors(inFlight_);
+    inFlight_ = 0;
+  }
+  {
+    Guard g(completedMutex_);
+    completed_.clear();
+  }
+
   setIdle();
 
   if (serverEventHandler_) {
@@ -852,8 +1507,21 @@ void TNonblockingServer::TConnection::close() {
   factoryInputTransport_->close();
   factoryOutputTransport_->close();
 
-  // release processor and handler
+  // release processor and handler, and the task that refers to them
   processor_.reset();
+  asyncProcessor_.reset();
+  task_.reset();
+
+  // drop responses a pipelined connection did not get to send
+  size_t unsent = responses_.size() + (sendingResponse_ ? 1 : 0);
+  if (appState_ == APP_SEND_RESULT) {
+    unsent = 1;
+  }
+  if (unsent > 0) {
+    server_->decrementActiveProcessors(unsent);
+  }
+  responses_.clear();
+  sendingResponse_.reset();
 
   // Give this object back to the server that owns it
   server_->returnConnection(this);
@@ -911,14 +1579,25 @@ TNonblockingServer::TConnection* TNonblockingServer::createConnection(stdcxx::sh
 
   // Check the connection stack to see if we can re-use
   TConnection* result = NULL;
-  if (connectionStack_.empty()) {
-    result = new TConnection(socket, ioThread);
-    ++numTConnections_;
-  } else {
-    result = connectionStack_.top();
-    connectionStack_.pop();
-    result->setSocket(socket);
-    result->init(ioThread);
+  try {
+    if (connectionStack_.empty()) {
+      result = new TConnection(socket, ioThread);
+      ++numTConnections_;
+    } else {
+      result = connectionStack_.top();
+      connectionStack_.pop();
+      result->setSocket(socket);
+      result->init(ioThread);
+    }
+  } catch (const TException& tx) {
+    // The protocol or processor factories refused this connection (e.g. a
+    // TSpecializedProtocolFactory whose protocol does not match the
+    // transports); the caller closes the socket.
+    GlobalOutput.printf("TNonblockingServer: failed to set up connection: %s", tx.what());
+    if (result) {
+      connectionStack_.push(result);
+    }
+    return NULL;
   }
   activeConnections_.push_back(result);
   return result;
@@ -953,6 +1632,15 @@ void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
   // Make sure that libevent didn't mess up the socket handles
   assert(fd == serverSocket_);
 
+  // While draining, connections are left queued on the listen socket
+  {
+    Guard g(connMutex_);
+    if (draining_) {
+      ioThreads_[0]->stopListening();
+      return;
+    }
+  }
+
   // Going to accept a new client socket
   stdcxx::shared_ptr<TSocket> clientSocket;
 
@@ -1009,37 +1697,73 @@ void TNonblockingServer::handleEvent(THRIFT_SOCKET fd, short which) {
 }
 
 /**
- * Creates a socket to listen on and binds it to the local port.
+ * Creates a socket to listen on and binds it to the local port, unless the
+ * transport is already listening.
  */
 void TNonblockingServer::createAndListenOnSocket() {
-  serverTransport_->listen();
+  // The transport may already have been put into listening state by the caller
+  if (serverTransport_->getSocketFD() == THRIFT_INVALID_SOCKET) {
+    serverTransport_->listen();
+  }
   serverSocket_ = serverTransport_->getSocketFD();
 }
 
 
 void TNonblockingServer::setThreadManager(stdcxx::shared_ptr<ThreadManager> threadManager) {
-  threadManager_ = threadManager;
+  std::vector<stdcxx::shared_ptr<ThreadManager> > threadManagers;
   if (threadManager) {
-    threadManager->setExpireCallback(
+    threadManagers.push_back(threadManager);
+  }
+  setThreadManagers(threadManagers);
+}
+
+void TNonblockingServer::setThreadManagers(
+    const std::vector<stdcxx::shared_ptr<ThreadManager> >& threadManagers) {
+  for (size_t i = 0; i < threadManagers.size(); ++i) {
+    if (!threadManagers[i]) {
+      throw InvalidArgumentException();
+    }
+  }
+  threadManagers_ = threadManagers;
+  for (size_t i = 0; i < threadManagers_.size(); ++i) {
+    threadManagers_[i]->setExpireCallback(
         apache::thrift::stdcxx::bind(&TNonblockingServer::expireClose,
                                      this,
                                      apache::thrift::stdcxx::placeholders::_1));
-    threadPoolProcessing_ = true;
-  } else {
-    threadPoolProcessing_ = false;
   }
+  threadManager_ = threadManagers_.empty() ? stdcxx::shared_ptr<ThreadManager>()
+                                           : threadManagers_.front();
+  threadPoolProcessing_ = !threadManagers_.empty();
+}
+
+bool TNonblockingServer::shedDequeuedTask(int64_t enqueueTime) {
+  if (queueDelayTarget_ <= 0) {
+    return false;
+  }
+  int64_t now = Util::monotonicTimeUsec();
+  if (!codel_.shouldShed(now - enqueueTime, now)) {
+    return false;
+  }
+  Guard g(connMutex_);
+  ++nShed_;
+  return true;
 }
 
 bool TNonblockingServer::serverOverloaded() {
   size_t activeConnections = numTConnections_ - connectionStack_.size();
-  if (numActiveProcessors_ > maxActiveProcessors_ || activeConnections > maxConnections_) {
+  bool queueStanding = queueDelayTarget_ > 0 && codel_.isOverloaded();
+  if (queueStanding || numActiveProcessors_ > maxActiveProcessors_
+      || activeConnections > maxConnections_) {
     if (!overloaded_) {
       GlobalOutput.printf("TNonblockingServer: overload condition begun.");
       overloaded_ = true;
     }
   } else {
-    if (overloaded_ && (numActiveProcessors_ <= overloadHysteresis_ * maxActiveProcessors_)
-        && (activeConnections <= overloadHysteresis_ * maxConnections_)) {
+    // With a queue delay target the queue itself tells when load is gone
+    if (overloaded_
+        && (queueDelayTarget_ > 0
+            || ((numActiveProcessors_ <= overloadHysteresis_ * maxActiveProcessors_)
+                && (activeConnections <= overloadHysteresis_ * maxConnections_)))) {
       GlobalOutput.printf(
           "TNonblockingServer: overload ended; "
           "%u dropped (%llu total)",
@@ -1054,11 +1778,12 @@ bool TNonblockingServer::serverOverloaded() {
 }
 
 bool TNonblockingServer::drainPendingTask() {
-  if (threadManager_) {
-    stdcxx::shared_ptr<Runnable> task = threadManager_->removeNextPending();
+  for (size_t i = 0; i < threadManagers_.size(); ++i) {
+    stdcxx::shared_ptr<Runnable> task = threadManagers_[i]->removeNextPending();
     if (task) {
       TConnection* connection = static_cast<TConnection::Task*>(task.get())->getTConnection();
-      assert(connection && connection->getServer() && connection->getState() == APP_WAIT_TASK);
+      assert(connection && connection->getServer()
+             && (connection->isPipelined() || connection->getState() == APP_WAIT_TASK));
       connection->forceClose();
       return true;
     }
@@ -1068,10 +1793,36 @@ bool TNonblockingServer::drainPendingTask() {
 
 void TNonblockingServer::expireClose(stdcxx::shared_ptr<Runnable> task) {
   TConnection* connection = static_cast<TConnection::Task*>(task.get())->getTConnection();
-  assert(connection && connection->getServer() && connection->getState() == APP_WAIT_TASK);
+  assert(connection && connection->getServer()
+         && (connection->isPipelined() || connection->getState() == APP_WAIT_TASK));
   connection->forceClose();
 }
 
+bool TNonblockingServer::drain(int64_t timeoutMs) {
+  bool drained;
+  {
+    Synchronized s(drainMonitor_);
+    draining_ = true;
+
+    int64_t deadline = Util::currentTime() + timeoutMs;
+    while (numActiveProcessors_ > 0) {
+      int64_t remaining = deadline - Util::currentTime();
+      if (timeoutMs != 0 && remaining <= 0) {
+        break;
+      }
+      try {
+        drainMonitor_.wait(timeoutMs != 0 ? remaining : 0);
+      } catch (const TimedOutException&) {
+        // checked above
+      }
+    }
+    drained = numActiveProcessors_ == 0;
+  }
+
+  stop();
+  return drained;
+}
+
 void TNonblockingServer::stop() {
   // Breaks the event loop in all threads so that they end ASAP.
   for (uint32_t i = 0; i < ioThreads_.size(); ++i) {
@@ -1080,6 +1831,9 @@ void TNonblockingServer::stop() {
 }
 
 void TNonblockingServer::registerEvents(event_base* user_event_base) {
+  if (isAsyncProcessing() && getHeaderTransport()) {
+    throw TException("TNonblockingServer: async processing needs framed transport");
+  }
   userEventBase_ = user_event_base;
 
   // init listen socket
@@ -1159,6 +1913,19 @@ void TNonblockingServer::serve() {
     ioThreads_[i]->join();
     GlobalOutput.printf("TNonblocking: join done for IO thread #%d", i);
   }
+
+  // After a drain with nothing left in flight, no task refers to the
+  // remaining connections and they can be closed right away
+  bool drained;
+  {
+    Guard g(connMutex_);
+    drained = draining_ && numActiveProcessors_ == 0;
+  }
+  if (drained) {
+    while (!activeConnections_.empty()) {
+      activeConnections_.front()->close();
+    }
+  }
 }
 
 TNonblockingIOThread::TNonblockingIOThread(TNonblockingServer* server,
@@ -1387,7 +2154,7 @@ void TNonblockingIOThread::notifyHandler(evutil_socket_t fd, short which, void*
         ioThread->breakLoop(false);
         return;
       }
-      connection->transition();
+      connection->notified();
     } else if (nBytes > 0) {
       // throw away these bytes and hope that next time we get a solid read
       GlobalOutput.printf("notifyHandler: Bad read of %d bytes, wanted %d", nBytes, kSize);
@@ -1468,6 +2235,17 @@ void TNonblockingIOThread::run() {
   if (useHighPriority_) {
     setCurrentThreadHighPriority(true);
   }
+  // The thread that called serve() runs IO thread #0, and gets its CPUs and
+  // memory policy back afterwards
+  ThreadPlacement placement = server_->getIOThreadPlacement(number_);
+  SavedThreadPlacement previous;
+  bool placed = false;
+  if (!placement.isAnywhere()) {
+    placed = placement.apply();
+    if (!placed) {
+      GlobalOutput.printf("TNonblockingServer: IO thread #%d could not be placed", number_);
+    }
+  }
 
   if (eventBase_ != NULL)
   {
@@ -1478,6 +2256,9 @@ void TNonblockingIOThread::run() {
     if (useHighPriority_) {
       setCurrentThreadHighPriority(false);
     }
+    if (placed && !previous.restore()) {
+      GlobalOutput.printf("TNonblockingServer: IO thread #%d could not be moved back", number_);
+    }
 
     // cleans up our registered events
     cleanupEvents();
@@ -1497,6 +2278,15 @@ void TNonblockingIOThread::cleanupEvents() {
   event_del(&notificationEvent_);
 }
 
+void TNonblockingIOThread::stopListening() {
+  if (listenSocket_ != THRIFT_INVALID_SOCKET) {
+    if (event_del(&serverEvent_) == -1) {
+      GlobalOutput.perror("TNonblockingIOThread::stopListening() event_del: ",
+                          THRIFT_GET_SOCKET_ERROR);
+    }
+  }
+}
+
 void TNonblockingIOThread::stop() {
   // This should cause the thread to fall out of its event loop ASAP.
   breakLoop(false);
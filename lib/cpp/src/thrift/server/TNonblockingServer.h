@@ -22,16 +22,22 @@
 
 #include <thrift/Thrift.h>
 #include <thrift/stdcxx.h>
+#include <thrift/async/TAsyncProcessor.h>
 #include <thrift/server/TServer.h>
+#include <thrift/server/TCoDel.h>
+#include <thrift/server/TRequestClassifier.h>
 #include <thrift/transport/PlatformSocket.h>
 #include <thrift/transport/TBufferTransports.h>
 #include <thrift/transport/TSocket.h>
 #include <thrift/transport/TNonblockingServerTransport.h>
 #include <thrift/concurrency/ThreadManager.h>
 #include <climits>
+#include <thrift/concurrency/AffinityThreadFactory.h>
 #include <thrift/concurrency/Thread.h>
 #include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/concurrency/Monitor.h>
 #include <thrift/concurrency/Mutex.h>
+#include <algorithm>
 #include <stack>
 #include <vector>
 #include <string>
@@ -56,6 +62,8 @@ using apache::thrift::concurrency::ThreadManager;
 using apache::thrift::concurrency::PlatformThreadFactory;
 using apache::thrift::concurrency::ThreadFactory;
 using apache::thrift::concurrency::Thread;
+using apache::thrift::concurrency::ThreadPlacement;
+using apache::thrift::concurrency::Monitor;
 using apache::thrift::concurrency::Mutex;
 using apache::thrift::concurrency::Guard;
 
@@ -99,6 +107,18 @@ inline SOCKOPT_CAST_T* cast_sockopt(T* v) {
  * operates a set of IO threads (by default only one). It assumes that
  * all incoming requests are framed with a 4 byte length indicator and
  * writes out responses using the same framing.
+ *
+ * With a flight recorder (see TServer::setFlightRecorder()) every phase
+ * of a request is recorded; ENQUEUED and DEQUEUED only with a thread
+ * manager, and ACCEPTED for the first request of a connection.
+ *
+ * Given a TAsyncProcessor instead of a TProcessor, the server calls it on
+ * the IO thread and writes the response when the processor calls back,
+ * from whatever thread, so that an IO thread carries any number of calls
+ * waiting on backends without a worker thread per call.  The processor
+ * must not block; a thread manager is not used.  Requests are then
+ * pipelined up to getMaxInFlightPerConnection(), and only framed (not
+ * header) transports are supported.
  */
 
 /// Overload condition actions.
@@ -162,9 +182,24 @@ private:
   /// For processing via thread pool, may be NULL
   stdcxx::shared_ptr<ThreadManager> threadManager_;
 
+  /// threadManager_ and the others of setThreadManagers(), one per group of IO threads
+  std::vector<stdcxx::shared_ptr<ThreadManager> > threadManagers_;
+
+  /// Where each IO thread runs, round-robin; empty for anywhere
+  std::vector<ThreadPlacement> ioThreadPlacements_;
+
+  /// For processing with a TAsyncProcessor on the IO threads, may be NULL
+  stdcxx::shared_ptr<async::TAsyncProcessorFactory> asyncProcessorFactory_;
+
+  /// Picks the ThreadManager lane of each request, if set
+  stdcxx::shared_ptr<TRequestClassifier> requestClassifier_;
+
   /// Is thread pool processing?
   bool threadPoolProcessing_;
 
+  /// Most requests of one connection processed at once (1 == in order)
+  uint32_t maxInFlightPerConnection_;
+
   // Factory to create the IO threads
   stdcxx::shared_ptr<PlatformThreadFactory> ioThreadFactory_;
 
@@ -180,7 +215,7 @@ private:
   /// Number of TConnection object we've created
   size_t numTConnections_;
 
-  /// Number of Connections processing or waiting to process
+  /// Number of Connections processing, waiting to process or answering
   size_t numActiveProcessors_;
 
   /// Limit for how many TConnection objects to cache
@@ -208,6 +243,12 @@ private:
   /// Action to take when we're overloaded.
   TOverloadAction overloadAction_;
 
+  /// Queueing delay target in milliseconds for load shedding (0 == disabled).
+  int64_t queueDelayTarget_;
+
+  /// Shedding state; only consulted when queueDelayTarget_ is set.
+  TCoDel codel_;
+
   /**
    * The write buffer is initialized (and when idleWriteBufferLimit_ is checked
    * and found to be exceeded, reinitialized) to this size.
@@ -246,6 +287,12 @@ private:
   /// Count of connections dropped on overload since server started
   uint64_t nTotalConnectionsDropped_;
 
+  /// Count of requests dropped because their client deadline had passed
+  uint64_t nDeadlineDropped_;
+
+  /// Count of requests shed because of queueing delay
+  uint64_t nShed_;
+
   /**
    * This is a stack of all the objects that have been created but that
    * are NOT currently in use. When we close a connection, we place it on this
@@ -266,6 +313,12 @@ private:
   */
   stdcxx::shared_ptr<TNonblockingServerTransport> serverTransport_;
 
+  /// Set once drain() has been called; guarded by connMutex_
+  bool draining_;
+
+  /// Signalled through connMutex_ when the last active processor finishes while draining
+  Monitor drainMonitor_;
+
   /**
    * Called when server socket had something happen.  We accept all waiting
    * client connections on listen socket fd and assign TConnection objects
@@ -282,6 +335,7 @@ private:
     useHighPriorityIOThreads_ = false;
     userEventBase_ = NULL;
     threadPoolProcessing_ = false;
+    maxInFlightPerConnection_ = 1;
     numTConnections_ = 0;
     numActiveProcessors_ = 0;
     connectionStackLimit_ = CONNECTION_STACK_LIMIT;
@@ -291,6 +345,7 @@ private:
     taskExpireTime_ = 0;
     overloadHysteresis_ = 0.8;
     overloadAction_ = T_OVERLOAD_NO_ACTION;
+    queueDelayTarget_ = 0;
     writeBufferDefaultSize_ = WRITE_BUFFER_DEFAULT_SIZE;
     idleReadBufferLimit_ = IDLE_READ_BUFFER_LIMIT;
     idleWriteBufferLimit_ = IDLE_WRITE_BUFFER_LIMIT;
@@ -298,18 +353,21 @@ private:
     overloaded_ = false;
     nConnectionsDropped_ = 0;
     nTotalConnectionsDropped_ = 0;
+    nDeadlineDropped_ = 0;
+    nShed_ = 0;
+    draining_ = false;
   }
 
 public:
   TNonblockingServer(const stdcxx::shared_ptr<TProcessorFactory>& processorFactory,
                      const stdcxx::shared_ptr<apache::thrift::transport::TNonblockingServerTransport>& serverTransport)
-    : TServer(processorFactory), serverTransport_(serverTransport) {
+    : TServer(processorFactory), serverTransport_(serverTransport), drainMonitor_(&connMutex_) {
     init();
   }
 
   TNonblockingServer(const stdcxx::shared_ptr<TProcessor>& processor,
                      const stdcxx::shared_ptr<apache::thrift::transport::TNonblockingServerTransport>& serverTransport)
-    : TServer(processor), serverTransport_(serverTransport) {
+    : TServer(processor), serverTransport_(serverTransport), drainMonitor_(&connMutex_) {
     init();
   }
 
@@ -319,7 +377,7 @@ public:
                      const stdcxx::shared_ptr<apache::thrift::transport::TNonblockingServerTransport>& serverTransport,
                      const stdcxx::shared_ptr<ThreadManager>& threadManager
                      = stdcxx::shared_ptr<ThreadManager>())
-    : TServer(processorFactory), serverTransport_(serverTransport) {
+    : TServer(processorFactory), serverTransport_(serverTransport), drainMonitor_(&connMutex_) {
     init();
 
     setInputProtocolFactory(protocolFactory);
@@ -332,7 +390,7 @@ public:
                      const stdcxx::shared_ptr<apache::thrift::transport::TNonblockingServerTransport>& serverTransport,
                      const stdcxx::shared_ptr<ThreadManager>& threadManager
                      = stdcxx::shared_ptr<ThreadManager>())
-    : TServer(processor), serverTransport_(serverTransport) {
+    : TServer(processor), serverTransport_(serverTransport), drainMonitor_(&connMutex_) {
     init();
 
     setInputProtocolFactory(protocolFactory);
@@ -348,7 +406,7 @@ public:
                      const stdcxx::shared_ptr<apache::thrift::transport::TNonblockingServerTransport>& serverTransport,
                      const stdcxx::shared_ptr<ThreadManager>& threadManager
                      = stdcxx::shared_ptr<ThreadManager>())
-    : TServer(processorFactory), serverTransport_(serverTransport) {
+    : TServer(processorFactory), serverTransport_(serverTransport), drainMonitor_(&connMutex_) {
     init();
 
     setInputTransportFactory(inputTransportFactory);
@@ -366,7 +424,7 @@ public:
                      const stdcxx::shared_ptr<apache::thrift::transport::TNonblockingServerTransport>& serverTransport,
                      const stdcxx::shared_ptr<ThreadManager>& threadManager
                      = stdcxx::shared_ptr<ThreadManager>())
-    : TServer(processor), serverTransport_(serverTransport) {
+    : TServer(processor), serverTransport_(serverTransport), drainMonitor_(&connMutex_) {
     init();
 
     setInputTransportFactory(inputTransportFactory);
@@ -376,14 +434,94 @@ public:
     setThreadManager(threadManager);
   }
 
+  TNonblockingServer(const stdcxx::shared_ptr<async::TAsyncProcessorFactory>& asyncProcessorFactory,
+                     const stdcxx::shared_ptr<TProtocolFactory>& protocolFactory,
+                     const stdcxx::shared_ptr<apache::thrift::transport::TNonblockingServerTransport>& serverTransport)
+    : TServer(stdcxx::shared_ptr<TProcessorFactory>()),
+      asyncProcessorFactory_(asyncProcessorFactory),
+      serverTransport_(serverTransport),
+      drainMonitor_(&connMutex_) {
+    init();
+
+    setInputProtocolFactory(protocolFactory);
+    setOutputProtocolFactory(protocolFactory);
+  }
+
+  TNonblockingServer(const stdcxx::shared_ptr<async::TAsyncProcessor>& asyncProcessor,
+                     const stdcxx::shared_ptr<TProtocolFactory>& protocolFactory,
+                     const stdcxx::shared_ptr<apache::thrift::transport::TNonblockingServerTransport>& serverTransport)
+    : TServer(stdcxx::shared_ptr<TProcessorFactory>()),
+      asyncProcessorFactory_(new async::TSingletonAsyncProcessorFactory(asyncProcessor)),
+      serverTransport_(serverTransport),
+      drainMonitor_(&connMutex_) {
+    init();
+
+    setInputProtocolFactory(protocolFactory);
+    setOutputProtocolFactory(protocolFactory);
+  }
+
   ~TNonblockingServer();
 
   void setThreadManager(stdcxx::shared_ptr<ThreadManager> threadManager);
 
+  /**
+   * Sets a ThreadManager for each group of IO threads: IO thread N hands
+   * the requests it reads to threadManagers[N % threadManagers.size()].
+   * With the threads of each ThreadManager placed by an
+   * AffinityThreadFactory, and the IO threads by setIOThreadPlacements(),
+   * a request then stays on one NUMA node from the socket to the response.
+   * getThreadManager() returns the first one.
+   *
+   * @throws InvalidArgumentException if one of them is NULL
+   */
+  void setThreadManagers(const std::vector<stdcxx::shared_ptr<ThreadManager> >& threadManagers);
+
   int getListenPort() { return serverTransport_->getListenPort(); }
 
   stdcxx::shared_ptr<ThreadManager> getThreadManager() { return threadManager_; }
 
+  const std::vector<stdcxx::shared_ptr<ThreadManager> >& getThreadManagers() const {
+    return threadManagers_;
+  }
+
+  /**
+   * Sets what decides the ThreadManager lane and fair share key of each
+   * request (see ThreadManager::addClassified()).  Without one, all
+   * requests share the NORMAL_PRIORITY lane in arrival order.  Only used
+   * with thread pool processing.
+   */
+  void setRequestClassifier(stdcxx::shared_ptr<TRequestClassifier> requestClassifier) {
+    requestClassifier_ = requestClassifier;
+  }
+
+  stdcxx::shared_ptr<TRequestClassifier> getRequestClassifier() const {
+    return requestClassifier_;
+  }
+
+  /**
+   * Sets how many requests of a single connection may be processed at once.
+   * With the default of 1, a connection is not read while its request is
+   * processed, and responses go out in request order.
+   *
+   * Above 1, a connection keeps reading requests while earlier ones are
+   * processed, dispatches each one to the ThreadManager on its own, and
+   * writes each response as soon as it is ready, so responses can go out of
+   * order.  The client must match them to its calls by sequence id, as
+   * TConcurrentClientSyncInfo does.  Reading stops while this many requests
+   * are being processed or have responses waiting to be written.
+   *
+   * The connection's processor and server event handler context are then
+   * used by several threads at once.  Only applies to thread pool and
+   * async processing with framed (not header) transports; must be set
+   * before connections are accepted.  Async processing always pipelines,
+   * so there it only sets the limit.
+   */
+  void setMaxInFlightPerConnection(uint32_t maxInFlight) {
+    maxInFlightPerConnection_ = maxInFlight > 0 ? maxInFlight : 1;
+  }
+
+  uint32_t getMaxInFlightPerConnection() const { return maxInFlightPerConnection_; }
+
   /**
    * Sets the number of IO threads used by this server. Can only be used before
    * the call to serve() and has no effect afterwards.  We always use a
@@ -405,6 +543,25 @@ public:
   /** Return the number of IO threads used by this server. */
   size_t getNumIOThreads() const { return numIOThreads_; }
 
+  /**
+   * Sets where the IO threads run: IO thread N on
+   * placements[N % placements.size()], such as the ThreadPlacement::onNode()
+   * of the node its ThreadManager (see setThreadManagers()) runs on.  IO
+   * thread 0 runs in the thread that calls serve(), which gets its CPUs back
+   * when serve() returns.  Can only be used before the call to serve().
+   */
+  void setIOThreadPlacements(const std::vector<ThreadPlacement>& placements) {
+    ioThreadPlacements_ = placements;
+  }
+
+  /** Return where an IO thread runs. */
+  ThreadPlacement getIOThreadPlacement(int ioThreadNumber) const {
+    if (ioThreadPlacements_.empty()) {
+      return ThreadPlacement();
+    }
+    return ioThreadPlacements_[ioThreadNumber % ioThreadPlacements_.size()];
+  }
+
   /**
    * Get the maximum number of unused TConnection we will hold in reserve.
    *
@@ -421,8 +578,14 @@ public:
 
   bool isThreadPoolProcessing() const { return threadPoolProcessing_; }
 
-  void addTask(stdcxx::shared_ptr<Runnable> task) {
-    threadManager_->add(task, 0LL, taskExpireTime_);
+  /// Whether requests go to a TAsyncProcessor on the IO threads
+  bool isAsyncProcessing() const { return asyncProcessorFactory_.get() != NULL; }
+
+  void addTask(stdcxx::shared_ptr<Runnable> task,
+               const ThreadManager::TaskClass& taskClass = ThreadManager::TaskClass(),
+               int ioThreadNumber = 0) {
+    threadManagers_[ioThreadNumber % threadManagers_.size()]
+        ->addClassified(task, taskClass, 0LL, taskExpireTime_);
   }
 
   /**
@@ -450,7 +613,8 @@ public:
    * Return count of number of connections which are currently processing.
    * This is defined as a connection where all data has been received and
    * either assigned a task (when threading) or passed to a handler (when
-   * not threading), and where the handler has not yet returned.
+   * not threading), and where the handler has not yet returned or its
+   * response has not yet been written.
    *
    * @return # of connections currently processing.
    */
@@ -463,10 +627,11 @@ public:
   }
 
   /// Decrement the count of connections currently processing.
-  void decrementActiveProcessors() {
+  void decrementActiveProcessors(size_t count = 1) {
     Guard g(connMutex_);
-    if (numActiveProcessors_ > 0) {
-      --numActiveProcessors_;
+    numActiveProcessors_ -= (std::min)(count, numActiveProcessors_);
+    if (draining_ && numActiveProcessors_ == 0) {
+      drainMonitor_.notifyAll();
     }
   }
 
@@ -564,12 +729,75 @@ public:
    */
   void setTaskExpireTime(int64_t taskExpireTime) { taskExpireTime_ = taskExpireTime; }
 
+  /**
+   * Get the queueing delay target used for load shedding.
+   *
+   * @return target in milliseconds, 0 if shedding is disabled.
+   */
+  int64_t getQueueDelayTarget() const { return queueDelayTarget_; }
+
+  /**
+   * Get the interval over which queueing delay is evaluated.
+   *
+   * @return interval in milliseconds.
+   */
+  int64_t getQueueDelayInterval() const { return codel_.getInterval() / 1000; }
+
+  /**
+   * Enable adaptive load shedding (see TCoDel).  When a request has waited
+   * in the task queue longer than the target for a whole interval, the
+   * server considers itself overloaded: requests that waited more than
+   * twice the target are answered with a TApplicationException instead of
+   * being processed, and the overload action is taken.  This replaces the
+   * overload hysteresis.  Only applies to thread pool processing.
+   *
+   * @param targetMs acceptable queueing delay in milliseconds, 0 disables.
+   * @param intervalMs how often the overload state is re-evaluated.
+   */
+  void setQueueDelayTarget(int64_t targetMs, int64_t intervalMs = 100) {
+    queueDelayTarget_ = targetMs;
+    codel_.setTarget(targetMs * 1000);
+    codel_.setInterval(intervalMs * 1000);
+  }
+
+  /**
+   * Get the number of requests whose response was dropped, unprocessed or
+   * not, because the client's deadline (see
+   * THeaderTransport::CLIENT_TIMEOUT_HEADER) had passed.
+   */
+  uint64_t getNumDeadlineDropped() const { return nDeadlineDropped_; }
+
+  /**
+   * Get the number of requests shed because of queueing delay.
+   */
+  uint64_t getNumShed() const { return nShed_; }
+
+  /**
+   * Decide whether a request taken off the task queue should be shed
+   * rather than processed, and count it if so.
+   *
+   * @param enqueueTime when the request was queued, in microseconds of
+   * Util::monotonicTimeUsec().
+   * @return true if the request should be shed.
+   */
+  bool shedDequeuedTask(int64_t enqueueTime);
+
+  /**
+   * Count a response that is dropped because the client's deadline passed.
+   */
+  void incrementDeadlineDropped() {
+    Guard g(connMutex_);
+    ++nDeadlineDropped_;
+  }
+
   /**
    * Determine if the server is currently overloaded.
    * This function checks the maximums for open connections and connections
    * currently in processing, and sets an overload condition if they are
    * exceeded.  The overload will persist until both values are below the
-   * current hysteresis fraction of their maximums.
+   * current hysteresis fraction of their maximums.  If a queue delay target
+   * is set, a standing task queue also signals overload, and the overload
+   * ends as soon as the queue drains and the maximums are respected.
    *
    * @return true if an overload condition exists, false if not.
    */
@@ -678,6 +906,23 @@ public:
    */
   void stop();
 
+  /**
+   * Stops the server without dropping requests (can be called from any
+   * thread): stops accepting connections, waits up to timeoutMs for the
+   * requests being processed to be answered, then stop()s.  Connections
+   * keep being served meanwhile.  When no request was left, serve() closes
+   * the remaining, idle, connections before it returns; otherwise they are
+   * closed when the server is destroyed.
+   *
+   * Connections waiting to be accepted stay queued on the listening socket,
+   * for a successor that it was handed off to (see
+   * TNonblockingServerSocket::handOff()).
+   *
+   * @param timeoutMs how long to wait for requests, 0 waits as long as it takes.
+   * @return true if no request was being processed when the server stopped.
+   */
+  bool drain(int64_t timeoutMs);
+
   /// Creates a socket to listen on and binds it to the local port.
   void createAndListenOnSocket();
 
@@ -723,6 +968,21 @@ private:
    */
   TConnection* createConnection(stdcxx::shared_ptr<TSocket> socket);
 
+  /**
+   * Get the TAsyncProcessor to handle calls on a connection, for async
+   * processing; called once per connection.
+   */
+  stdcxx::shared_ptr<async::TAsyncProcessor> getAsyncProcessor(
+      stdcxx::shared_ptr<TProtocol> inputProtocol,
+      stdcxx::shared_ptr<TProtocol> outputProtocol,
+      stdcxx::shared_ptr<TTransport> transport) {
+    TConnectionInfo connInfo;
+    connInfo.input = inputProtocol;
+    connInfo.output = outputProtocol;
+    connInfo.transport = transport;
+    return asyncProcessorFactory_->getProcessor(connInfo);
+  }
+
   /**
    * Returns a connection to pool or deletion.  If the connection pool
    * (a stack) isn't full, place the connection object on it, otherwise
@@ -779,6 +1039,9 @@ public:
   // Exits the event loop as soon as possible.
   void stop();
 
+  // Stops watching the listen socket; only call it on this IO thread.
+  void stopListening();
+
   // Ensures that the event-loop thread is fully finished and shut down.
   void join();
 
@@ -0,0 +1,184 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/server/TRequestClassifier.h>
+#include <thrift/transport/TBufferTransports.h>
+#include <thrift/transport/THeaderTransport.h>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+using apache::thrift::concurrency::ThreadManager;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::transport::THeaderTransport;
+using apache::thrift::transport::TMemoryBuffer;
+using stdcxx::shared_ptr;
+
+namespace {
+
+/**
+ * Reads a big endian int32 at frame[pos], if there is one
+ */
+bool readI32(const uint8_t* frame, uint32_t size, uint32_t& pos, uint32_t& value) {
+  if (size - pos < 4) {
+    return false;
+  }
+  value = (static_cast<uint32_t>(frame[pos]) << 24) | (static_cast<uint32_t>(frame[pos + 1]) << 16)
+          | (static_cast<uint32_t>(frame[pos + 2]) << 8) | frame[pos + 3];
+  pos += 4;
+  return true;
+}
+
+/**
+ * Reads a compact protocol varint32 at frame[pos], if there is one
+ */
+bool readVarint32(const uint8_t* frame, uint32_t size, uint32_t& pos, uint32_t& value) {
+  value = 0;
+  for (int shift = 0; shift < 35 && pos < size; shift += 7) {
+    uint8_t byte = frame[pos++];
+    value |= static_cast<uint32_t>(byte & 0x7f) << shift;
+    if (!(byte & 0x80)) {
+      return true;
+    }
+  }
+  return false;
+}
+
+/**
+ * Copies the length bytes at frame[pos] to name, if they are all there
+ */
+bool readName(const uint8_t* frame,
+              uint32_t size,
+              uint32_t pos,
+              uint32_t length,
+              std::string& name) {
+  if (length > size - pos) {
+    return false;
+  }
+  name.assign(reinterpret_cast<const char*>(frame + pos), length);
+  return true;
+}
+
+/**
+ * Reads the method name of a binary (strict or not) or compact protocol
+ * message straight from its bytes.  Returns false if the message is neither,
+ * or is cut short.
+ */
+bool readMethodName(const uint8_t* frame, uint32_t size, std::string& name) {
+  uint32_t pos = 0;
+  uint32_t value;
+  if (size < 2) {
+    return false;
+  }
+  if (frame[0] == 0x80 && frame[1] == 0x01) {
+    // Strict binary: version and type, then the name
+    return readI32(frame, size, pos, value) && readI32(frame, size, pos, value)
+           && readName(frame, size, pos, value, name);
+  }
+  if (frame[0] == 0x82 && (frame[1] & 0x1f) == 1) {
+    // Compact: protocol id, version and type, sequence id, then the name
+    pos = 2;
+    return readVarint32(frame, size, pos, value) && readVarint32(frame, size, pos, value)
+           && readName(frame, size, pos, value, name);
+  }
+  if (frame[0] == 0x00) {
+    // Old binary: the name comes first
+    return readI32(frame, size, pos, value) && readName(frame, size, pos, value, name);
+  }
+  return false;
+}
+}
+
+const std::string& TRequestInfo::method() const {
+  if (methodRead_) {
+    return method_;
+  }
+  methodRead_ = true;
+
+  const uint8_t* payload = frame_;
+  uint32_t size = size_;
+  int16_t protoId = 0;
+  if (headerFrame_) {
+    uint32_t offset;
+    if (!THeaderTransport::findPayload(frame_, size_, protoId, offset)) {
+      return method_;
+    }
+    payload += offset;
+    size -= offset;
+    if (protoId != protocol::T_BINARY_PROTOCOL && protoId != protocol::T_COMPACT_PROTOCOL) {
+      return method_;
+    }
+  }
+
+  // Binary and compact messages are read in place, so classifying them
+  // costs no allocations on the IO thread beyond the name itself
+  if (readMethodName(payload, size, method_)) {
+    return method_;
+  }
+  method_.clear();
+  if (headerFrame_ || !protocolFactory_) {
+    return method_;
+  }
+
+  // Any other protocol is decoded with protocolFactory
+  try {
+    // The buffer only observes the frame, so nothing is copied
+    shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer(const_cast<uint8_t*>(payload), size));
+    shared_ptr<TProtocol> protocol = protocolFactory_->getProtocol(buffer);
+    TMessageType type;
+    int32_t seqid;
+    protocol->readMessageBegin(method_, type, seqid);
+  } catch (const TException&) {
+    method_.clear();
+  }
+  return method_;
+}
+
+bool TRequestInfo::header(const std::string& key, std::string& value) const {
+  return headerFrame_ && THeaderTransport::findHeader(frame_, size_, key, value);
+}
+
+ThreadManager::TaskClass TMethodClassifier::classify(const TRequestInfo& request) {
+  ThreadManager::TaskClass taskClass(defaultPriority_);
+
+  if (!priorities_.empty()) {
+    std::map<std::string, ThreadManager::PRIORITY>::const_iterator it
+        = priorities_.find(request.method());
+    if (it != priorities_.end()) {
+      taskClass.priority = it->second;
+    }
+  }
+
+  std::string value;
+  if (!keyHeader_.empty() && request.header(keyHeader_, value)) {
+    // FNV-1a
+    uint64_t hash = 14695981039346656037ULL;
+    for (std::string::const_iterator c = value.begin(); c != value.end(); ++c) {
+      hash ^= static_cast<unsigned char>(*c);
+      hash *= 1099511628211ULL;
+    }
+    taskClass.key = hash;
+  }
+  return taskClass;
+}
+}
+}
+} // apache::thrift::server
@@ -0,0 +1,128 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TREQUESTCLASSIFIER_H_
+#define _THRIFT_SERVER_TREQUESTCLASSIFIER_H_ 1
+
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/protocol/TProtocol.h>
+#include <thrift/stdcxx.h>
+
+#include <map>
+#include <string>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * What a TRequestClassifier gets to see of a request: the raw frame it
+ * arrived in, with the frame size already stripped.  The method name is
+ * only decoded if asked for, and read straight from the frame for binary and
+ * compact messages.
+ */
+class TRequestInfo {
+public:
+  /**
+   * @param frame the request frame.
+   * @param size the size of frame.
+   * @param headerFrame whether the frame is in THeaderTransport format.
+   * @param protocolFactory the protocol the frame is encoded with, if it is
+   *        not in header format.
+   */
+  TRequestInfo(const uint8_t* frame,
+               uint32_t size,
+               bool headerFrame,
+               const stdcxx::shared_ptr<protocol::TProtocolFactory>& protocolFactory)
+    : frame_(frame),
+      size_(size),
+      headerFrame_(headerFrame),
+      protocolFactory_(protocolFactory),
+      methodRead_(false) {}
+
+  /**
+   * The name of the called method, or an empty string if it cannot be read
+   * (for instance because the payload of a header frame is compressed).
+   */
+  const std::string& method() const;
+
+  /**
+   * Looks up an info header.  Always false unless the request came over the
+   * header transport.
+   */
+  bool header(const std::string& key, std::string& value) const;
+
+private:
+  const uint8_t* frame_;
+  uint32_t size_;
+  bool headerFrame_;
+  stdcxx::shared_ptr<protocol::TProtocolFactory> protocolFactory_;
+  mutable bool methodRead_;
+  mutable std::string method_;
+};
+
+/**
+ * Decides the ThreadManager lane and fair share key of each request before
+ * a server queues it.  Called on the server's IO threads, so it must be
+ * quick and must neither block nor throw.
+ */
+class TRequestClassifier {
+public:
+  virtual ~TRequestClassifier() {}
+
+  virtual concurrency::ThreadManager::TaskClass classify(const TRequestInfo& request) = 0;
+};
+
+/**
+ * Classifies requests by method name into priority lanes, and optionally
+ * shares each lane fairly among the values of an info header, such as a
+ * tenant or client id.
+ */
+class TMethodClassifier : public TRequestClassifier {
+public:
+  explicit TMethodClassifier(concurrency::ThreadManager::PRIORITY defaultPriority
+                             = concurrency::ThreadManager::NORMAL_PRIORITY)
+    : defaultPriority_(defaultPriority) {}
+
+  /**
+   * Runs calls of method in the given lane.  For multiplexed services the
+   * method name includes the service prefix.
+   */
+  void setPriority(const std::string& method, concurrency::ThreadManager::PRIORITY priority) {
+    priorities_[method] = priority;
+  }
+
+  /**
+   * Shares lanes fairly among the values of this info header.  Requests
+   * without it share one key.
+   */
+  void setKeyHeader(const std::string& keyHeader) { keyHeader_ = keyHeader; }
+
+  concurrency::ThreadManager::TaskClass classify(const TRequestInfo& request);
+
+private:
+  concurrency::ThreadManager::PRIORITY defaultPriority_;
+  std::map<std::string, concurrency::ThreadManager::PRIORITY> priorities_;
+  std::string keyHeader_;
+};
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TREQUESTCLASSIFIER_H_
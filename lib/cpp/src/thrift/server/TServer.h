@@ -24,6 +24,7 @@
 #include <thrift/transport/TServerTransport.h>
 #include <thrift/protocol/TBinaryProtocol.h>
 #include <thrift/concurrency/Thread.h>
+#include <thrift/server/TFlightRecorder.h>
 
 #include <thrift/stdcxx.h>
 
@@ -123,6 +124,8 @@ public:
 
   stdcxx::shared_ptr<TServerEventHandler> getEventHandler() { return eventHandler_; }
 
+  stdcxx::shared_ptr<TFlightRecorder> getFlightRecorder() { return flightRecorder_; }
+
 protected:
   TServer(const stdcxx::shared_ptr<TProcessorFactory>& processorFactory)
     : processorFactory_(processorFactory) {
@@ -236,6 +239,8 @@ protected:
 
   stdcxx::shared_ptr<TServerEventHandler> eventHandler_;
 
+  stdcxx::shared_ptr<TFlightRecorder> flightRecorder_;
+
 public:
   void setInputTransportFactory(stdcxx::shared_ptr<TTransportFactory> inputTransportFactory) {
     inputTransportFactory_ = inputTransportFactory;
@@ -256,6 +261,14 @@ public:
   void setServerEventHandler(stdcxx::shared_ptr<TServerEventHandler> eventHandler) {
     eventHandler_ = eventHandler;
   }
+
+  /**
+   * Records the timeline of every request into flightRecorder; set before
+   * serving.  Which phases are seen depends on the server.
+   */
+  void setFlightRecorder(stdcxx::shared_ptr<TFlightRecorder> flightRecorder) {
+    flightRecorder_ = flightRecorder;
+  }
 };
 
 /**
@@ -20,6 +20,7 @@
 #include <algorithm>
 #include <stdexcept>
 #include <stdint.h>
+#include <thrift/concurrency/Util.h>
 #include <thrift/server/TServerFramework.h>
 
 namespace apache {
@@ -27,6 +28,8 @@ namespace thrift {
 namespace server {
 
 using apache::thrift::concurrency::Synchronized;
+using apache::thrift::concurrency::TimedOutException;
+using apache::thrift::concurrency::Util;
 using apache::thrift::protocol::TProtocol;
 using apache::thrift::protocol::TProtocolFactory;
 using apache::thrift::stdcxx::bind;
@@ -44,7 +47,8 @@ TServerFramework::TServerFramework(const shared_ptr<TProcessorFactory>& processo
   : TServer(processorFactory, serverTransport, transportFactory, protocolFactory),
     clients_(0),
     hwm_(0),
-    limit_(INT64_MAX) {
+    limit_(INT64_MAX),
+    draining_(false) {
 }
 
 TServerFramework::TServerFramework(const shared_ptr<TProcessor>& processor,
@@ -54,7 +58,8 @@ TServerFramework::TServerFramework(const shared_ptr<TProcessor>& processor,
   : TServer(processor, serverTransport, transportFactory, protocolFactory),
     clients_(0),
     hwm_(0),
-    limit_(INT64_MAX) {
+    limit_(INT64_MAX),
+    draining_(false) {
 }
 
 TServerFramework::TServerFramework(const shared_ptr<TProcessorFactory>& processorFactory,
@@ -71,7 +76,8 @@ TServerFramework::TServerFramework(const shared_ptr<TProcessorFactory>& processo
             outputProtocolFactory),
     clients_(0),
     hwm_(0),
-    limit_(INT64_MAX) {
+    limit_(INT64_MAX),
+    draining_(false) {
 }
 
 TServerFramework::TServerFramework(const shared_ptr<TProcessor>& processor,
@@ -88,7 +94,8 @@ TServerFramework::TServerFramework(const shared_ptr<TProcessor>& processor,
             outputProtocolFactory),
     clients_(0),
     hwm_(0),
-    limit_(INT64_MAX) {
+    limit_(INT64_MAX),
+    draining_(false) {
 }
 
 TServerFramework::~TServerFramework() {
@@ -155,13 +162,17 @@ void TServerFramework::serve() {
         outputProtocol = outputProtocolFactory_->getProtocol(outputTransport);
       }
 
-      newlyConnectedClient(shared_ptr<TConnectedClient>(
+      shared_ptr<TConnectedClient> pClient(
           new TConnectedClient(getProcessor(inputProtocol, outputProtocol, client),
                                inputProtocol,
                                outputProtocol,
                                eventHandler_,
                                client),
-          bind(&TServerFramework::disposeConnectedClient, this, stdcxx::placeholders::_1)));
+          bind(&TServerFramework::disposeConnectedClient, this, stdcxx::placeholders::_1));
+      if (flightRecorder_) {
+        pClient->setFlightRecorder(flightRecorder_);
+      }
+      newlyConnectedClient(pClient);
 
     } catch (TTransportException& ttx) {
       releaseOneDescriptor("inputTransport", inputTransport);
@@ -172,7 +183,7 @@ void TServerFramework::serve() {
         continue;
       } else if (ttx.getType() == TTransportException::END_OF_FILE
                  || ttx.getType() == TTransportException::INTERRUPTED) {
-        // Server was interrupted.  This only happens when stopping.
+        // Server was interrupted.  This only happens when stopping or draining.
         break;
       } else {
         // All other transport exceptions are logged.
@@ -184,6 +195,13 @@ void TServerFramework::serve() {
     }
   }
 
+  {
+    Synchronized sync(mon_);
+    while (draining_) {
+      mon_.wait();
+    }
+  }
+
   releaseOneDescriptor("serverTransport", serverTransport_);
 }
 
@@ -220,6 +238,34 @@ void TServerFramework::stop() {
   serverTransport_->interrupt();
 }
 
+bool TServerFramework::drain(int64_t timeoutMs) {
+  Synchronized sync(mon_);
+  draining_ = true;
+
+  // Stop accepting; serve() waits for the drain before closing the transport
+  serverTransport_->interrupt();
+
+  int64_t deadline = Util::currentTime() + timeoutMs;
+  while (clients_ > 0) {
+    int64_t remaining = deadline - Util::currentTime();
+    if (timeoutMs != 0 && remaining <= 0) {
+      break;
+    }
+    try {
+      mon_.wait(timeoutMs != 0 ? remaining : 0);
+    } catch (const TimedOutException&) {
+      // checked above
+    }
+  }
+  bool drained = clients_ == 0;
+
+  // Reads are interrupted, requests being processed are still answered
+  serverTransport_->interruptChildren();
+  draining_ = false;
+  mon_.notifyAll();
+  return drained;
+}
+
 void TServerFramework::newlyConnectedClient(const shared_ptr<TConnectedClient>& pClient) {
   {
     Synchronized sync(mon_);
@@ -227,6 +273,7 @@ void TServerFramework::newlyConnectedClient(const shared_ptr<TConnectedClient>&
     hwm_ = (std::max)(hwm_, clients_);
   }
 
+  pClient->markPhase(TFlightRecorder::ENQUEUED);
   onClientConnected(pClient);
 }
 
@@ -235,8 +282,9 @@ void TServerFramework::disposeConnectedClient(TConnectedClient* pClient) {
   delete pClient;
 
   Synchronized sync(mon_);
-  if (limit_ - --clients_ > 0) {
-    mon_.notify();
+  if (limit_ - --clients_ > 0 || draining_) {
+    // serve() and drain() may both be waiting
+    mon_.notifyAll();
   }
 }
 
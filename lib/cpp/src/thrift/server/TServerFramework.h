@@ -44,6 +44,12 @@ namespace server {
  * probably should be, it would break the TServer interface contract so
  * to maintain backwards compatibility for third party servers, no TServers
  * were harmed in the making of this class.
+ *
+ * With a flight recorder (see TServer::setFlightRecorder()) the first
+ * request of a client records when the client was accepted, handed to the
+ * server's threads (ENQUEUED) and taken up by one (DEQUEUED).  Each
+ * request records its first byte and the end of its response; reading,
+ * handling and answering it are a single processor call in between.
  */
 class TServerFramework : public TServer {
 public:
@@ -91,6 +97,21 @@ public:
    */
   virtual void stop();
 
+  /**
+   * Stop serve() gracefully: stop accepting clients, give the connected
+   * ones up to timeoutMs to disconnect, then interrupt those still
+   * connected; each is disconnected once its current request has been
+   * answered.  serve() then returns as it does after stop().  May be called
+   * from any thread while serve() runs.
+   *
+   * Clients waiting to be accepted stay queued on the listening socket,
+   * for a successor that it was handed off to (see TServerSocket::handOff()).
+   *
+   * \param[in]  timeoutMs  how long to wait for clients, 0 waits as long as it takes
+   * \returns true if every client had disconnected by then
+   */
+  virtual bool drain(int64_t timeoutMs);
+
   /**
    * Get the concurrent client limit.
    * \returns the concurrent client limit
@@ -176,6 +197,12 @@ private:
    * The limit on the number of concurrent clients.
    */
   int64_t limit_;
+
+  /**
+   * Set while drain() waits for clients; serve() keeps the server transport
+   * open until then so that the clients can still be interrupted.
+   */
+  bool draining_;
 };
 }
 }
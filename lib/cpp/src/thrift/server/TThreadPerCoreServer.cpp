@@ -0,0 +1,258 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <thrift/server/TThreadPerCoreServer.h>
+#include <thrift/concurrency/PlatformThreadFactory.h>
+
+#ifdef HAVE_UNISTD_H
+#include <unistd.h>
+#endif
+
+#ifdef __linux__
+#include <sched.h>
+#include <errno.h>
+#endif
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+using apache::thrift::concurrency::PlatformThreadFactory;
+using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::Synchronized;
+using apache::thrift::concurrency::Thread;
+using apache::thrift::protocol::TProtocolFactory;
+using apache::thrift::transport::TNonblockingServerSocket;
+using stdcxx::shared_ptr;
+
+class TThreadPerCoreServer::ShardRunner : public Runnable {
+public:
+  ShardRunner(TThreadPerCoreServer* server, size_t shard) : server_(server), shard_(shard) {}
+
+  void run() { server_->runShard(shard_); }
+
+private:
+  TThreadPerCoreServer* server_;
+  size_t shard_;
+};
+
+/**
+ * The CPUs the calling thread may run on, in ascending order.  Empty where
+ * that cannot be queried.
+ */
+static std::vector<int> allowedCpus() {
+  std::vector<int> cpus;
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+    for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+      if (CPU_ISSET(cpu, &set)) {
+        cpus.push_back(cpu);
+      }
+    }
+  }
+#endif
+  return cpus;
+}
+
+static void pinCurrentThread(int cpu) {
+#ifdef __linux__
+  cpu_set_t set;
+  CPU_ZERO(&set);
+  CPU_SET(cpu, &set);
+  if (sched_setaffinity(0, sizeof(set), &set) != 0) {
+    GlobalOutput.perror("TThreadPerCoreServer: sched_setaffinity() ", errno);
+  }
+#else
+  (void)cpu;
+#endif
+}
+
+TThreadPerCoreServer::TThreadPerCoreServer(const shared_ptr<TProcessorFactory>& processorFactory,
+                                           int port)
+  : TServer(processorFactory), port_(port) {
+  init();
+}
+
+TThreadPerCoreServer::TThreadPerCoreServer(const shared_ptr<TProcessor>& processor,
+                                           int port)
+  : TServer(processor), port_(port) {
+  init();
+}
+
+TThreadPerCoreServer::TThreadPerCoreServer(const shared_ptr<TProcessorFactory>& processorFactory,
+                                           const shared_ptr<TProtocolFactory>& protocolFactory,
+                                           int port)
+  : TServer(processorFactory), port_(port) {
+  setInputProtocolFactory(protocolFactory);
+  setOutputProtocolFactory(protocolFactory);
+  init();
+}
+
+TThreadPerCoreServer::TThreadPerCoreServer(const shared_ptr<TProcessor>& processor,
+                                           const shared_ptr<TProtocolFactory>& protocolFactory,
+                                           int port)
+  : TServer(processor), port_(port) {
+  setInputProtocolFactory(protocolFactory);
+  setOutputProtocolFactory(protocolFactory);
+  init();
+}
+
+TThreadPerCoreServer::~TThreadPerCoreServer() {
+}
+
+void TThreadPerCoreServer::init() {
+  listenPort_ = port_;
+  pinThreads_ = true;
+  stopping_ = false;
+  cpus_ = allowedCpus();
+  setNumShards(0);
+}
+
+void TThreadPerCoreServer::setNumShards(size_t numShards) {
+  numShards_ = numShards;
+  if (numShards_ == 0) {
+    numShards_ = cpus_.size();
+  }
+#ifdef HAVE_UNISTD_H
+  if (numShards_ == 0) {
+    long cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    numShards_ = cpus > 0 ? static_cast<size_t>(cpus) : 0;
+  }
+#endif
+  if (numShards_ == 0) {
+    numShards_ = 1;
+  }
+}
+
+int TThreadPerCoreServer::getListenPort() {
+  Synchronized s(monitor_);
+  return listenPort_;
+}
+
+shared_ptr<TNonblockingServer> TThreadPerCoreServer::getShard(size_t shard) {
+  Synchronized s(monitor_);
+  return shard < shards_.size() ? shards_[shard] : shared_ptr<TNonblockingServer>();
+}
+
+shared_ptr<TNonblockingServer> TThreadPerCoreServer::createShard(
+    size_t shard,
+    const shared_ptr<TNonblockingServerSocket>& socket) {
+  (void)shard;
+  // One processor per shard; the shard's connections all share it
+  shared_ptr<TProcessor> processor = processorFactory_->getProcessor(TConnectionInfo());
+  shared_ptr<TNonblockingServer> server(new TNonblockingServer(processor, socket));
+  server->setInputProtocolFactory(inputProtocolFactory_);
+  server->setOutputProtocolFactory(outputProtocolFactory_);
+  server->setServerEventHandler(eventHandler_);
+  server->setNumIOThreads(1);
+  return server;
+}
+
+void TThreadPerCoreServer::serve() {
+  {
+    Synchronized s(monitor_);
+    // A stop() that came first, even before serve(), stops this run
+    if (stopping_) {
+      stopping_ = false;
+      return;
+    }
+    shards_.clear();
+    registered_.assign(numShards_, false);
+
+    // With an ephemeral port, the first socket picks it for the others
+    int port = port_;
+    std::vector<shared_ptr<TNonblockingServerSocket> > sockets;
+    try {
+      for (size_t i = 0; i < numShards_; ++i) {
+        sockets.push_back(
+            shared_ptr<TNonblockingServerSocket>(new TNonblockingServerSocket(port)));
+        sockets.back()->setReusePort(true);
+        sockets.back()->listen();
+        if (i == 0) {
+          port = sockets.back()->getListenPort();
+          listenPort_ = port;
+        }
+        shards_.push_back(createShard(i, sockets.back()));
+      }
+    } catch (...) {
+      // Do not leave the shards bound so far holding the port
+      for (size_t i = 0; i < sockets.size(); ++i) {
+        sockets[i]->close();
+      }
+      shards_.clear();
+      throw;
+    }
+  }
+
+  PlatformThreadFactory threadFactory(false);
+  std::vector<shared_ptr<Thread> > threads;
+  for (size_t i = 0; i < numShards_; ++i) {
+    threads.push_back(threadFactory.newThread(shared_ptr<Runnable>(new ShardRunner(this, i))));
+    threads.back()->start();
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->join();
+  }
+
+  Synchronized s(monitor_);
+  stopping_ = false;
+}
+
+void TThreadPerCoreServer::runShard(size_t shard) {
+  if (pinThreads_ && !cpus_.empty()) {
+    pinCurrentThread(cpus_[shard % cpus_.size()]);
+  }
+
+  shared_ptr<TNonblockingServer> server;
+  try {
+    // Events are registered on the shard's own thread, under the monitor so
+    // that stop() either sees the shard registered or stops it starting
+    Synchronized s(monitor_);
+    if (stopping_) {
+      return;
+    }
+    server = shards_[shard];
+    server->registerEvents(NULL);
+    registered_[shard] = true;
+  } catch (const TException& e) {
+    GlobalOutput.printf("TThreadPerCoreServer: shard %u failed to start: %s",
+                        static_cast<unsigned>(shard),
+                        e.what());
+    return;
+  }
+
+  server->serve();
+}
+
+void TThreadPerCoreServer::stop() {
+  Synchronized s(monitor_);
+  stopping_ = true;
+  for (size_t i = 0; i < shards_.size(); ++i) {
+    if (registered_[i]) {
+      shards_[i]->stop();
+    }
+  }
+}
+}
+}
+} // apache::thrift::server
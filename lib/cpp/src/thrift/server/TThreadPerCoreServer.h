@@ -0,0 +1,151 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_SERVER_TTHREADPERCORESERVER_H_
+#define _THRIFT_SERVER_TTHREADPERCORESERVER_H_ 1
+
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/server/TNonblockingServer.h>
+#include <thrift/server/TServer.h>
+#include <thrift/stdcxx.h>
+#include <thrift/transport/TNonblockingServerSocket.h>
+
+#include <vector>
+
+namespace apache {
+namespace thrift {
+namespace server {
+
+/**
+ * A shared nothing server: one independent TNonblockingServer, a "shard", per
+ * CPU.  Every shard has its own listening socket bound to the same port with
+ * SO_REUSEPORT, so the kernel spreads connections over the shards, and runs
+ * its own event loop on a thread pinned to its CPU.  Requests are processed
+ * on that thread, so no ThreadManager, notification pipe or lock is shared
+ * between shards on the request path.
+ *
+ * Each shard gets its own processor, obtained once from the processor
+ * factory when serving starts (with an empty TConnectionInfo).  A handler
+ * shared by several shards is called concurrently.  So is the server event
+ * handler, and its preServe() is called once per shard.
+ *
+ * Requires SO_REUSEPORT, so it is only available where the platform has it
+ * (Linux 3.9 and later, the BSDs); thread pinning is Linux only.
+ */
+class TThreadPerCoreServer : public TServer {
+public:
+  /**
+   * @param port the port to listen on, 0 for an ephemeral one.
+   */
+  TThreadPerCoreServer(const stdcxx::shared_ptr<TProcessorFactory>& processorFactory,
+                       int port);
+
+  TThreadPerCoreServer(const stdcxx::shared_ptr<TProcessor>& processor,
+                       int port);
+
+  TThreadPerCoreServer(const stdcxx::shared_ptr<TProcessorFactory>& processorFactory,
+                       const stdcxx::shared_ptr<protocol::TProtocolFactory>& protocolFactory,
+                       int port);
+
+  TThreadPerCoreServer(const stdcxx::shared_ptr<TProcessor>& processor,
+                       const stdcxx::shared_ptr<protocol::TProtocolFactory>& protocolFactory,
+                       int port);
+
+  virtual ~TThreadPerCoreServer();
+
+  /**
+   * Sets the number of shards; 0, the default, runs one per CPU this process
+   * may run on.  Takes effect on the next serve().
+   */
+  void setNumShards(size_t numShards);
+
+  size_t getNumShards() const { return numShards_; }
+
+  /**
+   * Whether to pin each shard's thread to a CPU, on by default.  Shard i
+   * runs on the i-th CPU this process may run on, wrapping around when
+   * there are more shards than CPUs.
+   */
+  void setPinThreads(bool pinThreads) { pinThreads_ = pinThreads; }
+
+  bool getPinThreads() const { return pinThreads_; }
+
+  /**
+   * The port the shards listen on; when constructed with port 0, only valid
+   * once serve() has bound it.
+   */
+  int getListenPort();
+
+  /**
+   * The server of one shard, or an empty pointer before serve() is called.
+   */
+  stdcxx::shared_ptr<TNonblockingServer> getShard(size_t shard);
+
+  /**
+   * Binds the shards' sockets and runs every shard on its own thread.
+   * Returns once all of them have stopped, or at once if stop() was called
+   * since the last serve() returned.
+   *
+   * @throws TTransportException if a shard's socket cannot listen; the
+   *         sockets of the shards before it are closed again
+   */
+  void serve();
+
+  /**
+   * Stops all shards.  May be called from any thread, also before serve()
+   * or while it is starting the shards.
+   */
+  void stop();
+
+protected:
+  /**
+   * Creates the server of one shard, listening on socket.  Override to
+   * configure the shards; the default runs a single IO thread with no
+   * ThreadManager, using this server's protocol factories and event handler.
+   */
+  virtual stdcxx::shared_ptr<TNonblockingServer> createShard(
+      size_t shard,
+      const stdcxx::shared_ptr<transport::TNonblockingServerSocket>& socket);
+
+private:
+  class ShardRunner;
+
+  void init();
+
+  void runShard(size_t shard);
+
+  int port_;
+  int listenPort_;
+  size_t numShards_;
+  bool pinThreads_;
+
+  /// The CPUs the shards are pinned to
+  std::vector<int> cpus_;
+
+  /// Guards the members below, and serializes shard startup with stop()
+  concurrency::Monitor monitor_;
+  bool stopping_;
+  std::vector<stdcxx::shared_ptr<TNonblockingServer> > shards_;
+  std::vector<bool> registered_;
+};
+}
+}
+} // apache::thrift::server
+
+#endif // #ifndef _THRIFT_SERVER_TTHREADPERCORESERVER_H_
@@ -227,6 +227,28 @@ void TFramedTransport::writeSlow(const uint8_t* buf, uint32_t len) {
     new_size = new_size > 0 ? new_size * 2 : 1;
   }
 
+  resizeWriteBuffer(new_size);
+
+  // Copy the data into the new buffer.
+  memcpy(wBase_, buf, len);
+  wBase_ += len;
+}
+
+void TFramedTransport::reserve(uint32_t len) {
+  uint32_t have = static_cast<uint32_t>(wBase_ - wBuf_.get());
+  if (len <= wBufSize_ - have) {
+    return;
+  }
+  if (len + have < have /* overflow */ || len + have > 0x7fffffff) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "Attempted to write over 2 GB to TFramedTransport.");
+  }
+  resizeWriteBuffer(len + have);
+}
+
+void TFramedTransport::resizeWriteBuffer(uint32_t new_size) {
+  uint32_t have = static_cast<uint32_t>(wBase_ - wBuf_.get());
+
   // TODO(dreiss): Consider modifying this class to use malloc/free
   // so we can use realloc here.
 
@@ -241,10 +263,6 @@ void TFramedTransport::writeSlow(const uint8_t* buf, uint32_t len) {
   wBufSize_ = new_size;
   wBase_ = wBuf_.get() + have;
   wBound_ = wBuf_.get() + wBufSize_;
-
-  // Copy the data into the new buffer.
-  memcpy(wBase_, buf, len);
-  wBase_ += len;
 }
 
 void TFramedTransport::flush() {
@@ -371,6 +389,29 @@ void TMemoryBuffer::ensureCanWrite(uint32_t len) {
     avail = available_write() + (static_cast<uint32_t>(new_size) - bufferSize_);
   }
 
+  resizeBuffer(new_size);
+}
+
+void TMemoryBuffer::reserve(uint32_t len) {
+  uint32_t avail = available_write();
+  if (len <= avail) {
+    return;
+  }
+
+  if (!owner_) {
+    throw TTransportException("Insufficient space in external MemoryBuffer");
+  }
+
+  uint64_t new_size = static_cast<uint64_t>(bufferSize_) + (len - avail);
+  if (new_size > maxBufferSize_) {
+    throw TTransportException(TTransportException::BAD_ARGS,
+                              "Internal buffer size overflow");
+  }
+
+  resizeBuffer(new_size);
+}
+
+void TMemoryBuffer::resizeBuffer(uint64_t new_size) {
   // Allocate into a new pointer so we don't bork ours if it fails.
   uint8_t* new_buffer = static_cast<uint8_t*>(std::realloc(buffer_, new_size));
   if (new_buffer == NULL) {
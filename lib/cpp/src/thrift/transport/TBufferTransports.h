@@ -389,6 +389,15 @@ public:
    */
   uint32_t getMaxFrameSize() { return maxFrameSize_; }
 
+  /**
+   * Makes room for at least len more bytes in the current frame with a
+   * single allocation, so that writing a message whose size is known up
+   * front (see the generated serializedSize<Protocol_>() methods, and
+   * writeReserved() in thrift/TSerializer.h) never has to grow and copy the
+   * write buffer.
+   */
+  void reserve(uint32_t len);
+
 protected:
   /**
    * Reads a frame of input from the underlying stream.
@@ -398,6 +407,9 @@ protected:
    */
   virtual bool readFrame();
 
+  // Replaces the write buffer with one of new_size bytes, keeping its contents.
+  void resizeWriteBuffer(uint32_t new_size);
+
   void initPointers() {
     setReadBuffer(NULL, 0);
     setWriteBuffer(wBuf_.get(), wBufSize_);
@@ -670,6 +682,13 @@ public:
   // that had been provided by getWritePtr().
   void wroteBytes(uint32_t len);
 
+  // Makes sure at least 'len' bytes can be written without growing the
+  // buffer again.  Unlike the growth done by write(), which doubles the
+  // buffer, this allocates exactly what is missing, so pairing it with a
+  // generated serializedSize<Protocol_>() call sizes the buffer once, as
+  // writeReserved() in thrift/TSerializer.h does.
+  void reserve(uint32_t len);
+
   /*
    * TVirtualTransport provides a default implementation of readAll().
    * We want to use the TBufferBase version instead.
@@ -716,6 +735,9 @@ protected:
   // Make sure there's at least 'len' bytes available for writing.
   void ensureCanWrite(uint32_t len);
 
+  // Reallocate the buffer to new_size bytes, fixing up all pointers.
+  void resizeBuffer(uint64_t new_size);
+
   // Compute the position and available data for reading.
   void computeRead(uint32_t len, uint8_t** out_start, uint32_t* out_give);
 
@@ -0,0 +1,176 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+/*
+ * The parts of THeaderTransport that need neither zlib nor an instance, so
+ * that they live in the core library and servers can inspect header frames
+ * without linking libthriftz.
+ */
+
+#include <thrift/transport/THeaderTransport.h>
+#include <thrift/TApplicationException.h>
+
+#include <string.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+using std::string;
+
+const char* const THeaderTransport::CLIENT_TIMEOUT_HEADER = "client_timeout";
+
+bool THeaderTransport::getHeaderSize(const uint8_t* frame, uint32_t sz, uint32_t& headerSize) {
+  if (sz < 10) {
+    return false;
+  }
+  uint32_t magic_n;
+  memcpy(&magic_n, frame, sizeof(magic_n));
+  if ((ntohl(magic_n) & HEADER_MASK) != HEADER_MAGIC) {
+    return false;
+  }
+  // skip over magic(4), seqId(4) to the header size in words
+  uint16_t headerSize_n;
+  memcpy(&headerSize_n, frame + 8, sizeof(headerSize_n));
+  headerSize = ntohs(headerSize_n) * 4u;
+  return headerSize <= sz - 10;
+}
+
+bool THeaderTransport::findHeader(const uint8_t* frame,
+                                  uint32_t sz,
+                                  const string& key,
+                                  string& value) {
+  uint32_t headerSize;
+  if (!getHeaderSize(frame, sz, headerSize)) {
+    return false;
+  }
+
+  // Same layout as readHeaderFormat, but only compares keys
+  const uint8_t* ptr = frame + 10;
+  const uint8_t* const headerBoundary = ptr + headerSize;
+  try {
+    int16_t i16;
+    int32_t i32;
+    ptr += readVarint16(ptr, &i16, headerBoundary); // protocol id
+    int16_t numTransforms;
+    ptr += readVarint16(ptr, &numTransforms, headerBoundary);
+    for (int i = 0; i < numTransforms; i++) {
+      ptr += readVarint32(ptr, &i32, headerBoundary);
+    }
+
+    while (ptr < headerBoundary) {
+      int32_t infoId;
+      ptr += readVarint32(ptr, &infoId, headerBoundary);
+      if (infoId != infoIdType::KEYVALUE) {
+        // padding, or an info type we cannot skip
+        return false;
+      }
+      uint32_t numKVHeaders;
+      ptr += readVarint32(ptr, (int32_t*)&numKVHeaders, headerBoundary);
+      while (numKVHeaders-- && ptr < headerBoundary) {
+        int32_t keyLen;
+        ptr += readVarint32(ptr, &keyLen, headerBoundary);
+        if (keyLen < 0 || keyLen > headerBoundary - ptr) {
+          return false;
+        }
+        const uint8_t* keyPtr = ptr;
+        ptr += keyLen;
+        int32_t valueLen;
+        ptr += readVarint32(ptr, &valueLen, headerBoundary);
+        if (valueLen < 0 || valueLen > headerBoundary - ptr) {
+          return false;
+        }
+        if (static_cast<size_t>(keyLen) == key.size()
+            && memcmp(keyPtr, key.data(), keyLen) == 0) {
+          value.assign(reinterpret_cast<const char*>(ptr), valueLen);
+          return true;
+        }
+        ptr += valueLen;
+      }
+    }
+  } catch (const TApplicationException&) {
+    // ran past the header boundary
+  }
+  return false;
+}
+
+bool THeaderTransport::findPayload(const uint8_t* frame,
+                                   uint32_t sz,
+                                   int16_t& protoId,
+                                   uint32_t& offset) {
+  uint32_t headerSize;
+  if (!getHeaderSize(frame, sz, headerSize)) {
+    return false;
+  }
+
+  const uint8_t* const headerBoundary = frame + 10 + headerSize;
+  try {
+    const uint8_t* ptr = frame + 10;
+    ptr += readVarint16(ptr, &protoId, headerBoundary);
+    int16_t numTransforms;
+    readVarint16(ptr, &numTransforms, headerBoundary);
+    if (numTransforms != 0) {
+      return false;
+    }
+  } catch (const TApplicationException&) {
+    return false;
+  }
+  offset = 10 + headerSize;
+  return true;
+}
+
+/**
+ * Read an i16 from the wire as a varint. The MSB of each byte is set
+ * if there is another byte to follow. This can read up to 3 bytes.
+ */
+uint32_t THeaderTransport::readVarint16(uint8_t const* ptr, int16_t* i16, uint8_t const* boundary) {
+  int32_t val;
+  uint32_t rsize = readVarint32(ptr, &val, boundary);
+  *i16 = (int16_t)val;
+  return rsize;
+}
+
+/**
+ * Read an i32 from the wire as a varint. The MSB of each byte is set
+ * if there is another byte to follow. This can read up to 5 bytes.
+ */
+uint32_t THeaderTransport::readVarint32(uint8_t const* ptr, int32_t* i32, uint8_t const* boundary) {
+
+  uint32_t rsize = 0;
+  uint32_t val = 0;
+  int shift = 0;
+
+  while (true) {
+    if (ptr == boundary) {
+      throw TApplicationException(TApplicationException::INVALID_MESSAGE_TYPE,
+                                  "Trying to read past header boundary");
+    }
+    uint8_t byte = *(ptr++);
+    rsize++;
+    val |= (uint64_t)(byte & 0x7f) << shift;
+    shift += 7;
+    if (!(byte & 0x80)) {
+      *i32 = val;
+      return rsize;
+    }
+  }
+}
+}
+}
+} // apache::thrift::transport
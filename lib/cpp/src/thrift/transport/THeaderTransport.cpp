@@ -542,43 +542,6 @@ void THeaderTransport::flush() {
   outTransport_->flush();
 }
 
-/**
- * Read an i16 from the wire as a varint. The MSB of each byte is set
- * if there is another byte to follow. This can read up to 3 bytes.
- */
-uint32_t THeaderTransport::readVarint16(uint8_t const* ptr, int16_t* i16, uint8_t const* boundary) {
-  int32_t val;
-  uint32_t rsize = readVarint32(ptr, &val, boundary);
-  *i16 = (int16_t)val;
-  return rsize;
-}
-
-/**
- * Read an i32 from the wire as a varint. The MSB of each byte is set
- * if there is another byte to follow. This can read up to 5 bytes.
- */
-uint32_t THeaderTransport::readVarint32(uint8_t const* ptr, int32_t* i32, uint8_t const* boundary) {
-
-  uint32_t rsize = 0;
-  uint32_t val = 0;
-  int shift = 0;
-
-  while (true) {
-    if (ptr == boundary) {
-      throw TApplicationException(TApplicationException::INVALID_MESSAGE_TYPE,
-                                  "Trying to read past header boundary");
-    }
-    uint8_t byte = *(ptr++);
-    rsize++;
-    val |= (uint64_t)(byte & 0x7f) << shift;
-    shift += 7;
-    if (!(byte & 0x80)) {
-      *i32 = val;
-      return rsize;
-    }
-  }
-}
-
 /**
  * Write an i32 as a varint. Results in 1-5 bytes on the wire.
  */
@@ -161,6 +161,38 @@ public:
   // these work with read headers
   const StringToStringMap& getHeaders() const { return readHeaders_; }
 
+  /**
+   * Info header in which a client passes how many milliseconds it is still
+   * willing to wait for the reply, as a decimal string.  The timeout is
+   * relative because client and server clocks need not agree; servers such
+   * as TNonblockingServer turn it into a deadline when the request arrives.
+   * Like all write headers it must be set again for every request.
+   */
+  static const char* const CLIENT_TIMEOUT_HEADER;
+
+  /**
+   * Looks up a key-value info header in a received frame without parsing
+   * the rest of it.  frame points just past the 4 byte frame size and holds
+   * sz bytes.
+   *
+   * @return false if the frame is not in header format, is malformed or
+   *         does not carry the header.
+   */
+  static bool findHeader(const uint8_t* frame,
+                         uint32_t sz,
+                         const std::string& key,
+                         std::string& value);
+
+  /**
+   * Locates the payload of a received frame, laid out as for findHeader().
+   *
+   * @param protoId set to the protocol the payload is encoded with.
+   * @param offset set to where the payload starts in frame.
+   * @return false if the frame is not in header format, is malformed or has
+   *         transforms applied to its payload.
+   */
+  static bool findPayload(const uint8_t* frame, uint32_t sz, int16_t& protoId, uint32_t& offset);
+
   // accessors for seqId
   int32_t getSequenceNumber() const { return seqId; }
   void setSequenceNumber(int32_t seqId) { this->seqId = seqId; }
@@ -226,6 +258,12 @@ protected:
 
   void readString(uint8_t*& ptr, /* out */ std::string& str, uint8_t const* headerBoundary);
 
+  /**
+   * Checks that frame (without its frame size) is in header format and
+   * holds the header size it announces, which is returned in bytes.
+   */
+  static bool getHeaderSize(const uint8_t* frame, uint32_t sz, uint32_t& headerSize);
+
   void writeString(uint8_t*& ptr, const std::string& str);
 
   // Varint utils
@@ -233,13 +271,13 @@ protected:
    * Read an i16 from the wire as a varint. The MSB of each byte is set
    * if there is another byte to follow. This can read up to 3 bytes.
    */
-  uint32_t readVarint16(uint8_t const* ptr, int16_t* i16, uint8_t const* boundary);
+  static uint32_t readVarint16(uint8_t const* ptr, int16_t* i16, uint8_t const* boundary);
 
   /**
    * Read an i32 from the wire as a varint. The MSB of each byte is set
    * if there is another byte to follow. This can read up to 5 bytes.
    */
-  uint32_t readVarint32(uint8_t const* ptr, int32_t* i32, uint8_t const* boundary);
+  static uint32_t readVarint32(uint8_t const* ptr, int32_t* i32, uint8_t const* boundary);
 
   /**
    * Write an i32 as a varint. Results in 1-5 bytes on the wire.
@@ -45,6 +45,7 @@
 
 #include <thrift/transport/TSocket.h>
 #include <thrift/transport/TNonblockingServerSocket.h>
+#include <thrift/transport/TSocketHandoff.h>
 #include <thrift/transport/PlatformSocket.h>
 
 #ifndef AF_LOCAL
@@ -88,7 +89,9 @@ TNonblockingServerSocket::TNonblockingServerSocket(int port)
     tcpSendBuffer_(0),
     tcpRecvBuffer_(0),
     keepAlive_(false),
-    listening_(false) {
+    reusePort_(false),
+    listening_(false),
+    shared_(false) {
 }
 
 TNonblockingServerSocket::TNonblockingServerSocket(int port, int sendTimeout, int recvTimeout)
@@ -103,7 +106,9 @@ TNonblockingServerSocket::TNonblockingServerSocket(int port, int sendTimeout, in
     tcpSendBuffer_(0),
     tcpRecvBuffer_(0),
     keepAlive_(false),
-    listening_(false) {
+    reusePort_(false),
+    listening_(false),
+    shared_(false) {
 }
 
 TNonblockingServerSocket::TNonblockingServerSocket(const string& address, int port)
@@ -119,7 +124,9 @@ TNonblockingServerSocket::TNonblockingServerSocket(const string& address, int po
     tcpSendBuffer_(0),
     tcpRecvBuffer_(0),
     keepAlive_(false),
-    listening_(false) {
+    reusePort_(false),
+    listening_(false),
+    shared_(false) {
 }
 
 TNonblockingServerSocket::TNonblockingServerSocket(const string& path)
@@ -135,7 +142,9 @@ TNonblockingServerSocket::TNonblockingServerSocket(const string& path)
     tcpSendBuffer_(0),
     tcpRecvBuffer_(0),
     keepAlive_(false),
-    listening_(false) {
+    reusePort_(false),
+    listening_(false),
+    shared_(false) {
 }
 
 TNonblockingServerSocket::~TNonblockingServerSocket() {
@@ -175,6 +184,11 @@ void TNonblockingServerSocket::listen() {
 #ifdef _WIN32
   TWinsockSingleton::create();
 #endif // _WIN32
+
+  // An adopted socket is already listening
+  if (serverSocket_ != THRIFT_INVALID_SOCKET) {
+    return;
+  }
   
   // Validate port number
   if (port_ < 0 || port_ > 0xFFFF) {
@@ -246,6 +260,25 @@ void TNonblockingServerSocket::listen() {
 #endif
   }
 
+  // Let other sockets bind the same port and share its connections
+  if (reusePort_) {
+#ifdef SO_REUSEPORT
+    if (-1 == setsockopt(serverSocket_, SOL_SOCKET, SO_REUSEPORT, cast_sockopt(&one), sizeof(one))) {
+      int errno_copy = THRIFT_GET_SOCKET_ERROR;
+      GlobalOutput.perror("TNonblockingServerSocket::listen() setsockopt() SO_REUSEPORT ",
+                          errno_copy);
+      close();
+      throw TTransportException(TTransportException::NOT_OPEN,
+                                "Could not set SO_REUSEPORT",
+                                errno_copy);
+    }
+#else
+    close();
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "SO_REUSEPORT is not supported on this platform");
+#endif
+  }
+
   // Set TCP buffer sizes
   if (tcpSendBuffer_ > 0) {
     if (-1 == setsockopt(serverSocket_,
@@ -467,6 +500,56 @@ void TNonblockingServerSocket::listen() {
   // The socket is now listening!
 }
 
+/**
+ * The port socket is bound to, or 0 if it is not an internet socket.
+ */
+static int boundPort(THRIFT_SOCKET socket) {
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  std::memset(&sa, 0, len);
+  if (::getsockname(socket, reinterpret_cast<struct sockaddr*>(&sa), &len) < 0) {
+    GlobalOutput.perror("TNonblockingServerSocket::adopt() getsockname() ", THRIFT_GET_SOCKET_ERROR);
+    return 0;
+  }
+  if (sa.ss_family == AF_INET6) {
+    return ntohs(reinterpret_cast<const struct sockaddr_in6*>(&sa)->sin6_port);
+  } else if (sa.ss_family == AF_INET) {
+    return ntohs(reinterpret_cast<const struct sockaddr_in*>(&sa)->sin_port);
+  }
+  return 0;
+}
+
+void TNonblockingServerSocket::adopt(THRIFT_SOCKET socket) {
+  close();
+
+  // Accepting must not block when another process takes the connection first
+  int flags = THRIFT_FCNTL(socket, THRIFT_F_GETFL, 0);
+  if (flags == -1 || -1 == THRIFT_FCNTL(socket, THRIFT_F_SETFL, flags | THRIFT_O_NONBLOCK)) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    GlobalOutput.perror("TNonblockingServerSocket::adopt() THRIFT_FCNTL() THRIFT_O_NONBLOCK ", errno_copy);
+    ::THRIFT_CLOSESOCKET(socket);
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "THRIFT_FCNTL() THRIFT_F_SETFL THRIFT_O_NONBLOCK failed",
+                              errno_copy);
+  }
+
+  int port = boundPort(socket);
+  serverSocket_ = socket;
+  listening_ = true;
+  shared_ = true;
+  if (port != 0) {
+    listenPort_ = port;
+  }
+}
+
+void TNonblockingServerSocket::handOff(THRIFT_SOCKET channel) {
+  if (serverSocket_ == THRIFT_INVALID_SOCKET) {
+    throw TTransportException(TTransportException::NOT_OPEN, "TNonblockingServerSocket not listening");
+  }
+  TSocketHandoff::send(channel, serverSocket_);
+  shared_ = true;
+}
+
 int TNonblockingServerSocket::getPort() {
   return port_;
 }
@@ -537,11 +620,15 @@ shared_ptr<TSocket> TNonblockingServerSocket::createSocket(THRIFT_SOCKET clientS
 
 void TNonblockingServerSocket::close() {
   if (serverSocket_ != THRIFT_INVALID_SOCKET) {
-    shutdown(serverSocket_, THRIFT_SHUT_RDWR);
+    // A shared socket goes on listening in the other process
+    if (!shared_) {
+      shutdown(serverSocket_, THRIFT_SHUT_RDWR);
+    }
     ::THRIFT_CLOSESOCKET(serverSocket_);
   }
   serverSocket_ = THRIFT_INVALID_SOCKET;
   listening_ = false;
+  shared_ = false;
 }
 }
 }
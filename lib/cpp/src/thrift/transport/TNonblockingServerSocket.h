@@ -84,6 +84,13 @@ public:
 
   void setKeepAlive(bool keepAlive) { keepAlive_ = keepAlive; }
 
+  /**
+   * Sets SO_REUSEPORT, so that several sockets can listen on the same port
+   * and the kernel spreads new connections over them.  listen() fails where
+   * the option is not supported.
+   */
+  void setReusePort(bool reusePort) { reusePort_ = reusePort; }
+
   void setTcpSendBuffer(int tcpSendBuffer);
   void setTcpRecvBuffer(int tcpRecvBuffer);
 
@@ -100,6 +107,24 @@ public:
 
   THRIFT_SOCKET getSocketFD() { return serverSocket_; }
 
+  /**
+   * Serves on socket, an already bound and listening socket such as one
+   * received with TSocketHandoff::receive(), instead of creating one in
+   * listen().  Takes ownership of socket.
+   *
+   * @throws TTransportException if socket can not be made non-blocking
+   */
+  void adopt(THRIFT_SOCKET socket);
+
+  /**
+   * Sends the listening socket over channel to a successor process (see
+   * TSocketHandoff).  The socket is then shared: close() only closes this
+   * process's descriptor, and leaves the socket listening for the successor.
+   *
+   * @throws TTransportException if the socket is not listening or could not be sent
+   */
+  void handOff(THRIFT_SOCKET channel);
+
   int getPort();
   
   int getListenPort();
@@ -125,7 +150,9 @@ private:
   int tcpSendBuffer_;
   int tcpRecvBuffer_;
   bool keepAlive_;
+  bool reusePort_;
   bool listening_;
+  bool shared_;
 
   socket_func_t listenCallback_;
   socket_func_t acceptCallback_;
@@ -45,6 +45,7 @@
 
 #include <thrift/transport/TSocket.h>
 #include <thrift/transport/TServerSocket.h>
+#include <thrift/transport/TSocketHandoff.h>
 #include <thrift/transport/PlatformSocket.h>
 #include <thrift/stdcxx.h>
 
@@ -117,6 +118,7 @@ TServerSocket::TServerSocket(int port)
     tcpRecvBuffer_(0),
     keepAlive_(false),
     listening_(false),
+    shared_(false),
     interruptSockWriter_(THRIFT_INVALID_SOCKET),
     interruptSockReader_(THRIFT_INVALID_SOCKET),
     childInterruptSockWriter_(THRIFT_INVALID_SOCKET) {
@@ -136,6 +138,7 @@ TServerSocket::TServerSocket(int port, int sendTimeout, int recvTimeout)
     tcpRecvBuffer_(0),
     keepAlive_(false),
     listening_(false),
+    shared_(false),
     interruptSockWriter_(THRIFT_INVALID_SOCKET),
     interruptSockReader_(THRIFT_INVALID_SOCKET),
     childInterruptSockWriter_(THRIFT_INVALID_SOCKET) {
@@ -156,6 +159,7 @@ TServerSocket::TServerSocket(const string& address, int port)
     tcpRecvBuffer_(0),
     keepAlive_(false),
     listening_(false),
+    shared_(false),
     interruptSockWriter_(THRIFT_INVALID_SOCKET),
     interruptSockReader_(THRIFT_INVALID_SOCKET),
     childInterruptSockWriter_(THRIFT_INVALID_SOCKET) {
@@ -176,6 +180,7 @@ TServerSocket::TServerSocket(const string& path)
     tcpRecvBuffer_(0),
     keepAlive_(false),
     listening_(false),
+    shared_(false),
     interruptSockWriter_(THRIFT_INVALID_SOCKET),
     interruptSockReader_(THRIFT_INVALID_SOCKET),
     childInterruptSockWriter_(THRIFT_INVALID_SOCKET) {
@@ -252,6 +257,11 @@ void TServerSocket::listen() {
         = stdcxx::shared_ptr<THRIFT_SOCKET>(new THRIFT_SOCKET(sv[0]), destroyer_of_fine_sockets);
   }
 
+  // An adopted socket is already listening
+  if (serverSocket_ != THRIFT_INVALID_SOCKET) {
+    return;
+  }
+
   // Validate port number
   if (port_ < 0 || port_ > 0xFFFF) {
     throw TTransportException(TTransportException::BAD_ARGS, "Specified port is invalid");
@@ -530,6 +540,57 @@ void TServerSocket::listen() {
   // The socket is now listening!
 }
 
+/**
+ * The port socket is bound to, or 0 if it is not an internet socket.
+ */
+static int boundPort(THRIFT_SOCKET socket) {
+  struct sockaddr_storage sa;
+  socklen_t len = sizeof(sa);
+  std::memset(&sa, 0, len);
+  if (::getsockname(socket, reinterpret_cast<struct sockaddr*>(&sa), &len) < 0) {
+    GlobalOutput.perror("TServerSocket::adopt() getsockname() ", THRIFT_GET_SOCKET_ERROR);
+    return 0;
+  }
+  if (sa.ss_family == AF_INET6) {
+    return ntohs(reinterpret_cast<const struct sockaddr_in6*>(&sa)->sin6_port);
+  } else if (sa.ss_family == AF_INET) {
+    return ntohs(reinterpret_cast<const struct sockaddr_in*>(&sa)->sin_port);
+  }
+  return 0;
+}
+
+void TServerSocket::adopt(THRIFT_SOCKET socket) {
+  close();
+
+  // Accepting must not block when another process takes the connection first
+  int flags = THRIFT_FCNTL(socket, THRIFT_F_GETFL, 0);
+  if (flags == -1 || -1 == THRIFT_FCNTL(socket, THRIFT_F_SETFL, flags | THRIFT_O_NONBLOCK)) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    GlobalOutput.perror("TServerSocket::adopt() THRIFT_FCNTL() THRIFT_O_NONBLOCK ", errno_copy);
+    ::THRIFT_CLOSESOCKET(socket);
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "THRIFT_FCNTL() THRIFT_F_SETFL THRIFT_O_NONBLOCK failed",
+                              errno_copy);
+  }
+
+  int port = boundPort(socket);
+  concurrency::Guard g(rwMutex_);
+  serverSocket_ = socket;
+  shared_ = true;
+  if (port != 0) {
+    port_ = port;
+  }
+}
+
+void TServerSocket::handOff(THRIFT_SOCKET channel) {
+  if (serverSocket_ == THRIFT_INVALID_SOCKET) {
+    throw TTransportException(TTransportException::NOT_OPEN, "TServerSocket not listening");
+  }
+  TSocketHandoff::send(channel, serverSocket_);
+  concurrency::Guard g(rwMutex_);
+  shared_ = true;
+}
+
 int TServerSocket::getPort() {
   return port_;
 }
@@ -544,6 +605,10 @@ shared_ptr<TTransport> TServerSocket::acceptImpl() {
   int maxEintrs = 5;
   int numEintrs = 0;
 
+  struct sockaddr_storage clientAddress;
+  int size;
+  THRIFT_SOCKET clientSocket;
+
   while (true) {
     std::memset(fds, 0, sizeof(fds));
     fds[0].fd = serverSocket_;
@@ -580,22 +645,26 @@ shared_ptr<TTransport> TServerSocket::acceptImpl() {
       }
 
       // Check for the actual server socket being ready
-      if (fds[0].revents & THRIFT_POLLIN) {
-        break;
+      if (!(fds[0].revents & THRIFT_POLLIN)) {
+        continue;
       }
     } else {
       GlobalOutput("TServerSocket::acceptImpl() THRIFT_POLL 0");
       throw TTransportException(TTransportException::UNKNOWN);
     }
-  }
 
-  struct sockaddr_storage clientAddress;
-  int size = sizeof(clientAddress);
-  THRIFT_SOCKET clientSocket
-      = ::accept(serverSocket_, (struct sockaddr*)&clientAddress, (socklen_t*)&size);
+    size = sizeof(clientAddress);
+    clientSocket = ::accept(serverSocket_, (struct sockaddr*)&clientAddress, (socklen_t*)&size);
+    if (clientSocket != THRIFT_INVALID_SOCKET) {
+      break;
+    }
 
-  if (clientSocket == THRIFT_INVALID_SOCKET) {
     int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    if (errno_copy == THRIFT_EAGAIN || errno_copy == THRIFT_EWOULDBLOCK) {
+      // An adopted socket is nonblocking, and another acceptor (or a client
+      // that gave up) may have taken the connection since the poll
+      continue;
+    }
     GlobalOutput.perror("TServerSocket::acceptImpl() ::accept() ", errno_copy);
     throw TTransportException(TTransportException::UNKNOWN, "accept()", errno_copy);
   }
@@ -674,7 +743,10 @@ void TServerSocket::interruptChildren() {
 void TServerSocket::close() {
   concurrency::Guard g(rwMutex_);
   if (serverSocket_ != THRIFT_INVALID_SOCKET) {
-    shutdown(serverSocket_, THRIFT_SHUT_RDWR);
+    // A shared socket goes on listening in the other process
+    if (!shared_) {
+      shutdown(serverSocket_, THRIFT_SHUT_RDWR);
+    }
     ::THRIFT_CLOSESOCKET(serverSocket_);
   }
   if (interruptSockWriter_ != THRIFT_INVALID_SOCKET) {
@@ -692,6 +764,7 @@ void TServerSocket::close() {
   childInterruptSockWriter_ = THRIFT_INVALID_SOCKET;
   pChildInterruptSockReader_.reset();
   listening_ = false;
+  shared_ = false;
 }
 }
 }
@@ -139,6 +139,24 @@ public:
 
   THRIFT_SOCKET getSocketFD() { return serverSocket_; }
 
+  /**
+   * Serves on socket, an already bound and listening socket such as one
+   * received with TSocketHandoff::receive(), instead of creating one in
+   * listen().  Takes ownership of socket.
+   *
+   * @throws TTransportException if socket can not be made non-blocking
+   */
+  void adopt(THRIFT_SOCKET socket);
+
+  /**
+   * Sends the listening socket over channel to a successor process (see
+   * TSocketHandoff).  The socket is then shared: close() only closes this
+   * process's descriptor, and leaves the socket listening for the successor.
+   *
+   * @throws TTransportException if the socket is not listening or could not be sent
+   */
+  void handOff(THRIFT_SOCKET channel);
+
   int getPort();
 
   void listen();
@@ -169,6 +187,7 @@ private:
   int tcpRecvBuffer_;
   bool keepAlive_;
   bool listening_;
+  bool shared_;
 
   concurrency::Mutex rwMutex_;                                 // thread-safe interrupt
   THRIFT_SOCKET interruptSockWriter_;                          // is notified on interrupt()
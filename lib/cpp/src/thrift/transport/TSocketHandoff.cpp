@@ -0,0 +1,138 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <thrift/thrift-config.h>
+
+#include <cstring>
+#ifdef HAVE_SYS_SOCKET_H
+#include <sys/socket.h>
+#endif
+
+#include <thrift/transport/TSocketHandoff.h>
+#include <thrift/transport/TTransportException.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+#ifndef _WIN32
+
+void TSocketHandoff::send(THRIFT_SOCKET channel, THRIFT_SOCKET socket) {
+  // At least one byte of ordinary data has to go along with the socket
+  char byte = 0;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = sizeof(byte);
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  std::memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  cmsg->cmsg_level = SOL_SOCKET;
+  cmsg->cmsg_type = SCM_RIGHTS;
+  cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+  int fd = socket;
+  std::memcpy(CMSG_DATA(cmsg), &fd, sizeof(fd));
+
+  ssize_t sent;
+  do {
+    sent = sendmsg(channel, &msg, 0);
+  } while (sent == -1 && THRIFT_GET_SOCKET_ERROR == THRIFT_EINTR);
+
+  if (sent != static_cast<ssize_t>(sizeof(byte))) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    GlobalOutput.perror("TSocketHandoff::send() sendmsg() ", errno_copy);
+    throw TTransportException(TTransportException::NOT_OPEN, "Could not send socket", errno_copy);
+  }
+}
+
+THRIFT_SOCKET TSocketHandoff::receive(THRIFT_SOCKET channel) {
+  char byte;
+  struct iovec iov;
+  iov.iov_base = &byte;
+  iov.iov_len = sizeof(byte);
+
+  union {
+    struct cmsghdr align;
+    char buf[CMSG_SPACE(sizeof(int))];
+  } control;
+  std::memset(&control, 0, sizeof(control));
+
+  struct msghdr msg;
+  std::memset(&msg, 0, sizeof(msg));
+  msg.msg_iov = &iov;
+  msg.msg_iovlen = 1;
+  msg.msg_control = control.buf;
+  msg.msg_controllen = sizeof(control.buf);
+
+  ssize_t got;
+  do {
+    got = recvmsg(channel, &msg, 0);
+  } while (got == -1 && THRIFT_GET_SOCKET_ERROR == THRIFT_EINTR);
+
+  if (got == -1) {
+    int errno_copy = THRIFT_GET_SOCKET_ERROR;
+    GlobalOutput.perror("TSocketHandoff::receive() recvmsg() ", errno_copy);
+    throw TTransportException(TTransportException::NOT_OPEN,
+                              "Could not receive socket",
+                              errno_copy);
+  }
+  if (got == 0) {
+    throw TTransportException(TTransportException::END_OF_FILE,
+                              "Channel closed before a socket was received");
+  }
+
+  struct cmsghdr* cmsg = CMSG_FIRSTHDR(&msg);
+  if (cmsg == NULL || cmsg->cmsg_level != SOL_SOCKET || cmsg->cmsg_type != SCM_RIGHTS
+      || cmsg->cmsg_len != CMSG_LEN(sizeof(int)) || (msg.msg_flags & MSG_CTRUNC)) {
+    throw TTransportException(TTransportException::CORRUPTED_DATA,
+                              "No socket received over the channel");
+  }
+
+  int fd;
+  std::memcpy(&fd, CMSG_DATA(cmsg), sizeof(fd));
+  return fd;
+}
+
+#else
+
+void TSocketHandoff::send(THRIFT_SOCKET, THRIFT_SOCKET) {
+  throw TTransportException(TTransportException::INTERNAL_ERROR,
+                            "Socket handoff is not supported on this platform");
+}
+
+THRIFT_SOCKET TSocketHandoff::receive(THRIFT_SOCKET) {
+  throw TTransportException(TTransportException::INTERNAL_ERROR,
+                            "Socket handoff is not supported on this platform");
+}
+
+#endif // _WIN32
+}
+}
+} // apache::thrift::transport
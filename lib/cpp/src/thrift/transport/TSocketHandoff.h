@@ -0,0 +1,66 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#ifndef _THRIFT_TRANSPORT_TSOCKETHANDOFF_H_
+#define _THRIFT_TRANSPORT_TSOCKETHANDOFF_H_ 1
+
+#include <thrift/transport/PlatformSocket.h>
+
+namespace apache {
+namespace thrift {
+namespace transport {
+
+/**
+ * Passes sockets between processes over a unix domain socket (SCM_RIGHTS),
+ * so that a restarting server can give its listening socket to its
+ * successor instead of closing it.  Connections waiting to be accepted stay
+ * queued on the socket, and neither process ever refuses one.
+ *
+ * The channel is any connected unix domain socket, for instance a TSocket
+ * opened on a path that the old process serves with TServerSocket(path), or
+ * one end of a socketpair() inherited by a child process.  The usual
+ * sequence is:
+ *
+ *   successor:  server socket adopt(TSocketHandoff::receive(channel)), serve
+ *   old process: server socket handOff(channel), then drain() the server
+ *
+ * Not available on Windows.
+ */
+class TSocketHandoff {
+public:
+  /**
+   * Sends a duplicate of socket over channel; socket stays open here.
+   *
+   * @throws TTransportException if it could not be sent
+   */
+  static void send(THRIFT_SOCKET channel, THRIFT_SOCKET socket);
+
+  /**
+   * Receives a socket sent with send(), waiting for it if need be.  The
+   * caller owns the returned socket.
+   *
+   * @throws TTransportException if the channel was closed or carried no socket
+   */
+  static THRIFT_SOCKET receive(THRIFT_SOCKET channel);
+};
+}
+}
+} // apache::thrift::transport
+
+#endif // #ifndef _THRIFT_TRANSPORT_TSOCKETHANDOFF_H_
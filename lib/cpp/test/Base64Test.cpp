@@ -20,8 +20,20 @@
 #include <boost/test/auto_unit_test.hpp>
 #include <thrift/protocol/TBase64Utils.h>
 
+#include <algorithm>
+#include <string>
+#include <vector>
+
 using apache::thrift::protocol::base64_encode;
 using apache::thrift::protocol::base64_decode;
+using apache::thrift::protocol::base64_encode_buffer;
+using apache::thrift::protocol::base64_decode_buffer;
+using apache::thrift::protocol::base64_encoded_size;
+using apache::thrift::protocol::base64_impl_supported;
+using apache::thrift::protocol::Base64Impl;
+using apache::thrift::protocol::BASE64_IMPL_SCALAR;
+using apache::thrift::protocol::BASE64_IMPL_SSSE3;
+using apache::thrift::protocol::BASE64_IMPL_AVX2;
 
 BOOST_AUTO_TEST_SUITE(Base64Test)
 
@@ -71,4 +83,85 @@ BOOST_AUTO_TEST_CASE(test_Base64_Encode_Decode) {
   }
 }
 
+static std::vector<uint8_t> referenceEncode(const std::vector<uint8_t>& in) {
+  std::vector<uint8_t> out;
+  uint8_t b[4];
+  for (size_t i = 0; i < in.size(); i += 3) {
+    uint32_t n = static_cast<uint32_t>(std::min<size_t>(3, in.size() - i));
+    base64_encode(&in[i], n, b);
+    out.insert(out.end(), b, b + n + 1);
+  }
+  return out;
+}
+
+BOOST_AUTO_TEST_CASE(test_Base64_Buffer_Impls) {
+  const Base64Impl impls[] = {BASE64_IMPL_SCALAR, BASE64_IMPL_SSSE3, BASE64_IMPL_AVX2};
+
+  std::vector<uint8_t> input;
+  uint32_t seed = 12345;
+  for (int i = 0; i < 1000; i++) {
+    seed = seed * 1103515245 + 12345;
+    input.push_back(static_cast<uint8_t>(seed >> 16));
+  }
+
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (!base64_impl_supported(impls[i])) {
+      BOOST_TEST_MESSAGE("base64 implementation " << impls[i] << " not supported, skipping");
+      continue;
+    }
+    // Every length up to a few SIMD blocks, then a long one
+    for (uint32_t len = 0; len <= input.size(); len = len < 100 ? len + 1 : len + 450) {
+      std::vector<uint8_t> in(input.begin(), input.begin() + len);
+      std::vector<uint8_t> expected = referenceEncode(in);
+
+      std::vector<uint8_t> encoded(base64_encoded_size(len) + 1, 0xee);
+      uint32_t n = base64_encode_buffer(in.empty() ? NULL : &in[0], len, &encoded[0], impls[i]);
+      BOOST_REQUIRE_EQUAL(expected.size(), n);
+      BOOST_CHECK(std::equal(expected.begin(), expected.end(), encoded.begin()));
+      BOOST_CHECK_EQUAL(0xee, encoded[n]);
+
+      // Separate output buffer
+      std::vector<uint8_t> decoded(len + 1, 0xee);
+      BOOST_REQUIRE_EQUAL(len, base64_decode_buffer(&encoded[0], n, &decoded[0], impls[i]));
+      BOOST_CHECK(std::equal(in.begin(), in.end(), decoded.begin()));
+      BOOST_CHECK_EQUAL(0xee, decoded[len]);
+
+      // In place
+      BOOST_REQUIRE_EQUAL(len, base64_decode_buffer(&encoded[0], n, &encoded[0], impls[i]));
+      BOOST_CHECK(std::equal(in.begin(), in.end(), encoded.begin()));
+    }
+  }
+}
+
+BOOST_AUTO_TEST_CASE(test_Base64_Buffer_Invalid) {
+  const Base64Impl impls[] = {BASE64_IMPL_SCALAR, BASE64_IMPL_SSSE3, BASE64_IMPL_AVX2};
+
+  // Bad characters must give the same bytes whichever implementation is used
+  std::string text;
+  for (int i = 0; i < 10; i++) {
+    text += "QUJDREVGR0hJSktMTU5PUFFSU1RVVldYWVo-";
+  }
+  text[40] = '*';
+  text[77] = '\x80';
+
+  std::vector<uint8_t> expected(text.size());
+  uint32_t expected_len = base64_decode_buffer((const uint8_t*)text.data(),
+                                               static_cast<uint32_t>(text.size()),
+                                               &expected[0],
+                                               BASE64_IMPL_SCALAR);
+  BOOST_CHECK_EQUAL(text.size() / 4 * 3, expected_len);
+  for (size_t i = 0; i < sizeof(impls) / sizeof(impls[0]); i++) {
+    if (!base64_impl_supported(impls[i])) {
+      continue;
+    }
+    std::vector<uint8_t> out(text.size());
+    BOOST_CHECK_EQUAL(expected_len,
+                      base64_decode_buffer((const uint8_t*)text.data(),
+                                           static_cast<uint32_t>(text.size()),
+                                           &out[0],
+                                           impls[i]));
+    BOOST_CHECK(std::equal(expected.begin(), expected.begin() + expected_len, out.begin()));
+  }
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -25,6 +25,7 @@
 #include <math.h>
 #include "thrift/protocol/TBinaryProtocol.h"
 #include "thrift/stdcxx.h"
+#include "thrift/TToString.h"
 #include "thrift/transport/TBufferTransports.h"
 #include "gen-cpp/DebugProtoTest_types.h"
 
@@ -239,6 +240,45 @@ int main() {
     cout << " Double read big endian: " << num / (1000 * elapsed) << " kHz" << endl;
   }
 
+  HolyMoley hm;
+  hm.big.assign(100, ooe);
+  for (int x = 0; x < 100; ++x) {
+    std::vector<std::string> strings(10, "and a one");
+    strings[0] = apache::thrift::to_string(x);
+    hm.contain.insert(strings);
+    hm.bonks[strings[0]].resize(5);
+  }
+  num = 100;
+
+  {
+    size_t total = 0;
+    double elapsed = 0.0;
+    Timer timer;
+
+    for (int i = 0; i < num; i++) {
+      total += apache::thrift::to_string(hm).size();
+    }
+    elapsed = timer.frame();
+    cout << "to_string HolyMoley: " << num / (1000 * elapsed) << " kHz (" << total << " bytes)"
+         << endl;
+  }
+
+  {
+    size_t total = 0;
+    std::string str;
+    apache::thrift::TToStringBuffer out(str);
+    double elapsed = 0.0;
+    Timer timer;
+
+    for (int i = 0; i < num; i++) {
+      str.clear();
+      hm.printTo(out);
+      total += str.size();
+    }
+    elapsed = timer.frame();
+    cout << "TToStringBuffer HolyMoley: " << num / (1000 * elapsed) << " kHz (" << total
+         << " bytes)" << endl;
+  }
 
   return 0;
 }
@@ -308,3 +308,85 @@ BOOST_AUTO_TEST_CASE(test_debug_proto_3) {
   BOOST_CHECK_MESSAGE(!expected_result.compare(result),
     "Expected:\n" << expected_result << "\nGotten:\n" << result);
 }
+
+static std::string bufferDebugString(const HolyMoley& obj,
+                                     uint32_t len,
+                                     uint32_t max_elems,
+                                     uint32_t max_depth,
+                                     bool* truncated = NULL) {
+  using apache::thrift::protocol::TDebugBufferProtocol;
+  std::vector<char> buf(len);
+  TDebugBufferProtocol protocol(len ? &buf[0] : NULL, len);
+  protocol.setMaxContainerElements(max_elems);
+  protocol.setMaxDepth(max_depth);
+  obj.write(&protocol);
+  if (truncated) {
+    *truncated = protocol.truncated();
+  }
+  return std::string(len ? &buf[0] : NULL, protocol.size());
+}
+
+BOOST_AUTO_TEST_CASE(test_debug_buffer_proto_matches) {
+  testCaseSetup_3();
+
+  bool truncated = true;
+  BOOST_CHECK_EQUAL(apache::thrift::ThriftDebugString(*hm),
+                    bufferDebugString(*hm, 1 << 16, 100, 10, &truncated));
+  BOOST_CHECK(!truncated);
+
+  char buf[4096];
+  uint32_t len = apache::thrift::ThriftDebugString(*n, buf, sizeof(buf));
+  BOOST_CHECK_EQUAL(apache::thrift::ThriftDebugString(*n), std::string(buf, len));
+  BOOST_CHECK_EQUAL('\0', buf[len]);
+}
+
+BOOST_AUTO_TEST_CASE(test_debug_buffer_proto_truncate_bytes) {
+  testCaseSetup_3();
+
+  const std::string full(apache::thrift::ThriftDebugString(*hm));
+  bool truncated = false;
+  const std::string result(bufferDebugString(*hm, 40, 100, 10, &truncated));
+  BOOST_CHECK(truncated);
+  BOOST_CHECK_EQUAL(full.substr(0, 37) + "...", result);
+
+  BOOST_CHECK_EQUAL("..", bufferDebugString(*hm, 2, 100, 10));
+  BOOST_CHECK_EQUAL("", bufferDebugString(*hm, 0, 100, 10));
+
+  char buf[8];
+  BOOST_CHECK_EQUAL(7u, apache::thrift::ThriftDebugString(*hm, buf, sizeof(buf)));
+  BOOST_CHECK_EQUAL(std::string("Holy..."), buf);
+}
+
+BOOST_AUTO_TEST_CASE(test_debug_buffer_proto_truncate_elements) {
+  testCaseSetup_3();
+
+  const std::string expected_result(
+    "HolyMoley {\n"
+    "  01: big (list) = list<struct>[2] {\n"
+    "    [0] = OneOfEach {...},\n"
+    "    ...\n"
+    "  },\n"
+    "  02: contain (set) = set<list>[3] {\n"
+    "    list<string>[0] {...},\n"
+    "    ...\n"
+    "  },\n"
+    "  03: bonks (map) = map<string,list>[3] {\n"
+    "    \"nothing\" -> list<struct>[0] {...},\n"
+    "    ...\n"
+    "  },\n"
+    "}");
+  BOOST_CHECK_EQUAL(expected_result, bufferDebugString(*hm, 4096, 1, 2));
+}
+
+BOOST_AUTO_TEST_CASE(test_debug_buffer_proto_truncate_depth) {
+  testCaseSetup_3();
+
+  const std::string expected_result(
+    "HolyMoley {\n"
+    "  01: big (list) = list<struct>[2] {...},\n"
+    "  02: contain (set) = set<list>[3] {...},\n"
+    "  03: bonks (map) = map<string,list>[3] {...},\n"
+    "}");
+  BOOST_CHECK_EQUAL(expected_result, bufferDebugString(*hm, 4096, 100, 1));
+  BOOST_CHECK_EQUAL("HolyMoley {...}", bufferDebugString(*hm, 4096, 100, 0));
+}
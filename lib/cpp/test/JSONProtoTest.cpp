@@ -341,3 +341,33 @@ BOOST_AUTO_TEST_CASE(test_json_unicode_escaped_missing_hi_surrogate) {
   BOOST_CHECK_THROW(ooe2.read(proto.get()),
     apache::thrift::protocol::TProtocolException);
 }
+
+static void testBase64RoundTrip(stdcxx::shared_ptr<apache::thrift::transport::TTransport> trans,
+                                stdcxx::shared_ptr<TMemoryBuffer> buffer) {
+  OneOfEach in;
+  // Larger than the stack chunk used when the transport is not a TMemoryBuffer
+  for (int i = 0; i < 10007; ++i) {
+    in.base64.push_back(static_cast<char>(i * 131));
+  }
+
+  stdcxx::shared_ptr<TJSONProtocol> proto(new TJSONProtocol(trans));
+  in.write(proto.get());
+  trans->flush();
+
+  OneOfEach out;
+  stdcxx::shared_ptr<TJSONProtocol> rproto(new TJSONProtocol(buffer));
+  out.read(rproto.get());
+  BOOST_CHECK(in.base64 == out.base64);
+}
+
+BOOST_AUTO_TEST_CASE(test_json_base64_memory_buffer) {
+  stdcxx::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  testBase64RoundTrip(buffer, buffer);
+}
+
+BOOST_AUTO_TEST_CASE(test_json_base64_buffered_transport) {
+  stdcxx::shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  stdcxx::shared_ptr<apache::thrift::transport::TBufferedTransport> trans(
+    new apache::thrift::transport::TBufferedTransport(buffer));
+  testBase64RoundTrip(trans, buffer);
+}
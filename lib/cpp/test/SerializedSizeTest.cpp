@@ -0,0 +1,206 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+
+#include <boost/test/auto_unit_test.hpp>
+#include <thrift/TSerializer.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
+#include <thrift/stdcxx.h>
+#include <thrift/transport/TBufferTransports.h>
+#include "gen-cpp/DebugProtoTest_types.h"
+
+BOOST_AUTO_TEST_SUITE(SerializedSizeTest)
+
+using apache::thrift::serializeToString;
+using apache::thrift::writeReserved;
+using apache::thrift::protocol::TBinaryProtocolT;
+using apache::thrift::protocol::TCompactProtocolT;
+using apache::thrift::transport::TFramedTransport;
+using apache::thrift::transport::TMemoryBuffer;
+using apache::thrift::stdcxx::make_shared;
+using apache::thrift::stdcxx::shared_ptr;
+using namespace thrift::test::debug;
+
+typedef TBinaryProtocolT<TMemoryBuffer> BinaryProtocol;
+typedef TCompactProtocolT<TMemoryBuffer> CompactProtocol;
+
+template <typename Protocol_, typename Object_>
+uint32_t writtenSize(const Object_& obj) {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  Protocol_ proto(buffer);
+  uint32_t xfer = obj.write(&proto);
+  BOOST_CHECK_EQUAL(xfer, buffer->available_read());
+  return buffer->available_read();
+}
+
+template <typename Object_>
+void checkSizes(const Object_& obj) {
+  BOOST_CHECK_EQUAL(writtenSize<BinaryProtocol>(obj), obj.template serializedSize<BinaryProtocol>());
+  BOOST_CHECK_EQUAL(writtenSize<CompactProtocol>(obj),
+                    obj.template serializedSize<CompactProtocol>());
+}
+
+static OneOfEach makeOneOfEach() {
+  OneOfEach ooe;
+  ooe.im_true = true;
+  ooe.im_false = false;
+  ooe.a_bite = 0x7f;
+  ooe.integer16 = 27000;
+  ooe.integer32 = 1 << 24;
+  ooe.integer64 = (int64_t)6000 * 1000 * 1000;
+  ooe.double_precision = 3.141592653589793;
+  ooe.some_characters = "JSON THIS! \"\1";
+  ooe.zomg_unicode = "\xd7\n\a\t";
+  ooe.base64 = "\1\2\3\255";
+  ooe.i16_list.push_back(-300);
+  ooe.i64_list.push_back(-((int64_t)1 << 40));
+  return ooe;
+}
+
+BOOST_AUTO_TEST_CASE(test_primitives) {
+  checkSizes(OneOfEach());
+  checkSizes(makeOneOfEach());
+
+  Doubles dbls;
+  dbls.big = 1e300;
+  checkSizes(dbls);
+}
+
+BOOST_AUTO_TEST_CASE(test_nested) {
+  Nesting n;
+  n.my_ooe = makeOneOfEach();
+  n.my_bonk.type = 31337;
+  n.my_bonk.message = "I am a bonk... xor!";
+  checkSizes(n);
+
+  HolyMoley hm;
+  hm.big.push_back(makeOneOfEach());
+  hm.big.push_back(n.my_ooe);
+  hm.big[1].a_bite = -42;
+  std::vector<std::string> stage1;
+  stage1.push_back("and a one");
+  stage1.push_back("and a two");
+  hm.contain.insert(stage1);
+  hm.contain.insert(std::vector<std::string>());
+  hm.bonks["nothing"];
+  hm.bonks["something"].push_back(n.my_bonk);
+  checkSizes(hm);
+}
+
+BOOST_AUTO_TEST_CASE(test_containers) {
+  CompactProtoTestStruct cpts;
+  for (int i = 0; i < 20; ++i) {
+    cpts.i32_list.push_back(i * 1000);
+    cpts.boolean_list.push_back(i % 2 == 0);
+    cpts.string_set.insert(std::string(i * 10, 'x'));
+    cpts.byte_i64_map[static_cast<int8_t>(i)] = (int64_t)i << (i * 3);
+  }
+  cpts.struct_list.resize(3);
+  cpts.byte_map_map[1][2] = 3;
+  cpts.byte_map_map[4];
+  checkSizes(cpts);
+
+  RandomStuff rs;
+  rs.maps[1] = Wrapper();
+  rs.myintlist.push_back(-1);
+  checkSizes(rs);
+}
+
+BOOST_AUTO_TEST_CASE(test_field_ids) {
+  // Out-of-order and large field ids exercise the compact field header paths.
+  checkSizes(Backwards());
+  BigFieldIdStruct big;
+  big.field1 = "first";
+  big.field2 = "second";
+  checkSizes(big);
+}
+
+BOOST_AUTO_TEST_CASE(test_unions) {
+  TestUnion u;
+  checkSizes(u);
+  u.__set_i32_field(-12345);
+  checkSizes(u);
+  u = TestUnion();
+  u.__set_struct_field(makeOneOfEach());
+  checkSizes(u);
+}
+
+BOOST_AUTO_TEST_CASE(test_fixed_binary_size) {
+  BOOST_CHECK_EQUAL(Empty::fixedBinarySerializedSize, 1u);
+  BOOST_CHECK_EQUAL(Wrapper::fixedBinarySerializedSize, 5u);
+  BOOST_CHECK_EQUAL(Backwards::fixedBinarySerializedSize, 15u);
+  BOOST_CHECK_EQUAL(writtenSize<BinaryProtocol>(Backwards()),
+                    static_cast<uint32_t>(Backwards::fixedBinarySerializedSize));
+  BOOST_CHECK_EQUAL(writtenSize<BinaryProtocol>(PrimitiveThenStruct()),
+                    static_cast<uint32_t>(PrimitiveThenStruct::fixedBinarySerializedSize));
+}
+
+BOOST_AUTO_TEST_CASE(test_memory_buffer_reserve) {
+  HolyMoley hm;
+  hm.big.resize(50, makeOneOfEach());
+  uint32_t size = hm.serializedSize<BinaryProtocol>();
+
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer(16));
+  buffer->reserve(size);
+  BOOST_CHECK_EQUAL(buffer->getBufferSize(), size);
+
+  BinaryProtocol proto(buffer);
+  hm.write(&proto);
+  BOOST_CHECK_EQUAL(buffer->getBufferSize(), size);
+  BOOST_CHECK_EQUAL(buffer->available_read(), size);
+}
+
+BOOST_AUTO_TEST_CASE(test_framed_transport_reserve) {
+  HolyMoley hm;
+  hm.big.resize(50, makeOneOfEach());
+  uint32_t size = hm.serializedSize<TBinaryProtocolT<TFramedTransport> >();
+
+  shared_ptr<TMemoryBuffer> sink(new TMemoryBuffer());
+  shared_ptr<TFramedTransport> framed(new TFramedTransport(sink));
+  framed->reserve(size);
+  TBinaryProtocolT<TFramedTransport> proto(framed);
+  hm.write(&proto);
+  framed->flush();
+
+  BOOST_CHECK_EQUAL(sink->available_read(), size + 4);
+}
+
+BOOST_AUTO_TEST_CASE(test_write_reserved) {
+  HolyMoley hm;
+  hm.big.resize(50, makeOneOfEach());
+  uint32_t size = hm.serializedSize<BinaryProtocol>();
+
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer(16));
+  BinaryProtocol proto(buffer);
+  BOOST_CHECK_EQUAL(writeReserved(hm, proto, *buffer), size);
+  BOOST_CHECK_EQUAL(buffer->getBufferSize(), size);
+
+  std::string serialized = serializeToString<CompactProtocol>(hm);
+  BOOST_CHECK_EQUAL(serialized.size(), hm.serializedSize<CompactProtocol>());
+  HolyMoley read;
+  shared_ptr<TMemoryBuffer> input(new TMemoryBuffer());
+  input->resetBuffer(reinterpret_cast<uint8_t*>(&serialized[0]),
+                     static_cast<uint32_t>(serialized.size()));
+  CompactProtocol in(input);
+  read.read(&in);
+  BOOST_CHECK(read == hm);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,433 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#define BOOST_TEST_MODULE TCoroutineTest
+#include <boost/test/unit_test.hpp>
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include "thrift/async/TAsyncProtocolProcessor.h"
+#include "thrift/async/TCoroutine.h"
+#include "thrift/async/TEventBaseScheduler.h"
+#include "thrift/async/TEvhttpClientChannel.h"
+#include "thrift/async/TEvhttpServer.h"
+#include "thrift/async/TFramedAsyncChannel.h"
+#include "thrift/concurrency/Monitor.h"
+#include "thrift/concurrency/PlatformThreadFactory.h"
+#include "thrift/concurrency/ThreadManager.h"
+#include "thrift/concurrency/Util.h"
+#include "thrift/protocol/TBinaryProtocol.h"
+#include "thrift/server/TNonblockingServer.h"
+#include "thrift/transport/TNonblockingServerSocket.h"
+
+#include "gen-cpp/ParentService.h"
+
+#include <event2/event.h>
+#include <event2/http.h>
+
+#ifndef THRIFT_HAVE_COROUTINES
+#error "TCoroutineTest needs a compiler with C++20 coroutines"
+#endif
+
+using apache::thrift::TApplicationException;
+using apache::thrift::async::TAsyncProtocolProcessor;
+using apache::thrift::async::TEventBaseScheduler;
+using apache::thrift::async::TEvhttpClientChannel;
+using apache::thrift::async::TEvhttpServer;
+using apache::thrift::async::TFramedAsyncChannel;
+using apache::thrift::async::TTask;
+using apache::thrift::async::spawn;
+using apache::thrift::async::whenAll;
+using apache::thrift::concurrency::Monitor;
+using apache::thrift::concurrency::PlatformThreadFactory;
+using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::Synchronized;
+using apache::thrift::concurrency::Thread;
+using apache::thrift::concurrency::ThreadManager;
+using apache::thrift::concurrency::Util;
+using apache::thrift::protocol::TBinaryProtocolFactory;
+using apache::thrift::server::TNonblockingServer;
+using apache::thrift::server::TServerEventHandler;
+using apache::thrift::stdcxx::make_shared;
+using apache::thrift::stdcxx::shared_ptr;
+using apache::thrift::test::MyError;
+using apache::thrift::test::ParentServiceAsyncProcessor;
+using apache::thrift::test::ParentServiceCoroAdapter;
+using apache::thrift::test::ParentServiceCoroClient;
+using apache::thrift::test::ParentServiceCoroIf;
+using apache::thrift::test::ParentServiceIf;
+using apache::thrift::test::ParentServiceProcessor;
+using apache::thrift::transport::TNonblockingServerSocket;
+
+BOOST_AUTO_TEST_SUITE(TCoroutineTest)
+
+static TTask<int> value(int v) {
+  co_return v;
+}
+
+static TTask<int> sum(int a, int b) {
+  int x = co_await value(a);
+  int y = co_await value(b);
+  co_return x + y;
+}
+
+static TTask<int> fail(const char* what) {
+  co_await value(0);
+  throw std::runtime_error(what);
+}
+
+static TTask<void> record(std::vector<int>& seen, int v) {
+  seen.push_back(co_await value(v));
+}
+
+static TTask<void> collect(std::vector<TTask<int> > tasks, std::vector<int>& results) {
+  results = co_await whenAll(std::move(tasks));
+}
+
+static TTask<void> collectFailure(std::vector<TTask<int> > tasks, std::string& error) {
+  try {
+    co_await whenAll(std::move(tasks));
+  } catch (const std::exception& e) {
+    error = e.what();
+  }
+}
+
+BOOST_AUTO_TEST_CASE(tasks) {
+  // A task does nothing until it is awaited
+  std::vector<int> seen;
+  TTask<void> pending = record(seen, 1);
+  BOOST_CHECK(pending.valid());
+  BOOST_CHECK(!pending.done());
+  BOOST_CHECK(seen.empty());
+  spawn(std::move(pending));
+  BOOST_CHECK(!pending.valid());
+  BOOST_CHECK_EQUAL(1u, seen.size());
+
+  std::vector<TTask<int> > tasks;
+  tasks.push_back(sum(1, 2));
+  tasks.push_back(value(10));
+  tasks.push_back(sum(20, 30));
+  std::vector<int> results;
+  spawn(collect(std::move(tasks), results));
+  BOOST_REQUIRE_EQUAL(3u, results.size());
+  BOOST_CHECK_EQUAL(3, results[0]);
+  BOOST_CHECK_EQUAL(10, results[1]);
+  BOOST_CHECK_EQUAL(50, results[2]);
+
+  spawn(collect(std::vector<TTask<int> >(), results));
+  BOOST_CHECK(results.empty());
+
+  // The first failure, in the order of the tasks, is the one reported
+  tasks.clear();
+  tasks.push_back(value(1));
+  tasks.push_back(fail("first"));
+  tasks.push_back(fail("second"));
+  std::string error;
+  spawn(collectFailure(std::move(tasks), error));
+  BOOST_CHECK_EQUAL("first", error);
+}
+
+static TTask<void> sleepThenRecord(TEventBaseScheduler scheduler,
+                                   std::vector<int>& order,
+                                   int id,
+                                   int ms) {
+  co_await scheduler.sleepFor(ms);
+  order.push_back(id);
+}
+
+BOOST_AUTO_TEST_CASE(scheduler) {
+  event_base* base = event_base_new();
+  TEventBaseScheduler scheduler(base);
+
+  std::vector<int> order;
+  scheduler.spawn(sleepThenRecord(scheduler, order, 1, 40));
+  scheduler.spawn(sleepThenRecord(scheduler, order, 2, 0));
+  scheduler.spawn(sleepThenRecord(scheduler, order, 3, 20));
+  // Nothing runs before the loop does
+  BOOST_CHECK(order.empty());
+
+  int64_t start = Util::currentTime();
+  event_base_dispatch(base);
+  BOOST_CHECK(Util::currentTime() - start >= 40);
+  BOOST_REQUIRE_EQUAL(3u, order.size());
+  BOOST_CHECK_EQUAL(2, order[0]);
+  BOOST_CHECK_EQUAL(3, order[1]);
+  BOOST_CHECK_EQUAL(1, order[2]);
+
+  event_base_free(base);
+}
+
+// A synchronous handler that keeps a worker busy for length milliseconds
+struct SyncHandler : public ParentServiceIf {
+  int32_t incrementGeneration() { return 0; }
+  int32_t getGeneration() { return 0; }
+  void addString(const std::string&) {}
+  void getStrings(std::vector<std::string>&) {}
+
+  void getDataWait(std::string& _return, const int32_t length) {
+    THRIFT_SLEEP_USEC(length * 1000);
+    _return.assign(length, 'a');
+  }
+
+  void onewayWait() {}
+
+  void exceptionWait(const std::string& message) {
+    MyError e;
+    e.message = message;
+    throw e;
+  }
+
+  void unexpectedExceptionWait(const std::string&) {}
+};
+
+// Runs a TNonblockingServer on a thread of its own
+class ServerThread : public Runnable, public TServerEventHandler {
+public:
+  ServerThread(shared_ptr<ParentServiceIf> handler, size_t workers) : ready_(false) {
+    shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(workers);
+    threadManager->threadFactory(make_shared<PlatformThreadFactory>());
+    threadManager->start();
+    server_.reset(new TNonblockingServer(make_shared<ParentServiceProcessor>(handler),
+                                         make_shared<TBinaryProtocolFactory>(),
+                                         make_shared<TNonblockingServerSocket>(0),
+                                         threadManager));
+    server_->setMaxInFlightPerConnection(static_cast<uint32_t>(workers));
+  }
+
+  int start(shared_ptr<ServerThread> self) {
+    server_->setServerEventHandler(self);
+    thread_ = PlatformThreadFactory(false).newThread(self);
+    thread_->start();
+    Synchronized s(monitor_);
+    while (!ready_) {
+      monitor_.wait();
+    }
+    return server_->getListenPort();
+  }
+
+  void stop() {
+    server_->stop();
+    thread_->join();
+    server_->setServerEventHandler(shared_ptr<TServerEventHandler>());
+  }
+
+  void run() { server_->serve(); }
+
+  void preServe() {
+    Synchronized s(monitor_);
+    ready_ = true;
+    monitor_.notify();
+  }
+
+private:
+  shared_ptr<TNonblockingServer> server_;
+  shared_ptr<Thread> thread_;
+  Monitor monitor_;
+  bool ready_;
+};
+
+struct FanOut {
+  FanOut() : elapsed(0), caught(false) {}
+
+  TTask<void> run(std::vector<shared_ptr<ParentServiceCoroClient> > clients, event_base* base) {
+    std::vector<TTask<std::string> > calls;
+    for (size_t i = 0; i < clients.size(); ++i) {
+      calls.push_back(clients[i]->getDataWait(static_cast<int32_t>(100 + i)));
+    }
+    int64_t start = Util::currentTime();
+    results = co_await whenAll(std::move(calls));
+    elapsed = Util::currentTime() - start;
+
+    try {
+      co_await clients[0]->exceptionWait("from the server");
+    } catch (const MyError& e) {
+      caught = e.message == "from the server";
+    }
+    event_base_loopbreak(base);
+  }
+
+  std::vector<std::string> results;
+  int64_t elapsed;
+  bool caught;
+};
+
+BOOST_AUTO_TEST_CASE(client_fans_out) {
+  const size_t CALLS = 8;
+  shared_ptr<ServerThread> server(new ServerThread(make_shared<SyncHandler>(), CALLS));
+  int port = server->start(server);
+
+  event_base* base = event_base_new();
+  TBinaryProtocolFactory protocolFactory;
+  // All the calls share one connection
+  shared_ptr<TFramedAsyncChannel> channel(new TFramedAsyncChannel("127.0.0.1", port, base));
+  channel->setRecvTimeout(5000);
+  std::vector<shared_ptr<ParentServiceCoroClient> > clients;
+  for (size_t i = 0; i < CALLS; ++i) {
+    clients.push_back(make_shared<ParentServiceCoroClient>(channel, &protocolFactory));
+  }
+
+  FanOut fanOut;
+  TEventBaseScheduler(base).spawn(fanOut.run(clients, base));
+  event_base_dispatch(base);
+
+  BOOST_REQUIRE_EQUAL(CALLS, fanOut.results.size());
+  for (size_t i = 0; i < CALLS; ++i) {
+    BOOST_CHECK_EQUAL(100 + i, fanOut.results[i].size());
+  }
+  // The calls were outstanding at once
+  BOOST_CHECK(fanOut.elapsed < static_cast<int64_t>(CALLS * 100 / 2));
+  BOOST_CHECK(fanOut.caught);
+  BOOST_CHECK_EQUAL(0u, channel->getOutstandingCount());
+
+  clients.clear();
+  channel.reset();
+  event_base_free(base);
+  server->stop();
+}
+
+// A coroutine handler that waits on the event loop instead of a thread
+class CoroHandler : public ParentServiceCoroIf {
+public:
+  explicit CoroHandler(TEventBaseScheduler scheduler) : scheduler_(scheduler), generation_(0) {}
+
+  TTask<int32_t> incrementGeneration() { co_return ++generation_; }
+  TTask<int32_t> getGeneration() { co_return generation_; }
+
+  TTask<void> addString(std::string s) {
+    co_await scheduler_.schedule();
+    strings_.push_back(std::move(s));
+  }
+
+  TTask<std::vector<std::string> > getStrings() { co_return strings_; }
+
+  TTask<std::string> getDataWait(int32_t length) {
+    co_await scheduler_.sleepFor(length);
+    co_return std::string(length, 'a');
+  }
+
+  TTask<void> onewayWait() { co_return; }
+
+  TTask<void> exceptionWait(std::string message) {
+    co_await scheduler_.schedule();
+    if (message == "declared") {
+      MyError e;
+      e.message = message;
+      throw e;
+    }
+    throw std::runtime_error(message);
+  }
+
+  TTask<void> unexpectedExceptionWait(std::string) { co_return; }
+
+private:
+  TEventBaseScheduler scheduler_;
+  int32_t generation_;
+  std::vector<std::string> strings_;
+};
+
+struct Conversation {
+  Conversation() : generation(0), declared(false), undeclared(false), elapsed(0) {}
+
+  TTask<void> run(std::vector<shared_ptr<ParentServiceCoroClient> > clients, event_base* base) {
+    ParentServiceCoroClient& client = *clients[0];
+    co_await client.addString("one");
+    co_await client.addString("two");
+    strings = co_await client.getStrings();
+    co_await client.incrementGeneration();
+    generation = co_await client.incrementGeneration();
+
+    try {
+      co_await client.exceptionWait("declared");
+    } catch (const MyError& e) {
+      declared = e.message == "declared";
+    }
+    try {
+      co_await client.exceptionWait("undeclared");
+    } catch (const TApplicationException& e) {
+      undeclared = std::string(e.what()) == "undeclared";
+    }
+
+    // Handlers waiting on the loop do not hold each other up
+    std::vector<TTask<std::string> > calls;
+    for (size_t i = 0; i < clients.size(); ++i) {
+      calls.push_back(clients[i]->getDataWait(100));
+    }
+    int64_t start = Util::currentTime();
+    co_await whenAll(std::move(calls));
+    elapsed = Util::currentTime() - start;
+
+    event_base_loopbreak(base);
+  }
+
+  std::vector<std::string> strings;
+  int32_t generation;
+  bool declared;
+  bool undeclared;
+  int64_t elapsed;
+};
+
+BOOST_AUTO_TEST_CASE(coroutine_handler) {
+  // Server and clients all run on the one loop
+  event_base* base = event_base_new();
+  TEventBaseScheduler scheduler(base);
+
+  shared_ptr<ParentServiceCoroAdapter> adapter(
+      new ParentServiceCoroAdapter(make_shared<CoroHandler>(scheduler)));
+  shared_ptr<TEvhttpServer> server(new TEvhttpServer(make_shared<TAsyncProtocolProcessor>(
+      make_shared<ParentServiceAsyncProcessor>(adapter), make_shared<TBinaryProtocolFactory>())));
+  evhttp* http = evhttp_new(base);
+  evhttp_bound_socket* bound = evhttp_bind_socket_with_handle(http, "127.0.0.1", 0);
+  BOOST_REQUIRE(bound != NULL);
+  evhttp_set_cb(http, "/", TEvhttpServer::request, server.get());
+  sockaddr_in addr;
+  socklen_t addrLen = sizeof(addr);
+  BOOST_REQUIRE_EQUAL(
+      0, getsockname(evhttp_bound_socket_get_fd(bound), reinterpret_cast<sockaddr*>(&addr), &addrLen));
+  int port = ntohs(addr.sin_port);
+
+  // An HTTP channel carries one call at a time, so each client has its own
+  TBinaryProtocolFactory protocolFactory;
+  std::vector<shared_ptr<ParentServiceCoroClient> > clients;
+  for (int i = 0; i < 4; ++i) {
+    shared_ptr<TEvhttpClientChannel> channel(
+        new TEvhttpClientChannel("127.0.0.1", "/", "127.0.0.1", port, base));
+    clients.push_back(make_shared<ParentServiceCoroClient>(channel, &protocolFactory));
+  }
+
+  Conversation conversation;
+  scheduler.spawn(conversation.run(clients, base));
+  event_base_dispatch(base);
+
+  BOOST_REQUIRE_EQUAL(2u, conversation.strings.size());
+  BOOST_CHECK_EQUAL("one", conversation.strings[0]);
+  BOOST_CHECK_EQUAL("two", conversation.strings[1]);
+  BOOST_CHECK_EQUAL(2, conversation.generation);
+  BOOST_CHECK(conversation.declared);
+  BOOST_CHECK(conversation.undeclared);
+  BOOST_CHECK(conversation.elapsed < 300);
+
+  clients.clear();
+  evhttp_free(http);
+  event_base_free(base);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
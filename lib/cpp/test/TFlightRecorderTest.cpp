@@ -0,0 +1,183 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include <thrift/concurrency/Thread.h>
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/server/TFlightRecorder.h>
+
+using apache::thrift::server::TFlightRecorder;
+using apache::thrift::concurrency::PlatformThreadFactory;
+using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::Thread;
+using apache::thrift::stdcxx::shared_ptr;
+
+BOOST_AUTO_TEST_SUITE(TFlightRecorderTest)
+
+// A request that started at start and spent step usec in every phase
+static TFlightRecorder::Record makeRecord(int64_t start, int64_t step) {
+  TFlightRecorder::Record record;
+  for (int p = TFlightRecorder::FIRST_BYTE; p < TFlightRecorder::NUM_PHASES; ++p) {
+    record.time[p] = start + (p - TFlightRecorder::FIRST_BYTE) * step;
+  }
+  return record;
+}
+
+BOOST_AUTO_TEST_CASE(record_timeline) {
+  TFlightRecorder::Record record;
+  BOOST_CHECK_EQUAL(0, record.start());
+  BOOST_CHECK_EQUAL(0, record.duration());
+
+  record.time[TFlightRecorder::ACCEPTED] = 1000;
+  record.time[TFlightRecorder::FIRST_BYTE] = 5000;
+  record.time[TFlightRecorder::HANDLER_DONE] = 5200;
+  record.time[TFlightRecorder::LAST_BYTE_WRITTEN] = 5250;
+  BOOST_CHECK_EQUAL(1000, record.start());
+  BOOST_CHECK_EQUAL(5250, record.end());
+  // Time the connection sat idle before the request does not count
+  BOOST_CHECK_EQUAL(250, record.duration());
+  BOOST_CHECK_EQUAL(
+      "at 1000: 250us (accepted +0, first_byte +4000, handler_done +4200, last_byte_written +4250)",
+      record.toString());
+
+  record.time[TFlightRecorder::FIRST_BYTE] = 0;
+  BOOST_CHECK_EQUAL(4250, record.duration());
+
+  record.clear();
+  record.mark(TFlightRecorder::DEQUEUED);
+  BOOST_CHECK(record.time[TFlightRecorder::DEQUEUED] > 0);
+}
+
+BOOST_AUTO_TEST_CASE(keeps_most_recent) {
+  TFlightRecorder recorder(6, 2);
+  std::vector<TFlightRecorder::Record> records;
+  recorder.recent(records);
+  BOOST_CHECK(records.empty());
+
+  for (int64_t i = 1; i <= 3; ++i) {
+    recorder.record(makeRecord(i * 1000, 1));
+  }
+  recorder.recent(records);
+  BOOST_REQUIRE_EQUAL(3u, records.size());
+  BOOST_CHECK_EQUAL(1000, records[0].start());
+  BOOST_CHECK_EQUAL(3000, records[2].start());
+
+  // The capacity is rounded up to 8; older records are overwritten
+  for (int64_t i = 4; i <= 20; ++i) {
+    recorder.record(makeRecord(i * 1000, 1));
+  }
+  recorder.recent(records);
+  BOOST_REQUIRE_EQUAL(8u, records.size());
+  for (size_t i = 0; i < records.size(); ++i) {
+    BOOST_CHECK_EQUAL(static_cast<int64_t>(13 + i) * 1000, records[i].start());
+  }
+  BOOST_CHECK_EQUAL(20u, recorder.getRecordedCount());
+}
+
+BOOST_AUTO_TEST_CASE(keeps_slow_apart) {
+  TFlightRecorder recorder(4, 2);
+  recorder.setSlowThreshold(100);
+
+  recorder.record(makeRecord(1000, 20)); // 100us
+  recorder.record(makeRecord(2000, 10));
+  recorder.record(makeRecord(3000, 50)); // 250us
+  for (int64_t i = 0; i < 10; ++i) {
+    recorder.record(makeRecord(10000 + i, 1));
+  }
+
+  std::vector<TFlightRecorder::Record> records;
+  recorder.slow(records);
+  BOOST_REQUIRE_EQUAL(2u, records.size());
+  BOOST_CHECK_EQUAL(100, records[0].duration());
+  BOOST_CHECK_EQUAL(250, records[1].duration());
+  BOOST_CHECK_EQUAL(2u, recorder.getSlowCount());
+
+  recorder.recent(records);
+  BOOST_CHECK_EQUAL(4u, records.size());
+
+  std::string dump = recorder.dump();
+  BOOST_CHECK(dump.find("# slow requests (at least 100us): 2 recorded, last 2\n") == 0);
+  BOOST_CHECK(dump.find("# recent requests: 13 recorded, last 4\n") != std::string::npos);
+
+  // A threshold of 0 keeps no slow requests
+  recorder.setSlowThreshold(0);
+  recorder.record(makeRecord(50000, 1000));
+  BOOST_CHECK_EQUAL(2u, recorder.getSlowCount());
+}
+
+class Recording : public Runnable {
+public:
+  Recording(TFlightRecorder& recorder, int64_t id, int count)
+    : recorder_(recorder), id_(id), count_(count) {}
+
+  void run() {
+    for (int i = 0; i < count_; ++i) {
+      // Every phase carries the same value, so a torn record shows
+      TFlightRecorder::Record record;
+      for (int p = 0; p < TFlightRecorder::NUM_PHASES; ++p) {
+        record.time[p] = id_ * 1000000 + i + 1;
+      }
+      recorder_.record(record);
+    }
+  }
+
+private:
+  TFlightRecorder& recorder_;
+  int64_t id_;
+  int count_;
+};
+
+BOOST_AUTO_TEST_CASE(concurrent_recording) {
+  const int THREADS = 4;
+  const int PER_THREAD = 20000;
+  TFlightRecorder recorder(16, 2);
+
+  PlatformThreadFactory factory(false);
+  std::vector<shared_ptr<Thread> > threads;
+  for (int t = 0; t < THREADS; ++t) {
+    threads.push_back(factory.newThread(shared_ptr<Runnable>(
+        new Recording(recorder, t + 1, PER_THREAD))));
+    threads.back()->start();
+  }
+
+  // Readers never see a record half written
+  std::vector<TFlightRecorder::Record> records;
+  for (int i = 0; i < 2000; ++i) {
+    recorder.recent(records);
+    BOOST_REQUIRE(records.size() <= 16u);
+    for (size_t r = 0; r < records.size(); ++r) {
+      for (int p = 1; p < TFlightRecorder::NUM_PHASES; ++p) {
+        BOOST_REQUIRE_EQUAL(records[r].time[0], records[r].time[p]);
+      }
+    }
+  }
+
+  for (size_t t = 0; t < threads.size(); ++t) {
+    threads[t]->join();
+  }
+  BOOST_CHECK_EQUAL(static_cast<uint64_t>(THREADS * PER_THREAD), recorder.getRecordedCount());
+  recorder.recent(records);
+  BOOST_CHECK(!records.empty());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,259 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+#include <string>
+#include <vector>
+
+#include <boost/test/auto_unit_test.hpp>
+
+#include <thrift/concurrency/Thread.h>
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/processor/TMetricsEventHandler.h>
+
+using apache::thrift::processor::THistogram;
+using apache::thrift::processor::TMethodMetrics;
+using apache::thrift::processor::TMetricsEventHandler;
+using apache::thrift::concurrency::PlatformThreadFactory;
+using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::Thread;
+using apache::thrift::stdcxx::shared_ptr;
+
+BOOST_AUTO_TEST_SUITE(TMetricsEventHandlerTest)
+
+// Runs one call through the hooks in the order the generated processor does.
+static void simulateCall(TMetricsEventHandler& handler,
+                         const char* method,
+                         uint32_t bytesIn,
+                         uint32_t bytesOut,
+                         bool fail) {
+  void* ctx = handler.getContext(method, NULL);
+  handler.preRead(ctx, method);
+  handler.postRead(ctx, method, bytesIn);
+  if (fail) {
+    handler.handlerError(ctx, method);
+  } else {
+    handler.preWrite(ctx, method);
+    handler.postWrite(ctx, method, bytesOut);
+  }
+  handler.freeContext(ctx, method);
+}
+
+BOOST_AUTO_TEST_CASE(histogram_buckets) {
+  // Every value lands in a bucket whose upper bound is within 12.5% of it
+  for (uint64_t v = 0; v < 100000; ++v) {
+    uint32_t bucket = THistogram::bucketFor(v);
+    BOOST_REQUIRE_LT(bucket, THistogram::NUM_BUCKETS);
+    uint64_t upper = THistogram::bucketUpperBound(bucket);
+    BOOST_REQUIRE_GE(upper, v);
+    BOOST_REQUIRE_LE(upper - v, v / 8);
+    if (bucket > 0) {
+      BOOST_REQUIRE_LT(THistogram::bucketUpperBound(bucket - 1), v);
+    }
+  }
+  BOOST_CHECK_EQUAL(THistogram::bucketFor(~0ULL), THistogram::NUM_BUCKETS - 1);
+  BOOST_CHECK_EQUAL(THistogram::bucketUpperBound(THistogram::NUM_BUCKETS - 1),
+                    THistogram::MAX_VALUE);
+}
+
+BOOST_AUTO_TEST_CASE(histogram_percentiles) {
+  THistogram h;
+  BOOST_CHECK_EQUAL(h.percentile(50), 0u);
+  for (uint64_t v = 1; v <= 1000; ++v) {
+    h.record(v);
+  }
+  BOOST_CHECK_EQUAL(h.count(), 1000u);
+  BOOST_CHECK_EQUAL(h.sum(), 500500u);
+  BOOST_CHECK_EQUAL(h.min(), 1u);
+  BOOST_CHECK_EQUAL(h.max(), 1000u);
+  BOOST_CHECK_EQUAL(h.percentile(100), 1000u);
+
+  uint64_t p50 = h.percentile(50);
+  BOOST_CHECK_GE(p50, 500u);
+  BOOST_CHECK_LE(p50, 500u + 500u / 8);
+  uint64_t p99 = h.percentile(99);
+  BOOST_CHECK_GE(p99, 990u);
+  BOOST_CHECK_LE(p99, 1000u);
+
+  THistogram other;
+  other.record(5000);
+  h.merge(other);
+  BOOST_CHECK_EQUAL(h.count(), 1001u);
+  BOOST_CHECK_EQUAL(h.max(), 5000u);
+  BOOST_CHECK_EQUAL(h.percentile(100), 5000u);
+}
+
+BOOST_AUTO_TEST_CASE(counts_and_bytes) {
+  TMetricsEventHandler handler;
+  simulateCall(handler, "Svc.foo", 10, 20, false);
+  simulateCall(handler, "Svc.foo", 30, 40, false);
+  simulateCall(handler, "Svc.foo", 5, 0, true);
+  simulateCall(handler, "Svc.bar", 1, 2, false);
+
+  // Abandoned while reading the arguments
+  void* ctx = handler.getContext("Svc.bar", NULL);
+  handler.preRead(ctx, "Svc.bar");
+  handler.freeContext(ctx, "Svc.bar");
+
+  // Oneway
+  ctx = handler.getContext("Svc.baz", NULL);
+  handler.preRead(ctx, "Svc.baz");
+  handler.postRead(ctx, "Svc.baz", 7);
+  handler.asyncComplete(ctx, "Svc.baz");
+  handler.freeContext(ctx, "Svc.baz");
+
+  TMethodMetrics foo;
+  BOOST_REQUIRE(handler.getMethod("Svc.foo", foo));
+  BOOST_CHECK_EQUAL(foo.calls, 3u);
+  BOOST_CHECK_EQUAL(foo.errors, 1u);
+  BOOST_CHECK_EQUAL(foo.bytesRead, 45u);
+  BOOST_CHECK_EQUAL(foo.bytesWritten, 60u);
+  BOOST_CHECK_EQUAL(foo.readLatency.count(), 3u);
+  BOOST_CHECK_EQUAL(foo.handleLatency.count(), 3u);
+  BOOST_CHECK_EQUAL(foo.writeLatency.count(), 2u);
+
+  TMethodMetrics bar;
+  BOOST_REQUIRE(handler.getMethod("Svc.bar", bar));
+  BOOST_CHECK_EQUAL(bar.calls, 2u);
+  BOOST_CHECK_EQUAL(bar.errors, 1u);
+  BOOST_CHECK_EQUAL(bar.readLatency.count(), 1u);
+
+  TMethodMetrics baz;
+  BOOST_REQUIRE(handler.getMethod("Svc.baz", baz));
+  BOOST_CHECK_EQUAL(baz.calls, 1u);
+  BOOST_CHECK_EQUAL(baz.errors, 0u);
+  BOOST_CHECK_EQUAL(baz.handleLatency.count(), 1u);
+  BOOST_CHECK_EQUAL(baz.writeLatency.count(), 0u);
+
+  TMethodMetrics missing;
+  BOOST_CHECK(!handler.getMethod("Svc.missing", missing));
+
+  std::vector<TMethodMetrics> all;
+  handler.snapshot(all);
+  BOOST_REQUIRE_EQUAL(all.size(), 3u);
+  BOOST_CHECK_EQUAL(all[0].name, "Svc.bar");
+  BOOST_CHECK_EQUAL(all[1].name, "Svc.baz");
+  BOOST_CHECK_EQUAL(all[2].name, "Svc.foo");
+}
+
+BOOST_AUTO_TEST_CASE(overflow) {
+  TMetricsEventHandler handler(2);
+  simulateCall(handler, "a", 0, 0, false);
+  simulateCall(handler, "b", 0, 0, false);
+  simulateCall(handler, "c", 0, 0, false);
+  simulateCall(handler, "d", 0, 0, false);
+  simulateCall(handler, "a", 0, 0, false);
+
+  std::vector<TMethodMetrics> all;
+  handler.snapshot(all);
+  BOOST_REQUIRE_EQUAL(all.size(), 3u);
+  BOOST_CHECK_EQUAL(all[0].name, TMetricsEventHandler::OVERFLOW_METHOD);
+  BOOST_CHECK_EQUAL(all[0].calls, 2u);
+  BOOST_CHECK_EQUAL(all[1].name, "a");
+  BOOST_CHECK_EQUAL(all[1].calls, 2u);
+}
+
+BOOST_AUTO_TEST_CASE(dump_format) {
+  TMetricsEventHandler handler;
+  simulateCall(handler, "Svc.foo", 10, 20, false);
+
+  std::string text = handler.dump();
+  BOOST_CHECK(text.find("# TYPE thrift_calls_total counter\n") != std::string::npos);
+  BOOST_CHECK(text.find("thrift_calls_total{method=\"Svc.foo\"} 1\n") != std::string::npos);
+  BOOST_CHECK(text.find("thrift_read_bytes_total{method=\"Svc.foo\"} 10\n") != std::string::npos);
+  BOOST_CHECK(text.find("thrift_written_bytes_total{method=\"Svc.foo\"} 20\n")
+              != std::string::npos);
+  BOOST_CHECK(text.find("# TYPE thrift_latency_us summary\n") != std::string::npos);
+  BOOST_CHECK(
+      text.find("thrift_latency_us{method=\"Svc.foo\",phase=\"handle\",quantile=\"0.99\"} ")
+      != std::string::npos);
+  BOOST_CHECK(text.find("thrift_latency_us_count{method=\"Svc.foo\",phase=\"write\"} 1\n")
+              != std::string::npos);
+}
+
+BOOST_AUTO_TEST_CASE(contexts_are_reused) {
+  TMetricsEventHandler handler;
+  void* outer = handler.getContext("Svc.outer", NULL);
+  void* nested = handler.getContext("Svc.nested", NULL);
+  BOOST_CHECK(nested != outer);
+  handler.freeContext(nested, "Svc.nested");
+  handler.freeContext(outer, "Svc.outer");
+
+#if __cplusplus >= 201103L
+  // The next call on this thread gets a context back, reset
+  void* ctx = handler.getContext("Svc.foo", NULL);
+  BOOST_CHECK(ctx == outer);
+  handler.preRead(ctx, "Svc.foo");
+  handler.postRead(ctx, "Svc.foo", 1);
+  handler.asyncComplete(ctx, "Svc.foo");
+  handler.freeContext(ctx, "Svc.foo");
+#endif
+
+  simulateCall(handler, "Svc.foo", 1, 0, false);
+  TMethodMetrics foo;
+  BOOST_REQUIRE(handler.getMethod("Svc.foo", foo));
+  BOOST_CHECK_EQUAL(foo.errors, 0u);
+}
+
+class CallRunner : public Runnable {
+public:
+  CallRunner(TMetricsEventHandler& handler, int calls) : handler_(handler), calls_(calls) {}
+
+  void run() {
+    static const char* const methods[] = {"Svc.a", "Svc.b", "Svc.c", "Svc.d"};
+    for (int i = 0; i < calls_; ++i) {
+      simulateCall(handler_, methods[i % 4], 1, 2, (i % 10) == 0);
+    }
+  }
+
+private:
+  TMetricsEventHandler& handler_;
+  int calls_;
+};
+
+BOOST_AUTO_TEST_CASE(concurrent_recording) {
+  const int threads = 8;
+  const int calls = 4000;
+
+  TMetricsEventHandler handler;
+  PlatformThreadFactory factory(false);
+  std::vector<shared_ptr<Thread> > running;
+  for (int t = 0; t < threads; ++t) {
+    running.push_back(factory.newThread(shared_ptr<Runnable>(new CallRunner(handler, calls))));
+    running.back()->start();
+  }
+  for (size_t t = 0; t < running.size(); ++t) {
+    running[t]->join();
+  }
+
+  std::vector<TMethodMetrics> all;
+  handler.snapshot(all);
+  BOOST_REQUIRE_EQUAL(all.size(), 4u);
+  uint64_t total = 0;
+  uint64_t errors = 0;
+  for (size_t i = 0; i < all.size(); ++i) {
+    total += all[i].calls;
+    errors += all[i].errors;
+    BOOST_CHECK_EQUAL(all[i].calls, all[i].readLatency.count());
+    BOOST_CHECK_EQUAL(all[i].bytesRead, all[i].calls);
+  }
+  BOOST_CHECK_EQUAL(total, static_cast<uint64_t>(threads * calls));
+  BOOST_CHECK_EQUAL(errors, static_cast<uint64_t>(threads * (calls / 10)));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -20,23 +20,49 @@
 #define BOOST_TEST_MODULE TNonblockingServerTest
 #include <boost/test/unit_test.hpp>
 
+#include "thrift/async/TFramedAsyncChannel.h"
+#include "thrift/concurrency/AffinityThreadFactory.h"
 #include "thrift/concurrency/Monitor.h"
 #include "thrift/concurrency/Thread.h"
+#include "thrift/concurrency/ThreadManager.h"
+#include "thrift/server/TCoDel.h"
+#include "thrift/server/TFlightRecorder.h"
 #include "thrift/server/TNonblockingServer.h"
+#include "thrift/server/TRequestClassifier.h"
+#include "thrift/server/TThreadPerCoreServer.h"
+#include "thrift/protocol/TCompactProtocol.h"
+#include "thrift/transport/THeaderTransport.h"
 #include "thrift/transport/TNonblockingServerSocket.h"
+#include "thrift/transport/TServerSocket.h"
+#include "thrift/transport/TSocketHandoff.h"
 #include "thrift/stdcxx.h"
 
 #include "gen-cpp/ParentService.h"
 
+#ifdef THRIFT_TEST_HEADER_TRANSPORT
+#include "thrift/protocol/THeaderProtocol.h"
+#endif
+
 #include <event.h>
+#include <map>
+#include <set>
 
+using apache::thrift::async::TFramedAsyncChannel;
+using apache::thrift::concurrency::AffinityThreadFactory;
 using apache::thrift::concurrency::Guard;
 using apache::thrift::concurrency::Monitor;
 using apache::thrift::concurrency::Mutex;
 using apache::thrift::concurrency::PlatformThreadFactory;
 using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::Synchronized;
 using apache::thrift::concurrency::Thread;
 using apache::thrift::concurrency::ThreadFactory;
+using apache::thrift::concurrency::ThreadManager;
+using apache::thrift::concurrency::ThreadPlacement;
+using apache::thrift::server::TCoDel;
+using apache::thrift::server::TFlightRecorder;
+using apache::thrift::server::TMethodClassifier;
+using apache::thrift::server::TRequestInfo;
 using apache::thrift::server::TServerEventHandler;
 using apache::thrift::stdcxx::make_shared;
 using apache::thrift::stdcxx::shared_ptr;
@@ -48,10 +74,12 @@ struct Handler : public test::ParentServiceIf {
   void getStrings(std::vector<std::string>& _return) { _return = strings_; }
   std::vector<std::string> strings_;
 
+  // keeps a worker busy for length milliseconds
+  void getDataWait(std::string&, const int32_t length) { THRIFT_SLEEP_USEC(length * 1000); }
+
   // dummy overrides not used in this test
   int32_t incrementGeneration() { return 0; }
   int32_t getGeneration() { return 0; }
-  void getDataWait(std::string&, const int32_t) {}
   void onewayWait() {}
   void exceptionWait(const std::string&) {}
   void unexpectedExceptionWait(const std::string&) {}
@@ -77,12 +105,20 @@ private:
     int port;
     shared_ptr<event_base> userEventBase;
     shared_ptr<TProcessor> processor;
+    shared_ptr<async::TAsyncProcessor> asyncProcessor;
     shared_ptr<server::TNonblockingServer> server;
     shared_ptr<ListenEventHandler> listenHandler;
     shared_ptr<transport::TNonblockingServerSocket> socket;
+    shared_ptr<ThreadManager> threadManager;
+    std::vector<shared_ptr<ThreadManager> > ioThreadManagers;
+    std::vector<ThreadPlacement> ioThreadPlacements;
+    shared_ptr<TFlightRecorder> flightRecorder;
+    shared_ptr<protocol::TProtocolFactory> protocolFactory;
+    bool headerTransport;
+    uint32_t maxInFlight;
     Mutex mutex_;
 
-    Runner() {
+    Runner() : headerTransport(false), maxInFlight(1) {
       listenHandler.reset(new ListenEventHandler(&mutex_));
     }
 
@@ -103,8 +139,34 @@ private:
     void startServer(int retry_count) {
       try {
         socket.reset(new transport::TNonblockingServerSocket(port));
-        server.reset(new server::TNonblockingServer(processor, socket));
+        if (asyncProcessor) {
+          server.reset(new server::TNonblockingServer(
+              asyncProcessor, make_shared<protocol::TBinaryProtocolFactory>(), socket));
+        } else {
+          server.reset(new server::TNonblockingServer(processor, socket));
+        }
         server->setServerEventHandler(listenHandler);
+        if (threadManager) {
+          server->setThreadManager(threadManager);
+        }
+        if (!ioThreadManagers.empty()) {
+          server->setNumIOThreads(ioThreadManagers.size());
+          server->setThreadManagers(ioThreadManagers);
+          server->setIOThreadPlacements(ioThreadPlacements);
+        }
+        server->setMaxInFlightPerConnection(maxInFlight);
+        server->setFlightRecorder(flightRecorder);
+        if (protocolFactory) {
+          server->setInputProtocolFactory(protocolFactory);
+          server->setOutputProtocolFactory(protocolFactory);
+        }
+#ifdef THRIFT_TEST_HEADER_TRANSPORT
+        if (headerTransport) {
+          // no output protocol factory selects header transport
+          server->setInputProtocolFactory(make_shared<protocol::THeaderProtocolFactory>());
+          server->setOutputProtocolFactory(shared_ptr<protocol::TProtocolFactory>());
+        }
+#endif
         if (userEventBase) {
           server->registerEvents(userEventBase.get());
         }
@@ -125,7 +187,10 @@ private:
   };
 
 protected:
-  Fixture() : processor(new test::ParentServiceProcessor(make_shared<Handler>())) {}
+  Fixture()
+    : processor(new test::ParentServiceProcessor(make_shared<Handler>())),
+      headerTransport_(false),
+      maxInFlight_(1) {}
 
   ~Fixture() {
     if (server) {
@@ -140,11 +205,50 @@ protected:
     userEventBase_.reset(user_event_base, EventDeleter());
   }
 
+  void setHandler(shared_ptr<Handler> handler) {
+    processor.reset(new test::ParentServiceProcessor(handler));
+  }
+
+  void setThreadManager(shared_ptr<ThreadManager> threadManager) {
+    threadManager_ = threadManager;
+  }
+
+  // One IO thread per ThreadManager, placed on ioThreadPlacements
+  void setIOThreadManagers(const std::vector<shared_ptr<ThreadManager> >& ioThreadManagers,
+                           const std::vector<ThreadPlacement>& ioThreadPlacements) {
+    ioThreadManagers_ = ioThreadManagers;
+    ioThreadPlacements_ = ioThreadPlacements;
+  }
+
+  void setHeaderTransport(bool headerTransport) { headerTransport_ = headerTransport; }
+
+  void setMaxInFlight(uint32_t maxInFlight) { maxInFlight_ = maxInFlight; }
+
+  void setFlightRecorder(shared_ptr<TFlightRecorder> flightRecorder) {
+    flightRecorder_ = flightRecorder;
+  }
+
+  void setProtocolFactory(shared_ptr<protocol::TProtocolFactory> protocolFactory) {
+    protocolFactory_ = protocolFactory;
+  }
+
+  void setAsyncProcessor(shared_ptr<async::TAsyncProcessor> asyncProcessor) {
+    asyncProcessor_ = asyncProcessor;
+  }
+
   int startServer(int port) {
     shared_ptr<Runner> runner(new Runner);
     runner->port = port;
     runner->processor = processor;
     runner->userEventBase = userEventBase_;
+    runner->threadManager = threadManager_;
+    runner->ioThreadManagers = ioThreadManagers_;
+    runner->ioThreadPlacements = ioThreadPlacements_;
+    runner->headerTransport = headerTransport_;
+    runner->maxInFlight = maxInFlight_;
+    runner->flightRecorder = flightRecorder_;
+    runner->protocolFactory = protocolFactory_;
+    runner->asyncProcessor = asyncProcessor_;
 
     shared_ptr<ThreadFactory> threadFactory(
         new PlatformThreadFactory(
@@ -158,9 +262,19 @@ protected:
     runner->readyBarrier();
 
     server = runner->server;
+    serverSocket = runner->socket;
     return runner->port;
   }
 
+  // Stops the server and lets go of it, so that it is destroyed
+  void stopServer() {
+    server->stop();
+    thread->join();
+    thread.reset();
+    server.reset();
+    serverSocket.reset();
+  }
+
   bool canCommunicate(int serverPort) {
     shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", serverPort));
     socket->open();
@@ -175,8 +289,17 @@ protected:
 private:
   shared_ptr<event_base> userEventBase_;
   shared_ptr<test::ParentServiceProcessor> processor;
+  shared_ptr<ThreadManager> threadManager_;
+  std::vector<shared_ptr<ThreadManager> > ioThreadManagers_;
+  std::vector<ThreadPlacement> ioThreadPlacements_;
+  shared_ptr<TFlightRecorder> flightRecorder_;
+  shared_ptr<protocol::TProtocolFactory> protocolFactory_;
+  shared_ptr<async::TAsyncProcessor> asyncProcessor_;
+  bool headerTransport_;
+  uint32_t maxInFlight_;
 protected:
   shared_ptr<server::TNonblockingServer> server;
+  shared_ptr<transport::TNonblockingServerSocket> serverSocket;
 private:
   shared_ptr<apache::thrift::concurrency::Thread> thread;
 
@@ -216,4 +339,1020 @@ BOOST_FIXTURE_TEST_CASE(provide_event_base, Fixture) {
 #endif
 }
 
+#ifdef THRIFT_TEST_HEADER_TRANSPORT
+struct SlowCall : public Runnable {
+  explicit SlowCall(int port) : port_(port) {}
+
+  void run() {
+    shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port_));
+    socket->open();
+    test::ParentServiceClient client(make_shared<protocol::THeaderProtocol>(socket));
+    std::string data;
+    client.getDataWait(data, 300);
+  }
+
+  int port_;
+};
+
+BOOST_FIXTURE_TEST_CASE(client_deadline_drops_queued_request, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(1);
+  threadManager->threadFactory(make_shared<PlatformThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  setHeaderTransport(true);
+  int port = startServer(0);
+  port = server->getListenPort();
+
+  // Occupy the only worker
+  PlatformThreadFactory factory(false);
+  shared_ptr<Thread> slow = factory.newThread(make_shared<SlowCall>(port));
+  slow->start();
+  THRIFT_SLEEP_USEC(50 * 1000);
+
+  // Queued behind the slow call, this cannot make its 100ms deadline
+  shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port));
+  socket->setRecvTimeout(500);
+  socket->open();
+  shared_ptr<protocol::THeaderProtocol> proto = make_shared<protocol::THeaderProtocol>(socket);
+  test::ParentServiceClient client(proto);
+  proto->setHeader(transport::THeaderTransport::CLIENT_TIMEOUT_HEADER, "100");
+  BOOST_CHECK_THROW(client.addString("late"), transport::TTransportException);
+  slow->join();
+  BOOST_CHECK_EQUAL(server->getNumDeadlineDropped(), 1u);
+
+  // The late request was never processed, and requests without a deadline still are
+  shared_ptr<transport::TSocket> socket2(new transport::TSocket("localhost", port));
+  socket2->open();
+  test::ParentServiceClient client2(make_shared<protocol::THeaderProtocol>(socket2));
+  std::vector<std::string> strings;
+  client2.getStrings(strings);
+  BOOST_CHECK(strings.empty());
+  BOOST_CHECK_EQUAL(server->getNumDeadlineDropped(), 1u);
+}
+#endif
+
+struct BusyClient : public Runnable {
+  BusyClient(int port, int calls) : port_(port), calls_(calls), served_(0), shed_(0) {}
+
+  void run() {
+    shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port_));
+    socket->open();
+    test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(socket)));
+    for (int i = 0; i < calls_; ++i) {
+      try {
+        std::string data;
+        client.getDataWait(data, 10);
+        ++served_;
+      } catch (const TApplicationException&) {
+        ++shed_;
+      }
+    }
+  }
+
+  int port_;
+  int calls_;
+  int served_;
+  int shed_;
+};
+
+BOOST_FIXTURE_TEST_CASE(standing_queue_is_shed, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(1);
+  threadManager->threadFactory(make_shared<PlatformThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  startServer(0);
+  server->setQueueDelayTarget(1, 20);
+  BOOST_CHECK_EQUAL(server->getQueueDelayTarget(), 1);
+  BOOST_CHECK_EQUAL(server->getQueueDelayInterval(), 20);
+
+  // Eight clients keep about 70ms of work queued in front of the only worker
+  PlatformThreadFactory factory(false);
+  std::vector<shared_ptr<BusyClient> > clients;
+  std::vector<shared_ptr<Thread> > threads;
+  for (int i = 0; i < 8; ++i) {
+    clients.push_back(make_shared<BusyClient>(server->getListenPort(), 20));
+    threads.push_back(factory.newThread(clients.back()));
+    threads.back()->start();
+  }
+  int served = 0;
+  int shed = 0;
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->join();
+    served += clients[i]->served_;
+    shed += clients[i]->shed_;
+  }
+
+  // Every call got an answer, and some were turned away
+  BOOST_CHECK_EQUAL(served + shed, 8 * 20);
+  BOOST_CHECK_GT(shed, 0);
+  BOOST_CHECK_GT(served, 0);
+  BOOST_CHECK_EQUAL(server->getNumShed(), static_cast<uint64_t>(shed));
+}
+
+// Sends getDataWait(length) with the given seqid, without waiting for the answer
+static void sendDataWait(protocol::TProtocol* proto, int32_t seqid, int32_t length) {
+  test::ParentService_getDataWait_pargs args;
+  args.length = &length;
+  proto->writeMessageBegin("getDataWait", protocol::T_CALL, seqid);
+  args.write(proto);
+  proto->writeMessageEnd();
+  proto->getTransport()->writeEnd();
+  proto->getTransport()->flush();
+}
+
+// Reads the next response, returning its seqid
+static int32_t receiveSeqid(protocol::TProtocol* proto) {
+  std::string name;
+  protocol::TMessageType type;
+  int32_t seqid;
+  proto->readMessageBegin(name, type, seqid);
+  proto->skip(protocol::T_STRUCT);
+  proto->readMessageEnd();
+  proto->getTransport()->readEnd();
+  BOOST_CHECK_EQUAL(type, protocol::T_REPLY);
+  return seqid;
+}
+
+BOOST_FIXTURE_TEST_CASE(pipelined_responses_out_of_order, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(3);
+  threadManager->threadFactory(make_shared<PlatformThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  setMaxInFlight(2);
+  startServer(0);
+  int port = server->getListenPort();
+
+  shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port));
+  socket->open();
+  shared_ptr<protocol::TProtocol> proto = make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket));
+
+  // The quick call overtakes the slow one
+  sendDataWait(proto.get(), 1, 300);
+  sendDataWait(proto.get(), 2, 0);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 2);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 1);
+
+  // With two slow calls in flight, the third is not read until one is done
+  sendDataWait(proto.get(), 3, 300);
+  sendDataWait(proto.get(), 4, 300);
+  sendDataWait(proto.get(), 5, 0);
+  int32_t first = receiveSeqid(proto.get());
+  int32_t second = receiveSeqid(proto.get());
+  BOOST_CHECK(first != 5 && second != 5);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 5);
+
+  // A client leaving with calls in flight does not disturb the others
+  shared_ptr<transport::TSocket> leaving(new transport::TSocket("localhost", port));
+  leaving->open();
+  shared_ptr<protocol::TProtocol> leavingProto = make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(leaving));
+  sendDataWait(leavingProto.get(), 1, 200);
+  sendDataWait(leavingProto.get(), 2, 200);
+  leaving->close();
+  sendDataWait(proto.get(), 6, 0);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 6);
+  THRIFT_SLEEP_USEC(300 * 1000);
+  sendDataWait(proto.get(), 7, 0);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 7);
+  BOOST_CHECK(canCommunicate(port));
+}
+
+BOOST_FIXTURE_TEST_CASE(in_order_by_default, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(2);
+  threadManager->threadFactory(make_shared<PlatformThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  startServer(0);
+
+  shared_ptr<transport::TSocket> socket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  socket->open();
+  shared_ptr<protocol::TProtocol> proto = make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket));
+  sendDataWait(proto.get(), 1, 100);
+  sendDataWait(proto.get(), 2, 0);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 1);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 2);
+}
+
+// Remembers which thread added each string
+struct ThreadRecordingHandler : public Handler {
+  void addString(const std::string& s) {
+    Guard g(mutex_);
+    threads_.insert(std::make_pair(s, Thread::get_current()));
+  }
+
+  size_t threadsFor(const std::string& s) {
+    Guard g(mutex_);
+    std::set<Thread::id_t> threads;
+    typedef std::multimap<std::string, Thread::id_t>::const_iterator Iter;
+    std::pair<Iter, Iter> range = threads_.equal_range(s);
+    for (Iter i = range.first; i != range.second; ++i) {
+      threads.insert(i->second);
+    }
+    return threads.size();
+  }
+
+  Thread::id_t threadFor(const std::string& s) {
+    Guard g(mutex_);
+    return threads_.find(s)->second;
+  }
+
+  Mutex mutex_;
+  std::multimap<std::string, Thread::id_t> threads_;
+};
+
+BOOST_FIXTURE_TEST_CASE(io_thread_keeps_its_workers, Fixture) {
+  shared_ptr<ThreadRecordingHandler> handler = make_shared<ThreadRecordingHandler>();
+  setHandler(handler);
+  std::vector<shared_ptr<ThreadManager> > threadManagers;
+  std::vector<ThreadPlacement> placements;
+  for (int i = 0; i < 2; ++i) {
+    // Wherever this test may run: the placement itself is not observable here
+    placements.push_back(ThreadPlacement::current());
+    threadManagers.push_back(ThreadManager::newSimpleThreadManager(1));
+    threadManagers.back()->threadFactory(make_shared<AffinityThreadFactory>(
+        make_shared<PlatformThreadFactory>(), placements.back()));
+    threadManagers.back()->start();
+  }
+  setIOThreadManagers(threadManagers, placements);
+  startServer(0);
+  int port = server->getListenPort();
+  BOOST_CHECK(server->getThreadManager() == threadManagers[0]);
+  // IO thread 1 sets up its events on its own, after the server is ready
+  THRIFT_SLEEP_USEC(100 * 1000);
+
+  // Connections go to the IO threads in turn, and each to its own worker
+  const char* names[] = {"first", "second"};
+  std::vector<shared_ptr<test::ParentServiceClient> > clients;
+  for (int i = 0; i < 2; ++i) {
+    shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port));
+    socket->open();
+    clients.push_back(make_shared<test::ParentServiceClient>(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(socket))));
+  }
+  for (int n = 0; n < 3; ++n) {
+    for (int i = 0; i < 2; ++i) {
+      clients[i]->addString(names[i]);
+    }
+  }
+  BOOST_CHECK_EQUAL(handler->threadsFor("first"), 1u);
+  BOOST_CHECK_EQUAL(handler->threadsFor("second"), 1u);
+  BOOST_CHECK(!(handler->threadFor("first") == handler->threadFor("second")));
+}
+
+BOOST_AUTO_TEST_CASE(null_thread_manager_rejected) {
+  server::TNonblockingServer server(
+      make_shared<test::ParentServiceProcessor>(make_shared<Handler>()),
+      make_shared<transport::TNonblockingServerSocket>(0));
+  std::vector<shared_ptr<ThreadManager> > threadManagers;
+  threadManagers.push_back(ThreadManager::newSimpleThreadManager(1));
+  threadManagers.push_back(shared_ptr<ThreadManager>());
+  BOOST_CHECK_THROW(server.setThreadManagers(threadManagers),
+                    apache::thrift::concurrency::InvalidArgumentException);
+  BOOST_CHECK(!server.getThreadManager());
+  BOOST_CHECK(!server.isThreadPoolProcessing());
+}
+
+#ifndef _WIN32
+struct ServeRunner : public Runnable {
+  ServeRunner(const shared_ptr<server::TNonblockingServer>& server) : server_(server) {}
+  void run() { server_->serve(); }
+  shared_ptr<server::TNonblockingServer> server_;
+};
+
+BOOST_FIXTURE_TEST_CASE(drain_and_hand_off, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(1);
+  threadManager->threadFactory(make_shared<PlatformThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  startServer(0);
+  int port = server->getListenPort();
+
+  shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port));
+  socket->setRecvTimeout(2000);
+  socket->open();
+  shared_ptr<protocol::TProtocol> proto = make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket));
+  sendDataWait(proto.get(), 1, 200);
+  THRIFT_SLEEP_USEC(50 * 1000);
+
+  // The successor adopts the listening socket and starts serving on it
+  THRIFT_SOCKET sv[2];
+  BOOST_REQUIRE_EQUAL(0, THRIFT_SOCKETPAIR(AF_LOCAL, SOCK_STREAM, 0, sv));
+  serverSocket->handOff(sv[0]);
+  shared_ptr<transport::TNonblockingServerSocket> nextSocket(
+      new transport::TNonblockingServerSocket(0));
+  nextSocket->adopt(transport::TSocketHandoff::receive(sv[1]));
+  ::THRIFT_CLOSESOCKET(sv[0]);
+  ::THRIFT_CLOSESOCKET(sv[1]);
+  BOOST_CHECK_EQUAL(nextSocket->getListenPort(), port);
+
+  shared_ptr<server::TNonblockingServer> next(new server::TNonblockingServer(
+      make_shared<test::ParentServiceProcessor>(make_shared<Handler>()), nextSocket));
+  shared_ptr<Thread> nextThread
+      = PlatformThreadFactory(false).newThread(make_shared<ServeRunner>(next));
+  nextThread->start();
+
+  // The request in progress is still answered
+  BOOST_CHECK(server->drain(2000));
+  BOOST_CHECK_EQUAL(server->getNumActiveProcessors(), 0u);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 1);
+
+  // New clients reach the successor
+  BOOST_CHECK(canCommunicate(port));
+
+  next->stop();
+  nextThread->join();
+}
+#endif
+
+// Requests are recorded once their response has been written
+static void waitForRecords(const TFlightRecorder& recorder, uint64_t count) {
+  for (int i = 0; i < 200 && recorder.getRecordedCount() < count; ++i) {
+    THRIFT_SLEEP_USEC(10 * 1000);
+  }
+  BOOST_REQUIRE_EQUAL(recorder.getRecordedCount(), count);
+}
+
+// Every phase from the first byte on was reached, in order
+static void checkTimeline(const TFlightRecorder::Record& record) {
+  for (int p = TFlightRecorder::FIRST_BYTE; p < TFlightRecorder::NUM_PHASES; ++p) {
+    BOOST_CHECK_MESSAGE(record.time[p] != 0,
+                        TFlightRecorder::phaseName(static_cast<TFlightRecorder::Phase>(p)));
+    BOOST_CHECK(record.time[p] >= record.time[p - 1]);
+  }
+}
+
+BOOST_FIXTURE_TEST_CASE(flight_recorder_captures_slow_requests, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(1);
+  threadManager->threadFactory(make_shared<PlatformThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  shared_ptr<TFlightRecorder> recorder(new TFlightRecorder());
+  recorder->setSlowThreshold(50000);
+  setFlightRecorder(recorder);
+  startServer(0);
+
+  shared_ptr<transport::TSocket> socket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  socket->open();
+  shared_ptr<protocol::TProtocol> proto = make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket));
+  sendDataWait(proto.get(), 1, 0);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 1);
+  sendDataWait(proto.get(), 2, 100);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 2);
+  waitForRecords(*recorder, 2);
+
+  std::vector<TFlightRecorder::Record> records;
+  recorder->recent(records);
+  BOOST_REQUIRE_EQUAL(records.size(), 2u);
+  // Only the first request of a connection has it accepted
+  BOOST_CHECK(records[0].time[TFlightRecorder::ACCEPTED] != 0);
+  BOOST_CHECK_EQUAL(records[1].time[TFlightRecorder::ACCEPTED], 0);
+  checkTimeline(records[0]);
+  checkTimeline(records[1]);
+
+  // The slow one was captured, with its time spent in the handler
+  recorder->slow(records);
+  BOOST_REQUIRE_EQUAL(records.size(), 1u);
+  BOOST_CHECK(records[0].duration() >= 100000);
+  BOOST_CHECK(records[0].time[TFlightRecorder::HANDLER_DONE]
+                  - records[0].time[TFlightRecorder::DEQUEUED]
+              >= 100000);
+}
+
+BOOST_FIXTURE_TEST_CASE(flight_recorder_pipelined, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(2);
+  threadManager->threadFactory(make_shared<PlatformThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  setMaxInFlight(2);
+  shared_ptr<TFlightRecorder> recorder(new TFlightRecorder());
+  setFlightRecorder(recorder);
+  startServer(0);
+
+  shared_ptr<transport::TSocket> socket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  socket->open();
+  shared_ptr<protocol::TProtocol> proto = make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket));
+  sendDataWait(proto.get(), 1, 100);
+  sendDataWait(proto.get(), 2, 0);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 2);
+  BOOST_CHECK_EQUAL(receiveSeqid(proto.get()), 1);
+  waitForRecords(*recorder, 2);
+
+  // Each request kept its own timeline; the quick one finished first
+  std::vector<TFlightRecorder::Record> records;
+  recorder->recent(records);
+  BOOST_REQUIRE_EQUAL(records.size(), 2u);
+  checkTimeline(records[0]);
+  checkTimeline(records[1]);
+  BOOST_CHECK(records[0].duration() < records[1].duration());
+  BOOST_CHECK(records[1].time[TFlightRecorder::FIRST_BYTE]
+              <= records[0].time[TFlightRecorder::FIRST_BYTE]);
+}
+
+// Calls getDataWait over a cob client and notes which call completed, or
+// failed, in turn
+struct AsyncCalls {
+  AsyncCalls(event_base* base, size_t expected) : base_(base), expected_(expected) {}
+
+  struct Done {
+    Done(AsyncCalls* calls, int id) : calls_(calls), id_(id) {}
+
+    void operator()(test::ParentServiceCobClient* client) {
+      std::string data;
+      try {
+        client->recv_getDataWait(data);
+        calls_->done(id_);
+      } catch (const TException&) {
+        calls_->done(-id_);
+      }
+    }
+
+    AsyncCalls* calls_;
+    int id_;
+  };
+
+  void call(test::ParentServiceCobClient& client, int id, int32_t length) {
+    client.getDataWait(Done(this, id), length);
+  }
+
+  void done(int id) {
+    completed_.push_back(id);
+    if (completed_.size() == expected_) {
+      event_base_loopbreak(base_);
+    }
+  }
+
+  event_base* base_;
+  size_t expected_;
+  std::vector<int> completed_;
+};
+
+BOOST_FIXTURE_TEST_CASE(framed_async_channel_matches_responses, Fixture) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(3);
+  threadManager->threadFactory(make_shared<PlatformThreadFactory>());
+  threadManager->start();
+  setThreadManager(threadManager);
+  setMaxInFlight(3);
+  startServer(0);
+
+  shared_ptr<event_base> base(event_base_new(), event_base_free);
+  shared_ptr<TFramedAsyncChannel> channel(
+      new TFramedAsyncChannel("localhost", server->getListenPort(), base.get()));
+  protocol::TBinaryProtocolFactory protocolFactory;
+  test::ParentServiceCobClient slow(channel, &protocolFactory);
+  test::ParentServiceCobClient quick(channel, &protocolFactory);
+  test::ParentServiceCobClient quicker(channel, &protocolFactory);
+
+  // All three go out on the one connection; the responses overtake each
+  // other and still reach the right client
+  AsyncCalls calls(base.get(), 3);
+  calls.call(slow, 1, 300);
+  calls.call(quick, 2, 100);
+  calls.call(quicker, 3, 0);
+  BOOST_CHECK_EQUAL(channel->getOutstandingCount(), 3u);
+  event_base_dispatch(base.get());
+
+  BOOST_REQUIRE_EQUAL(calls.completed_.size(), 3u);
+  BOOST_CHECK_EQUAL(calls.completed_[0], 3);
+  BOOST_CHECK_EQUAL(calls.completed_[1], 2);
+  BOOST_CHECK_EQUAL(calls.completed_[2], 1);
+  BOOST_CHECK_EQUAL(channel->getOutstandingCount(), 0u);
+  BOOST_CHECK(channel->good());
+}
+
+// Issues the next call from the callback of the previous one
+struct ChainedCalls {
+  ChainedCalls(test::ParentServiceCobClient& client, event_base* base, int count)
+    : client_(client), base_(base), count_(count), succeeded_(0) {}
+
+  void done(test::ParentServiceCobClient* client) {
+    std::string data;
+    try {
+      client->recv_getDataWait(data);
+      ++succeeded_;
+    } catch (const TException&) {
+    }
+    next();
+  }
+
+  void next() {
+    if (--count_ < 0) {
+      event_base_loopbreak(base_);
+      return;
+    }
+    client_.getDataWait(stdcxx::bind(&ChainedCalls::done, this, stdcxx::placeholders::_1), 0);
+  }
+
+  test::ParentServiceCobClient& client_;
+  event_base* base_;
+  int count_;
+  int succeeded_;
+};
+
+BOOST_FIXTURE_TEST_CASE(framed_async_channel_compact, Fixture) {
+  shared_ptr<protocol::TProtocolFactory> protocolFactory(new protocol::TCompactProtocolFactory());
+  setProtocolFactory(protocolFactory);
+  startServer(0);
+
+  shared_ptr<event_base> base(event_base_new(), event_base_free);
+  shared_ptr<TFramedAsyncChannel> channel(
+      new TFramedAsyncChannel("localhost", server->getListenPort(), base.get()));
+  test::ParentServiceCobClient client(channel, protocolFactory.get());
+
+  // Past 127 the sequence id the channel sends takes a longer varint than
+  // the one the client wrote
+  ChainedCalls calls(client, base.get(), 200);
+  calls.next();
+  event_base_dispatch(base.get());
+  BOOST_CHECK_EQUAL(calls.succeeded_, 200);
+  BOOST_CHECK(channel->good());
+}
+
+BOOST_FIXTURE_TEST_CASE(framed_async_channel_timeouts, Fixture) {
+  startServer(0);
+  int port = server->getListenPort();
+
+  shared_ptr<event_base> base(event_base_new(), event_base_free);
+  shared_ptr<TFramedAsyncChannel> channel(
+      new TFramedAsyncChannel("localhost", port, base.get()));
+  protocol::TBinaryProtocolFactory protocolFactory;
+  test::ParentServiceCobClient client(channel, &protocolFactory);
+
+  // The first call gives up early, and the channel stays usable; its
+  // response comes late and is dropped
+  channel->setRecvTimeout(100);
+  AsyncCalls calls(base.get(), 1);
+  calls.call(client, 1, 400);
+  event_base_dispatch(base.get());
+  BOOST_REQUIRE_EQUAL(calls.completed_.size(), 1u);
+  BOOST_CHECK_EQUAL(calls.completed_[0], -1);
+  BOOST_CHECK(channel->good());
+  BOOST_CHECK(!channel->timedOut());
+
+  channel->setRecvTimeout(2000);
+  calls.expected_ = 2;
+  calls.call(client, 2, 0);
+  event_base_dispatch(base.get());
+  BOOST_REQUIRE_EQUAL(calls.completed_.size(), 2u);
+  BOOST_CHECK_EQUAL(calls.completed_[1], 2);
+  BOOST_CHECK_EQUAL(channel->getOutstandingCount(), 0u);
+
+}
+
+BOOST_AUTO_TEST_CASE(framed_async_channel_connection_lost) {
+  transport::TServerSocket listener("localhost", 0);
+  listener.listen();
+
+  shared_ptr<event_base> base(event_base_new(), event_base_free);
+  shared_ptr<TFramedAsyncChannel> channel(
+      new TFramedAsyncChannel("localhost", listener.getPort(), base.get()));
+  protocol::TBinaryProtocolFactory protocolFactory;
+  test::ParentServiceCobClient first(channel, &protocolFactory);
+  test::ParentServiceCobClient second(channel, &protocolFactory);
+
+  // Outstanding calls fail once the connection is gone, and so do later ones
+  AsyncCalls calls(base.get(), 2);
+  calls.call(first, 1, 0);
+  calls.call(second, 2, 0);
+  listener.accept()->close();
+  event_base_dispatch(base.get());
+  BOOST_REQUIRE_EQUAL(calls.completed_.size(), 2u);
+  BOOST_CHECK_EQUAL(calls.completed_[0], -1);
+  BOOST_CHECK_EQUAL(calls.completed_[1], -2);
+  BOOST_CHECK(channel->error());
+  BOOST_CHECK(!channel->good());
+  BOOST_CHECK_THROW(calls.call(first, 3, 0), transport::TTransportException);
+}
+
+// A cob style handler whose getDataWait() waits until completeAll() is
+// called, from any thread; everything else completes right away
+struct DeferringHandler : public test::ParentServiceCobSvIf {
+  typedef stdcxx::function<void(std::string const&)> DataCob;
+
+  DeferringHandler() : monitor_(&mutex_) {}
+
+  void getDataWait(DataCob cob, const int32_t length) {
+    if (length == 0) {
+      cob(std::string());
+      return;
+    }
+    Synchronized s(monitor_);
+    pending_.push_back(std::make_pair(cob, length));
+    monitor_.notifyAll();
+  }
+
+  void waitForPending(size_t count) {
+    Synchronized s(monitor_);
+    while (pending_.size() < count) {
+      monitor_.wait();
+    }
+  }
+
+  // Lets go of the waiting calls without completing them
+  void dropAll() {
+    Synchronized s(monitor_);
+    pending_.clear();
+  }
+
+  // Completes the waiting calls, last first
+  void completeAll() {
+    std::vector<std::pair<DataCob, int32_t> > pending;
+    {
+      Synchronized s(monitor_);
+      pending.swap(pending_);
+    }
+    while (!pending.empty()) {
+      pending.back().first(std::string(pending.back().second, 'x'));
+      pending.pop_back();
+    }
+  }
+
+  void exceptionWait(stdcxx::function<void()>,
+                     stdcxx::function<void(TDelayedException*)> exn_cob,
+                     const std::string& message) {
+    test::MyError e;
+    e.message = message;
+    exn_cob(TDelayedException::delayException(e));
+  }
+
+  void unexpectedExceptionWait(stdcxx::function<void()>, const std::string& message) {
+    throw std::runtime_error(message);
+  }
+
+  void incrementGeneration(stdcxx::function<void(int32_t const&)> cob) { cob(0); }
+  void getGeneration(stdcxx::function<void(int32_t const&)> cob) { cob(0); }
+  void addString(stdcxx::function<void()> cob, const std::string&) { cob(); }
+  void getStrings(stdcxx::function<void(std::vector<std::string> const&)> cob) {
+    cob(std::vector<std::string>());
+  }
+  void onewayWait(stdcxx::function<void()> cob) { cob(); }
+
+  Mutex mutex_;
+  Monitor monitor_;
+  std::vector<std::pair<DataCob, int32_t> > pending_;
+};
+
+// Stands in for a backend that answers a batch of calls from its own thread
+struct Backend : public Runnable {
+  Backend(shared_ptr<DeferringHandler> handler, size_t count) : handler_(handler), count_(count) {}
+
+  void run() {
+    handler_->waitForPending(count_);
+    handler_->completeAll();
+  }
+
+  shared_ptr<DeferringHandler> handler_;
+  size_t count_;
+};
+
+BOOST_FIXTURE_TEST_CASE(async_processor_without_workers, Fixture) {
+  const int CALLS = 500;
+  shared_ptr<DeferringHandler> handler(new DeferringHandler);
+  setAsyncProcessor(make_shared<test::ParentServiceAsyncProcessor>(handler));
+  setMaxInFlight(CALLS + 1);
+  startServer(0);
+  BOOST_CHECK(server->isAsyncProcessing());
+  BOOST_CHECK(!server->isThreadPoolProcessing());
+
+  shared_ptr<event_base> base(event_base_new(), event_base_free);
+  shared_ptr<TFramedAsyncChannel> channel(
+      new TFramedAsyncChannel("localhost", server->getListenPort(), base.get()));
+  channel->setRecvTimeout(10000);
+  protocol::TBinaryProtocolFactory protocolFactory;
+  test::ParentServiceCobClient client(channel, &protocolFactory);
+
+  // All the calls wait on the backend at once, on the one IO thread; one
+  // more completes while the processor is called
+  shared_ptr<Thread> backend = PlatformThreadFactory(false).newThread(
+      make_shared<Backend>(handler, CALLS));
+  backend->start();
+  AsyncCalls calls(base.get(), CALLS + 1);
+  for (int i = 1; i <= CALLS; ++i) {
+    calls.call(client, i, 10);
+  }
+  calls.call(client, CALLS + 1, 0);
+  event_base_dispatch(base.get());
+  backend->join();
+
+  BOOST_REQUIRE_EQUAL(calls.completed_.size(), static_cast<size_t>(CALLS + 1));
+  // The backend's answers went out in the order it gave them
+  int previous = CALLS + 1;
+  for (size_t i = 0; i < calls.completed_.size(); ++i) {
+    BOOST_REQUIRE(calls.completed_[i] > 0);
+    if (calls.completed_[i] <= CALLS) {
+      BOOST_CHECK_EQUAL(calls.completed_[i], previous - 1);
+      previous = calls.completed_[i];
+    }
+  }
+  BOOST_CHECK_EQUAL(previous, 1);
+  BOOST_CHECK(channel->good());
+}
+
+BOOST_FIXTURE_TEST_CASE(async_processor_exceptions, Fixture) {
+  setAsyncProcessor(make_shared<test::ParentServiceAsyncProcessor>(
+      make_shared<DeferringHandler>()));
+  startServer(0);
+
+  shared_ptr<transport::TSocket> socket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  socket->open();
+  test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket)));
+
+  // A declared exception is the response
+  BOOST_CHECK_THROW(client.exceptionWait("declared"), test::MyError);
+  std::string data;
+  client.getDataWait(data, 0);
+
+  // A processor that throws loses its connection
+  BOOST_CHECK_THROW(client.unexpectedExceptionWait("undeclared"), transport::TTransportException);
+}
+
+BOOST_FIXTURE_TEST_CASE(async_processor_drops_call, Fixture) {
+  shared_ptr<DeferringHandler> handler(new DeferringHandler);
+  setAsyncProcessor(make_shared<test::ParentServiceAsyncProcessor>(handler));
+  startServer(0);
+
+  shared_ptr<transport::TSocket> socket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  socket->setRecvTimeout(10000);
+  socket->open();
+  test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket)));
+
+  // A call the handler never completes closes the connection instead of
+  // leaving the client waiting
+  client.send_getDataWait(5);
+  handler->waitForPending(1);
+  handler->dropAll();
+  std::string data;
+  BOOST_CHECK_THROW(client.recv_getDataWait(data), transport::TTransportException);
+  BOOST_CHECK_EQUAL(server->getNumActiveProcessors(), 0u);
+}
+
+BOOST_FIXTURE_TEST_CASE(async_processor_completes_after_server_is_gone, Fixture) {
+  shared_ptr<DeferringHandler> handler(new DeferringHandler);
+  setAsyncProcessor(make_shared<test::ParentServiceAsyncProcessor>(handler));
+  startServer(0);
+
+  shared_ptr<transport::TSocket> socket(
+      new transport::TSocket("localhost", server->getListenPort()));
+  socket->open();
+  test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+      make_shared<transport::TFramedTransport>(socket)));
+  client.send_getDataWait(5);
+  handler->waitForPending(1);
+
+  // The call failed when the server went, and completing it does nothing
+  stopServer();
+  handler->completeAll();
+}
+
+BOOST_AUTO_TEST_CASE(codel_sheds_only_standing_queue) {
+  TCoDel codel(5000, 100000);
+  int64_t now = 1000000;
+
+  // Short delays never lead to shedding
+  for (int i = 0; i < 100; ++i, now += 10000) {
+    BOOST_CHECK(!codel.shouldShed(1000, now));
+  }
+  BOOST_CHECK(!codel.isOverloaded());
+
+  // One slow request is not a standing queue
+  BOOST_CHECK(!codel.shouldShed(50000, now));
+  now += 10000;
+  BOOST_CHECK(!codel.shouldShed(1000, now));
+
+  // Every request delayed for a whole interval is
+  for (int i = 0; i < 30; ++i, now += 10000) {
+    codel.shouldShed(20000, now);
+  }
+  BOOST_CHECK(codel.isOverloaded());
+  BOOST_CHECK(codel.shouldShed(20000, now));
+  BOOST_CHECK(!codel.shouldShed(8000, now));
+
+  // Once the queue drains the overload ends at the next interval
+  for (int i = 0; i < 30; ++i, now += 10000) {
+    codel.shouldShed(1000, now);
+  }
+  BOOST_CHECK(!codel.isOverloaded());
+  BOOST_CHECK(!codel.shouldShed(20000, now));
+}
+
+BOOST_AUTO_TEST_CASE(header_lookup_in_raw_frame) {
+  // A header format frame, without the frame size, carrying two info headers
+  const uint8_t frame[] = {
+    0x0f, 0xff, 0x00, 0x00,             // magic, flags
+    0x00, 0x00, 0x00, 0x01,             // sequence id
+    0x00, 0x08,                         // header size in words
+    0x00, 0x00,                         // protocol id, no transforms
+    0x01, 0x02,                         // key-value headers, two of them
+    0x05, 'o', 't', 'h', 'e', 'r', 0x01, 'x',
+    0x0e, 'c', 'l', 'i', 'e', 'n', 't', '_', 't', 'i', 'm', 'e', 'o', 'u', 't',
+    0x03, '2', '5', '0',
+    0x00,                               // padding
+    0x80, 0x01, 0x00, 0x01              // payload
+  };
+  const uint32_t sz = sizeof(frame);
+  BOOST_REQUIRE_EQUAL(sz, 10u + 8u * 4u + 4u);
+
+  std::string value;
+  BOOST_REQUIRE(transport::THeaderTransport::findHeader(frame,
+                                                        sz,
+                                                        transport::THeaderTransport::
+                                                            CLIENT_TIMEOUT_HEADER,
+                                                        value));
+  BOOST_CHECK_EQUAL(value, "250");
+  BOOST_REQUIRE(transport::THeaderTransport::findHeader(frame, sz, "other", value));
+  BOOST_CHECK_EQUAL(value, "x");
+  BOOST_CHECK(!transport::THeaderTransport::findHeader(frame, sz, "missing", value));
+
+  // Truncated or non-header frames are rejected rather than overrun
+  BOOST_CHECK(!transport::THeaderTransport::findHeader(frame, 20, "other", value));
+  BOOST_CHECK(!transport::THeaderTransport::findHeader(frame + 4, sz - 4, "other", value));
+}
+
+BOOST_AUTO_TEST_CASE(method_classifier) {
+  // A binary protocol call of "ping", as framed by TFramedTransport
+  const uint8_t call[] = {
+    0x80, 0x01, 0x00, 0x01,             // version, call
+    0x00, 0x00, 0x00, 0x04, 'p', 'i', 'n', 'g',
+    0x00, 0x00, 0x00, 0x01              // sequence id
+  };
+  // The same call in a header format frame with an info header
+  const uint8_t headerCall[] = {
+    0x0f, 0xff, 0x00, 0x00,             // magic, flags
+    0x00, 0x00, 0x00, 0x01,             // sequence id
+    0x00, 0x08,                         // header size in words
+    0x00, 0x00,                         // binary protocol, no transforms
+    0x01, 0x02,                         // key-value headers, two of them
+    0x06, 't', 'e', 'n', 'a', 'n', 't', 0x01, 'x',
+    0x0e, 'c', 'l', 'i', 'e', 'n', 't', '_', 't', 'i', 'm', 'e', 'o', 'u', 't',
+    0x03, '2', '5', '0',
+    0x80, 0x01, 0x00, 0x01,
+    0x00, 0x00, 0x00, 0x04, 'p', 'i', 'n', 'g',
+    0x00, 0x00, 0x00, 0x01
+  };
+  shared_ptr<protocol::TProtocolFactory> binary(new protocol::TBinaryProtocolFactory);
+
+  TRequestInfo plain(call, sizeof(call), false, binary);
+  BOOST_CHECK_EQUAL(plain.method(), "ping");
+  TRequestInfo header(headerCall, sizeof(headerCall), true, binary);
+  BOOST_CHECK_EQUAL(header.method(), "ping");
+  std::string value;
+  BOOST_REQUIRE(header.header("tenant", value));
+  BOOST_CHECK_EQUAL(value, "x");
+  BOOST_CHECK(!plain.header("tenant", value));
+
+  TMethodClassifier classifier(ThreadManager::LOW_PRIORITY);
+  classifier.setPriority("ping", ThreadManager::HIGH_PRIORITY);
+  classifier.setKeyHeader("tenant");
+  ThreadManager::TaskClass taskClass = classifier.classify(plain);
+  BOOST_CHECK_EQUAL(taskClass.priority, ThreadManager::HIGH_PRIORITY);
+  BOOST_CHECK_EQUAL(taskClass.key, 0u);
+  taskClass = classifier.classify(header);
+  BOOST_CHECK_EQUAL(taskClass.priority, ThreadManager::HIGH_PRIORITY);
+  BOOST_CHECK(taskClass.key != 0u);
+
+  // Compact and old binary calls are read without a protocol as well
+  const uint8_t compactCall[] = {
+    0x82, 0x21,                         // protocol id, version and call
+    0x01, 0x04, 'p', 'i', 'n', 'g'      // sequence id, name
+  };
+  const uint8_t oldBinaryCall[] = {
+    0x00, 0x00, 0x00, 0x04, 'p', 'i', 'n', 'g',
+    0x01, 0x00, 0x00, 0x00, 0x01        // call, sequence id
+  };
+  TRequestInfo compact(compactCall, sizeof(compactCall), false, binary);
+  BOOST_CHECK_EQUAL(compact.method(), "ping");
+  TRequestInfo oldBinary(oldBinaryCall, sizeof(oldBinaryCall), false, binary);
+  BOOST_CHECK_EQUAL(oldBinary.method(), "ping");
+
+  // Unknown methods and unreadable frames fall into the default lane
+  TRequestInfo truncated(call, 6, false, binary);
+  BOOST_CHECK_EQUAL(truncated.method(), "");
+  TRequestInfo truncatedName(call, 10, false, binary);
+  BOOST_CHECK_EQUAL(truncatedName.method(), "");
+  TRequestInfo truncatedCompact(compactCall, 5, false, binary);
+  BOOST_CHECK_EQUAL(truncatedCompact.method(), "");
+  BOOST_CHECK_EQUAL(classifier.classify(truncated).priority, ThreadManager::LOW_PRIORITY);
+}
+
+// Gives every shard a processor with a handler of its own
+struct ShardProcessorFactory : public TProcessorFactory {
+  ShardProcessorFactory() : created(0) {}
+
+  shared_ptr<TProcessor> getProcessor(const TConnectionInfo&) {
+    Guard g(mutex);
+    ++created;
+    return make_shared<test::ParentServiceProcessor>(make_shared<Handler>());
+  }
+
+  Mutex mutex;
+  int created;
+};
+
+struct ShardsReady : public TServerEventHandler {
+  ShardsReady() : started(0) {}
+
+  void preServe() /* override */ {
+    Synchronized s(monitor);
+    ++started;
+    monitor.notifyAll();
+  }
+
+  Monitor monitor;
+  size_t started;
+};
+
+BOOST_AUTO_TEST_CASE(thread_per_core_server) {
+  shared_ptr<ShardProcessorFactory> factory(new ShardProcessorFactory);
+  shared_ptr<server::TThreadPerCoreServer> server(new server::TThreadPerCoreServer(factory, 0));
+  server->setNumShards(2);
+  shared_ptr<ShardsReady> ready(new ShardsReady);
+  server->setServerEventHandler(ready);
+  BOOST_CHECK_EQUAL(server->getNumShards(), 2u);
+
+  PlatformThreadFactory threadFactory(false);
+  shared_ptr<Thread> thread = threadFactory.newThread(server);
+  thread->start();
+  {
+    Synchronized s(ready->monitor);
+    while (ready->started < 2) {
+      ready->monitor.wait();
+    }
+  }
+  int port = server->getListenPort();
+  BOOST_REQUIRE_NE(port, 0);
+  BOOST_CHECK_EQUAL(factory->created, 2);
+  BOOST_CHECK(server->getShard(1));
+
+  // Connections land on either shard, which keeps its own handler state
+  for (size_t i = 0; i < 8; ++i) {
+    shared_ptr<transport::TSocket> socket(new transport::TSocket("localhost", port));
+    socket->open();
+    test::ParentServiceClient client(make_shared<protocol::TBinaryProtocol>(
+        make_shared<transport::TFramedTransport>(socket)));
+    client.addString("foo");
+    std::vector<std::string> strings;
+    client.getStrings(strings);
+    BOOST_CHECK_GE(strings.size(), 1u);
+    BOOST_CHECK_LE(strings.size(), i + 1);
+  }
+
+  server->stop();
+  thread->join();
+}
+
+BOOST_AUTO_TEST_CASE(thread_per_core_server_stopped_before_serve) {
+  shared_ptr<ShardProcessorFactory> factory(new ShardProcessorFactory);
+  server::TThreadPerCoreServer server(factory, 0);
+  server.setNumShards(2);
+
+  // The stop is not lost, and serve() returns without binding anything
+  server.stop();
+  server.serve();
+  BOOST_CHECK_EQUAL(factory->created, 0);
+  BOOST_CHECK(!server.getShard(0));
+}
+
+// Fails to create its second shard
+class FailingShardServer : public server::TThreadPerCoreServer {
+public:
+  FailingShardServer(const shared_ptr<TProcessorFactory>& factory)
+    : server::TThreadPerCoreServer(factory, 0) {}
+
+protected:
+  shared_ptr<server::TNonblockingServer> createShard(
+      size_t shard,
+      const shared_ptr<transport::TNonblockingServerSocket>& socket) {
+    if (shard == 1) {
+      throw transport::TTransportException("no second shard");
+    }
+    return server::TThreadPerCoreServer::createShard(shard, socket);
+  }
+};
+
+BOOST_AUTO_TEST_CASE(thread_per_core_server_closes_shards_on_failure) {
+  FailingShardServer server(shared_ptr<TProcessorFactory>(new ShardProcessorFactory));
+  server.setNumShards(2);
+  BOOST_CHECK_THROW(server.serve(), transport::TTransportException);
+  int port = server.getListenPort();
+  BOOST_REQUIRE_NE(port, 0);
+
+  // The first shard let go of the port, so a socket without SO_REUSEPORT
+  // can take it
+  transport::TServerSocket socket(port);
+  BOOST_CHECK_NO_THROW(socket.listen());
+  socket.close();
+}
+
 BOOST_AUTO_TEST_SUITE_END()
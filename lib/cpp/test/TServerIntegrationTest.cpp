@@ -24,6 +24,8 @@
 #include <boost/foreach.hpp>
 #include <boost/format.hpp>
 #include <boost/thread.hpp>
+#include <thrift/server/TElasticServer.h>
+#include <thrift/server/TFlightRecorder.h>
 #include <thrift/server/TSimpleServer.h>
 #include <thrift/server/TThreadPoolServer.h>
 #include <thrift/server/TThreadedServer.h>
@@ -31,6 +33,7 @@
 #include <thrift/protocol/TBinaryProtocol.h>
 #include <thrift/transport/TServerSocket.h>
 #include <thrift/transport/TSocket.h>
+#include <thrift/transport/TSocketHandoff.h>
 #include <thrift/transport/TTransport.h>
 #include "gen-cpp/ParentService.h"
 #include <string>
@@ -47,9 +50,12 @@ using apache::thrift::protocol::TProtocolFactory;
 using apache::thrift::transport::TServerSocket;
 using apache::thrift::transport::TServerTransport;
 using apache::thrift::transport::TSocket;
+using apache::thrift::transport::TSocketHandoff;
 using apache::thrift::transport::TTransport;
 using apache::thrift::transport::TTransportException;
 using apache::thrift::transport::TTransportFactory;
+using apache::thrift::server::TElasticServer;
+using apache::thrift::server::TFlightRecorder;
 using apache::thrift::server::TServer;
 using apache::thrift::server::TServerEventHandler;
 using apache::thrift::server::TSimpleServer;
@@ -426,6 +432,72 @@ BOOST_FIXTURE_TEST_CASE(test_threadpool_stress,
   stress(10, boost::posix_time::seconds(3));
 }
 
+BOOST_FIXTURE_TEST_CASE(test_elastic_factory,
+                        TServerIntegrationProcessorFactoryTestFixture<TElasticServer>) {
+  // idle clients are parked, not given a worker each
+  pServer->setMaxWorkers(2);
+  baseline(10, 10, "factory");
+  BOOST_CHECK_EQUAL(0u, pServer->getWorkerCount());
+}
+
+BOOST_FIXTURE_TEST_CASE(test_elastic, TServerIntegrationProcessorTestFixture<TElasticServer>) {
+  pServer->setMaxWorkers(2);
+  baseline(10, 10, "processor");
+}
+
+BOOST_FIXTURE_TEST_CASE(test_elastic_bound,
+                        TServerIntegrationProcessorTestFixture<TElasticServer>) {
+  pServer->setConcurrentClientLimit(4);
+  baseline(10, 4, "limit by server framework");
+}
+
+BOOST_FIXTURE_TEST_CASE(test_elastic_stress,
+                        TServerIntegrationProcessorTestFixture<TElasticServer>) {
+  pServer->setMaxWorkers(4);
+  stress(10, boost::posix_time::seconds(3));
+}
+
+BOOST_AUTO_TEST_SUITE_END()
+
+BOOST_FIXTURE_TEST_SUITE(TElasticServerTest,
+                         TServerIntegrationProcessorTestFixture<TElasticServer>)
+
+BOOST_AUTO_TEST_CASE(test_idle_clients_share_workers) {
+  pServer->setMinWorkers(1);
+  pServer->setMaxWorkers(3);
+  pServer->setIdleTimeout(20);
+  startServer();
+
+  std::vector<shared_ptr<TSocket> > sockets;
+  std::vector<shared_ptr<ParentServiceClient> > clients;
+  for (int i = 0; i < 50; ++i) {
+    shared_ptr<TSocket> pClientSock(new TSocket("localhost", getServerPort()), autoSocketCloser);
+    pClientSock->open();
+    sockets.push_back(pClientSock);
+    clients.push_back(make_shared<ParentServiceClient>(make_shared<TBinaryProtocol>(pClientSock)));
+    BOOST_CHECK_EQUAL(i + 1, clients.back()->incrementGeneration());
+  }
+  BOOST_CHECK_EQUAL(50, pServer->getConcurrentClientCount());
+  BOOST_CHECK_LE(pServer->getWorkerCount(), 3u);
+
+  // workers above the minimum go away once idle
+  for (int i = 0; i < 100 && pServer->getWorkerCount() > 1; ++i) {
+    boost::this_thread::sleep(milliseconds(10));
+  }
+  BOOST_CHECK_EQUAL(1u, pServer->getWorkerCount());
+
+  // parked clients are still served, in any order
+  for (int i = 49; i >= 0; --i) {
+    BOOST_CHECK_EQUAL(100 - i, clients[i]->incrementGeneration());
+  }
+
+  // stopping the server disconnects the parked clients
+  stopServer();
+  uint8_t buf[1];
+  BOOST_CHECK_EQUAL(0, sockets[0]->read(&buf[0], 1));
+  BOOST_CHECK_EQUAL(0u, pServer->getWorkerCount());
+}
+
 BOOST_AUTO_TEST_SUITE_END()
 
 BOOST_FIXTURE_TEST_SUITE(TServerIntegrationTest,
@@ -533,4 +605,112 @@ BOOST_AUTO_TEST_CASE(test_concurrent_client_limit) {
   t2.join();
 }
 
+BOOST_AUTO_TEST_CASE(test_flight_recorder) {
+  shared_ptr<TFlightRecorder> recorder(new TFlightRecorder());
+  pServer->setFlightRecorder(recorder);
+  startServer();
+
+  shared_ptr<TSocket> pClientSock1(new TSocket("localhost", getServerPort()),
+                                          autoSocketCloser);
+  ParentServiceClient client1(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock1)));
+  pClientSock1->open();
+  client1.incrementGeneration();
+  client1.incrementGeneration();
+
+  // Requests are recorded once the processor returns
+  for (int i = 0; i < 200 && recorder->getRecordedCount() < 2; ++i) {
+    boost::this_thread::sleep(milliseconds(10));
+  }
+  std::vector<TFlightRecorder::Record> records;
+  recorder->recent(records);
+  BOOST_REQUIRE_EQUAL(2u, records.size());
+
+  // The first request also has the client's way to its thread
+  const int64_t* first = records[0].time;
+  BOOST_CHECK(first[TFlightRecorder::ACCEPTED] != 0);
+  BOOST_CHECK(first[TFlightRecorder::ENQUEUED] >= first[TFlightRecorder::ACCEPTED]);
+  BOOST_CHECK(first[TFlightRecorder::DEQUEUED] >= first[TFlightRecorder::ENQUEUED]);
+  BOOST_CHECK(first[TFlightRecorder::FIRST_BYTE] >= first[TFlightRecorder::DEQUEUED]);
+  BOOST_CHECK(first[TFlightRecorder::LAST_BYTE_WRITTEN] >= first[TFlightRecorder::FIRST_BYTE]);
+  BOOST_CHECK_EQUAL(0, first[TFlightRecorder::HANDLER_DONE]);
+
+  const int64_t* second = records[1].time;
+  BOOST_CHECK_EQUAL(0, second[TFlightRecorder::ACCEPTED]);
+  BOOST_CHECK_EQUAL(0, second[TFlightRecorder::DEQUEUED]);
+  BOOST_CHECK(second[TFlightRecorder::FIRST_BYTE] >= first[TFlightRecorder::LAST_BYTE_WRITTEN]);
+  BOOST_CHECK(second[TFlightRecorder::LAST_BYTE_WRITTEN] >= second[TFlightRecorder::FIRST_BYTE]);
+
+  stopServer();
+}
+
+#ifndef _WIN32
+BOOST_AUTO_TEST_CASE(test_drain_and_hand_off) {
+  BOOST_TEST_MESSAGE("Testing drain with the listening socket handed off");
+
+  startServer();
+  int port = getServerPort();
+
+  shared_ptr<TSocket> pClientSock1(new TSocket("localhost", port), autoSocketCloser);
+  ParentServiceClient client1(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock1)));
+  pClientSock1->open();
+  BOOST_CHECK_EQUAL(1, client1.incrementGeneration());
+
+  // The successor adopts the listening socket and starts serving on it
+  THRIFT_SOCKET sv[2];
+  BOOST_REQUIRE_EQUAL(0, THRIFT_SOCKETPAIR(AF_LOCAL, SOCK_STREAM, 0, sv));
+  dynamic_pointer_cast<TServerSocket>(pServer->getServerTransport())->handOff(sv[0]);
+  shared_ptr<TServerSocket> pNextSock(new TServerSocket("localhost", 0));
+  pNextSock->adopt(TSocketHandoff::receive(sv[1]));
+  ::THRIFT_CLOSESOCKET(sv[0]);
+  ::THRIFT_CLOSESOCKET(sv[1]);
+  BOOST_CHECK_EQUAL(port, pNextSock->getPort());
+
+  shared_ptr<TThreadedServer> pNext(
+      new TThreadedServer(make_shared<ParentServiceProcessor>(make_shared<ParentHandler>()),
+                          pNextSock,
+                          shared_ptr<TTransportFactory>(new TTransportFactory),
+                          shared_ptr<TProtocolFactory>(new TBinaryProtocolFactory)));
+  boost::thread nextThread(apache::thrift::stdcxx::bind(&TThreadedServer::serve, pNext.get()));
+
+  // The connected client is given time to finish
+  boost::thread t1(apache::thrift::stdcxx::bind(&TServerIntegrationTestFixture::delayClose,
+                               this,
+                               pClientSock1,
+                               milliseconds(100)));
+  BOOST_CHECK(pServer->drain(5000));
+  pServerThread->join();
+  pServerThread.reset();
+  t1.join();
+
+  // New clients reach the successor, which has a generation of its own
+  shared_ptr<TSocket> pClientSock2(new TSocket("localhost", port), autoSocketCloser);
+  ParentServiceClient client2(shared_ptr<TProtocol>(new TBinaryProtocol(pClientSock2)));
+  pClientSock2->open();
+  BOOST_CHECK_EQUAL(1, client2.incrementGeneration());
+  pClientSock2->close();
+
+  pNext->stop();
+  nextThread.join();
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(test_drain_timeout) {
+  BOOST_TEST_MESSAGE("Testing drain with a client that stays connected");
+
+  startServer();
+
+  shared_ptr<TSocket> pClientSock1(new TSocket("localhost", getServerPort()),
+                                          autoSocketCloser);
+  pClientSock1->open();
+  blockUntilAccepted(1);
+
+  BOOST_CHECK(!pServer->drain(50));
+  pServerThread->join();
+  pServerThread.reset();
+
+  // the client was disconnected once the time was up
+  uint8_t buf[1];
+  BOOST_CHECK_EQUAL(0, pClientSock1->read(&buf[0], 1));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -18,12 +18,16 @@
  */
 
 #include <boost/test/auto_unit_test.hpp>
+#include <thrift/concurrency/PlatformThreadFactory.h>
 #include <thrift/transport/TSocket.h>
 #include <thrift/transport/TServerSocket.h>
 #include <thrift/stdcxx.h>
 #include "TTransportCheckThrow.h"
 #include <iostream>
 
+using apache::thrift::concurrency::PlatformThreadFactory;
+using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::Thread;
 using apache::thrift::transport::TServerSocket;
 using apache::thrift::transport::TSocket;
 using apache::thrift::transport::TTransport;
@@ -66,4 +70,59 @@ BOOST_AUTO_TEST_CASE(test_get_port) {
   BOOST_CHECK_EQUAL(888, sock1.getPort());
 }
 
+#ifndef _WIN32
+// Accepts one connection, keeping what came of it
+class Acceptor : public Runnable {
+public:
+  explicit Acceptor(TServerSocket* sock) : sock_(sock), failed_(false) {}
+
+  void run() {
+    try {
+      accepted_ = sock_->accept();
+    } catch (const TTransportException&) {
+      failed_ = true;
+    }
+  }
+
+  TServerSocket* sock_;
+  shared_ptr<TTransport> accepted_;
+  bool failed_;
+};
+
+BOOST_AUTO_TEST_CASE(test_adopted_sockets_share_connections) {
+  TServerSocket listener("localhost", 0);
+  listener.listen();
+  int port = listener.getPort();
+
+  // Two acceptors on one nonblocking listening socket both wake up for a
+  // connection, and the one that loses the race polls again
+  TServerSocket sock1("localhost", 0);
+  TServerSocket sock2("localhost", 0);
+  sock1.adopt(::dup(listener.getSocketFD()));
+  sock2.adopt(::dup(listener.getSocketFD()));
+  shared_ptr<Acceptor> acceptor1(new Acceptor(&sock1));
+  shared_ptr<Acceptor> acceptor2(new Acceptor(&sock2));
+  PlatformThreadFactory threadFactory(false);
+  shared_ptr<Thread> thread1 = threadFactory.newThread(acceptor1);
+  shared_ptr<Thread> thread2 = threadFactory.newThread(acceptor2);
+  thread1->start();
+  thread2->start();
+
+  TSocket client1("localhost", port);
+  client1.open();
+  TSocket client2("localhost", port);
+  client2.open();
+  thread1->join();
+  thread2->join();
+
+  BOOST_CHECK(!acceptor1->failed_);
+  BOOST_CHECK(!acceptor2->failed_);
+  BOOST_CHECK(acceptor1->accepted_);
+  BOOST_CHECK(acceptor2->accepted_);
+  sock1.close();
+  sock2.close();
+  listener.close();
+}
+#endif
+
 BOOST_AUTO_TEST_SUITE_END()
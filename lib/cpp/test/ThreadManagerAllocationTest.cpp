@@ -0,0 +1,319 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+// A test executable of its own, as it replaces the global operator new
+
+#include <thrift/concurrency/ThreadManager.h>
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/stdcxx.h>
+
+#ifdef THRIFT_TEST_NONBLOCKING_SERVER
+#include <thrift/TProcessor.h>
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/server/TNonblockingServer.h>
+#include <thrift/server/TServer.h>
+#include <thrift/transport/TNonblockingServerSocket.h>
+#include <thrift/transport/TSocket.h>
+#endif
+
+#define BOOST_TEST_MODULE ThreadManagerAllocationTest
+#include <boost/test/unit_test.hpp>
+
+#include <boost/atomic.hpp>
+#include <cstdlib>
+#include <new>
+#include <unistd.h>
+
+using apache::thrift::stdcxx::shared_ptr;
+
+using namespace apache::thrift::concurrency;
+
+namespace {
+boost::atomic<size_t> allocations(0);
+boost::atomic<size_t> frees(0);
+}
+
+void* operator new(std::size_t size) {
+  ++allocations;
+  void* p = std::malloc(size > 0 ? size : 1);
+  if (p == NULL) {
+    throw std::bad_alloc();
+  }
+  return p;
+}
+
+void* operator new[](std::size_t size) {
+  return operator new(size);
+}
+
+void operator delete(void* p) throw() {
+  if (p != NULL) {
+    ++frees;
+    std::free(p);
+  }
+}
+
+void operator delete[](void* p) throw() {
+  operator delete(p);
+}
+
+namespace {
+
+/**
+ * Counts its runs
+ */
+class Counter : public Runnable {
+public:
+  Counter() : runs_(0) {}
+
+  virtual void run() { ++runs_; }
+
+  size_t runs() const { return runs_; }
+
+private:
+  boost::atomic<size_t> runs_;
+};
+
+/**
+ * Starts a manager without workers
+ */
+shared_ptr<ThreadManager> startThreadManager() {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(0);
+  shared_ptr<ThreadFactory> threadFactory(new PlatformThreadFactory());
+  threadFactory->setDetached(false);
+  threadManager->threadFactory(threadFactory);
+  threadManager->start();
+  return threadManager;
+}
+
+const size_t BATCH = 64;
+
+ThreadManager::TaskClass taskClass(size_t i) {
+  return ThreadManager::TaskClass(
+      static_cast<ThreadManager::PRIORITY>(i % ThreadManager::N_PRIORITIES), i % 8);
+}
+
+void addBatch(ThreadManager& threadManager, const shared_ptr<Counter>& counter, bool classified) {
+  for (size_t i = 0; i < BATCH; ++i) {
+    if (classified) {
+      threadManager.addClassified(counter, taskClass(i));
+    } else {
+      threadManager.add(counter);
+    }
+  }
+}
+
+/**
+ * Waits for the workers to be done with all tasks, including giving them
+ * back for reuse
+ */
+void waitForIdle(ThreadManager& threadManager) {
+  while (threadManager.totalTaskCount() > 0) {
+    usleep(100);
+  }
+}
+
+/**
+ * Queues a whole batch before there are workers to run it, so that the
+ * manager has held that many tasks at once, then adds workers
+ */
+void warmUp(ThreadManager& threadManager, const shared_ptr<Counter>& counter, bool classified) {
+  addBatch(threadManager, counter, classified);
+  threadManager.addWorker(2);
+  waitForIdle(threadManager);
+}
+
+/**
+ * Adds batches, waiting for each to run, and returns the number of
+ * allocations meanwhile
+ */
+size_t addBatches(ThreadManager& threadManager,
+                  const shared_ptr<Counter>& counter,
+                  bool classified,
+                  int batches) {
+  const size_t before = allocations;
+  for (int batch = 0; batch < batches; ++batch) {
+    addBatch(threadManager, counter, classified);
+    waitForIdle(threadManager);
+  }
+  return allocations - before;
+}
+}
+
+BOOST_AUTO_TEST_CASE(add_does_not_allocate) {
+  shared_ptr<ThreadManager> threadManager = startThreadManager();
+  shared_ptr<Counter> counter(new Counter);
+
+  warmUp(*threadManager, counter, false);
+  BOOST_CHECK_EQUAL(0u, addBatches(*threadManager, counter, false, 200));
+  BOOST_CHECK_EQUAL(201u * BATCH, counter->runs());
+
+  threadManager->stop();
+}
+
+BOOST_AUTO_TEST_CASE(add_classified_does_not_allocate) {
+  shared_ptr<ThreadManager> threadManager = startThreadManager();
+  shared_ptr<Counter> counter(new Counter);
+
+  // Warming up also makes the flows of the keys, which then stay
+  warmUp(*threadManager, counter, true);
+  BOOST_CHECK_EQUAL(0u, addBatches(*threadManager, counter, true, 200));
+  BOOST_CHECK_EQUAL(201u * BATCH, counter->runs());
+
+  threadManager->stop();
+}
+
+BOOST_AUTO_TEST_CASE(pending_tasks_are_freed) {
+  // Neither the tasks kept for reuse nor those still pending when the
+  // manager goes are leaked
+  const size_t before = allocations - frees;
+  {
+    shared_ptr<ThreadManager> threadManager = startThreadManager();
+    shared_ptr<Counter> counter(new Counter);
+    warmUp(*threadManager, counter, true);
+    threadManager->removeWorker(2);
+    addBatch(*threadManager, counter, false);
+    threadManager->stop();
+  }
+  BOOST_CHECK_EQUAL(before, allocations - frees);
+}
+
+#ifdef THRIFT_TEST_NONBLOCKING_SERVER
+namespace {
+
+using apache::thrift::TProcessor;
+using apache::thrift::protocol::TBinaryProtocolFactory;
+using apache::thrift::protocol::TMessageType;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::server::TNonblockingServer;
+using apache::thrift::server::TServerEventHandler;
+using apache::thrift::transport::TNonblockingServerSocket;
+using apache::thrift::transport::TSocket;
+
+/**
+ * Answers every call with an empty reply
+ */
+class EmptyReplies : public TProcessor {
+public:
+  bool process(shared_ptr<TProtocol> in, shared_ptr<TProtocol> out, void*) {
+    std::string name;
+    TMessageType type;
+    int32_t seqid;
+    in->readMessageBegin(name, type, seqid);
+    in->skip(apache::thrift::protocol::T_STRUCT);
+    in->readMessageEnd();
+    in->getTransport()->readEnd();
+
+    out->writeMessageBegin(name, apache::thrift::protocol::T_REPLY, seqid);
+    out->writeStructBegin("result");
+    out->writeFieldStop();
+    out->writeStructEnd();
+    out->writeMessageEnd();
+    out->getTransport()->writeEnd();
+    out->getTransport()->flush();
+    return true;
+  }
+};
+
+/**
+ * Serves until stopped, letting the test know once it listens
+ */
+class Serve : public Runnable, public TServerEventHandler {
+public:
+  Serve(shared_ptr<TNonblockingServer> server) : server_(server), ready_(false) {}
+
+  void run() { server_->serve(); }
+
+  void preServe() {
+    Synchronized s(monitor_);
+    ready_ = true;
+    monitor_.notifyAll();
+  }
+
+  void waitForReady() {
+    Synchronized s(monitor_);
+    while (!ready_) {
+      monitor_.wait();
+    }
+  }
+
+private:
+  shared_ptr<TNonblockingServer> server_;
+  Monitor monitor_;
+  bool ready_;
+};
+
+// A framed, strict binary call of "ping" with no arguments, and its reply
+const uint8_t PING_CALL[] = {0, 0, 0, 17, 0x80, 1, 0, 1, 0, 0, 0, 4, 'p', 'i', 'n', 'g',
+                             0, 0, 0, 0, 0};
+const uint8_t PING_REPLY[] = {0, 0, 0, 17, 0x80, 1, 0, 2, 0, 0, 0, 4, 'p', 'i', 'n', 'g',
+                              0, 0, 0, 0, 0};
+
+bool ping(TSocket& socket) {
+  uint8_t reply[sizeof(PING_REPLY)];
+  socket.write(PING_CALL, sizeof(PING_CALL));
+  socket.readAll(reply, sizeof(reply));
+  return std::equal(reply, reply + sizeof(reply), PING_REPLY);
+}
+}
+
+BOOST_AUTO_TEST_CASE(nonblocking_server_round_trip_does_not_allocate) {
+  // A request may be queued before the worker gave back the task of the
+  // last one, so the manager has to have held a few at once
+  shared_ptr<ThreadManager> threadManager = startThreadManager();
+  warmUp(*threadManager, shared_ptr<Counter>(new Counter), false);
+  shared_ptr<TNonblockingServer> server(
+      new TNonblockingServer(shared_ptr<TProcessor>(new EmptyReplies),
+                             shared_ptr<TBinaryProtocolFactory>(new TBinaryProtocolFactory),
+                             shared_ptr<TNonblockingServerSocket>(new TNonblockingServerSocket(0)),
+                             threadManager));
+  shared_ptr<Serve> serve(new Serve(server));
+  server->setServerEventHandler(serve);
+
+  PlatformThreadFactory factory;
+  factory.setDetached(false);
+  shared_ptr<Thread> thread = factory.newThread(serve);
+  thread->start();
+  serve->waitForReady();
+
+  TSocket socket("localhost", server->getListenPort());
+  socket.open();
+
+  // The first requests make the connection's buffers and task, and the
+  // manager's
+  for (int i = 0; i < 10; ++i) {
+    BOOST_REQUIRE(ping(socket));
+  }
+
+  const size_t before = allocations;
+  bool replied = true;
+  for (int i = 0; i < 200 && replied; ++i) {
+    replied = ping(socket);
+  }
+  const size_t allocated = allocations - before;
+  BOOST_CHECK(replied);
+  BOOST_CHECK_EQUAL(0u, allocated);
+
+  socket.close();
+  server->stop();
+  thread->join();
+  threadManager->stop();
+}
+#endif
@@ -29,6 +29,17 @@
 #include "gen-cpp/DebugProtoTest_types.h"
 
 using apache::thrift::to_string;
+using apache::thrift::append_to;
+using apache::thrift::TToStringBuffer;
+
+template <typename T>
+static std::string buffer_to_string(const T& t,
+                                    uint32_t max_elements = TToStringBuffer::UNLIMITED) {
+  std::string str;
+  TToStringBuffer out(str, max_elements);
+  append_to(out, t);
+  return str;
+}
 
 BOOST_AUTO_TEST_SUITE(ToStringTest)
 
@@ -134,4 +145,75 @@ BOOST_AUTO_TEST_CASE(generated_nested_list_object_to_string) {
                     "ListBonks(bonk=[Bonk(message=a, type=0), Bonk(message=b, type=0)])");
 }
 
+BOOST_AUTO_TEST_CASE(base_types_buffer) {
+  BOOST_CHECK_EQUAL(buffer_to_string(10), to_string(10));
+  BOOST_CHECK_EQUAL(buffer_to_string(-7L), to_string(-7L));
+  BOOST_CHECK_EQUAL(buffer_to_string(true), to_string(true));
+  BOOST_CHECK_EQUAL(buffer_to_string('a'), to_string('a'));
+  BOOST_CHECK_EQUAL(buffer_to_string((int8_t)'b'), to_string((int8_t)'b'));
+  BOOST_CHECK_EQUAL(buffer_to_string((int16_t)-300), to_string((int16_t)-300));
+  BOOST_CHECK_EQUAL(buffer_to_string((int64_t)1 << 40), to_string((int64_t)1 << 40));
+  BOOST_CHECK_EQUAL(buffer_to_string(1.2), to_string(1.2));
+  BOOST_CHECK_EQUAL(buffer_to_string(1.2f), to_string(1.2f));
+  BOOST_CHECK_EQUAL(buffer_to_string(1e300), to_string(1e300));
+  BOOST_CHECK_EQUAL(buffer_to_string("abc"), to_string("abc"));
+  BOOST_CHECK_EQUAL(buffer_to_string(std::string("abc")), "abc");
+}
+
+BOOST_AUTO_TEST_CASE(containers_buffer) {
+  std::vector<int> l;
+  BOOST_CHECK_EQUAL(buffer_to_string(l), "[]");
+  l.push_back(100);
+  l.push_back(150);
+  l.push_back(200);
+  BOOST_CHECK_EQUAL(buffer_to_string(l), to_string(l));
+  BOOST_CHECK_EQUAL(buffer_to_string(l, 2), "[100, 150, ...]");
+  BOOST_CHECK_EQUAL(buffer_to_string(l, 0), "[...]");
+
+  std::map<int, std::string> m;
+  m[12] = "abc";
+  m[31] = "xyz";
+  BOOST_CHECK_EQUAL(buffer_to_string(m), to_string(m));
+  BOOST_CHECK_EQUAL(buffer_to_string(m, 1), "{12: abc, ...}");
+
+  std::set<char> s;
+  s.insert('a');
+  s.insert('z');
+  BOOST_CHECK_EQUAL(buffer_to_string(s), to_string(s));
+}
+
+BOOST_AUTO_TEST_CASE(generated_objects_buffer) {
+  thrift::test::Tricky2 t;
+  BOOST_CHECK_EQUAL(buffer_to_string(t), to_string(t));
+  t.__set_im_optional(123);
+  BOOST_CHECK_EQUAL(buffer_to_string(t), to_string(t));
+
+  thrift::test::ListBonks l;
+  l.bonk.assign(3, thrift::test::Bonk());
+  l.bonk[0].__set_message("a");
+  l.bonk[1].__set_message("b");
+  BOOST_CHECK_EQUAL(buffer_to_string(l), to_string(l));
+  BOOST_CHECK_EQUAL(buffer_to_string(l, 1), "ListBonks(bonk=[Bonk(message=a, type=0), ...])");
+
+  thrift::test::Insanity insanity;
+  insanity.userMap[thrift::test::Numberz::FIVE] = 5;
+  insanity.userMap[static_cast<thrift::test::Numberz::type>(42)] = 42;
+  insanity.xtructs.resize(1);
+  BOOST_CHECK_EQUAL(buffer_to_string(insanity), to_string(insanity));
+
+  thrift::test::debug::HolyMoley hm;
+  hm.big.resize(2);
+  hm.big[0].double_precision = 3.25;
+  hm.bonks["poe"].resize(1);
+  BOOST_CHECK_EQUAL(buffer_to_string(hm), to_string(hm));
+
+  // The same buffer can be reused
+  std::string str;
+  TToStringBuffer out(str);
+  hm.printTo(out);
+  str.clear();
+  hm.printTo(out);
+  BOOST_CHECK_EQUAL(str, to_string(hm));
+}
+
 BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,198 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Built with T_GLOBAL_DEBUG_VIRTUAL=2, together with VirtualProfiling.cpp
+
+#define BOOST_TEST_MODULE VirtualProfilingTest
+#include <boost/test/unit_test.hpp>
+
+#include <thrift/TDispatchProcessor.h>
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
+#include <thrift/protocol/TJSONProtocol.h>
+#include <thrift/stdcxx.h>
+#include <thrift/transport/TBufferTransports.h>
+
+#include <stdio.h>
+#include <string>
+
+#if T_GLOBAL_DEBUG_VIRTUAL < 2
+#error "VirtualProfilingTest must be built with T_GLOBAL_DEBUG_VIRTUAL=2"
+#endif
+
+using apache::thrift::TDispatchProcessorT;
+using apache::thrift::concurrency::PlatformThreadFactory;
+using apache::thrift::concurrency::Runnable;
+using apache::thrift::concurrency::Thread;
+using apache::thrift::protocol::TBinaryProtocol;
+using apache::thrift::protocol::TCompactProtocol;
+using apache::thrift::protocol::TJSONProtocol;
+using apache::thrift::protocol::TProtocol;
+using apache::thrift::stdcxx::shared_ptr;
+using apache::thrift::transport::TMemoryBuffer;
+
+namespace {
+
+class NullProcessor : public TDispatchProcessorT<TBinaryProtocol> {
+protected:
+  virtual bool dispatchCall(TProtocol*, TProtocol*, const std::string&, int32_t, void*) {
+    return true;
+  }
+
+  virtual bool dispatchCallTemplated(TBinaryProtocol*,
+                                     TBinaryProtocol*,
+                                     const std::string&,
+                                     int32_t,
+                                     void*) {
+    return true;
+  }
+};
+
+template <class Protocol_>
+void processCall(NullProcessor& processor) {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  shared_ptr<Protocol_> protocol(new Protocol_(buffer));
+  protocol->writeMessageBegin("ping", apache::thrift::protocol::T_CALL, 1);
+  protocol->writeMessageEnd();
+  BOOST_CHECK(processor.process(protocol, protocol, NULL));
+}
+
+/**
+ * Makes some virtual calls through a TProtocol, on a thread of its own
+ */
+class Caller : public Runnable {
+public:
+  explicit Caller(int calls) : calls_(calls) {}
+
+  virtual void run() {
+    shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+    TJSONProtocol json(buffer);
+    TProtocol& protocol = json;
+    for (int n = 0; n < calls_; ++n) {
+      call(protocol);
+    }
+  }
+
+protected:
+  virtual void call(TProtocol& protocol) { protocol.writeDouble(1.5); }
+
+private:
+  int calls_;
+};
+
+/**
+ * Calls a method no other test does, so that its samples are its own
+ */
+class Sampler : public Caller {
+public:
+  explicit Sampler(int calls) : Caller(calls) {}
+
+protected:
+  virtual void call(TProtocol& protocol) { protocol.writeI16(1); }
+};
+
+void runOnThread(shared_ptr<Runnable> runnable) {
+  PlatformThreadFactory factory;
+  factory.setDetached(false);
+  shared_ptr<Thread> thread = factory.newThread(runnable);
+  thread->start();
+  thread->join();
+}
+
+std::string printed() {
+  FILE* f = tmpfile();
+  BOOST_REQUIRE(f != NULL);
+  apache::thrift::profile_print_info(f);
+  std::string text;
+  rewind(f);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    text.append(buf, n);
+  }
+  fclose(f);
+  return text;
+}
+
+bool contains(const std::string& text, const std::string& what) {
+  if (text.find(what) != std::string::npos) {
+    return true;
+  }
+  BOOST_TEST_MESSAGE("\"" << what << "\" not found in:\n" << text);
+  return false;
+}
+}
+
+BOOST_AUTO_TEST_CASE(templated_and_generic_protocols) {
+  NullProcessor processor;
+  processCall<TBinaryProtocol>(processor);
+  processCall<TBinaryProtocol>(processor);
+  processCall<TCompactProtocol>(processor);
+
+  std::string text = printed();
+  BOOST_CHECK(contains(text, "NullProcessor: 2 calls with its own protocol, 2 with another\n"));
+  BOOST_CHECK(contains(text, "    2 with apache::thrift::protocol::TCompactProtocolT<"));
+}
+
+BOOST_AUTO_TEST_CASE(virtual_calls_by_type_and_method) {
+  shared_ptr<TMemoryBuffer> buffer(new TMemoryBuffer());
+  TJSONProtocol json(buffer);
+  TProtocol& protocol = json;
+  for (int n = 0; n < 10; ++n) {
+    protocol.writeI32(n);
+  }
+  // Calls on the concrete type are not virtual, and not counted
+  json.writeI32(10);
+
+  BOOST_CHECK(
+      contains(printed(), "  10 calls to writeI32 on apache::thrift::protocol::TJSONProtocol\n"));
+}
+
+BOOST_AUTO_TEST_CASE(threads_merge_at_exit) {
+  runOnThread(shared_ptr<Runnable>(new Caller(7)));
+  runOnThread(shared_ptr<Runnable>(new Caller(5)));
+
+  BOOST_CHECK(
+      contains(printed(), "  12 calls to writeDouble on apache::thrift::protocol::TJSONProtocol\n"));
+}
+
+BOOST_AUTO_TEST_CASE(sampled_stacks) {
+  // A new thread takes the stack of its first call, and then of one in
+  // every sample rate; here the 1st, 5th, 9th, 13th and 17th of the calls to
+  // writeI16() and the transport's write() they make in turn
+  apache::thrift::profile_set_sample_rate(4);
+  runOnThread(shared_ptr<Runnable>(new Sampler(9)));
+  apache::thrift::profile_set_sample_rate(1000);
+
+  std::string text = printed();
+#if defined(__GLIBC__)
+  BOOST_CHECK(contains(text, "T_VIRTUAL_CALL: 5 sampled calls to writeI16 on "
+                             "apache::thrift::protocol::TJSONProtocol:\n  #"));
+#endif
+
+  FILE* generic = tmpfile();
+  FILE* virtuals = tmpfile();
+  BOOST_REQUIRE(generic != NULL && virtuals != NULL);
+  apache::thrift::profile_write_pprof(generic, virtuals);
+  // the header, the samples and the trailer
+  BOOST_CHECK_GT(ftell(virtuals), static_cast<long>(8 * sizeof(uintptr_t)));
+  fclose(generic);
+  fclose(virtuals);
+}
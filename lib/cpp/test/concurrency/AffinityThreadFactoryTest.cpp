@@ -0,0 +1,182 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+// This is linked into the UnitTests test executable
+
+#include <boost/test/unit_test.hpp>
+
+#include "thrift/concurrency/AffinityThreadFactory.h"
+#include "thrift/concurrency/Monitor.h"
+#include "thrift/concurrency/PlatformThreadFactory.h"
+#include "thrift/concurrency/ThreadManager.h"
+#include <thrift/stdcxx.h>
+
+#ifdef __linux__
+#include <linux/mempolicy.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+using apache::thrift::stdcxx::shared_ptr;
+
+using namespace apache::thrift::concurrency;
+
+namespace {
+
+/**
+ * Remembers where it ran
+ */
+class WhereAmI : public Runnable {
+public:
+  WhereAmI() : done_(false) {}
+
+  virtual void run() {
+    Synchronized s(monitor_);
+    cpus_ = ThreadPlacement::current().getCpus();
+    done_ = true;
+    monitor_.notify();
+  }
+
+  std::vector<int> cpus() {
+    Synchronized s(monitor_);
+    while (!done_) {
+      monitor_.wait();
+    }
+    return cpus_;
+  }
+
+private:
+  Monitor monitor_;
+  bool done_;
+  std::vector<int> cpus_;
+};
+
+shared_ptr<ThreadFactory> platformFactory() {
+  shared_ptr<ThreadFactory> factory(new PlatformThreadFactory());
+  factory->setDetached(false);
+  return factory;
+}
+}
+
+BOOST_AUTO_TEST_SUITE(AffinityThreadFactoryTest)
+
+BOOST_AUTO_TEST_CASE(topology) {
+  BOOST_CHECK_GE(ThreadPlacement::numaNodes(), 1);
+  for (int node = 0; node < ThreadPlacement::numaNodes(); ++node) {
+    ThreadPlacement placement = ThreadPlacement::onNode(node);
+    // Nodes may be memory only
+    BOOST_CHECK(node > 0 || !placement.getCpus().empty());
+    BOOST_CHECK_EQUAL(placement.getMemoryNode(), ThreadPlacement::numaNodes() > 1 ? node : -1);
+  }
+  BOOST_CHECK(ThreadPlacement().isAnywhere());
+  BOOST_CHECK(ThreadPlacement().apply());
+}
+
+BOOST_AUTO_TEST_CASE(detaches_wrapped_factory) {
+  shared_ptr<ThreadFactory> wrapped = platformFactory();
+  AffinityThreadFactory factory(wrapped, ThreadPlacement());
+  BOOST_CHECK(!factory.isDetached());
+
+  factory.setDetached(true);
+  BOOST_CHECK(wrapped->isDetached());
+  factory.setDetached(false);
+  BOOST_CHECK(!wrapped->isDetached());
+}
+
+#ifdef __linux__
+BOOST_AUTO_TEST_CASE(pins_threads) {
+  std::vector<int> allowed = ThreadPlacement::current().getCpus();
+  BOOST_REQUIRE(!allowed.empty());
+  std::vector<int> last(1, allowed.back());
+
+  AffinityThreadFactory factory(platformFactory(), ThreadPlacement(last));
+  factory.setDetached(false);
+  shared_ptr<WhereAmI> runnable(new WhereAmI);
+  shared_ptr<Thread> thread = factory.newThread(runnable);
+
+  // Users of the thread see the Runnable they gave, and the other way round
+  BOOST_CHECK(thread->runnable() == runnable);
+  BOOST_CHECK(runnable->thread() == thread);
+
+  thread->start();
+  BOOST_CHECK(runnable->cpus() == last);
+  thread->join();
+
+  // The calling thread stays where it was
+  BOOST_CHECK(ThreadPlacement::current().getCpus() == allowed);
+}
+
+BOOST_AUTO_TEST_CASE(saved_placement_restores_cpus_and_memory) {
+  std::vector<int> allowed = ThreadPlacement::current().getCpus();
+  BOOST_REQUIRE(!allowed.empty());
+
+  // A memory policy of its own, where the kernel has them
+  bool preferred = ThreadPlacement(allowed, 0).apply();
+  SavedThreadPlacement saved;
+
+  BOOST_REQUIRE(ThreadPlacement(std::vector<int>(1, allowed.back())).apply());
+  BOOST_REQUIRE(saved.restore());
+  BOOST_CHECK(ThreadPlacement::current().getCpus() == allowed);
+  if (preferred) {
+    int mode = -1;
+    unsigned long nodes[16] = {0};
+    BOOST_REQUIRE_EQUAL(
+        0, syscall(SYS_get_mempolicy, &mode, nodes, 8 * sizeof(nodes), NULL, 0));
+    BOOST_CHECK_EQUAL(MPOL_PREFERRED, mode);
+    BOOST_CHECK_EQUAL(1ul, nodes[0]);
+  }
+  BOOST_CHECK(ThreadPlacement().apply());
+}
+
+BOOST_AUTO_TEST_CASE(places_in_turn) {
+  std::vector<int> allowed = ThreadPlacement::current().getCpus();
+  BOOST_REQUIRE(!allowed.empty());
+  std::vector<ThreadPlacement> placements;
+  placements.push_back(ThreadPlacement(std::vector<int>(1, allowed.front())));
+  placements.push_back(ThreadPlacement(allowed));
+
+  AffinityThreadFactory factory(platformFactory(), placements);
+  factory.setDetached(false);
+  for (size_t i = 0; i < 4; ++i) {
+    shared_ptr<WhereAmI> runnable(new WhereAmI);
+    shared_ptr<Thread> thread = factory.newThread(runnable);
+    thread->start();
+    BOOST_CHECK(runnable->cpus() == placements[i % 2].getCpus());
+    thread->join();
+  }
+}
+#endif
+
+BOOST_AUTO_TEST_CASE(thread_manager_workers) {
+  shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(2);
+  threadManager->threadFactory(shared_ptr<ThreadFactory>(
+      new AffinityThreadFactory(platformFactory(), ThreadPlacement::current())));
+  threadManager->start();
+  BOOST_CHECK_EQUAL(threadManager->workerCount(), 2u);
+
+  shared_ptr<WhereAmI> runnable(new WhereAmI);
+  threadManager->add(runnable);
+  BOOST_CHECK(runnable->cpus() == ThreadPlacement::current().getCpus());
+
+  threadManager->removeWorker(1);
+  BOOST_CHECK_EQUAL(threadManager->workerCount(), 1u);
+  threadManager->stop();
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,386 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+// Compares the locks of the thrift library, in whichever implementation it
+// was built with (see WITH_FUTEX), with plain pthread ones:
+//
+//   concurrency_benchmark [milliseconds per case]
+
+#include <thrift/thrift-config.h>
+#include <thrift/concurrency/DistributedReadWriteMutex.h>
+#include <thrift/concurrency/Monitor.h>
+#include <thrift/concurrency/Mutex.h>
+#include <thrift/concurrency/PlatformThreadFactory.h>
+#include <thrift/concurrency/Util.h>
+#include <thrift/stdcxx.h>
+
+#include <boost/atomic.hpp>
+
+#include <iomanip>
+#include <iostream>
+#include <pthread.h>
+#include <sstream>
+#include <stdlib.h>
+#include <string>
+#include <unistd.h>
+#include <vector>
+
+using apache::thrift::stdcxx::shared_ptr;
+using namespace apache::thrift::concurrency;
+
+namespace {
+
+int64_t caseMillis = 500;
+
+class ThriftMutex {
+public:
+  void lock() { mutex_.lock(); }
+  void unlock() { mutex_.unlock(); }
+
+private:
+  Mutex mutex_;
+};
+
+class PthreadMutex {
+public:
+  PthreadMutex() { pthread_mutex_init(&mutex_, NULL); }
+  ~PthreadMutex() { pthread_mutex_destroy(&mutex_); }
+  void lock() { pthread_mutex_lock(&mutex_); }
+  void unlock() { pthread_mutex_unlock(&mutex_); }
+
+private:
+  pthread_mutex_t mutex_;
+};
+
+template <class ReadWriteMutex_>
+class ThriftRWLock {
+public:
+  void acquireRead() { rwlock_.acquireRead(); }
+  void acquireWrite() { rwlock_.acquireWrite(); }
+  void release() { rwlock_.release(); }
+
+private:
+  ReadWriteMutex_ rwlock_;
+};
+
+class PthreadRWLock {
+public:
+  PthreadRWLock() { pthread_rwlock_init(&rwlock_, NULL); }
+  ~PthreadRWLock() { pthread_rwlock_destroy(&rwlock_); }
+  void acquireRead() { pthread_rwlock_rdlock(&rwlock_); }
+  void acquireWrite() { pthread_rwlock_wrlock(&rwlock_); }
+  void release() { pthread_rwlock_unlock(&rwlock_); }
+
+private:
+  pthread_rwlock_t rwlock_;
+};
+
+class ThriftMonitor {
+public:
+  void lock() { monitor_.lock(); }
+  void unlock() { monitor_.unlock(); }
+  void wait() { monitor_.waitForever(); }
+  void notify() { monitor_.notify(); }
+
+private:
+  Monitor monitor_;
+};
+
+class PthreadMonitor {
+public:
+  PthreadMonitor() {
+    pthread_mutex_init(&mutex_, NULL);
+    pthread_cond_init(&cond_, NULL);
+  }
+  ~PthreadMonitor() {
+    pthread_cond_destroy(&cond_);
+    pthread_mutex_destroy(&mutex_);
+  }
+  void lock() { pthread_mutex_lock(&mutex_); }
+  void unlock() { pthread_mutex_unlock(&mutex_); }
+  void wait() { pthread_cond_wait(&cond_, &mutex_); }
+  void notify() { pthread_cond_signal(&cond_); }
+
+private:
+  pthread_mutex_t mutex_;
+  pthread_cond_t cond_;
+};
+
+/**
+ * Runs a loop of operations until the case is over, and counts them
+ */
+class Worker : public Runnable {
+public:
+  Worker(const boost::atomic<bool>& stop) : stop_(stop), ops_(0) {}
+
+  virtual void run() {
+    uint64_t ops = 0;
+    while (!stop_.load(boost::memory_order_relaxed)) {
+      operation(ops);
+      ++ops;
+    }
+    ops_ = ops;
+  }
+
+  uint64_t ops() const { return ops_; }
+
+protected:
+  virtual void operation(uint64_t n) = 0;
+
+private:
+  const boost::atomic<bool>& stop_;
+  uint64_t ops_;
+};
+
+template <class Lock>
+class LockWorker : public Worker {
+public:
+  LockWorker(const boost::atomic<bool>& stop, Lock& lock, volatile uint64_t& counter)
+    : Worker(stop), lock_(lock), counter_(counter) {}
+
+protected:
+  virtual void operation(uint64_t) {
+    lock_.lock();
+    counter_ = counter_ + 1;
+    lock_.unlock();
+  }
+
+private:
+  Lock& lock_;
+  volatile uint64_t& counter_;
+};
+
+/**
+ * Reads, and writes once in every writeEvery operations, if writeEvery is
+ * not 0
+ */
+template <class RWLock>
+class RWLockWorker : public Worker {
+public:
+  RWLockWorker(const boost::atomic<bool>& stop,
+               RWLock& rwlock,
+               volatile uint64_t& counter,
+               uint64_t writeEvery)
+    : Worker(stop), rwlock_(rwlock), counter_(counter), writeEvery_(writeEvery) {}
+
+protected:
+  virtual void operation(uint64_t n) {
+    if (writeEvery_ != 0 && n % writeEvery_ == 0) {
+      rwlock_.acquireWrite();
+      counter_ = counter_ + 1;
+    } else {
+      rwlock_.acquireRead();
+      uint64_t value = counter_;
+      (void)value;
+    }
+    rwlock_.release();
+  }
+
+private:
+  RWLock& rwlock_;
+  volatile uint64_t& counter_;
+  uint64_t writeEvery_;
+};
+
+/**
+ * Passes a turn back and forth with another HandoffWorker: each operation
+ * waits for the turn, and hands it over
+ */
+template <class Monitor_>
+class HandoffWorker : public Worker {
+public:
+  HandoffWorker(const boost::atomic<bool>& stop, Monitor_& monitor, volatile int& turn, int me)
+    : Worker(stop), stop_(stop), monitor_(monitor), turn_(turn), me_(me) {}
+
+protected:
+  virtual void operation(uint64_t) {
+    monitor_.lock();
+    while (turn_ != me_ && !stop_.load(boost::memory_order_relaxed)) {
+      monitor_.wait();
+    }
+    turn_ = 1 - me_;
+    monitor_.notify();
+    monitor_.unlock();
+  }
+
+private:
+  const boost::atomic<bool>& stop_;
+  Monitor_& monitor_;
+  volatile int& turn_;
+  int me_;
+};
+
+/**
+ * Runs the workers for caseMillis, and returns the operations they did
+ */
+uint64_t runWorkers(const std::vector<shared_ptr<Worker> >& workers,
+                    boost::atomic<bool>& stop,
+                    void (*wakeAll)(void*) = NULL,
+                    void* arg = NULL) {
+  PlatformThreadFactory factory;
+  factory.setDetached(false);
+  std::vector<shared_ptr<Thread> > threads;
+  for (size_t i = 0; i < workers.size(); ++i) {
+    threads.push_back(factory.newThread(workers[i]));
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->start();
+  }
+  usleep(static_cast<useconds_t>(caseMillis * 1000));
+  stop.store(true);
+  if (wakeAll) {
+    wakeAll(arg);
+  }
+  uint64_t ops = 0;
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->join();
+    ops += workers[i]->ops();
+  }
+  return ops;
+}
+
+std::string withThreads(const char* what, int threads) {
+  std::ostringstream text;
+  text << what << ", " << threads << " threads";
+  return text.str();
+}
+
+void report(const std::string& what, const char* impl, uint64_t ops) {
+  double seconds = caseMillis / 1000.0;
+  std::cout << "\t\t" << std::left << std::setw(40) << what << std::setw(12) << impl << std::right
+            << std::setw(12) << static_cast<uint64_t>(ops / seconds) << " ops/s" << std::setw(12)
+            << std::fixed << std::setprecision(3) << (ops ? caseMillis * 1000.0 / ops : 0.0)
+            << " us/op" << std::endl;
+}
+
+template <class Lock>
+void uncontended(const char* impl) {
+  Lock lock;
+  volatile uint64_t counter = 0;
+  int64_t end = Util::currentTime() + caseMillis;
+  uint64_t ops = 0;
+  while (Util::currentTime() < end) {
+    for (int n = 0; n < 1000; ++n) {
+      lock.lock();
+      counter = counter + 1;
+      lock.unlock();
+    }
+    ops += 1000;
+  }
+  report("uncontended lock/unlock", impl, ops);
+}
+
+template <class Lock>
+void contended(const char* impl, int threads) {
+  Lock lock;
+  volatile uint64_t counter = 0;
+  boost::atomic<bool> stop(false);
+  std::vector<shared_ptr<Worker> > workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.push_back(shared_ptr<Worker>(new LockWorker<Lock>(stop, lock, counter)));
+  }
+  uint64_t ops = runWorkers(workers, stop);
+  if (ops != counter) {
+    std::cerr << "\t\tlost updates: " << counter << " of " << ops << std::endl;
+    exit(1);
+  }
+  report(withThreads("contended lock/unlock", threads), impl, ops);
+}
+
+template <class RWLock>
+void readMostly(const char* impl, int threads, uint64_t writeEvery) {
+  RWLock rwlock;
+  volatile uint64_t counter = 0;
+  boost::atomic<bool> stop(false);
+  std::vector<shared_ptr<Worker> > workers;
+  for (int i = 0; i < threads; ++i) {
+    workers.push_back(
+        shared_ptr<Worker>(new RWLockWorker<RWLock>(stop, rwlock, counter, writeEvery)));
+  }
+  uint64_t ops = runWorkers(workers, stop);
+  std::ostringstream what;
+  what << "rwlock, 1 write in " << writeEvery;
+  report(withThreads(what.str().c_str(), threads), impl, ops);
+}
+
+template <class Monitor_>
+void wakeHandoff(void* arg) {
+  Monitor_* monitor = static_cast<Monitor_*>(arg);
+  monitor->lock();
+  monitor->notify();
+  monitor->notify();
+  monitor->unlock();
+}
+
+template <class Monitor_>
+void handoff(const char* impl) {
+  Monitor_ monitor;
+  volatile int turn = 0;
+  boost::atomic<bool> stop(false);
+  std::vector<shared_ptr<Worker> > workers;
+  workers.push_back(shared_ptr<Worker>(new HandoffWorker<Monitor_>(stop, monitor, turn, 0)));
+  workers.push_back(shared_ptr<Worker>(new HandoffWorker<Monitor_>(stop, monitor, turn, 1)));
+  uint64_t ops = runWorkers(workers, stop, wakeHandoff<Monitor_>, &monitor);
+  report("monitor handoff between 2 threads", impl, ops);
+}
+}
+
+int main(int argc, char** argv) {
+  if (argc > 1) {
+    caseMillis = atoi(argv[1]);
+  }
+  if (getenv("VALGRIND") != 0) {
+    caseMillis = 50;
+  }
+
+  int cpus = static_cast<int>(sysconf(_SC_NPROCESSORS_ONLN));
+  std::vector<int> threadCounts;
+  threadCounts.push_back(2);
+  if (cpus > 2) {
+    threadCounts.push_back(cpus);
+  }
+  threadCounts.push_back(cpus * 2 > 4 ? cpus * 2 : 4);
+
+  std::cout << "Lock benchmarks, " << caseMillis << "ms per case, " << cpus << " cpus..."
+            << std::endl;
+
+  uncontended<ThriftMutex>("thrift");
+  uncontended<PthreadMutex>("pthread");
+
+  for (size_t i = 0; i < threadCounts.size(); ++i) {
+    contended<ThriftMutex>("thrift", threadCounts[i]);
+    contended<PthreadMutex>("pthread", threadCounts[i]);
+  }
+
+  // Readers in the hundreds per write, as with a server list, and in the
+  // hundreds of thousands, as with a configuration
+  uint64_t writeEvery[] = {100, 100000};
+  for (size_t w = 0; w < sizeof(writeEvery) / sizeof(writeEvery[0]); ++w) {
+    for (int threads = 1; threads <= 64; threads *= 2) {
+      readMostly<ThriftRWLock<ReadWriteMutex> >("thrift", threads, writeEvery[w]);
+      readMostly<ThriftRWLock<DistributedReadWriteMutex> >("distributed", threads, writeEvery[w]);
+      readMostly<PthreadRWLock>("pthread", threads, writeEvery[w]);
+    }
+  }
+
+  handoff<ThriftMonitor>("thrift");
+  handoff<PthreadMonitor>("pthread");
+
+  return 0;
+}
@@ -0,0 +1,273 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+// This is linked into the UnitTests test executable
+
+#include <boost/test/unit_test.hpp>
+
+#include "thrift/concurrency/ContentionProfiler.h"
+#include "thrift/concurrency/Monitor.h"
+#include "thrift/concurrency/Mutex.h"
+#include "thrift/concurrency/PosixThreadFactory.h"
+#include <thrift/stdcxx.h>
+
+#include <stdio.h>
+#include <string>
+
+using apache::thrift::stdcxx::shared_ptr;
+
+using namespace apache::thrift::concurrency;
+
+namespace {
+
+/**
+ * Holds a lock for a while, once the test is waiting for it
+ */
+class Holder : public Runnable {
+public:
+  Holder(const Mutex& mutex, int ms) : mutex_(mutex), ms_(ms), locked_(false) {}
+
+  virtual void run() {
+    Guard g(mutex_);
+    locked_ = true;
+    usleep(ms_ * 1000);
+  }
+
+  bool locked() const { return locked_; }
+
+private:
+  const Mutex& mutex_;
+  int ms_;
+  volatile bool locked_;
+};
+
+class WriteHolder : public Runnable {
+public:
+  WriteHolder(const ReadWriteMutex& rwlock, int ms) : rwlock_(rwlock), ms_(ms), locked_(false) {}
+
+  virtual void run() {
+    RWGuard g(rwlock_, RW_WRITE);
+    locked_ = true;
+    usleep(ms_ * 1000);
+  }
+
+  bool locked() const { return locked_; }
+
+private:
+  const ReadWriteMutex& rwlock_;
+  int ms_;
+  volatile bool locked_;
+};
+
+std::string readAll(FILE* f) {
+  std::string text;
+  rewind(f);
+  char buf[4096];
+  size_t n;
+  while ((n = fread(buf, 1, sizeof(buf), f)) > 0) {
+    text.append(buf, n);
+  }
+  fclose(f);
+  return text;
+}
+
+std::string profileText() {
+  FILE* f = tmpfile();
+  BOOST_REQUIRE(f != NULL);
+  printContentionProfile(f);
+  return readAll(f);
+}
+
+/**
+ * The time printed for the first site of what ("waited" or "held") on the
+ * lock named name, or -1 if there is none
+ */
+long long microsFor(const std::string& text, const char* what, const char* name) {
+  std::string tail = std::string(" samples on ") + name + ":\n";
+  std::string::size_type end = text.find(tail);
+  while (end != std::string::npos) {
+    std::string::size_type start = text.rfind('\n', end);
+    start = (start == std::string::npos) ? 0 : start + 1;
+    long long micros;
+    unsigned long long samples;
+    char kind[16];
+    if (sscanf(text.c_str() + start, "%15s %lld us in %llu", kind, &micros, &samples) == 3
+        && std::string(kind) == what) {
+      return micros;
+    }
+    end = text.find(tail, end + 1);
+  }
+  return -1;
+}
+
+struct Profiling {
+  Profiling() { clearContentionProfile(); }
+  ~Profiling() {
+    disableContentionProfiling();
+    enableMutexProfiling(0, NULL);
+    clearContentionProfile();
+  }
+};
+
+int callbackCalls = 0;
+const void* callbackId = NULL;
+
+void countWait(const void* id, int64_t waitTimeMicros) {
+  (void)waitTimeMicros;
+  ++callbackCalls;
+  callbackId = id;
+}
+}
+
+BOOST_FIXTURE_TEST_SUITE(ContentionProfilerTest, Profiling)
+
+BOOST_AUTO_TEST_CASE(waits_by_name_and_stack) {
+  Mutex mutex;
+  mutex.setName("ContentionProfilerTest::waits");
+  BOOST_CHECK_EQUAL(std::string("ContentionProfilerTest::waits"), mutex.getName());
+
+  enableContentionProfiling(1, 0);
+
+  PosixThreadFactory factory;
+  factory.setDetached(false);
+  shared_ptr<Holder> holder(new Holder(mutex, 100));
+  shared_ptr<Thread> thread = factory.newThread(holder);
+  thread->start();
+  while (!holder->locked()) {
+    usleep(1000);
+  }
+
+  // Uncontended locks are sampled, but not charged
+  Mutex other;
+  other.setName("ContentionProfilerTest::free");
+  other.lock();
+  other.unlock();
+
+  mutex.lock();
+  mutex.unlock();
+  thread->join();
+
+  std::string text = profileText();
+  BOOST_CHECK_GE(microsFor(text, "waited", "ContentionProfilerTest::waits"), 50000);
+  BOOST_CHECK_EQUAL(-1, microsFor(text, "waited", "ContentionProfilerTest::free"));
+  BOOST_CHECK_EQUAL(-1, microsFor(text, "held", "ContentionProfilerTest::waits"));
+
+  FILE* waits = tmpfile();
+  BOOST_REQUIRE(waits != NULL);
+  writeContentionPprof(waits, NULL);
+  std::string pprof = readAll(waits);
+  BOOST_CHECK_EQUAL(0u, pprof.find("--- contention:\ncycles/second = 1000000\nsampling period = 1\n"));
+#if defined(__GLIBC__)
+  BOOST_CHECK(pprof.find(" 1 @ 0x") != std::string::npos);
+  BOOST_CHECK(pprof.find("--- Memory map: ---\n") != std::string::npos);
+#endif
+}
+
+BOOST_AUTO_TEST_CASE(holds_end_at_monitor_waits) {
+  Monitor monitor;
+  monitor.mutex().setName("ContentionProfilerTest::monitor");
+
+  enableContentionProfiling(0, 1);
+
+  {
+    Synchronized s(monitor);
+    usleep(20000);
+    // Waiting releases the lock: the hold ends here
+    monitor.waitForTimeRelative(300);
+  }
+
+  std::string text = profileText();
+  long long held = microsFor(text, "held", "ContentionProfilerTest::monitor");
+  BOOST_CHECK_GE(held, 20000);
+  BOOST_CHECK_LT(held, 300000);
+  BOOST_CHECK_EQUAL(-1, microsFor(text, "waited", "ContentionProfilerTest::monitor"));
+}
+
+BOOST_AUTO_TEST_CASE(recursive_holds_end_at_outermost_unlock) {
+  Mutex mutex(Mutex::RECURSIVE_INITIALIZER);
+  mutex.setName("ContentionProfilerTest::recursive");
+
+  enableContentionProfiling(0, 1);
+
+  mutex.lock();
+  mutex.lock();
+  mutex.unlock();
+  usleep(20000);
+  mutex.unlock();
+
+  BOOST_CHECK_GE(microsFor(profileText(), "held", "ContentionProfilerTest::recursive"), 20000);
+}
+
+BOOST_AUTO_TEST_CASE(read_write_mutex) {
+  ReadWriteMutex rwlock;
+  rwlock.setName("ContentionProfilerTest::rw");
+
+  enableContentionProfiling(1, 1);
+
+  PosixThreadFactory factory;
+  factory.setDetached(false);
+  shared_ptr<WriteHolder> holder(new WriteHolder(rwlock, 50));
+  shared_ptr<Thread> thread = factory.newThread(holder);
+  thread->start();
+  while (!holder->locked()) {
+    usleep(1000);
+  }
+
+  // A reader waits for the writer, but its own hold is not sampled
+  rwlock.acquireRead();
+  rwlock.release();
+  thread->join();
+
+  std::string text = profileText();
+  BOOST_CHECK_GT(microsFor(text, "waited", "ContentionProfilerTest::rw"), 0);
+  BOOST_CHECK_GE(microsFor(text, "held", "ContentionProfilerTest::rw"), 40000);
+}
+
+BOOST_AUTO_TEST_CASE(disabled) {
+  Mutex mutex;
+  mutex.setName("ContentionProfilerTest::disabled");
+
+  enableContentionProfiling(1, 1);
+  disableContentionProfiling();
+
+  mutex.lock();
+  usleep(1000);
+  mutex.unlock();
+
+  BOOST_CHECK_EQUAL(-1, microsFor(profileText(), "held", "ContentionProfilerTest::disabled"));
+}
+
+BOOST_AUTO_TEST_CASE(mutex_wait_callback) {
+  Mutex mutex;
+  callbackCalls = 0;
+
+  enableMutexProfiling(1, countWait);
+  mutex.lock();
+  mutex.unlock();
+  enableMutexProfiling(0, NULL);
+  mutex.lock();
+  mutex.unlock();
+
+  BOOST_CHECK_EQUAL(1, callbackCalls);
+  BOOST_CHECK_EQUAL(static_cast<const void*>(&mutex), callbackId);
+  // The callback alone does not collect a profile
+  BOOST_CHECK_EQUAL(std::string(), profileText());
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -0,0 +1,239 @@
+/*
+ * Licensed to the Apache Software Foundation (ASF) under one
+ * or more contributor license agreements. See the NOTICE file
+ * distributed with this work for additional information
+ * regarding copyright ownership. The ASF licenses this file
+ * to you under the Apache License, Version 2.0 (the
+ * "License"); you may not use this file except in compliance
+ * with the License. You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing,
+ * software distributed under the License is distributed on an
+ * "AS IS" BASIS, WITHOUT WARRANTIES OR CONDITIONS OF ANY
+ * KIND, either express or implied. See the License for the
+ * specific language governing permissions and limitations
+ * under the License.
+ */
+
+// This is linked into the UnitTests test executable
+
+#include <boost/test/unit_test.hpp>
+
+#include "thrift/concurrency/DistributedReadWriteMutex.h"
+#include "thrift/concurrency/PlatformThreadFactory.h"
+#include <thrift/stdcxx.h>
+
+#include <unistd.h>
+#include <vector>
+
+using apache::thrift::stdcxx::shared_ptr;
+
+using namespace apache::thrift::concurrency;
+
+namespace {
+
+/**
+ * Tries to take the lock once, from another thread than the test's
+ */
+class Attempt : public Runnable {
+public:
+  Attempt(const ReadWriteMutex& rwlock, bool write)
+    : rwlock_(rwlock), write_(write), gotLock_(false) {}
+
+  virtual void run() {
+    gotLock_ = write_ ? rwlock_.attemptWrite() : rwlock_.attemptRead();
+    if (gotLock_) {
+      rwlock_.release();
+    }
+  }
+
+  bool gotLock() const { return gotLock_; }
+
+private:
+  const ReadWriteMutex& rwlock_;
+  bool write_;
+  bool gotLock_;
+};
+
+bool attempt(const ReadWriteMutex& rwlock, bool write) {
+  PlatformThreadFactory factory;
+  factory.setDetached(false);
+  shared_ptr<Attempt> runnable(new Attempt(rwlock, write));
+  shared_ptr<Thread> thread = factory.newThread(runnable);
+  thread->start();
+  thread->join();
+  return runnable->gotLock();
+}
+
+/**
+ * Takes the lock, and holds it until signaled
+ */
+class Holder : public Runnable {
+public:
+  Holder(const ReadWriteMutex& rwlock, bool write)
+    : rwlock_(rwlock), write_(write), started_(false), gotLock_(false), signaled_(false) {}
+
+  virtual void run() {
+    started_ = true;
+    if (write_) {
+      rwlock_.acquireWrite();
+    } else {
+      rwlock_.acquireRead();
+    }
+    gotLock_ = true;
+    while (!signaled_) {
+      usleep(1000);
+    }
+    rwlock_.release();
+  }
+
+  bool started() const { return started_; }
+  bool gotLock() const { return gotLock_; }
+  void signal() { signaled_ = true; }
+
+private:
+  const ReadWriteMutex& rwlock_;
+  bool write_;
+  volatile bool started_;
+  volatile bool gotLock_;
+  volatile bool signaled_;
+};
+
+/**
+ * Writes two counters together, and checks that readers always see them equal
+ */
+class Checker : public Runnable {
+public:
+  Checker(const ReadWriteMutex& rwlock, volatile uint64_t* counters)
+    : rwlock_(rwlock), counters_(counters), torn_(0) {}
+
+  virtual void run() {
+    for (int n = 0; n < 20000; ++n) {
+      if (n % 50 == 0) {
+        RWGuard g(rwlock_, RW_WRITE);
+        counters_[0] = counters_[0] + 1;
+        counters_[1] = counters_[1] + 1;
+      } else {
+        RWGuard g(rwlock_, RW_READ);
+        if (counters_[0] != counters_[1]) {
+          ++torn_;
+        }
+      }
+    }
+  }
+
+  int torn() const { return torn_; }
+
+private:
+  const ReadWriteMutex& rwlock_;
+  volatile uint64_t* counters_;
+  int torn_;
+};
+}
+
+BOOST_AUTO_TEST_SUITE(DistributedReadWriteMutexTest)
+
+BOOST_AUTO_TEST_CASE(slots) {
+  DistributedReadWriteMutex rwlock;
+  BOOST_CHECK_GE(rwlock.slots(), 1u);
+  BOOST_CHECK_LE(rwlock.slots(), 64u);
+  BOOST_CHECK_EQUAL(0u, rwlock.slots() & (rwlock.slots() - 1));
+}
+
+BOOST_AUTO_TEST_CASE(readers_share) {
+  DistributedReadWriteMutex rwlock;
+  rwlock.acquireRead();
+  BOOST_CHECK(attempt(rwlock, false));
+  BOOST_CHECK(!attempt(rwlock, true));
+  // The failed writer does not keep readers out
+  BOOST_CHECK(attempt(rwlock, false));
+  rwlock.release();
+  BOOST_CHECK(attempt(rwlock, true));
+}
+
+BOOST_AUTO_TEST_CASE(writer_excludes) {
+  DistributedReadWriteMutex rwlock;
+  rwlock.acquireWrite();
+  BOOST_CHECK(!attempt(rwlock, false));
+  BOOST_CHECK(!attempt(rwlock, true));
+  rwlock.release();
+  BOOST_CHECK(attempt(rwlock, false));
+  BOOST_CHECK(rwlock.attemptWrite());
+  BOOST_CHECK(!attempt(rwlock, false));
+  rwlock.release();
+}
+
+BOOST_AUTO_TEST_CASE(writer_comes_first) {
+  DistributedReadWriteMutex rwlock;
+  PlatformThreadFactory factory;
+  factory.setDetached(false);
+
+  shared_ptr<Holder> reader1(new Holder(rwlock, false));
+  shared_ptr<Holder> writer(new Holder(rwlock, true));
+  shared_ptr<Holder> reader2(new Holder(rwlock, false));
+  shared_ptr<Thread> treader1 = factory.newThread(reader1);
+  shared_ptr<Thread> twriter = factory.newThread(writer);
+  shared_ptr<Thread> treader2 = factory.newThread(reader2);
+
+  treader1->start();
+  while (!reader1->gotLock()) {
+    usleep(1000);
+  }
+
+  // The writer waits for the reader, and the second reader for the writer
+  twriter->start();
+  while (!writer->started()) {
+    usleep(1000);
+  }
+  usleep(100000);
+  treader2->start();
+  while (!reader2->started()) {
+    usleep(1000);
+  }
+  usleep(100000);
+  BOOST_CHECK(!writer->gotLock());
+  BOOST_CHECK(!reader2->gotLock());
+
+  reader1->signal();
+  while (!writer->gotLock() && !reader2->gotLock()) {
+    usleep(1000);
+  }
+  BOOST_CHECK(writer->gotLock());
+  BOOST_CHECK(!reader2->gotLock());
+
+  writer->signal();
+  while (!reader2->gotLock()) {
+    usleep(1000);
+  }
+  reader2->signal();
+  treader1->join();
+  twriter->join();
+  treader2->join();
+}
+
+BOOST_AUTO_TEST_CASE(consistency) {
+  DistributedReadWriteMutex rwlock;
+  volatile uint64_t counters[2] = {0, 0};
+  PlatformThreadFactory factory;
+  factory.setDetached(false);
+
+  std::vector<shared_ptr<Checker> > checkers;
+  std::vector<shared_ptr<Thread> > threads;
+  for (int i = 0; i < 8; ++i) {
+    checkers.push_back(shared_ptr<Checker>(new Checker(rwlock, counters)));
+    threads.push_back(factory.newThread(checkers.back()));
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->start();
+  }
+  for (size_t i = 0; i < threads.size(); ++i) {
+    threads[i]->join();
+    BOOST_CHECK_EQUAL(0, checkers[i]->torn());
+  }
+  BOOST_CHECK_EQUAL(8u * 400u, counters[0]);
+  BOOST_CHECK_EQUAL(counters[0], counters[1]);
+}
+
+BOOST_AUTO_TEST_SUITE_END()
@@ -186,6 +186,20 @@ int main(int argc, char** argv) {
         std::cerr << "\t\tThreadManager blockTest FAILED" << std::endl;
         return 1;
       }
+
+      std::cout << "\t\tThreadManager priority test" << std::endl;
+
+      if (!threadManagerTests.priorityTest()) {
+        std::cerr << "\t\tThreadManager priorityTest FAILED" << std::endl;
+        return 1;
+      }
+
+      std::cout << "\t\tThreadManager batch test" << std::endl;
+
+      if (!threadManagerTests.batchTest()) {
+        std::cerr << "\t\tThreadManager batchTest FAILED" << std::endl;
+        return 1;
+      }
     }
   }
 
@@ -21,6 +21,7 @@
 #include <thrift/concurrency/ThreadManager.h>
 #include <thrift/concurrency/PlatformThreadFactory.h>
 #include <thrift/concurrency/Monitor.h>
+#include <thrift/concurrency/ParallelFor.h>
 #include <thrift/concurrency/Util.h>
 
 #include <assert.h>
@@ -28,6 +29,7 @@
 #include <set>
 #include <iostream>
 #include <stdint.h>
+#include <vector>
 
 namespace apache {
 namespace thrift {
@@ -675,6 +677,280 @@ public:
     threadManager.reset();
     return true;
   }
+
+  class NamedTask : public Runnable {
+  public:
+    NamedTask(const std::string& name) : _name(name) {}
+    void run() {}
+    std::string _name;
+  };
+
+  static void addNamed(shared_ptr<ThreadManager>& threadManager,
+                       const std::string& name,
+                       const ThreadManager::TaskClass& taskClass) {
+    threadManager->addClassified(shared_ptr<Runnable>(new NamedTask(name)), taskClass);
+  }
+
+  // Drains the pending queue in the order the workers would run it
+  static std::string pendingOrder(shared_ptr<ThreadManager>& threadManager) {
+    std::string order;
+    shared_ptr<Runnable> task;
+    while ((task = threadManager->removeNextPending())) {
+      order += (order.empty() ? "" : " ") + stdcxx::dynamic_pointer_cast<NamedTask>(task)->_name;
+    }
+    return order;
+  }
+
+  /**
+   * Priority lanes and fair sharing within a lane.  No workers are added so
+   * the pending queue can be inspected in the order it would be served.
+   */
+  bool priorityTest() {
+    shared_ptr<ThreadManager> threadManager = ThreadManager::newThreadManager();
+    threadManager->threadFactory(shared_ptr<PlatformThreadFactory>(new PlatformThreadFactory()));
+    threadManager->start();
+
+    typedef ThreadManager::TaskClass TaskClass;
+    addNamed(threadManager, "L1", TaskClass(ThreadManager::LOW_PRIORITY));
+    addNamed(threadManager, "A1", TaskClass(ThreadManager::NORMAL_PRIORITY, 1));
+    addNamed(threadManager, "A2", TaskClass(ThreadManager::NORMAL_PRIORITY, 1));
+    addNamed(threadManager, "A3", TaskClass(ThreadManager::NORMAL_PRIORITY, 1));
+    addNamed(threadManager, "B1", TaskClass(ThreadManager::NORMAL_PRIORITY, 2));
+    addNamed(threadManager, "H1", TaskClass(ThreadManager::HIGH_PRIORITY));
+
+    EXPECT(threadManager->pendingTaskCount(), 6);
+    EXPECT(threadManager->pendingTaskCount(ThreadManager::HIGH_PRIORITY), 1);
+    EXPECT(threadManager->pendingTaskCount(ThreadManager::NORMAL_PRIORITY), 4);
+    EXPECT(threadManager->pendingTaskCount(ThreadManager::LOW_PRIORITY), 1);
+
+    std::string order = pendingOrder(threadManager);
+    if (order != "H1 A1 B1 A2 A3 L1") {
+      std::cerr << "\t\t\tunexpected lane order: " << order << std::endl;
+      return false;
+    }
+
+    // Costlier tasks use up a flow's share faster
+    threadManager->fairShareQuantum(2);
+    for (int i = 1; i <= 4; ++i) {
+      addNamed(threadManager, "A" + std::string(1, '0' + i),
+               TaskClass(ThreadManager::NORMAL_PRIORITY, 1, 1));
+    }
+    addNamed(threadManager, "B1", TaskClass(ThreadManager::NORMAL_PRIORITY, 2, 2));
+    addNamed(threadManager, "B2", TaskClass(ThreadManager::NORMAL_PRIORITY, 2, 2));
+    order = pendingOrder(threadManager);
+    if (order != "A1 A2 B1 A3 A4 B2") {
+      std::cerr << "\t\t\tunexpected weighted order: " << order << std::endl;
+      return false;
+    }
+
+    // A full lane refuses work without affecting the other lanes
+    threadManager->setLaneLimits(ThreadManager::LOW_PRIORITY, 1);
+    addNamed(threadManager, "L1", TaskClass(ThreadManager::LOW_PRIORITY));
+    try {
+      threadManager->addClassified(shared_ptr<Runnable>(new NamedTask("L2")),
+                                   TaskClass(ThreadManager::LOW_PRIORITY), -1);
+      std::cerr << "\t\t\texpected TooManyPendingTasksException" << std::endl;
+      return false;
+    } catch (TooManyPendingTasksException&) {
+    }
+    addNamed(threadManager, "N1", TaskClass(ThreadManager::NORMAL_PRIORITY));
+    EXPECT(threadManager->pendingTaskCount(), 2);
+
+    // A lane's default expiration applies to tasks added without one
+    threadManager->setLaneLimits(ThreadManager::NORMAL_PRIORITY, 0, 1);
+    addNamed(threadManager, "N2", TaskClass(ThreadManager::NORMAL_PRIORITY));
+    sleep_(10);
+    threadManager->removeExpiredTasks();
+    EXPECT(threadManager->expiredTaskCount(), 1);
+    EXPECT(threadManager->pendingTaskCount(ThreadManager::NORMAL_PRIORITY), 1);
+    EXPECT(threadManager->pendingTaskCount(ThreadManager::LOW_PRIORITY), 1);
+
+    threadManager->stop();
+    return true;
+  }
+
+  class CountingTask : public Runnable {
+  public:
+    CountingTask(Monitor& monitor, size_t& count) : _monitor(monitor), _count(count) {}
+    void run() {
+      Synchronized s(_monitor);
+      if (--_count == 0) {
+        _monitor.notify();
+      }
+    }
+    Monitor& _monitor;
+    size_t& _count;
+  };
+
+  static void hit(std::vector<int>* hits, size_t i) { ++(*hits)[i]; }
+
+  static void failAt(size_t failure, size_t i) {
+    if (i == failure) {
+      throw TException("body failed");
+    }
+  }
+
+  // Runs a parallelFor from a worker, while the other workers are all busy
+  class NestedTask : public Runnable {
+  public:
+    NestedTask(ThreadManager& threadManager) : _threadManager(threadManager), _hits(100, 0) {}
+    void run() {
+      parallelFor(_threadManager,
+                  0,
+                  _hits.size(),
+                  stdcxx::bind(hit, &_hits, stdcxx::placeholders::_1));
+    }
+    ThreadManager& _threadManager;
+    std::vector<int> _hits;
+  };
+
+  // A manager with no more than the required methods, adding to another one
+  class PlainManager : public ThreadManager {
+  public:
+    PlainManager(shared_ptr<ThreadManager> manager) : _manager(manager) {}
+    void start() { _manager->start(); }
+    void stop() { _manager->stop(); }
+    STATE state() const { return _manager->state(); }
+    shared_ptr<ThreadFactory> threadFactory() const { return _manager->threadFactory(); }
+    void threadFactory(shared_ptr<ThreadFactory> value) { _manager->threadFactory(value); }
+    void addWorker(size_t value) { _manager->addWorker(value); }
+    void removeWorker(size_t value) { _manager->removeWorker(value); }
+    size_t idleWorkerCount() const { return _manager->idleWorkerCount(); }
+    size_t workerCount() const { return _manager->workerCount(); }
+    size_t pendingTaskCount() const { return _manager->pendingTaskCount(); }
+    size_t totalTaskCount() const { return _manager->totalTaskCount(); }
+    size_t pendingTaskCountMax() const { return _manager->pendingTaskCountMax(); }
+    size_t expiredTaskCount() { return _manager->expiredTaskCount(); }
+    void add(shared_ptr<Runnable> task, int64_t timeout, int64_t expiration) {
+      _manager->add(task, timeout, expiration);
+    }
+    void remove(shared_ptr<Runnable> task) { _manager->remove(task); }
+    shared_ptr<Runnable> removeNextPending() { return _manager->removeNextPending(); }
+    void removeExpiredTasks() { _manager->removeExpiredTasks(); }
+    void setExpireCallback(ExpireCallback expireCallback) {
+      _manager->setExpireCallback(expireCallback);
+    }
+    shared_ptr<ThreadManager> _manager;
+  };
+
+  /**
+   * Batches of tasks, and parallelFor() on top of them
+   */
+  bool batchTest() {
+    typedef ThreadManager::TaskClass TaskClass;
+
+    // Batches keep their order, and go to the lane asked for
+    shared_ptr<ThreadManager> threadManager = ThreadManager::newSimpleThreadManager(0, 3);
+    threadManager->threadFactory(shared_ptr<PlatformThreadFactory>(new PlatformThreadFactory()));
+    threadManager->start();
+
+    std::vector<shared_ptr<Runnable> > batch;
+    batch.push_back(shared_ptr<Runnable>(new NamedTask("N1")));
+    batch.push_back(shared_ptr<Runnable>(new NamedTask("N2")));
+    threadManager->addBatch(batch);
+    batch.clear();
+    batch.push_back(shared_ptr<Runnable>(new NamedTask("H1")));
+    threadManager->addClassifiedBatch(batch, TaskClass(ThreadManager::HIGH_PRIORITY));
+    EXPECT(threadManager->pendingTaskCount(ThreadManager::HIGH_PRIORITY), 1);
+    std::string order = pendingOrder(threadManager);
+    if (order != "H1 N1 N2") {
+      std::cerr << "\t\t\tunexpected batch order: " << order << std::endl;
+      return false;
+    }
+
+    // Managers without batches or lanes add() batches one task at a time
+    shared_ptr<ThreadManager> plainManager(new PlainManager(threadManager));
+    batch.clear();
+    batch.push_back(shared_ptr<Runnable>(new NamedTask("N1")));
+    batch.push_back(shared_ptr<Runnable>(new NamedTask("N2")));
+    plainManager->addBatch(batch);
+    batch.clear();
+    batch.push_back(shared_ptr<Runnable>(new NamedTask("H1")));
+    plainManager->addClassifiedBatch(batch, TaskClass(ThreadManager::HIGH_PRIORITY));
+    EXPECT(plainManager->pendingTaskCount(ThreadManager::HIGH_PRIORITY), 0);
+    EXPECT(plainManager->pendingTaskCount(ThreadManager::NORMAL_PRIORITY), 3);
+    order = pendingOrder(plainManager);
+    if (order != "N1 N2 H1") {
+      std::cerr << "\t\t\tunexpected plain batch order: " << order << std::endl;
+      return false;
+    }
+
+    // Without room for all of a batch, the tasks that fit stay queued
+    batch.clear();
+    for (int i = 1; i <= 4; ++i) {
+      batch.push_back(shared_ptr<Runnable>(new NamedTask("T" + std::string(1, '0' + i))));
+    }
+    try {
+      threadManager->addBatch(batch, -1);
+      std::cerr << "\t\t\texpected TooManyPendingTasksException" << std::endl;
+      return false;
+    } catch (TooManyPendingTasksException&) {
+    }
+    order = pendingOrder(threadManager);
+    if (order != "T1 T2 T3") {
+      std::cerr << "\t\t\tunexpected partial batch: " << order << std::endl;
+      return false;
+    }
+
+    // A batch larger than the limit gets in as workers make room
+    threadManager->addWorker(4);
+    Monitor monitor;
+    size_t count = 100;
+    batch.clear();
+    for (size_t i = 0; i < count; ++i) {
+      batch.push_back(shared_ptr<Runnable>(new CountingTask(monitor, count)));
+    }
+    threadManager->addBatch(batch);
+    {
+      Synchronized s(monitor);
+      while (count > 0) {
+        monitor.wait();
+      }
+    }
+
+    // parallelFor visits each index once
+    std::vector<int> hits(1000, 0);
+    for (size_t grain = 1; grain <= 1000; grain *= 7) {
+      parallelFor(*threadManager,
+                  10,
+                  990,
+                  stdcxx::bind(hit, &hits, stdcxx::placeholders::_1),
+                  grain);
+    }
+    for (size_t i = 0; i < hits.size(); ++i) {
+      if (hits[i] != (i >= 10 && i < 990 ? 4 : 0)) {
+        std::cerr << "\t\t\tindex " << i << " visited " << hits[i] << " times" << std::endl;
+        return false;
+      }
+    }
+
+    // and passes on failures
+    try {
+      parallelFor(*threadManager, 0, 100, stdcxx::bind(failAt, 42, stdcxx::placeholders::_1));
+      std::cerr << "\t\t\texpected parallelFor to fail" << std::endl;
+      return false;
+    } catch (TException& e) {
+      if (std::string(e.what()) != "body failed") {
+        std::cerr << "\t\t\tunexpected failure: " << e.what() << std::endl;
+        return false;
+      }
+    }
+
+    // A worker may use parallelFor even when there is no one to help
+    threadManager->removeWorker(3);
+    shared_ptr<NestedTask> nested(new NestedTask(*threadManager));
+    threadManager->add(nested);
+    while (threadManager->totalTaskCount() > 0) {
+      sleep_(1);
+    }
+    if (nested->_hits != std::vector<int>(100, 1)) {
+      std::cerr << "\t\t\tnested parallelFor missed indices" << std::endl;
+      return false;
+    }
+
+    threadManager->stop();
+    return true;
+  }
 };
 
 }
@@ -28,6 +28,8 @@
 #include <thrift/concurrency/PlatformThreadFactory.h>
 #include <thrift/concurrency/Monitor.h>
 #include <thrift/protocol/TBinaryProtocol.h>
+#include <thrift/protocol/TCompactProtocol.h>
+#include <thrift/protocol/TSpecializedProtocolFactory.h>
 #include <thrift/server/TThreadedServer.h>
 #include <thrift/server/TThreadPoolServer.h>
 #include <thrift/server/TNonblockingServer.h>
@@ -193,6 +195,30 @@ public:
   typedef ChildServiceClientT<Protocol> ChildClient;
 };
 
+/*
+ * Processors specialised on a concrete protocol, with a protocol factory that
+ * refuses to hand them anything else.  Every call must therefore go through
+ * TDispatchProcessorT::processFast().
+ */
+class TSpecializedCompactProtocolFactory
+    : public TSpecializedProtocolFactory<TCompactProtocolT<TBufferBase> > {
+public:
+  TSpecializedCompactProtocolFactory()
+    : TSpecializedProtocolFactory<TCompactProtocolT<TBufferBase> >(
+          stdcxx::shared_ptr<TProtocolFactory>(new TCompactProtocolFactoryT<TBufferBase>)) {}
+};
+
+class SpecializedTraits {
+public:
+  typedef TSpecializedCompactProtocolFactory ProtocolFactory;
+  typedef TCompactProtocolT<TBufferBase> Protocol;
+
+  typedef ParentServiceProcessorT<Protocol> ParentProcessor;
+  typedef ChildServiceProcessorT<Protocol> ChildProcessor;
+  typedef ParentServiceClientT<Protocol> ParentClient;
+  typedef ChildServiceClientT<Protocol> ChildClient;
+};
+
 template <typename TemplateTraits_>
 class ParentServiceTraits {
 public:
@@ -903,6 +929,25 @@ DEFINE_TNONBLOCKINGSERVER_TESTS(TNonblockingServer, Untemplated)
 DEFINE_TNONBLOCKINGSERVER_TESTS(TNonblockingServerNoThreads, Templated)
 DEFINE_TNONBLOCKINGSERVER_TESTS(TNonblockingServerNoThreads, Untemplated)
 
+// testEventSequencing() writes its request with TBinaryProtocol, so the
+// compact-only specialised servers get the framed test set.
+DEFINE_TNONBLOCKINGSERVER_TESTS(TThreadPoolServer, Specialized)
+DEFINE_TNONBLOCKINGSERVER_TESTS(TNonblockingServer, Specialized)
+DEFINE_TNONBLOCKINGSERVER_TESTS(TNonblockingServerNoThreads, Specialized)
+
+BOOST_AUTO_TEST_CASE(SpecializedProtocolFactory_mismatch) {
+  TSpecializedCompactProtocolFactory factory;
+  stdcxx::shared_ptr<TTransport> framed(new TFramedTransport(
+      stdcxx::shared_ptr<TTransport>(new TMemoryBuffer)));
+  BOOST_CHECK(stdcxx::dynamic_pointer_cast<TCompactProtocolT<TBufferBase> >(
+      factory.getProtocol(framed)));
+
+  // A transport that is not a TBufferBase would have given a generic protocol
+  stdcxx::shared_ptr<TTransport> socket(new TSocket("127.0.0.1", 0));
+  BOOST_CHECK_THROW(factory.getProtocol(socket), TTransportException);
+  BOOST_CHECK_THROW(factory.getProtocol(socket, framed), TTransportException);
+}
+
 DEFINE_SIMPLE_TESTS(TSimpleServer, Templated)
 DEFINE_SIMPLE_TESTS(TSimpleServer, Untemplated)
 DEFINE_NOFRAME_TESTS(TSimpleServer, Templated)